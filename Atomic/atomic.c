@@ -0,0 +1,43 @@
+/*
+ *  atomic.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 24/3/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "atomic.h"
+
+// The original out-of-line entry points, which used to be written in
+// assembly. Everything in the library itself uses the inline versions
+// in atomic.h; these are for anything built against the old calls.
+
+int DPCompareAndSwap( unsigned int oldVal, unsigned int newVal, unsigned int * address )
+{
+    return ( DPAtomicCompareAndSwap32( oldVal, newVal, address, kDPMemoryOrderSequential ) );
+}
+
+#if __i386__
+
+int DPCompareAndSwap64( unsigned long long oldVal, unsigned long long newVal,
+                        unsigned long long * address )
+{
+    return ( DPAtomicCompareAndSwap64( oldVal, newVal, address, kDPMemoryOrderSequential ) );
+}
+
+#endif
+
+void DPCodeSync( void * address )
+{
+    DPAtomicCodeSync( address );
+}
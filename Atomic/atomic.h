@@ -31,12 +31,351 @@ __BEGIN_DECLS
         processor's instruction and data caches do not contain copies of
         the modified data from before it was modified. 
 
-        The routines themselves are implemented in PowerPC and IA-32
-        assembly.
+        The DPAtomic routines are inline, written with PowerPC and IA-32
+        inline assembly, and each takes a memory order saying which
+        other loads and stores may be moved across it. The original
+        out-of-line routines, DPCompareAndSwap, DPCompareAndSwap64 and
+        DPCodeSync, are kept as thin wrappers around them for callers
+        which link against them.
+
+        There's no 128-bit compare-and-swap: neither processor can do
+        one in 32-bit mode. The widest available, for swapping a
+        pointer together with a count or a tag, is
+        @link DPAtomicCompareAndSwap64 DPAtomicCompareAndSwap64 @/link,
+        on Intel only.
  @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
  @author Jim Dovey
  */
 
+/*!
+ @enum Memory Orders
+ @abstract How far other memory accesses may be moved across an atomic
+        operation, with the same meanings as in C++0x.
+ @constant kDPMemoryOrderRelaxed No ordering; the operation is atomic,
+        and that's all.
+ @constant kDPMemoryOrderAcquire Later loads and stores stay after it.
+ @constant kDPMemoryOrderRelease Earlier loads and stores stay before it.
+ @constant kDPMemoryOrderAcquireRelease Both of the above.
+ @constant kDPMemoryOrderSequential Both of the above, and every
+        sequential operation is seen in the same order by every
+        processor.
+ */
+typedef enum
+{
+    kDPMemoryOrderRelaxed           = 0,
+    kDPMemoryOrderAcquire           = 1,
+    kDPMemoryOrderRelease           = 2,
+    kDPMemoryOrderAcquireRelease    = 3,
+    kDPMemoryOrderSequential        = 4
+
+} DPMemoryOrder;
+
+#define __DPOrderAcquires( order )  ( (order) == kDPMemoryOrderAcquire || \
+                                      (order) >= kDPMemoryOrderAcquireRelease )
+#define __DPOrderReleases( order )  ( (order) >= kDPMemoryOrderRelease )
+
+/*!
+ @function DPMemoryBarrier
+ @abstract Keep loads and stores from moving across this point.
+ @discussion Intel only reorders a store with a later load, so anything
+        short of sequential ordering just needs the compiler kept in
+        line. The lock-prefixed instructions used by the read-modify-
+        write routines below are full barriers by themselves.
+ @param order The ordering wanted.
+ */
+static __inline__ void DPMemoryBarrier( DPMemoryOrder order )
+{
+    if ( order == kDPMemoryOrderRelaxed )
+        return;
+
+#if defined(__ppc__)
+    if ( order == kDPMemoryOrderSequential )
+        __asm__ __volatile__ ( "sync" : : : "memory" );
+    else
+        __asm__ __volatile__ ( "lwsync" : : : "memory" );
+#elif defined(__i386__)
+    if ( order == kDPMemoryOrderSequential )
+        __asm__ __volatile__ ( "mfence" : : : "memory" );
+    else
+        __asm__ __volatile__ ( "" : : : "memory" );
+#endif
+}
+
+#if defined(__ppc__)
+// a read-modify-write sequence on PowerPC is bracketed by these
+static __inline__ void __DPBarrierBefore( DPMemoryOrder order )
+{
+    if ( order == kDPMemoryOrderSequential )
+        __asm__ __volatile__ ( "sync" : : : "memory" );
+    else if ( __DPOrderReleases( order ) )
+        __asm__ __volatile__ ( "lwsync" : : : "memory" );
+}
+
+static __inline__ void __DPBarrierAfter( DPMemoryOrder order )
+{
+    if ( __DPOrderAcquires( order ) )
+        __asm__ __volatile__ ( "isync" : : : "memory" );
+}
+#endif
+
+/*!
+ @function DPAtomicLoad32
+ @abstract Read a 32-bit word, with ordering.
+ @param address The word to read.
+ @param order Relaxed, acquire or sequential.
+ @result The value read.
+ */
+static __inline__ unsigned int DPAtomicLoad32( volatile unsigned int * address,
+                                               DPMemoryOrder order )
+{
+    unsigned int value;
+
+    if ( order == kDPMemoryOrderSequential )
+        DPMemoryBarrier( order );
+
+    value = *address;
+
+    if ( __DPOrderAcquires( order ) )
+        DPMemoryBarrier( kDPMemoryOrderAcquire );
+
+    return ( value );
+}
+
+/*!
+ @function DPAtomicStore32
+ @abstract Write a 32-bit word, with ordering.
+ @param address The word to write.
+ @param value The value to write.
+ @param order Relaxed, release or sequential.
+ */
+static __inline__ void DPAtomicStore32( volatile unsigned int * address, unsigned int value,
+                                        DPMemoryOrder order )
+{
+    if ( __DPOrderReleases( order ) )
+        DPMemoryBarrier( kDPMemoryOrderRelease );
+
+    *address = value;
+
+    if ( order == kDPMemoryOrderSequential )
+        DPMemoryBarrier( order );
+}
+
+/*!
+ @function DPAtomicCompareAndSwap32
+ @abstract Replace a 32-bit word, if it holds what we expect.
+ @param oldVal The value expected at the address.
+ @param newVal The value to store there.
+ @param address The word to change.
+ @param order The ordering wanted.
+ @result 1 if the word was changed, 0 if it didn't hold oldVal.
+ */
+static __inline__ int DPAtomicCompareAndSwap32( unsigned int oldVal, unsigned int newVal,
+                                                volatile unsigned int * address,
+                                                DPMemoryOrder order )
+{
+#if defined(__ppc__)
+    unsigned int current;
+
+    __DPBarrierBefore( order );
+
+    __asm__ __volatile__ (
+        "1: lwarx   %0, 0, %1   \n\t"
+        "   cmpw    %0, %2      \n\t"
+        "   bne-    2f          \n\t"
+        "   stwcx.  %3, 0, %1   \n\t"
+        "   bne-    1b          \n\t"
+        "2:                     \n\t"
+        : "=&r" (current)
+        : "r" (address), "r" (oldVal), "r" (newVal)
+        : "cr0", "memory" );
+
+    if ( current != oldVal )
+        return ( 0 );
+
+    __DPBarrierAfter( order );
+
+    return ( 1 );
+#elif defined(__i386__)
+    unsigned char result;
+
+    // lock cmpxchg is a full barrier whatever the order
+    __asm__ __volatile__ (
+        "lock; cmpxchgl %3, %1  \n\t"
+        "sete   %0              \n\t"
+        : "=q" (result), "+m" (*address), "+a" (oldVal)
+        : "r" (newVal)
+        : "cc", "memory" );
+
+    return ( result );
+#endif
+}
+
+/*!
+ @function DPAtomicCompareAndSwapPtr
+ @abstract As @link DPAtomicCompareAndSwap32 DPAtomicCompareAndSwap32 @/link,
+        for a pointer.
+ */
+static __inline__ int DPAtomicCompareAndSwapPtr( void * oldVal, void * newVal,
+                                                 void * volatile * address,
+                                                 DPMemoryOrder order )
+{
+    return ( DPAtomicCompareAndSwap32( (unsigned int) oldVal, (unsigned int) newVal,
+                                       (volatile unsigned int *) address, order ) );
+}
+
+/*!
+ @function DPAtomicFetchAdd32
+ @abstract Add to a 32-bit word.
+ @param address The word to add to.
+ @param delta The amount to add; may be 'negative'.
+ @param order The ordering wanted.
+ @result The value of the word before the addition.
+ */
+static __inline__ unsigned int DPAtomicFetchAdd32( volatile unsigned int * address,
+                                                   unsigned int delta,
+                                                   DPMemoryOrder order )
+{
+#if defined(__ppc__)
+    unsigned int previous, sum;
+
+    __DPBarrierBefore( order );
+
+    __asm__ __volatile__ (
+        "1: lwarx   %0, 0, %2   \n\t"
+        "   add     %1, %0, %3  \n\t"
+        "   stwcx.  %1, 0, %2   \n\t"
+        "   bne-    1b          \n\t"
+        : "=&r" (previous), "=&r" (sum)
+        : "r" (address), "r" (delta)
+        : "cr0", "memory" );
+
+    __DPBarrierAfter( order );
+
+    return ( previous );
+#elif defined(__i386__)
+    __asm__ __volatile__ (
+        "lock; xaddl %0, %1     \n\t"
+        : "+r" (delta), "+m" (*address)
+        :
+        : "cc", "memory" );
+
+    return ( delta );
+#endif
+}
+
+#if defined(__i386__)
+
+/*!
+ @function DPAtomicCompareAndSwap64
+ @abstract Replace a 64-bit value, if it holds what we expect. Intel only.
+ @discussion %ebx is needed by cmpxchg8b, but it's also the PIC base
+        register, so the compiler can't be asked for it; the low word
+        of the new value is swapped in and out around the instruction.
+ @param oldVal The value expected at the address.
+ @param newVal The value to store there.
+ @param address The value to change. It needn't be 8-byte aligned, but
+        it's much slower if it straddles a cache line.
+ @param order The ordering wanted; always sequential in practice.
+ @result 1 if the value was changed, 0 if it didn't hold oldVal.
+ */
+static __inline__ int DPAtomicCompareAndSwap64( unsigned long long oldVal,
+                                                unsigned long long newVal,
+                                                volatile unsigned long long * address,
+                                                DPMemoryOrder order )
+{
+    unsigned int newLow = (unsigned int) newVal;
+    unsigned int newHigh = (unsigned int) (newVal >> 32);
+    unsigned char result;
+
+    __asm__ __volatile__ (
+        "xchgl  %%ebx, %%edi        \n\t"
+        "lock; cmpxchg8b (%%esi)    \n\t"
+        "xchgl  %%ebx, %%edi        \n\t"
+        "sete   %0                  \n\t"
+        : "=q" (result), "+A" (oldVal)
+        : "D" (newLow), "c" (newHigh), "S" (address)
+        : "cc", "memory" );
+
+    return ( result );
+}
+
+/*!
+ @function DPAtomicLoad64
+ @abstract Read a 64-bit value in one go. Intel only.
+ @discussion Done with a compare-and-swap which never changes anything,
+        since a pair of 32-bit loads could be split by a store.
+ @param address The value to read.
+ @result The value read.
+ */
+static __inline__ unsigned long long DPAtomicLoad64( volatile unsigned long long * address )
+{
+    unsigned long long value = *address;
+
+    while ( !DPAtomicCompareAndSwap64( value, value, address, kDPMemoryOrderSequential ) )
+        value = *address;
+
+    return ( value );
+}
+
+/*!
+ @function DPAtomicFetchAdd64
+ @abstract Add to a 64-bit value. Intel only.
+ @param address The value to add to.
+ @param delta The amount to add.
+ @param order The ordering wanted; always sequential in practice.
+ @result The value before the addition.
+ */
+static __inline__ unsigned long long DPAtomicFetchAdd64( volatile unsigned long long * address,
+                                                         unsigned long long delta,
+                                                         DPMemoryOrder order )
+{
+    unsigned long long previous;
+
+    do
+    {
+        previous = *address;
+
+    } while ( !DPAtomicCompareAndSwap64( previous, previous + delta, address, order ) );
+
+    return ( previous );
+}
+
+#endif  /* __i386__ */
+
+/*!
+ @function DPAtomicCodeSync
+ @abstract Make the processor see code just written at an address.
+ @discussion On PowerPC, the data cache block is written out and the
+        instruction cache block thrown away; on Intel, the processor
+        notices writes to code by itself, and the cache line is just
+        flushed.
+ @param address An address within the code written; everything in the
+        same cache line is synced.
+ */
+static __inline__ void DPAtomicCodeSync( void * address )
+{
+#if defined(__ppc__)
+    __asm__ __volatile__ (
+        "dcbst  0, %0   \n\t"
+        "sync           \n\t"
+        "icbi   0, %0   \n\t"
+        "sync           \n\t"
+        "isync          \n\t"
+        :
+        : "r" (address)
+        : "memory" );
+#elif defined(__i386__)
+    __asm__ __volatile__ (
+        "mfence         \n\t"
+        "clflush (%0)   \n\t"
+        :
+        : "r" (address)
+        : "memory" );
+#endif
+}
+
+#pragma mark -
+
 /*!
  @function DPCompareAndSwap
  @abstract Check the value at an address, then update it.
@@ -48,7 +387,9 @@ __BEGIN_DECLS
         the processor to refetch its instruction cache.
 
         This routine is used to write the branch absolute instruction at
-        the beginning of a patched function.
+        the beginning of a patched function. It's a wrapper around
+        @link DPAtomicCompareAndSwap32 DPAtomicCompareAndSwap32 @/link
+        with sequential ordering.
  @param oldVal Value expected to be at supplied address prior to write.
  @param newVal Value to write into memory at supplied address.
  @param address The address at which to check/update value.
@@ -58,7 +399,8 @@ __BEGIN_DECLS
 int DPCompareAndSwap( unsigned int oldVal, unsigned int newVal, unsigned int * address );
 
 #if __i386__
-// Intel processors get a 64-bit version of the above
+// Intel processors get a 64-bit version of the above; see
+// DPAtomicCompareAndSwap64
 int DPCompareAndSwap64( unsigned long long oldVal, unsigned long long newVal,
                         unsigned long long * address );
 #endif
@@ -70,14 +412,10 @@ int DPCompareAndSwap64( unsigned long long oldVal, unsigned long long newVal,
         caches to re-sync with main memory. This is called after writing
         new executable code to memory.
 
-        On Intel processors, full syncs can only be performed by in
-        ring zero (I think), so this function takes a parameter to use
-        with the i386 CLFLUSH instruction, which flushes/syncs the cache
-        line containing a specific address. On PowerPC, however, there
-        are simply instructions to sync each cache (data and instruction)
-        as a whole.
- @param address Address of data whose cache lines to flush 
-        (Intel processors only).
+        A wrapper around
+        @link DPAtomicCodeSync DPAtomicCodeSync @/link, which syncs the
+        cache line containing the given address.
+ @param address Address of data whose cache lines to flush.
  */
 void DPCodeSync( void * address );
 
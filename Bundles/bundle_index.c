@@ -0,0 +1,757 @@
+/*
+ *  bundle_index.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 23/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <mach-o/dyld.h>
+
+#include "bundle_index.h"
+#include "Injection.h"
+#include "Lookup.h"
+#include "logging.h"
+
+// where the index files go, under the user's home folder
+#define INDEX_CACHE_SUBPATH     "/Library/Caches/DynamicPatch"
+
+#if defined(__ppc__)
+# define NATIVE_ARCH            kInsertionArchPPC
+#else
+# define NATIVE_ARCH            kInsertionArchIA32
+#endif
+
+// used while a folder is being indexed
+struct index_builder
+{
+    struct bundle_index_entry *     entries;
+    unsigned int                    count;
+    unsigned int                    allocated;
+
+    unsigned int *                  names;
+    unsigned int                    name_count;
+    unsigned int                    names_allocated;
+
+    char *                          strings;
+    unsigned int                    strings_size;
+    unsigned int                    strings_allocated;
+
+    int                             failed;
+};
+
+#pragma mark -
+
+// the index file for a folder is named after a hash of its path; the
+// path itself is stored inside, in case two folders share a hash
+static int get_cache_path( const char * dir_path, char cache_path[PATH_MAX] )
+{
+    const char * home = getenv( "HOME" );
+    const unsigned char * p = (const unsigned char *) dir_path;
+    unsigned int hash = 5381;
+
+    if ( ( home == NULL ) || ( home[0] == '\0' ) )
+        return ( 0 );
+
+    while ( *p != '\0' )
+        hash = ((hash << 5) + hash) + *p++;
+
+    snprintf( cache_path, PATH_MAX, "%s" INDEX_CACHE_SUBPATH "/BundleIndex-%08x",
+              home, hash );
+
+    return ( 1 );
+}
+
+static void set_index_pointers( struct bundle_index * index )
+{
+    const char * bytes = (const char *) index->base;
+
+    index->header = (const struct bundle_index_header *) bytes;
+
+    if ( index->size >= sizeof(struct bundle_index_header) )
+    {
+        index->entries = (const struct bundle_index_entry *)
+                         (bytes + index->header->entries_offset);
+        index->names = (const unsigned int *) (bytes + index->header->names_offset);
+        index->strings = bytes + index->header->strings_offset;
+    }
+}
+
+// makes sure everything the header describes is inside the file
+static int validate_index( const struct bundle_index * index )
+{
+    const struct bundle_index_header * hdr = index->header;
+    size_t size = index->size;
+
+    if ( size < sizeof(struct bundle_index_header) )
+        return ( 0 );
+
+    if ( ( hdr->magic != kBundleIndexMagic ) || ( hdr->version != kBundleIndexVersion ) )
+        return ( 0 );
+
+    if ( ( hdr->entries_offset > size ) ||
+         ( hdr->entry_count > (size - hdr->entries_offset) /
+                              sizeof(struct bundle_index_entry) ) )
+        return ( 0 );
+
+    if ( ( hdr->names_offset > size ) ||
+         ( hdr->name_count > (size - hdr->names_offset) / sizeof(unsigned int) ) )
+        return ( 0 );
+
+    if ( ( hdr->strings_size == 0 ) || ( hdr->strings_offset > size ) ||
+         ( hdr->strings_size > size - hdr->strings_offset ) )
+        return ( 0 );
+
+    if ( index->strings[hdr->strings_size - 1] != '\0' )
+        return ( 0 );
+
+    return ( 1 );
+}
+
+// finds a bundle's Info.plist, in either a modern or a flat bundle;
+// returns zero if it hasn't got one
+static int stat_info_plist( const char * bundle_path, struct stat * pStat )
+{
+    char path[PATH_MAX];
+
+    snprintf( path, PATH_MAX, "%s/Contents/Info.plist", bundle_path );
+    if ( stat( path, pStat ) == 0 )
+        return ( 1 );
+
+    snprintf( path, PATH_MAX, "%s/Info.plist", bundle_path );
+    return ( stat( path, pStat ) == 0 );
+}
+
+// an Info.plist can be edited without touching the folder's date, and
+// the index holds the filters from it
+static int info_plists_current( const struct bundle_index * index )
+{
+    const struct bundle_index_entry * entry = NULL;
+    struct stat statBuf;
+    unsigned int i;
+
+    for ( i = 0; i < index->header->entry_count; i++ )
+    {
+        entry = &index->entries[i];
+
+        if ( !stat_info_plist( __bundle_index_string( index, entry->bundle_path ),
+                               &statBuf ) )
+        {
+            bzero( &statBuf, sizeof(statBuf) );
+        }
+
+        if ( ( entry->info_mtime != (unsigned int) statBuf.st_mtime ) ||
+             ( entry->info_size != (unsigned int) statBuf.st_size ) )
+        {
+            DEBUGLOG( "Info.plist of '%s' has changed since it was indexed",
+                      __bundle_index_string( index, entry->bundle_path ) );
+            return ( 0 );
+        }
+    }
+
+    return ( 1 );
+}
+
+static int read_cached_index( const char * cache_path, const char * dir_path,
+                              unsigned int dir_mtime, struct bundle_index * index )
+{
+    struct stat statBuf;
+    void * base = MAP_FAILED;
+    int fd = open( cache_path, O_RDONLY, 0 );
+
+    if ( fd == -1 )
+        return ( 0 );
+
+    if ( ( fstat( fd, &statBuf ) == 0 ) && ( statBuf.st_size > 0 ) )
+    {
+        base = mmap( NULL, (size_t) statBuf.st_size, PROT_READ,
+                     MAP_FILE | MAP_PRIVATE, fd, 0 );
+    }
+
+    close( fd );
+
+    if ( base == MAP_FAILED )
+        return ( 0 );
+
+    index->base = base;
+    index->size = (size_t) statBuf.st_size;
+    index->mapped = 1;
+    set_index_pointers( index );
+
+    if ( ( validate_index( index ) ) &&
+         ( index->header->dir_mtime == dir_mtime ) &&
+         ( strcmp( __bundle_index_string( index, index->header->dir_path ),
+                   dir_path ) == 0 ) &&
+         ( info_plists_current( index ) ) )
+    {
+        return ( 1 );
+    }
+
+    __close_bundle_index( index );
+
+    return ( 0 );
+}
+
+#pragma mark -
+
+static unsigned int builder_add_string( struct index_builder * builder, const char * str )
+{
+    unsigned int len = (unsigned int) strlen( str ) + 1;
+    unsigned int result = builder->strings_size;
+
+    if ( builder->strings_size + len > builder->strings_allocated )
+    {
+        unsigned int newSize = builder->strings_allocated + 1024;
+        char * newStrings = NULL;
+
+        while ( newSize < builder->strings_size + len )
+            newSize += 1024;
+
+        newStrings = (char *) realloc( builder->strings, newSize );
+        if ( newStrings == NULL )
+        {
+            builder->failed = 1;
+            return ( 0 );
+        }
+
+        builder->strings = newStrings;
+        builder->strings_allocated = newSize;
+    }
+
+    memcpy( builder->strings + builder->strings_size, str, len );
+    builder->strings_size += len;
+
+    return ( result );
+}
+
+static void builder_add_name( struct index_builder * builder, const char * name )
+{
+    if ( builder->name_count == builder->names_allocated )
+    {
+        unsigned int newCount = builder->names_allocated + 16;
+        unsigned int * newNames = (unsigned int *) realloc( builder->names,
+            newCount * sizeof(unsigned int) );
+
+        if ( newNames == NULL )
+        {
+            builder->failed = 1;
+            return;
+        }
+
+        builder->names = newNames;
+        builder->names_allocated = newCount;
+    }
+
+    builder->names[builder->name_count++] = builder_add_string( builder, name );
+}
+
+// adds the strings in an Info.plist array to the name list; returns
+// how many there were
+static unsigned int builder_add_names( struct index_builder * builder, CFBundleRef bundle,
+                                       CFStringRef key )
+{
+    CFTypeRef value = CFBundleGetValueForInfoDictionaryKey( bundle, key );
+    CFIndex i, count;
+    unsigned int result = 0;
+
+    if ( ( value == NULL ) || ( CFGetTypeID( value ) != CFArrayGetTypeID( ) ) )
+        return ( 0 );
+
+    count = CFArrayGetCount( (CFArrayRef) value );
+
+    for ( i = 0; i < count; i++ )
+    {
+        CFStringRef name = (CFStringRef) CFArrayGetValueAtIndex( (CFArrayRef) value, i );
+        char buf[ 256 ];
+
+        if ( ( CFGetTypeID( name ) == CFStringGetTypeID( ) ) &&
+             ( CFStringGetCString( name, buf, 256, kCFStringEncodingUTF8 ) ) )
+        {
+            builder_add_name( builder, buf );
+            result++;
+        }
+    }
+
+    return ( result );
+}
+
+static struct bundle_index_entry * builder_new_entry( struct index_builder * builder )
+{
+    if ( builder->count == builder->allocated )
+    {
+        unsigned int newCount = builder->allocated + 16;
+        struct bundle_index_entry * newEntries = (struct bundle_index_entry *)
+            realloc( builder->entries, newCount * sizeof(struct bundle_index_entry) );
+
+        if ( newEntries == NULL )
+        {
+            builder->failed = 1;
+            return ( NULL );
+        }
+
+        builder->entries = newEntries;
+        builder->allocated = newCount;
+    }
+
+    return ( &builder->entries[builder->count++] );
+}
+
+// this does what CFBundleCreateBundlesFromDirectory() would, for one
+// bundle, and notes down everything we'll need next time
+static void index_a_bundle( struct index_builder * builder, const char * path )
+{
+    struct bundle_index_entry * entry = NULL;
+    CFStringRef str = NULL;
+    CFURLRef url = NULL;
+    CFBundleRef bundle = NULL;
+    CFStringRef identifier = NULL;
+    CFTypeRef threadSafe = NULL;
+    char exec_path[PATH_MAX];
+    char buf[ 256 ];
+    struct stat statBuf, infoStat;
+
+    // taken before CFBundleCreate() reads it, so an edit made in
+    // between makes the index look stale rather than current
+    if ( !stat_info_plist( path, &infoStat ) )
+        bzero( &infoStat, sizeof(infoStat) );
+
+    str = CFStringCreateWithCString( NULL, path, kCFStringEncodingUTF8 );
+    if ( str != NULL )
+    {
+        url = CFURLCreateWithFileSystemPath( NULL, str, kCFURLPOSIXPathStyle, TRUE );
+        CFRelease( str );
+    }
+
+    if ( url != NULL )
+    {
+        bundle = CFBundleCreate( NULL, url );
+        CFRelease( url );
+    }
+
+    if ( bundle == NULL )
+    {
+        LogError( "Failed to create bundle '%s' !", path );
+        return;
+    }
+
+    url = CFBundleCopyExecutableURL( bundle );
+    if ( ( url == NULL ) ||
+         ( !CFURLGetFileSystemRepresentation( url, TRUE, (UInt8 *) exec_path, PATH_MAX ) ) ||
+         ( stat( exec_path, &statBuf ) != 0 ) )
+    {
+        LogError( "Unable to find the executable of '%s'", path );
+    }
+    else if ( ( entry = builder_new_entry( builder ) ) != NULL )
+    {
+        entry->bundle_path = builder_add_string( builder, path );
+        entry->exec_path = builder_add_string( builder, exec_path );
+        entry->exec_mtime = (unsigned int) statBuf.st_mtime;
+        entry->exec_size = (unsigned int) statBuf.st_size;
+        entry->info_mtime = (unsigned int) infoStat.st_mtime;
+        entry->info_size = (unsigned int) infoStat.st_size;
+        entry->start_fn_offset = (unsigned int) DPFindFunctionForArchitecture(
+            "_" kStartFunctionName, exec_path, NATIVE_ARCH );
+        entry->identifier = 0;
+        entry->flags = 0;
+
+        identifier = CFBundleGetIdentifier( bundle );
+        if ( ( identifier != NULL ) &&
+             ( CFStringGetCString( identifier, buf, 256, kCFStringEncodingUTF8 ) ) )
+        {
+            entry->identifier = builder_add_string( builder, buf );
+        }
+
+        threadSafe = CFBundleGetValueForInfoDictionaryKey( bundle,
+            CFSTR(kPatchThreadSafeStartKey) );
+        if ( ( threadSafe != NULL ) &&
+             ( CFGetTypeID( threadSafe ) == CFBooleanGetTypeID( ) ) &&
+             ( CFBooleanGetValue( (CFBooleanRef) threadSafe ) ) )
+        {
+            entry->flags |= kBundleIndexThreadSafe;
+        }
+
+        entry->first_app = builder->name_count;
+        entry->app_count = builder_add_names( builder, bundle,
+                                              CFSTR(kPatchTargetApplicationsKey) );
+        entry->first_path = builder->name_count;
+        entry->path_count = builder_add_names( builder, bundle,
+                                               CFSTR(kPatchTargetPathsKey) );
+        entry->first_pid = builder->name_count;
+        entry->pid_count = builder_add_names( builder, bundle,
+                                              CFSTR(kPatchTargetProcessIDsKey) );
+        entry->first_dep = builder->name_count;
+        entry->dep_count = builder_add_names( builder, bundle,
+                                              CFSTR(kPatchDependenciesKey) );
+    }
+
+    if ( url != NULL )
+        CFRelease( url );
+
+    CFRelease( bundle );
+}
+
+// lays the index out in one block, exactly as it'll be written
+static int build_index( const char * dir_path, const char * bundle_type,
+                        unsigned int dir_mtime, struct bundle_index * index )
+{
+    struct index_builder builder;
+    struct bundle_index_header * hdr = NULL;
+    DIR * dir = NULL;
+    struct dirent * dp = NULL;
+    size_t type_len = strlen( bundle_type );
+    unsigned int dir_string = 0;
+    char * block = NULL;
+    size_t size = 0;
+
+    bzero( &builder, sizeof(builder) );
+
+    // offset zero is the empty string
+    (void) builder_add_string( &builder, "" );
+    dir_string = builder_add_string( &builder, dir_path );
+
+    dir = opendir( dir_path );
+    if ( dir == NULL )
+        return ( 0 );
+
+    while ( ( !builder.failed ) && ( ( dp = readdir( dir ) ) != NULL ) )
+    {
+        size_t len = strlen( dp->d_name );
+        char path[PATH_MAX];
+
+        if ( ( dp->d_name[0] == '.' ) || ( len <= type_len + 1 ) ||
+             ( dp->d_name[len - type_len - 1] != '.' ) ||
+             ( strcmp( dp->d_name + len - type_len, bundle_type ) != 0 ) )
+            continue;
+
+        if ( dir_path[strlen( dir_path ) - 1] == '/' )
+            snprintf( path, PATH_MAX, "%s%s", dir_path, dp->d_name );
+        else
+            snprintf( path, PATH_MAX, "%s/%s", dir_path, dp->d_name );
+        index_a_bundle( &builder, path );
+    }
+
+    closedir( dir );
+
+    if ( !builder.failed )
+    {
+        size = sizeof(struct bundle_index_header) +
+               (builder.count * sizeof(struct bundle_index_entry)) +
+               (builder.name_count * sizeof(unsigned int)) + builder.strings_size;
+
+        block = (char *) malloc( size );
+    }
+
+    if ( block != NULL )
+    {
+        hdr = (struct bundle_index_header *) block;
+        hdr->magic = kBundleIndexMagic;
+        hdr->version = kBundleIndexVersion;
+        hdr->dir_mtime = dir_mtime;
+        hdr->dir_path = dir_string;
+        hdr->entry_count = builder.count;
+        hdr->entries_offset = sizeof(struct bundle_index_header);
+        hdr->name_count = builder.name_count;
+        hdr->names_offset = hdr->entries_offset +
+                            (builder.count * sizeof(struct bundle_index_entry));
+        hdr->strings_offset = hdr->names_offset +
+                              (builder.name_count * sizeof(unsigned int));
+        hdr->strings_size = builder.strings_size;
+
+        if ( builder.count > 0 )
+        {
+            memcpy( block + hdr->entries_offset, builder.entries,
+                    builder.count * sizeof(struct bundle_index_entry) );
+        }
+        if ( builder.name_count > 0 )
+        {
+            memcpy( block + hdr->names_offset, builder.names,
+                    builder.name_count * sizeof(unsigned int) );
+        }
+        memcpy( block + hdr->strings_offset, builder.strings, builder.strings_size );
+
+        index->base = block;
+        index->size = size;
+        index->mapped = 0;
+        set_index_pointers( index );
+    }
+    else
+    {
+        LogError( "Unable to allocate memory to index '%s'", dir_path );
+    }
+
+    free( builder.entries );
+    free( builder.names );
+    free( builder.strings );
+
+    return ( block != NULL );
+}
+
+static void write_cached_index( const char * cache_path, const struct bundle_index * index )
+{
+    char temp_path[PATH_MAX];
+    char * slash = NULL;
+    int fd = -1;
+    ssize_t written = -1;
+
+    // make sure the folder's there; its parent should already be
+    strlcpy( temp_path, cache_path, PATH_MAX );
+    slash = strrchr( temp_path, '/' );
+    if ( slash != NULL )
+    {
+        *slash = '\0';
+        (void) mkdir( temp_path, 0755 );
+    }
+
+    // write it alongside, then move it into place, so nobody reads
+    // half an index
+    snprintf( temp_path, PATH_MAX, "%s.%d", cache_path, getpid( ) );
+
+    fd = open( temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd == -1 )
+    {
+        DEBUGLOG( "Unable to create bundle index '%s'", temp_path );
+        return;
+    }
+
+    written = write( fd, index->base, index->size );
+    close( fd );
+
+    if ( ( written != (ssize_t) index->size ) || ( rename( temp_path, cache_path ) != 0 ) )
+    {
+        DEBUGLOG( "Unable to write bundle index '%s'", cache_path );
+        (void) unlink( temp_path );
+    }
+}
+
+#pragma mark -
+
+int __open_bundle_index( const char * dir_path, const char * bundle_type,
+                         struct bundle_index * index )
+{
+    char cache_path[PATH_MAX];
+    struct stat statBuf;
+    int cacheable = 0;
+
+    bzero( index, sizeof(struct bundle_index) );
+
+    if ( stat( dir_path, &statBuf ) != 0 )
+        return ( 0 );
+
+    cacheable = get_cache_path( dir_path, cache_path );
+
+    if ( ( cacheable ) &&
+         ( read_cached_index( cache_path, dir_path, (unsigned int) statBuf.st_mtime,
+                              index ) ) )
+    {
+        DEBUGLOG( "Using cached index of %u bundles in '%s'",
+                  index->header->entry_count, dir_path );
+        return ( 1 );
+    }
+
+    // the folder's date was taken before it was scanned, so if it
+    // changes while we're looking, the index is rebuilt next time
+    if ( !build_index( dir_path, bundle_type, (unsigned int) statBuf.st_mtime, index ) )
+        return ( 0 );
+
+    DEBUGLOG( "Indexed %u bundles in '%s'", index->header->entry_count, dir_path );
+
+    if ( cacheable )
+        write_cached_index( cache_path, index );
+
+    return ( 1 );
+}
+
+void __close_bundle_index( struct bundle_index * index )
+{
+    if ( index->base != NULL )
+    {
+        if ( index->mapped )
+            (void) munmap( index->base, index->size );
+        else
+            free( index->base );
+    }
+
+    bzero( index, sizeof(struct bundle_index) );
+}
+
+const char * __bundle_index_string( const struct bundle_index * index,
+                                    unsigned int offset )
+{
+    if ( offset >= index->header->strings_size )
+        return ( "" );
+
+    return ( index->strings + offset );
+}
+
+static int match_pid( const char * pattern, pid_t pid )
+{
+    char * end = NULL;
+    long lo, hi;
+
+    if ( strcmp( pattern, "*" ) == 0 )
+        return ( 1 );
+
+    lo = strtol( pattern, &end, 10 );
+    if ( end == pattern )
+        return ( 0 );
+
+    if ( *end == '\0' )
+        return ( pid == (pid_t) lo );
+
+    if ( *end != '-' )
+        return ( 0 );
+
+    pattern = end + 1;
+    hi = strtol( pattern, &end, 10 );
+    if ( ( end == pattern ) || ( *end != '\0' ) )
+        return ( 0 );
+
+    return ( ( pid >= (pid_t) lo ) && ( pid <= (pid_t) hi ) );
+}
+
+// checks one of an entry's lists of patterns; an empty list matches
+// anything. If str is NULL, the patterns are process IDs.
+static int match_list( const struct bundle_index * index, unsigned int first,
+                       unsigned int count, const char * str, pid_t pid )
+{
+    unsigned int i;
+
+    if ( count == 0 )
+        return ( 1 );
+
+    if ( ( first > index->header->name_count ) ||
+         ( count > index->header->name_count - first ) )
+        return ( 1 );
+
+    for ( i = 0; i < count; i++ )
+    {
+        const char * pattern = __bundle_index_string( index, index->names[first + i] );
+
+        if ( str == NULL )
+        {
+            if ( match_pid( pattern, pid ) )
+                return ( 1 );
+        }
+        else if ( fnmatch( pattern, str, 0 ) == 0 )
+        {
+            return ( 1 );
+        }
+    }
+
+    return ( 0 );
+}
+
+int __bundle_index_wants_process( const struct bundle_index * index,
+                                  const struct bundle_index_entry * entry,
+                                  const struct target_process * proc )
+{
+    // if we don't know something, don't filter on it
+    if ( ( proc->name != NULL ) &&
+         ( !match_list( index, entry->first_app, entry->app_count, proc->name, 0 ) ) )
+        return ( 0 );
+
+    if ( ( proc->path != NULL ) &&
+         ( !match_list( index, entry->first_path, entry->path_count, proc->path, 0 ) ) )
+        return ( 0 );
+
+    if ( !match_list( index, entry->first_pid, entry->pid_count, NULL, proc->pid ) )
+        return ( 0 );
+
+    return ( 1 );
+}
+
+unsigned int __bundle_index_count_wanted( const struct bundle_index * index,
+                                          const struct target_process * proc )
+{
+    unsigned int i, result = 0;
+
+    for ( i = 0; i < index->header->entry_count; i++ )
+    {
+        if ( __bundle_index_wants_process( index, &index->entries[i], proc ) )
+            result++;
+    }
+
+    return ( result );
+}
+
+void __get_target_process( struct target_process * proc )
+{
+    static char exec_path[PATH_MAX];
+    static int have_path = 0;
+
+    if ( !have_path )
+    {
+        uint32_t size = PATH_MAX;
+        have_path = ( _NSGetExecutablePath( exec_path, &size ) == 0 );
+    }
+
+    proc->name = ApplicationName( );
+    proc->path = ( have_path ? exec_path : NULL );
+    proc->pid = getpid( );
+}
+
+const char * __bundle_index_dependency( const struct bundle_index * index,
+                                        const struct bundle_index_entry * entry,
+                                        unsigned int i )
+{
+    if ( ( entry->first_dep > index->header->name_count ) ||
+         ( i >= index->header->name_count - entry->first_dep ) )
+        return ( "" );
+
+    return ( __bundle_index_string( index, index->names[entry->first_dep + i] ) );
+}
+
+void * __bundle_index_start_fn( const struct bundle_index * index,
+                                const struct bundle_index_entry * entry )
+{
+    const char * exec_path = __bundle_index_string( index, entry->exec_path );
+    const char * name = NULL;
+    struct stat statBuf;
+    unsigned long i, num;
+
+    if ( entry->start_fn_offset == 0 )
+        return ( NULL );
+
+    // rebuilt since it was indexed?
+    if ( ( stat( exec_path, &statBuf ) != 0 ) ||
+         ( entry->exec_mtime != (unsigned int) statBuf.st_mtime ) ||
+         ( entry->exec_size != (unsigned int) statBuf.st_size ) )
+        return ( NULL );
+
+    num = _dyld_image_count( );
+    for ( i = 0; i < num; i++ )
+    {
+        name = _dyld_get_image_name( i );
+        if ( ( name != NULL ) && ( strncmp( name, exec_path, PATH_MAX ) == 0 ) )
+        {
+            return ( (void *) (_dyld_get_image_vmaddr_slide( i ) +
+                               entry->start_fn_offset) );
+        }
+    }
+
+    return ( NULL );
+}
@@ -0,0 +1,274 @@
+/*
+ *  bundle_index.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 23/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_BUNDLE_INDEX_H__
+#define __DP_BUNDLE_INDEX_H__
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <stddef.h>
+
+/*!
+ @header Bundle Index
+ @discussion Finding the patch bundles in a folder means listing it,
+         then creating a CFBundle for each entry, which reads and
+         parses its Info.plist. Since that happens in every process we
+         inject into, the results are kept in an index file, one per
+         folder, in the user's Caches folder. The index is rebuilt
+         whenever the folder's modification date changes, which it
+         does whenever a bundle is added, removed, or renamed.
+
+         Each entry also records the modification date and size of the
+         bundle's executable, so a bundle which has been rebuilt in
+         place won't be started using a stale function offset, and of
+         its Info.plist. Editing an Info.plist doesn't change the date
+         of the folder, so a cached index is only used if every
+         bundle's Info.plist is still the one it was made from.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+#define kBundleIndexMagic           0x44504249  /* 'DPBI' */
+#define kBundleIndexVersion         4
+
+/*!
+ @struct bundle_index_header
+ @abstract The start of an index file.
+ @discussion All offsets are from the start of the file, except string
+         offsets, which are from the start of the string table. String
+         offset zero is always the empty string.
+ @field magic @link kBundleIndexMagic kBundleIndexMagic @/link.
+ @field version @link kBundleIndexVersion kBundleIndexVersion @/link.
+ @field dir_mtime The modification time of the indexed folder.
+ @field dir_path The string offset of the folder's path.
+ @field entry_count The number of bundles.
+ @field entries_offset The offset of the array of
+        @link bundle_index_entry bundle_index_entry @/link structures.
+ @field name_count The total number of names in the name list: the
+        bundles' application names, executable paths, process IDs, and
+        dependencies.
+ @field names_offset The offset of the name list, an array of string
+        offsets.
+ @field strings_offset The offset of the string table.
+ @field strings_size The size of the string table, including the final
+        NUL character.
+ */
+struct bundle_index_header
+{
+    unsigned int    magic;
+    unsigned int    version;
+    unsigned int    dir_mtime;
+    unsigned int    dir_path;
+    unsigned int    entry_count;
+    unsigned int    entries_offset;
+    unsigned int    name_count;
+    unsigned int    names_offset;
+    unsigned int    strings_offset;
+    unsigned int    strings_size;
+};
+
+/*!
+ @enum Bundle index flags
+ @constant kBundleIndexThreadSafe The bundle's start function can run
+        alongside other bundles' start functions.
+ */
+enum
+{
+    kBundleIndexThreadSafe      = 0x00000001
+};
+
+/*!
+ @struct bundle_index_entry
+ @abstract One bundle in an index.
+ @field bundle_path The string offset of the bundle's path.
+ @field identifier The string offset of the bundle's identifier.
+ @field exec_path The string offset of the bundle executable's path.
+ @field exec_mtime The modification time of the executable.
+ @field exec_size The size of the executable.
+ @field info_mtime The modification time of the bundle's Info.plist, or
+        zero if it doesn't have one.
+ @field info_size The size of the bundle's Info.plist.
+ @field start_fn_offset The offset of the bundle's start function in
+        its executable, or zero if it couldn't be found.
+ @field flags Bundle index flags, from its Info.plist.
+ @field first_app The index of the bundle's first application name in
+        the index's name list.
+ @field app_count The number of application name patterns the bundle
+        listed under
+        @link //apple_ref/c/macro/kPatchTargetApplicationsKey kPatchTargetApplicationsKey @/link;
+        zero means it patches applications of any name.
+ @field first_path The index of the bundle's first executable path
+        pattern in the index's name list.
+ @field path_count The number of patterns listed under
+        @link //apple_ref/c/macro/kPatchTargetPathsKey kPatchTargetPathsKey @/link.
+ @field first_pid The index of the bundle's first process ID pattern in
+        the index's name list.
+ @field pid_count The number of patterns listed under
+        @link //apple_ref/c/macro/kPatchTargetProcessIDsKey kPatchTargetProcessIDsKey @/link.
+ @field first_dep The index of the first of the bundle's dependencies
+        in the index's name list.
+ @field dep_count The number of bundle identifiers listed under
+        @link //apple_ref/c/macro/kPatchDependenciesKey kPatchDependenciesKey @/link.
+ */
+struct bundle_index_entry
+{
+    unsigned int    bundle_path;
+    unsigned int    identifier;
+    unsigned int    exec_path;
+    unsigned int    exec_mtime;
+    unsigned int    exec_size;
+    unsigned int    info_mtime;
+    unsigned int    info_size;
+    unsigned int    start_fn_offset;
+    unsigned int    flags;
+    unsigned int    first_app;
+    unsigned int    app_count;
+    unsigned int    first_path;
+    unsigned int    path_count;
+    unsigned int    first_pid;
+    unsigned int    pid_count;
+    unsigned int    first_dep;
+    unsigned int    dep_count;
+};
+
+/*!
+ @struct bundle_index
+ @abstract An index which has been read into memory.
+ */
+struct bundle_index
+{
+    void *                                  base;
+    size_t                                  size;
+    int                                     mapped;
+    const struct bundle_index_header *      header;
+    const struct bundle_index_entry *       entries;
+    const unsigned int *                    names;
+    const char *                            strings;
+};
+
+/*!
+ @struct target_process
+ @abstract What a bundle's target filter is matched against.
+ @field name The process name.
+ @field path The full path of the process executable.
+ @field pid The process ID.
+ */
+struct target_process
+{
+    const char *    name;
+    const char *    path;
+    pid_t           pid;
+};
+
+/*!
+ @function __get_target_process
+ @abstract Describe the current process, for filtering bundles.
+ @param proc Filled in with details of the current process. The
+        strings remain valid for the life of the process.
+ */
+void __get_target_process( struct target_process * proc );
+
+/*!
+ @function __open_bundle_index
+ @abstract Get the index for a patch bundle folder.
+ @discussion If the cached index is missing or out of date, the folder
+         is scanned and a new one is written.
+ @param dir_path The folder to index.
+ @param bundle_type The file extension of the bundles to look for.
+ @param index Filled in with the index.
+ @result Nonzero on success.
+ */
+int __open_bundle_index( const char * dir_path, const char * bundle_type,
+                         struct bundle_index * index );
+
+/*!
+ @function __close_bundle_index
+ @abstract Release an index.
+ @param index An index opened with
+        @link __open_bundle_index __open_bundle_index @/link.
+ */
+void __close_bundle_index( struct bundle_index * index );
+
+/*!
+ @function __bundle_index_string
+ @abstract Get a string from an index's string table.
+ @param index An open index.
+ @param offset The string offset.
+ @result The string, or an empty string if the offset is out of range.
+ */
+const char * __bundle_index_string( const struct bundle_index * index,
+                                    unsigned int offset );
+
+/*!
+ @function __bundle_index_wants_process
+ @abstract Check a process against a bundle's target filter.
+ @discussion Each of the bundle's lists of application names, executable
+         paths, and process IDs which isn't empty must have a match.
+         Names and paths are matched using <code>fnmatch()</code>; a
+         process ID pattern is either a single number, a range such as
+         <code>100-200</code>, or <code>*</code>.
+ @param index An open index.
+ @param entry One of its entries.
+ @param proc The process.
+ @result Nonzero if the bundle patches this process.
+ */
+int __bundle_index_wants_process( const struct bundle_index * index,
+                                  const struct bundle_index_entry * entry,
+                                  const struct target_process * proc );
+
+/*!
+ @function __bundle_index_count_wanted
+ @abstract Count the bundles in an index which patch a process.
+ @param index An open index.
+ @param proc The process.
+ @result The number of bundles whose target filters match.
+ */
+unsigned int __bundle_index_count_wanted( const struct bundle_index * index,
+                                          const struct target_process * proc );
+
+/*!
+ @function __bundle_index_dependency
+ @abstract Get one of a bundle's dependencies.
+ @param index An open index.
+ @param entry One of its entries.
+ @param i Which dependency, less than the entry's dep_count.
+ @result The dependency's bundle identifier, or an empty string if the
+         index is damaged.
+ */
+const char * __bundle_index_dependency( const struct bundle_index * index,
+                                        const struct bundle_index_entry * entry,
+                                        unsigned int i );
+
+/*!
+ @function __bundle_index_start_fn
+ @abstract Find a loaded bundle's start function from its index entry.
+ @discussion This saves a symbol lookup. It checks that the executable
+         is still the one which was indexed.
+ @param index An open index.
+ @param entry The entry for a bundle whose executable has been loaded.
+ @result The address of the start function, or NULL if it needs to be
+         looked up by name.
+ */
+void * __bundle_index_start_fn( const struct bundle_index * index,
+                                const struct bundle_index_entry * entry );
+
+__END_DECLS
+
+#endif  /* __DP_BUNDLE_INDEX_H__ */
@@ -23,6 +23,9 @@
 #include <sys/stat.h>
 
 #include "logging.h"
+#include "load_bundle.h"
+#include "bundle_index.h"
+#include "parallel_load.h"
 
 // get the function name constants from here
 #include "Injection.h"
@@ -42,6 +45,10 @@ const char *pBundleSubpath      = "/DynamicPatch/";
 // bundles
 const char *pBundleType         = "patch";
 
+// the most folders load_patch_bundles() will look in; there's one for
+// each domain searched
+#define MAX_SEARCH_FOLDERS      4
+
 // this is the expected prototype for the startup function. It should
 // return zero if it is to be unloaded from memory (if it decided not
 // to patch anything, or if some error occurred), and nonzero if
@@ -72,7 +79,31 @@ typedef int (*__bundle_start_fn_ptr)( CFBundleRef bundle );
 
 #pragma mark -
 
-// this is called for each bundle found
+CFBundleRef create_patch_bundle( const char * path )
+{
+    CFBundleRef result = NULL;
+    CFStringRef str = CFStringCreateWithCString( NULL, path, kCFStringEncodingUTF8 );
+
+    if ( str != NULL )
+    {
+        CFURLRef url = CFURLCreateWithFileSystemPath( NULL, str, kCFURLPOSIXPathStyle, TRUE );
+        if ( url != NULL )
+        {
+            result = CFBundleCreate( NULL, url );
+            CFRelease( url );
+        }
+
+        CFRelease( str );
+    }
+
+    if ( result == NULL )
+        LogError( "Failed to create bundle '%s' !", path );
+
+    return ( result );
+}
+
+// this is called for a specific bundle; bundles found in the
+// standard folders go through __load_bundles_in_parallel() instead
 static int handle_a_bundle( CFBundleRef bundle )
 {
     // NB: At this point, we could search through the bundle's
@@ -120,69 +151,52 @@ static int handle_a_bundle( CFBundleRef bundle )
 #pragma mark -
 
 void load_patch_bundles( void )
+{
+    struct target_process proc;
+
+    __get_target_process( &proc );
+    (void) load_patch_bundles_for_process( &proc );
+}
+
+unsigned int load_patch_bundles_for_process( const struct target_process * proc )
 {
     NSSearchPathEnumerationState srchState;
-    struct stat statBuf;
-    CFStringRef bundleType = DEFINE_CFSTR(pBundleType);
+    struct bundle_index indexes[ MAX_SEARCH_FOLDERS ];
+    unsigned int i, num_indexes = 0, num_wanted = 0, num_loaded = 0;
     char path[ PATH_MAX ];
 
     srchState = NSStartSearchPathEnumeration( srchDir,
                                               NSUserDomainMask | NSLocalDomainMask );
 
-    while ( (srchState = NSGetNextSearchPathEnumeration(srchState, path)) != 0 )
+    while ( ( (srchState = NSGetNextSearchPathEnumeration(srchState, path)) != 0 ) &&
+            ( num_indexes < MAX_SEARCH_FOLDERS ) )
     {
         // append our subfolder
         // the system doesn't seem to mind double-separators
         strlcat( path, pBundleSubpath, PATH_MAX );
 
-        if ( stat( path, &statBuf ) != -1 )
+        // this only looks at the folder's contents if they've changed
+        // since last time
+        if ( __open_bundle_index( path, pBundleType, &indexes[num_indexes] ) )
         {
-            // it exists, enumerate its contents
-            CFStringRef bundlePath = NULL;
-            CFURLRef url = NULL;
-            CFArrayRef bundles = NULL;
-
-            bundlePath = CFStringCreateWithCString( NULL, path, kCFStringEncodingUTF8 );
-            url = CFURLCreateWithFileSystemPath( NULL, bundlePath, kCFURLPOSIXPathStyle, TRUE );
-            bundles = CFBundleCreateBundlesFromDirectory( NULL, url, bundleType );
-
-            if ( bundles != NULL )
-            {
-                CFBundleRef bundle = NULL;
-                CFIndex i = 0;
-                CFIndex num = CFArrayGetCount( bundles );
-
-                DEBUGLOG( "Got %u bundles in folder '%s'", num, path );
-
-                for ( i = 0; i < num; i++ )
-                {
-                    bundle = (CFBundleRef) CFArrayGetValueAtIndex( bundles, i );
-
-                    if ( bundle != NULL )
-                    {
-                        // if the bundle loads stuff, we need to keep
-                        // it around when we release the array
-                        if ( handle_a_bundle( bundle ) )
-                            CFRetain( bundle );
-                    }
-                    else
-                    {
-                        LogError( "Failed to get bundle at index '%u'", i );
-                    }
-                }
-
-                CFRelease( bundles );
-            }
-
-            if ( url != NULL )
-                CFRelease( url );
-            if ( bundlePath != NULL )
-                CFRelease( bundlePath );
+            DEBUGLOG( "Got %u bundles in folder '%s'",
+                      indexes[num_indexes].header->entry_count, path );
+            num_wanted += __bundle_index_count_wanted( &indexes[num_indexes], proc );
+            num_indexes++;
         }
     }
 
-    if ( bundleType != NULL )
-        CFRelease( bundleType );
+    // bundles which stay loaded keep their bundle objects; releasing
+    // them would unload the code
+    if ( num_wanted > 0 )
+        num_loaded = __load_bundles_in_parallel( indexes, num_indexes, proc );
+    else
+        DEBUGLOG( "No patch bundles target process %d", proc->pid );
+
+    for ( i = 0; i < num_indexes; i++ )
+        __close_bundle_index( &indexes[i] );
+
+    return ( num_loaded );
 }
 
 void load_patch_bundle( const char *pPatchToLoad )
@@ -236,8 +250,6 @@ CFArrayRef list_patch_bundles( void )
     CFMutableArrayRef result = NULL;
 
     NSSearchPathEnumerationState srchState;
-    struct stat statBuf;
-    CFStringRef bundleType = DEFINE_CFSTR(pBundleType);
     char path[ PATH_MAX ];
 
     srchState = NSStartSearchPathEnumeration( srchDir,
@@ -245,33 +257,32 @@ CFArrayRef list_patch_bundles( void )
 
     while ( (srchState = NSGetNextSearchPathEnumeration(srchState, path)) != 0 )
     {
+        struct bundle_index index;
+
         // append our subfolder
         // the system doesn't seem to mind double-separators
         strlcat( path, pBundleSubpath, PATH_MAX );
 
-        if ( stat( path, &statBuf ) != -1 )
+        if ( __open_bundle_index( path, pBundleType, &index ) )
         {
-            // it exists, enumerate its contents
-            CFStringRef bundlePath = NULL;
-            CFURLRef url = NULL;
-            CFArrayRef bundles = NULL;
+            unsigned int i, num = index.header->entry_count;
 
-            bundlePath = CFStringCreateWithCString( NULL, path, kCFStringEncodingUTF8 );
-            url = CFURLCreateWithFileSystemPath( NULL, bundlePath, kCFURLPOSIXPathStyle, TRUE );
-            bundles = CFBundleCreateBundlesFromDirectory( NULL, url, bundleType );
+            if ( ( result == NULL ) && ( num > 0 ) )
+                result = CFArrayCreateMutable( NULL, 0, &kCFTypeArrayCallBacks );
 
-            if ( (bundles != NULL) && (CFArrayGetCount(bundles) > 0) )
+            for ( i = 0; i < num; i++ )
             {
-                if ( result == NULL )
-                {
-                    result = CFArrayCreateMutableCopy( NULL, 0, bundles );
-                }
-                else
+                CFBundleRef bundle = create_patch_bundle( __bundle_index_string( &index,
+                    index.entries[i].bundle_path ) );
+
+                if ( bundle != NULL )
                 {
-                    CFRange range = CFRangeMake( 0, CFArrayGetCount(bundles) );
-                    CFArrayAppendArray( result, bundles, range );
+                    CFArrayAppendValue( result, bundle );
+                    CFRelease( bundle );
                 }
             }
+
+            __close_bundle_index( &index );
         }
     }
 
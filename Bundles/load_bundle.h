@@ -42,9 +42,26 @@ __BEGIN_DECLS
          folder (e.g. /Library/Application Support/DynamicPatch/) for
          bundles with a predefined file extension (e.g. .patch), and
          will load each of them, calling their initialization routines.
+         Several bundles are loaded at once; see
+         @link //apple_ref/c/func/__load_bundles_in_parallel __load_bundles_in_parallel @/link.
  */
 void load_patch_bundles( void );
 
+struct target_process;
+
+/*!
+ @function load_patch_bundles_for_process
+ @abstract Load the patches in the standard place which target a process.
+ @discussion This does the work for
+         @link load_patch_bundles load_patch_bundles @/link. Each
+         bundle's target filter, as recorded in its folder's index, is
+         checked against the given process before anything is loaded,
+         so if no bundle matches, no bundle is even opened.
+ @param proc The process to load bundles for; normally the current one.
+ @result The number of bundles which stayed loaded.
+ */
+unsigned int load_patch_bundles_for_process( const struct target_process * proc );
+
 /*!
  @function load_patch_bundle
  @abstract Load and launch a patch bundle at a specified path.
@@ -70,6 +87,16 @@ void load_patch_bundle( const char *pPatchToLoad );
  */
 CFArrayRef list_patch_bundles( void );
 
+/*!
+ @function create_patch_bundle
+ @abstract Create a bundle object for a patch bundle.
+ @discussion This doesn't load the bundle's executable. An error is
+         logged on failure.
+ @param pPath The fully-qualified POSIX path to the patch bundle.
+ @result A new CFBundleRef, or NULL.
+ */
+CFBundleRef create_patch_bundle( const char *pPath );
+
 __END_DECLS
 
 #endif  /* __DP_LOAD_BUNDLE_H__ */
@@ -0,0 +1,464 @@
+/*
+ *  parallel_load.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 24/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#include <mach/mach_time.h>
+
+#include "parallel_load.h"
+#include "load_bundle.h"
+#include "Injection.h"
+#include "timing.h"
+#include "logging.h"
+
+// the calling thread makes one more
+#define MAX_LOAD_THREADS    4
+
+// a bundle moves through these in order
+enum
+{
+    kJobQueued = 0,         // waiting to be loaded
+    kJobLoading,
+    kJobLoaded,             // waiting for its dependencies to start
+    kJobStarting,
+    kJobDone                // started, or failed to load
+};
+
+// what a thread should do next
+enum
+{
+    kTaskNone = 0,
+    kTaskLoad,
+    kTaskStart
+};
+
+struct bundle_job
+{
+    const struct bundle_index *         index;
+    const struct bundle_index_entry *   entry;
+    const char *                        path;
+    const char *                        identifier;
+    int                                 thread_safe;
+
+    // indices of the jobs which must start first
+    unsigned int *                      deps;
+    unsigned int                        dep_count;
+
+    CFBundleRef                         bundle;
+    __bundle_start_fn                   start_fn;
+    int                                 state;
+    int                                 result;
+    unsigned long long                  load_usec;
+    unsigned long long                  start_usec;
+};
+
+// shared between all the threads; everything is protected by the lock
+struct load_pool
+{
+    pthread_mutex_t                     lock;
+    pthread_cond_t                      cond;
+    struct bundle_job *                 jobs;
+    unsigned int                        count;
+    unsigned int                        next_load;
+    unsigned int                        num_busy;
+    unsigned int                        num_done;
+    int                                 exclusive;  // running a start which isn't thread-safe
+};
+
+static unsigned int count_load_threads( unsigned int num_jobs )
+{
+    int ncpu = 1;
+    size_t len = sizeof(ncpu);
+    unsigned int result = 0;
+
+    if ( ( sysctlbyname( "hw.ncpu", &ncpu, &len, NULL, 0 ) != 0 ) || ( ncpu < 2 ) )
+        ncpu = 2;   // still worth it: most of loading is waiting on the disk
+
+    result = (unsigned int) ncpu;
+    if ( result > MAX_LOAD_THREADS )
+        result = MAX_LOAD_THREADS;
+
+    // the calling thread takes a share of the work too
+    if ( result >= num_jobs )
+        result = num_jobs - 1;
+
+    return ( result );
+}
+
+#pragma mark -
+
+static void load_job( struct bundle_job * job )
+{
+    unsigned long long start = mach_absolute_time( );
+
+    job->bundle = create_patch_bundle( job->path );
+
+    if ( ( job->bundle != NULL ) && ( CFBundleLoadExecutable( job->bundle ) ) )
+    {
+        job->start_fn = (__bundle_start_fn) __bundle_index_start_fn( job->index, job->entry );
+
+        if ( job->start_fn == 0 )
+        {
+            CFStringRef funcName = CFStringCreateWithCString( NULL, kStartFunctionName,
+                                                              kCFStringEncodingASCII );
+            job->start_fn = (__bundle_start_fn) CFBundleGetFunctionPointerForName(
+                job->bundle, funcName );
+            CFRelease( funcName );
+        }
+
+        if ( job->start_fn == 0 )
+            LogError( "Couldn't find startup function in '%s' !", job->path );
+    }
+    else if ( job->bundle != NULL )
+    {
+        LogError( "Failed to load bundle '%s' !", job->path );
+    }
+
+    job->load_usec = AbsoluteToMicroseconds( mach_absolute_time( ) - start );
+}
+
+static void start_job( struct bundle_job * job )
+{
+    unsigned long long start = mach_absolute_time( );
+
+    if ( job->start_fn != 0 )
+    {
+        job->result = job->start_fn( job->bundle );
+        DEBUGLOG( "Called startup function of '%s', result is %d", job->path, job->result );
+    }
+
+    if ( ( job->result == 0 ) && ( job->bundle != NULL ) )
+    {
+        // bundle startup failed, cancelled, or we couldn't find the
+        // function
+        CFBundleUnloadExecutable( job->bundle );
+        CFRelease( job->bundle );
+        job->bundle = NULL;
+    }
+
+    job->start_usec = AbsoluteToMicroseconds( mach_absolute_time( ) - start );
+
+    DEBUGLOG( "Bundle '%s': loaded in %llu usec, started in %llu usec", job->path,
+              job->load_usec, job->start_usec );
+}
+
+static int dependencies_done( const struct load_pool * pool, const struct bundle_job * job )
+{
+    unsigned int i;
+
+    for ( i = 0; i < job->dep_count; i++ )
+    {
+        if ( pool->jobs[job->deps[i]].state != kJobDone )
+            return ( 0 );
+    }
+
+    return ( 1 );
+}
+
+// called with the pool locked. Only the calling thread passes a
+// nonzero any_thread, allowing it to run start functions which aren't
+// thread-safe; it looks for those first, leaving the rest to the pool.
+// Those still run alone, just as they did before bundles were loaded in
+// parallel: one is only handed out when nothing else is being loaded or
+// started, and nothing else is handed out until it returns.
+static int next_task( struct load_pool * pool, int any_thread, unsigned int * pJob )
+{
+    unsigned int i;
+    int pass;
+
+    if ( pool->exclusive )
+        return ( kTaskNone );
+
+    if ( pool->next_load < pool->count )
+    {
+        *pJob = pool->next_load++;
+        return ( kTaskLoad );
+    }
+
+    for ( pass = ( any_thread ? 0 : 1 ); pass < 2; pass++ )
+    {
+        for ( i = 0; i < pool->count; i++ )
+        {
+            struct bundle_job * job = &pool->jobs[i];
+
+            if ( ( job->state != kJobLoaded ) || ( job->thread_safe != pass ) )
+                continue;
+
+            if ( ( !job->thread_safe ) && ( pool->num_busy != 0 ) )
+                break;
+
+            if ( dependencies_done( pool, job ) )
+            {
+                *pJob = i;
+                return ( kTaskStart );
+            }
+        }
+    }
+
+    return ( kTaskNone );
+}
+
+// called with the pool locked; drops the lock while the work is done
+static void run_task( struct load_pool * pool, int task, unsigned int i )
+{
+    struct bundle_job * job = &pool->jobs[i];
+
+    job->state = ( task == kTaskLoad ) ? kJobLoading : kJobStarting;
+    pool->num_busy++;
+
+    if ( ( task == kTaskStart ) && ( !job->thread_safe ) )
+        pool->exclusive = 1;
+
+    pthread_mutex_unlock( &pool->lock );
+
+    if ( task == kTaskLoad )
+    {
+        load_job( job );
+
+        // nothing to start if it didn't load, so just clean up
+        if ( job->start_fn == 0 )
+            start_job( job );
+    }
+    else
+    {
+        start_job( job );
+    }
+
+    pthread_mutex_lock( &pool->lock );
+
+    pool->num_busy--;
+
+    if ( ( task == kTaskStart ) && ( !job->thread_safe ) )
+        pool->exclusive = 0;
+
+    if ( ( task == kTaskLoad ) && ( job->start_fn != 0 ) )
+    {
+        job->state = kJobLoaded;
+    }
+    else
+    {
+        job->state = kJobDone;
+        pool->num_done++;
+    }
+
+    pthread_cond_broadcast( &pool->cond );
+}
+
+static void * load_thread( void * arg )
+{
+    struct load_pool * pool = (struct load_pool *) arg;
+    unsigned int i = 0;
+    int task;
+
+    pthread_mutex_lock( &pool->lock );
+
+    while ( pool->num_done < pool->count )
+    {
+        task = next_task( pool, 0, &i );
+
+        if ( task == kTaskNone )
+            pthread_cond_wait( &pool->cond, &pool->lock );
+        else
+            run_task( pool, task, i );
+    }
+
+    pthread_mutex_unlock( &pool->lock );
+
+    return ( NULL );
+}
+
+// the calling thread's share of the work
+static void run_load_pool( struct load_pool * pool )
+{
+    unsigned int i = 0;
+    int task;
+
+    pthread_mutex_lock( &pool->lock );
+
+    while ( pool->num_done < pool->count )
+    {
+        task = next_task( pool, 1, &i );
+
+        if ( ( task == kTaskNone ) && ( pool->num_busy == 0 ) )
+        {
+            // everything's loaded, nothing's running, and nothing can
+            // start: the dependencies go round in a circle
+            for ( i = 0; i < pool->count; i++ )
+            {
+                if ( pool->jobs[i].state == kJobLoaded )
+                    break;
+            }
+
+            if ( i == pool->count )
+                break;
+
+            LogError( "Circular dependency involving patch bundle '%s', starting it anyway",
+                      pool->jobs[i].path );
+            task = kTaskStart;
+        }
+
+        if ( task == kTaskNone )
+            pthread_cond_wait( &pool->cond, &pool->lock );
+        else
+            run_task( pool, task, i );
+    }
+
+    pthread_mutex_unlock( &pool->lock );
+}
+
+#pragma mark -
+
+// works out which jobs each job has to wait for
+static int resolve_dependencies( struct bundle_job * jobs, unsigned int count )
+{
+    unsigned int i, j, k;
+
+    for ( i = 0; i < count; i++ )
+    {
+        struct bundle_job * job = &jobs[i];
+        unsigned int num_deps = job->entry->dep_count;
+
+        if ( num_deps == 0 )
+            continue;
+
+        job->deps = (unsigned int *) calloc( num_deps, sizeof(unsigned int) );
+        if ( job->deps == NULL )
+            return ( 0 );
+
+        for ( k = 0; k < num_deps; k++ )
+        {
+            const char * dep = __bundle_index_dependency( job->index, job->entry, k );
+
+            for ( j = 0; j < count; j++ )
+            {
+                if ( ( j != i ) && ( jobs[j].identifier[0] != '\0' ) &&
+                     ( strcmp( jobs[j].identifier, dep ) == 0 ) )
+                    break;
+            }
+
+            if ( j < count )
+                job->deps[job->dep_count++] = j;
+            else
+                DEBUGLOG( "Bundle '%s' depends on '%s', which isn't being loaded",
+                          job->path, dep );
+        }
+    }
+
+    return ( 1 );
+}
+
+unsigned int __load_bundles_in_parallel( const struct bundle_index * indexes,
+                                         unsigned int index_count,
+                                         const struct target_process * proc )
+{
+    struct load_pool pool;
+    struct bundle_job * jobs = NULL;
+    pthread_t threads[MAX_LOAD_THREADS];
+    unsigned int num_threads = 0, total = 0, count = 0, result = 0;
+    unsigned long long start = mach_absolute_time( );
+    unsigned int i, j;
+
+    for ( i = 0; i < index_count; i++ )
+        total += indexes[i].header->entry_count;
+
+    if ( total == 0 )
+        return ( 0 );
+
+    jobs = (struct bundle_job *) calloc( total, sizeof(struct bundle_job) );
+    if ( jobs == NULL )
+    {
+        LogError( "Unable to allocate memory to load %u bundles", total );
+        return ( 0 );
+    }
+
+    for ( i = 0; i < index_count; i++ )
+    {
+        const struct bundle_index * index = &indexes[i];
+
+        for ( j = 0; j < index->header->entry_count; j++ )
+        {
+            const struct bundle_index_entry * entry = &index->entries[j];
+            struct bundle_job * job = &jobs[count];
+
+            job->index = index;
+            job->entry = entry;
+            job->path = __bundle_index_string( index, entry->bundle_path );
+            job->identifier = __bundle_index_string( index, entry->identifier );
+            job->thread_safe = ( ( entry->flags & kBundleIndexThreadSafe ) != 0 );
+
+            if ( ( proc != NULL ) && ( !__bundle_index_wants_process( index, entry, proc ) ) )
+            {
+                DEBUGLOG( "Bundle '%s' doesn't patch this process", job->path );
+                continue;
+            }
+
+            count++;
+        }
+    }
+
+    if ( ( count > 0 ) && ( resolve_dependencies( jobs, count ) ) )
+    {
+        bzero( &pool, sizeof(pool) );
+        pthread_mutex_init( &pool.lock, NULL );
+        pthread_cond_init( &pool.cond, NULL );
+        pool.jobs = jobs;
+        pool.count = count;
+
+        // if any of these can't be created, there's just more for
+        // everyone else to do
+        for ( i = count_load_threads( count ); i > 0; i-- )
+        {
+            if ( pthread_create( &threads[num_threads], NULL, load_thread, &pool ) == 0 )
+                num_threads++;
+        }
+
+        run_load_pool( &pool );
+
+        for ( i = 0; i < num_threads; i++ )
+            (void) pthread_join( threads[i], NULL );
+
+        pthread_cond_destroy( &pool.cond );
+        pthread_mutex_destroy( &pool.lock );
+
+        // the ones which are still loaded keep their bundle objects
+        for ( i = 0; i < count; i++ )
+        {
+            if ( jobs[i].bundle != NULL )
+                result++;
+        }
+    }
+    else if ( count > 0 )
+    {
+        LogError( "Unable to allocate memory to load %u bundles", count );
+    }
+
+    DEBUGLOG( "Loaded %u of %u bundles in %llu usec, using %u extra threads", result,
+              count, AbsoluteToMicroseconds( mach_absolute_time( ) - start ), num_threads );
+
+    for ( i = 0; i < count; i++ )
+        free( jobs[i].deps );
+    free( jobs );
+
+    return ( result );
+}
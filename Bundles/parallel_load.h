@@ -0,0 +1,64 @@
+/*
+ *  parallel_load.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 24/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_PARALLEL_LOAD_H__
+#define __DP_PARALLEL_LOAD_H__
+
+#include <sys/cdefs.h>
+
+#include "bundle_index.h"
+
+/*!
+ @header Parallel Bundle Loading
+ @discussion With a lot of patch bundles installed, loading them one at
+         a time holds up the start of every application they're
+         injected into. These routines load and link bundle
+         executables on a small pool of threads.
+
+         Start functions are called in an order which respects each
+         bundle's declared dependencies. Those of bundles which say
+         their start functions are thread-safe are called on the pool
+         threads, alongside each other; all the others are called one
+         at a time, on the calling thread, as they always have been.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+/*!
+ @function __load_bundles_in_parallel
+ @abstract Load and start the bundles in a set of folder indexes.
+ @discussion The indexes must stay open until this returns. Bundles
+         whose start functions return zero are unloaded again; the
+         rest stay loaded for the life of the process. The total time
+         taken, and the time spent loading and starting each bundle,
+         are logged.
+ @param indexes The indexes of the patch bundle folders.
+ @param index_count The number of indexes.
+ @param proc The current process, used to skip bundles whose target
+        filters don't match it. If NULL, every bundle is loaded.
+ @result The number of bundles which stayed loaded.
+ */
+unsigned int __load_bundles_in_parallel( const struct bundle_index * indexes,
+                                         unsigned int index_count,
+                                         const struct target_process * proc );
+
+__END_DECLS
+
+#endif  /* __DP_PARALLEL_LOAD_H__ */
@@ -0,0 +1,121 @@
+/*
+ *  main.c
+ *  DynamicPatch/IslandBenchmark
+ *
+ *  Created by jim on 26/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sysexits.h>
+
+#include <mach/mach_time.h>
+
+#include <DynamicPatch/DynamicPatch.h>
+
+// Times calls to a trivial function when unpatched, when patched with
+// a standard island, and when patched with a direct-branch island
+// (kDPPatchDirectBranch). Each patch just calls on to the original, so
+// the difference from the unpatched figure is the cost of the hook.
+
+#define kDefaultIterations  10000000
+
+typedef int (*add_fn)( int, int );
+
+// one target per patch, since a function can only have one island
+static int __attribute__((noinline)) add_unpatched( int a, int b ) { return ( a + b ); }
+static int __attribute__((noinline)) add_standard( int a, int b ) { return ( a + b ); }
+static int __attribute__((noinline)) add_direct( int a, int b ) { return ( a + b ); }
+
+static add_fn original_standard = NULL;
+static add_fn original_direct = NULL;
+
+static int patch_standard( int a, int b )
+{
+    return ( original_standard( a, b ) );
+}
+
+static int patch_direct( int a, int b )
+{
+    return ( original_direct( a, b ) );
+}
+
+// call through a volatile pointer so the compiler can't inline or hoist
+static double time_calls( add_fn volatile fn, unsigned int iterations )
+{
+    mach_timebase_info_data_t timebase;
+    unsigned long long start, elapsed;
+    unsigned int i;
+    int total = 0;
+
+    mach_timebase_info( &timebase );
+
+    start = mach_absolute_time( );
+    for ( i = 0; i < iterations; i++ )
+        total = fn( total, 1 );
+    elapsed = mach_absolute_time( ) - start;
+
+    if ( total != (int) iterations )
+        printf( "Warning: got %d, expected %u\n", total, iterations );
+
+    return ( ( (double) elapsed * timebase.numer / timebase.denom ) / iterations );
+}
+
+int main( int argc, const char * argv[ ] )
+{
+    unsigned int iterations = kDefaultIterations;
+    double base, standard, direct;
+
+    if ( argc > 2 )
+    {
+        printf( "Usage: IslandBenchmark [<iterations>]\n" );
+        exit( EX_USAGE );
+    }
+
+    if ( argc == 2 )
+        iterations = (unsigned int) strtoul( argv[1], NULL, 10 );
+
+    InitLogs( "IslandBenchmark" );
+
+    original_standard = (add_fn) DPCreatePatch( (void *) &add_standard,
+                                                (void *) &patch_standard );
+    original_direct = (add_fn) DPCreatePatchWithOptions( (void *) &add_direct,
+                                                         (void *) &patch_direct,
+                                                         kDPPatchDirectBranch );
+
+    if ( ( original_standard == NULL ) || ( original_direct == NULL ) )
+    {
+        printf( "Unable to install the patches\n" );
+        exit( EX_SOFTWARE );
+    }
+
+    // once round to warm everything up, then for real
+    (void) time_calls( add_unpatched, iterations / 10 );
+    (void) time_calls( add_standard, iterations / 10 );
+    (void) time_calls( add_direct, iterations / 10 );
+
+    base = time_calls( add_unpatched, iterations );
+    standard = time_calls( add_standard, iterations );
+    direct = time_calls( add_direct, iterations );
+
+    printf( "%u calls each:\n", iterations );
+    printf( "  unpatched        %6.2f ns/call\n", base );
+    printf( "  standard island  %6.2f ns/call  (+%.2f)\n", standard, standard - base );
+    printf( "  direct island    %6.2f ns/call  (+%.2f)\n", direct, direct - base );
+
+    DPRemovePatch( (void *) &add_standard );
+    DPRemovePatch( (void *) &add_direct );
+
+    return ( EX_OK );
+}
@@ -0,0 +1,202 @@
+/*
+ *  main.c
+ *  DynamicPatch/PatchControl
+ *
+ *  Created by jim on 25/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fnmatch.h>
+#include <sysexits.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+
+#include <DynamicPatch/DynamicPatch.h>
+
+// Lists, and switches on and off, the patches in every process which
+// has published a patch control segment -- or just the ones named on
+// the command line. Everything is done through the shared segments;
+// the patched processes pick up changes on their own.
+
+enum
+{
+    kCommandList,
+    kCommandEnable,
+    kCommandDisable,
+    kCommandRate
+};
+
+static void usage( void )
+{
+    printf( "Usage: PatchControl list [<pid> ...]\n"
+            "       PatchControl enable <function> [<pid> ...]\n"
+            "       PatchControl disable <function> [<pid> ...]\n"
+            "       PatchControl rate <n> <function> [<pid> ...]\n"
+            "\n"
+            "<function> is a function name, which may contain wildcards.\n"
+            "With no process IDs, every process with patches is used.\n" );
+    exit( EX_USAGE );
+}
+
+// copy a slot's counters while they're not being updated
+static void read_counters( const DPControlSlot * slot, unsigned long long * calls,
+                           unsigned long long * samples, unsigned long long * ticks )
+{
+    unsigned int sequence;
+
+    do
+    {
+        while ( ( sequence = slot->sequence ) & 1 )
+            usleep( 100 );
+
+        *calls = slot->calls;
+        *samples = slot->samples;
+        *ticks = slot->total_ticks;
+
+    } while ( slot->sequence != sequence );
+}
+
+static void list_slot( const DPControlSlot * slot )
+{
+    unsigned long long calls, samples, ticks;
+
+    read_counters( slot, &calls, &samples, &ticks );
+
+    printf( "  %-32s %-8s rate %-4u calls %-10llu mean %llu ticks\n",
+            slot->name, slot->enabled ? "enabled" : "disabled",
+            slot->sample_rate ? slot->sample_rate : 1, calls,
+            samples ? ( ticks / samples ) : 0ULL );
+}
+
+static void control_process( pid_t pid, int command, const char * pattern,
+                             unsigned int rate )
+{
+    DPControlSegment * segment = DPMapControlSegment( pid );
+    unsigned int i, count;
+
+    if ( segment == NULL )
+        return;
+
+    count = segment->slot_count;
+    if ( count > kDPControlMaxSlots )
+        count = kDPControlMaxSlots;
+
+    printf( "%d:\n", (int) pid );
+
+    for ( i = 0; i < count; i++ )
+    {
+        DPControlSlot * slot = &segment->slots[i];
+
+        if ( slot->target == NULL )
+            continue;
+
+        if ( ( pattern != NULL ) && ( fnmatch( pattern, slot->name, 0 ) != 0 ) )
+            continue;
+
+        switch ( command )
+        {
+            case kCommandEnable:
+                slot->enabled = 1;
+                break;
+
+            case kCommandDisable:
+                slot->enabled = 0;
+                break;
+
+            case kCommandRate:
+                slot->sample_rate = rate;
+                break;
+
+            default:
+                break;
+        }
+
+        list_slot( slot );
+    }
+
+    DPUnmapControlSegment( segment );
+}
+
+static void control_all_processes( int command, const char * pattern, unsigned int rate )
+{
+    int mib[3] = { CTL_KERN, KERN_PROC, KERN_PROC_ALL };
+    struct kinfo_proc * procs = NULL;
+    size_t size = 0;
+    unsigned int i;
+
+    if ( ( sysctl( mib, 3, NULL, &size, NULL, 0 ) != 0 ) ||
+         ( ( procs = (struct kinfo_proc *) malloc( size ) ) == NULL ) ||
+         ( sysctl( mib, 3, procs, &size, NULL, 0 ) != 0 ) )
+    {
+        printf( "Unable to list processes\n" );
+        free( procs );
+        exit( EX_OSERR );
+    }
+
+    for ( i = 0; i < size / sizeof(struct kinfo_proc); i++ )
+        control_process( procs[i].kp_proc.p_pid, command, pattern, rate );
+
+    free( procs );
+}
+
+int main( int argc, const char * argv[ ] )
+{
+    const char * pattern = NULL;
+    unsigned int rate = 0;
+    int command = kCommandList;
+    int arg = 2;
+
+    if ( argc < 2 )
+        usage( );
+
+    if ( strcmp( argv[1], "enable" ) == 0 )
+        command = kCommandEnable;
+    else if ( strcmp( argv[1], "disable" ) == 0 )
+        command = kCommandDisable;
+    else if ( strcmp( argv[1], "rate" ) == 0 )
+        command = kCommandRate;
+    else if ( strcmp( argv[1], "list" ) != 0 )
+        usage( );
+
+    if ( command == kCommandRate )
+    {
+        if ( argc < 4 )
+            usage( );
+        rate = (unsigned int) strtoul( argv[arg++], NULL, 10 );
+    }
+
+    if ( command != kCommandList )
+    {
+        if ( argc <= arg )
+            usage( );
+        pattern = argv[arg++];
+    }
+
+    InitLogs( "PatchControl" );
+
+    if ( arg == argc )
+    {
+        control_all_processes( command, pattern, rate );
+    }
+    else
+    {
+        for ( ; arg < argc; arg++ )
+            control_process( (pid_t) strtoul( argv[arg], NULL, 10 ), command, pattern, rate );
+    }
+
+    return ( EX_OK );
+}
@@ -0,0 +1,58 @@
+/*
+ *  main.c
+ *  DynamicPatch/PatchManifest
+ *
+ *  Created by jim on 22/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sysexits.h>
+
+#include <DynamicPatch/DynamicPatch.h>
+
+// Writes the patch manifest for a Rosetta patch bundle. Run it from a
+// Run Script build phase in the bundle's target, once the bundle has
+// been built, on a PowerPC Mac or under Rosetta:
+//
+//   "$BUILT_PRODUCTS_DIR/PatchManifest" "$BUILT_PRODUCTS_DIR/$WRAPPER_NAME" "$TARGET_EXECUTABLE"
+//
+// The bundle's Info.plist must set DPPatchManifestReplacesWillPatch,
+// or no manifest is written.
+
+static void usage( void )
+{
+    printf( "Usage: PatchManifest <bundle> <target executable> [<manifest>]\n"
+            "\n"
+            "<target executable> is the full path of the executable of the\n"
+            "application the bundle patches. The manifest is written into\n"
+            "the bundle's Resources folder unless a path is given.\n" );
+    exit( EX_USAGE );
+}
+
+int main( int argc, const char * argv[ ] )
+{
+    if ( ( argc < 3 ) || ( argc > 4 ) )
+        usage( );
+
+    InitLogs( "PatchManifest" );
+
+    if ( !DPWritePatchManifest( argv[1], argv[2], ( argc == 4 ) ? argv[3] : NULL ) )
+    {
+        printf( "Unable to write a patch manifest for '%s'\n", argv[1] );
+        return ( EX_SOFTWARE );
+    }
+
+    return ( EX_OK );
+}
@@ -47,6 +47,7 @@
 #include "lookup.h"
 #include "injection.h"
 #include "apps.h"
+#include "patch_manifest.h"
 
 #include "code_blocks.c"
 #include "../Patching/stub_helper_code.c"
@@ -885,6 +886,11 @@ void RosettaInjector::LoadPatches( )
 }
 void RosettaInjector::HandleCurrentBundle( )
 {
+    // if the bundle came with its details worked out in advance, we
+    // don't need to load it at all
+    if ( HandleBundleManifest( ) )
+        return;
+
     if ( CFBundleLoadExecutable( currentBundle ) )
     {
         int willPatch = 0;
@@ -947,6 +953,70 @@ void RosettaInjector::HandleCurrentBundle( )
     }
 }
 
+bool RosettaInjector::HandleBundleManifest( )
+{
+    struct patch_manifest manifest;
+    pid_t appPid = 0;
+    const char * appName = NULL;
+    const char * appPath = NULL;
+    bool matches = false;
+    unsigned int i;
+
+    if ( !__open_patch_manifest( currentBundle, &manifest ) )
+        return ( false );
+
+    (void) pid_for_task( taskPort, &appPid );
+
+    // the addresses in the manifest are only good for the executable
+    // it was made from
+    appPath = PathForProcessID( appPid );
+    if ( appPath != NULL )
+    {
+        matches = ( __patch_manifest_matches_target( &manifest, appPath ) != 0 );
+
+        // this was created using strdup()
+        free( (void *) appPath );
+    }
+
+    if ( !matches )
+    {
+        // load the bundle and ask it instead
+        __close_patch_manifest( &manifest );
+        return ( false );
+    }
+
+    appName = NameForProcessID( appPid );
+
+    if ( appName != NULL )
+    {
+        if ( __patch_manifest_wants_app( &manifest, appName ) )
+        {
+            DEBUGLOG( "Using manifest of %u patches", manifest.header->patch_count );
+
+            for ( i = 0; i < manifest.header->patch_count; i++ )
+            {
+                const struct patch_manifest_entry * pEntry = &manifest.entries[i];
+
+                InstallPatchStubAtOffset( (void *) pEntry->target_addr,
+                                          pEntry->patch_fn_offset,
+                                          __patch_manifest_string( &manifest,
+                                                                   pEntry->patch_name ) );
+            }
+        }
+
+        // this was created using strdup()
+        free( (void *) appName );
+    }
+    else
+    {
+        LogError( "Failed to get target application's name !" );
+    }
+
+    __close_patch_manifest( &manifest );
+
+    return ( true );
+}
+
 #pragma mark -
 
 void RosettaInjector::_handle_patch_details( void * targetAddr,
@@ -967,36 +1037,40 @@ void RosettaInjector::_handle_patch_details( void * targetAddr,
 }
 void RosettaInjector::InstallPatchStub( void * targetAddr, const char * patchFnName )
 {
-    patch_entry_t entry = { (unsigned) targetAddr, 0 };
-    unsigned patchOffset = 0;
     UInt8 urlStr[ PATH_MAX ];
 
     // get the URL of the current bundle as a C-string
     CFURLRef url = CFBundleCopyExecutableURL( currentBundle );
     (void) CFURLGetFileSystemRepresentation( url, TRUE, urlStr, PATH_MAX );
+    CFRelease( url );
 
-    // get the address of this function for PPC
-    // value returned is actually an offset, relative to vm_addr of
-    // zero
-    if ( patchFnName[0] != '_' )
-    {
-        // use a leading underscore to locate the symbol
-        char symbol[ 256 ];
-        symbol[0] = '_';
-        symbol[1] = '\0';
-        strncat( symbol, patchFnName, 254 );
-        symbol[255] = '\0';
+    InstallPatchStubAtOffset( targetAddr,
+        __find_patch_function_offset( patchFnName, (const char *) urlStr ),
+        patchFnName );
+}
+void RosettaInjector::InstallPatchStubAtOffset( void * targetAddr, unsigned patchOffset,
+                                                const char * patchFnName )
+{
+    patch_entry_t entry = { (unsigned) targetAddr, 0 };
+    UInt8 urlStr[ PATH_MAX ];
 
-        patchOffset = (unsigned) DPFindFunctionForArchitecture( symbol,
-            (const char *) urlStr, kInsertionArchPPC );
-    }
-    else
+    // get the URL of the current bundle as a C-string
+    CFURLRef url = CFBundleCopyExecutableURL( currentBundle );
+    (void) CFURLGetFileSystemRepresentation( url, TRUE, urlStr, PATH_MAX );
+    CFRelease( url );
+
+    // does the bundle want all its patches bound up front?
+    int eagerBind = 0;
+    CFTypeRef eagerValue = CFBundleGetValueForInfoDictionaryKey( currentBundle,
+        CFSTR(kRosettaEagerBindingKey) );
+    if ( ( eagerValue != NULL ) &&
+         ( CFGetTypeID( eagerValue ) == CFBooleanGetTypeID( ) ) )
     {
-        patchOffset = (unsigned) DPFindFunctionForArchitecture( patchFnName,
-            (const char *) urlStr, kInsertionArchPPC );
+        eagerBind = CFBooleanGetValue( (CFBooleanRef) eagerValue ) ? 1 : 0;
     }
 
-    entry.ba_instr = _rosetta_install_patch_stub( targetAddr, patchOffset, urlStr, taskPort );
+    entry.ba_instr = _rosetta_install_patch_stub( targetAddr, patchOffset, urlStr,
+                                                  eagerBind, taskPort );
 
     if ( entry.ba_instr != 0 )
     {
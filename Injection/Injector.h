@@ -145,6 +145,11 @@ class RosettaInjector : public Injector
         void LoadPatches( );
         void HandleCurrentBundle( );
 
+        // if the current bundle has an up to date manifest, this
+        // installs its patches from that and returns true; otherwise
+        // it returns false and HandleCurrentBundle loads the bundle
+        bool HandleBundleManifest( );
+
         // this is a callback, whose address gets given to certain
         // functions within a patch bundle. The patch bundle uses this
         // callback to register which functions it would like patched
@@ -154,6 +159,9 @@ class RosettaInjector : public Injector
         // this is called by the callback to create a patch stub and an
         // entry in the patch entry list.
         void InstallPatchStub( void * targetAddr, const char * patchFnName );
+        // this does the work, once the patch function's been found
+        void InstallPatchStubAtOffset( void * targetAddr, unsigned patchOffset,
+                                       const char * patchFnName );
 
         patch_entry_list patchEntries;
         thread_act_t kernel_thread;
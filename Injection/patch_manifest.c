@@ -0,0 +1,611 @@
+/*
+ *  patch_manifest.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 22/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/param.h>
+
+#include "patch_manifest.h"
+#include "Injection.h"
+#include "Lookup.h"
+#include "logging.h"
+
+// used while a manifest is being generated
+struct manifest_builder
+{
+    struct patch_manifest_entry *   entries;
+    unsigned int                    count;
+    unsigned int                    allocated;
+
+    unsigned int *                  apps;
+    unsigned int                    app_count;
+
+    char *                          strings;
+    unsigned int                    strings_size;
+    unsigned int                    strings_allocated;
+
+    const char *                    exec_path;
+    unsigned int                    target_path;
+    int                             failed;
+};
+
+#pragma mark -
+
+static int get_os_version( char version[16] )
+{
+    size_t len = 16;
+
+    bzero( version, 16 );
+
+    // leave room for the NUL
+    if ( sysctlbyname( "kern.osversion", version, &len, NULL, 0 ) != 0 )
+        return ( 0 );
+
+    version[15] = '\0';
+
+    return ( 1 );
+}
+
+static int get_executable_info( CFBundleRef bundle, char path[PATH_MAX],
+                                struct stat * pStat )
+{
+    CFURLRef url = CFBundleCopyExecutableURL( bundle );
+    int result = 0;
+
+    if ( url != NULL )
+    {
+        if ( CFURLGetFileSystemRepresentation( url, TRUE, (UInt8 *) path, PATH_MAX ) )
+            result = ( stat( path, pStat ) == 0 );
+
+        CFRelease( url );
+    }
+
+    return ( result );
+}
+
+// a manifest stands in for the bundle's WillPatchApplication function,
+// so it's only used if the bundle says that's all right
+static int bundle_allows_manifest( CFBundleRef bundle )
+{
+    CFTypeRef value = CFBundleGetValueForInfoDictionaryKey( bundle,
+        CFSTR(kPatchManifestReplacesWillPatchKey) );
+
+    return ( ( value != NULL ) && ( CFGetTypeID( value ) == CFBooleanGetTypeID( ) ) &&
+             ( CFBooleanGetValue( (CFBooleanRef) value ) ) );
+}
+
+// makes sure everything the header describes is inside the file
+static int validate_manifest( const struct patch_manifest * manifest )
+{
+    const struct patch_manifest_header * hdr = manifest->header;
+    size_t size = manifest->size;
+
+    if ( size < sizeof(struct patch_manifest_header) )
+        return ( 0 );
+
+    if ( ( hdr->magic != kPatchManifestMagic ) ||
+         ( hdr->version != kPatchManifestVersion ) )
+        return ( 0 );
+
+    if ( ( hdr->apps_offset > size ) ||
+         ( hdr->app_count > (size - hdr->apps_offset) / sizeof(unsigned int) ) )
+        return ( 0 );
+
+    if ( ( hdr->patches_offset > size ) ||
+         ( hdr->patch_count > (size - hdr->patches_offset) /
+                               sizeof(struct patch_manifest_entry) ) )
+        return ( 0 );
+
+    if ( ( hdr->strings_size == 0 ) || ( hdr->strings_offset > size ) ||
+         ( hdr->strings_size > size - hdr->strings_offset ) )
+        return ( 0 );
+
+    // every string is terminated if the table is
+    if ( manifest->strings[hdr->strings_size - 1] != '\0' )
+        return ( 0 );
+
+    return ( 1 );
+}
+
+// makes sure the manifest describes this executable on this system
+static int manifest_is_current( CFBundleRef bundle, const struct patch_manifest * manifest )
+{
+    const struct patch_manifest_header * hdr = manifest->header;
+    char exec_path[PATH_MAX];
+    char os_version[16];
+    struct stat statBuf;
+
+    if ( !get_executable_info( bundle, exec_path, &statBuf ) )
+        return ( 0 );
+
+    if ( ( hdr->exec_mtime != (unsigned int) statBuf.st_mtime ) ||
+         ( hdr->exec_size != (unsigned int) statBuf.st_size ) )
+    {
+        DEBUGLOG( "Patch manifest is older than executable '%s'", exec_path );
+        return ( 0 );
+    }
+
+    if ( ( !get_os_version( os_version ) ) ||
+         ( strncmp( os_version, hdr->os_version, 16 ) != 0 ) )
+    {
+        DEBUGLOG( "Patch manifest for '%s' was built on OS build '%.16s'",
+                  exec_path, hdr->os_version );
+        return ( 0 );
+    }
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+int __open_patch_manifest( CFBundleRef bundle, struct patch_manifest * manifest )
+{
+    CFStringRef name = CFSTR(kPatchManifestResourceName);
+    CFStringRef type = CFSTR(kPatchManifestResourceType);
+    CFURLRef url = NULL;
+    char path[PATH_MAX];
+    struct stat statBuf;
+    void * base = MAP_FAILED;
+    int fd = -1;
+    int result = 0;
+
+    bzero( manifest, sizeof(struct patch_manifest) );
+
+    url = CFBundleCopyResourceURL( bundle, name, type, NULL );
+    if ( url == NULL )
+        return ( 0 );
+
+    if ( !bundle_allows_manifest( bundle ) )
+    {
+        DEBUGLOG( "Bundle doesn't set %s; ignoring its patch manifest",
+                  kPatchManifestReplacesWillPatchKey );
+        CFRelease( url );
+        return ( 0 );
+    }
+
+    if ( CFURLGetFileSystemRepresentation( url, TRUE, (UInt8 *) path, PATH_MAX ) )
+        fd = open( path, O_RDONLY, 0 );
+
+    CFRelease( url );
+
+    if ( fd == -1 )
+        return ( 0 );
+
+    if ( ( fstat( fd, &statBuf ) == 0 ) && ( statBuf.st_size > 0 ) )
+    {
+        base = mmap( NULL, (size_t) statBuf.st_size, PROT_READ,
+                     MAP_FILE | MAP_PRIVATE, fd, 0 );
+    }
+
+    // the mapping stays valid once the file's closed
+    close( fd );
+
+    if ( base == MAP_FAILED )
+    {
+        LogError( "Unable to map patch manifest '%s'", path );
+        return ( 0 );
+    }
+
+    manifest->base = base;
+    manifest->size = (size_t) statBuf.st_size;
+    manifest->header = (const struct patch_manifest_header *) base;
+
+    if ( manifest->size >= sizeof(struct patch_manifest_header) )
+    {
+        const char * bytes = (const char *) base;
+
+        manifest->apps = (const unsigned int *) (bytes + manifest->header->apps_offset);
+        manifest->entries = (const struct patch_manifest_entry *)
+                            (bytes + manifest->header->patches_offset);
+        manifest->strings = bytes + manifest->header->strings_offset;
+    }
+
+    if ( !validate_manifest( manifest ) )
+    {
+        LogError( "Patch manifest '%s' is damaged, ignoring it", path );
+    }
+    else if ( manifest_is_current( bundle, manifest ) )
+    {
+        result = 1;
+    }
+
+    if ( result == 0 )
+        __close_patch_manifest( manifest );
+
+    return ( result );
+}
+
+void __close_patch_manifest( struct patch_manifest * manifest )
+{
+    if ( manifest->base != NULL )
+        (void) munmap( manifest->base, manifest->size );
+
+    bzero( manifest, sizeof(struct patch_manifest) );
+}
+
+int __patch_manifest_matches_target( const struct patch_manifest * manifest,
+                                     const char * exec_path )
+{
+    const struct patch_manifest_header * hdr = manifest->header;
+    struct stat statBuf;
+
+    if ( strcmp( __patch_manifest_string( manifest, hdr->target_path ), exec_path ) != 0 )
+        return ( 0 );
+
+    if ( ( stat( exec_path, &statBuf ) != 0 ) ||
+         ( hdr->target_mtime != (unsigned int) statBuf.st_mtime ) ||
+         ( hdr->target_size != (unsigned int) statBuf.st_size ) )
+    {
+        DEBUGLOG( "Patch manifest is older than target executable '%s'", exec_path );
+        return ( 0 );
+    }
+
+    return ( 1 );
+}
+
+int __patch_manifest_wants_app( const struct patch_manifest * manifest,
+                                const char * app_name )
+{
+    unsigned int i;
+
+    if ( manifest->header->app_count == 0 )
+        return ( 1 );
+
+    for ( i = 0; i < manifest->header->app_count; i++ )
+    {
+        if ( strcmp( __patch_manifest_string( manifest, manifest->apps[i] ),
+                     app_name ) == 0 )
+            return ( 1 );
+    }
+
+    return ( 0 );
+}
+
+const char * __patch_manifest_string( const struct patch_manifest * manifest,
+                                      unsigned int offset )
+{
+    if ( offset >= manifest->header->strings_size )
+        return ( "" );
+
+    return ( manifest->strings + offset );
+}
+
+unsigned int __find_patch_function_offset( const char * patch_fn_name,
+                                           const char * exec_path )
+{
+    // get the address of this function for PPC
+    // value returned is actually an offset, relative to vm_addr of
+    // zero
+    if ( patch_fn_name[0] != '_' )
+    {
+        // use a leading underscore to locate the symbol
+        char symbol[ 256 ];
+        symbol[0] = '_';
+        symbol[1] = '\0';
+        strncat( symbol, patch_fn_name, 254 );
+        symbol[255] = '\0';
+
+        return ( (unsigned int) DPFindFunctionForArchitecture( symbol, exec_path,
+                                                               kInsertionArchPPC ) );
+    }
+
+    return ( (unsigned int) DPFindFunctionForArchitecture( patch_fn_name, exec_path,
+                                                           kInsertionArchPPC ) );
+}
+
+#pragma mark -
+
+static unsigned int builder_add_string( struct manifest_builder * builder,
+                                        const char * str )
+{
+    unsigned int len = (unsigned int) strlen( str ) + 1;
+    unsigned int result = builder->strings_size;
+
+    if ( builder->strings_size + len > builder->strings_allocated )
+    {
+        unsigned int newSize = builder->strings_allocated + 1024;
+        char * newStrings = NULL;
+
+        while ( newSize < builder->strings_size + len )
+            newSize += 1024;
+
+        newStrings = (char *) realloc( builder->strings, newSize );
+        if ( newStrings == NULL )
+        {
+            builder->failed = 1;
+            return ( 0 );
+        }
+
+        builder->strings = newStrings;
+        builder->strings_allocated = newSize;
+    }
+
+    memcpy( builder->strings + builder->strings_size, str, len );
+    builder->strings_size += len;
+
+    return ( result );
+}
+
+// handed to the bundle's GetPatchDetails function
+static void builder_add_patch( void * addr, const char * name, void * info )
+{
+    struct manifest_builder * builder = (struct manifest_builder *) info;
+    struct patch_manifest_entry * entry = NULL;
+    unsigned int offset = 0;
+
+    if ( builder->failed )
+        return;
+
+    offset = __find_patch_function_offset( name, builder->exec_path );
+    if ( offset == 0 )
+    {
+        LogError( "Unable to find patch function '%s' in '%s'", name,
+                  builder->exec_path );
+        builder->failed = 1;
+        return;
+    }
+
+    if ( builder->count == builder->allocated )
+    {
+        unsigned int newCount = builder->allocated + 16;
+        struct patch_manifest_entry * newEntries = (struct patch_manifest_entry *)
+            realloc( builder->entries, newCount * sizeof(struct patch_manifest_entry) );
+
+        if ( newEntries == NULL )
+        {
+            builder->failed = 1;
+            return;
+        }
+
+        builder->entries = newEntries;
+        builder->allocated = newCount;
+    }
+
+    entry = &builder->entries[builder->count++];
+    entry->target_addr = (unsigned int) addr;
+    entry->patch_fn_offset = offset;
+    entry->patch_name = builder_add_string( builder, name );
+}
+
+static void builder_add_apps( struct manifest_builder * builder, CFBundleRef bundle )
+{
+    CFTypeRef value = CFBundleGetValueForInfoDictionaryKey( bundle,
+        CFSTR(kPatchTargetApplicationsKey) );
+    CFIndex i, count;
+
+    if ( ( value == NULL ) || ( CFGetTypeID( value ) != CFArrayGetTypeID( ) ) )
+        return;
+
+    count = CFArrayGetCount( (CFArrayRef) value );
+    if ( count == 0 )
+        return;
+
+    builder->apps = (unsigned int *) calloc( count, sizeof(unsigned int) );
+    if ( builder->apps == NULL )
+    {
+        builder->failed = 1;
+        return;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        CFStringRef str = (CFStringRef) CFArrayGetValueAtIndex( (CFArrayRef) value, i );
+        char name[ 256 ];
+
+        if ( ( CFGetTypeID( str ) != CFStringGetTypeID( ) ) ||
+             ( !CFStringGetCString( str, name, 256, kCFStringEncodingUTF8 ) ) )
+        {
+            LogError( "Invalid entry in %s", kPatchTargetApplicationsKey );
+            continue;
+        }
+
+        builder->apps[builder->app_count++] = builder_add_string( builder, name );
+    }
+}
+
+static int write_manifest( const char * path, const struct manifest_builder * builder,
+                           const struct stat * pExecStat, const struct stat * pTargetStat )
+{
+    struct patch_manifest_header hdr;
+    char temp_path[PATH_MAX];
+    FILE * fp = NULL;
+    int ok = 1;
+
+    bzero( &hdr, sizeof(hdr) );
+
+    hdr.magic = kPatchManifestMagic;
+    hdr.version = kPatchManifestVersion;
+    hdr.exec_mtime = (unsigned int) pExecStat->st_mtime;
+    hdr.exec_size = (unsigned int) pExecStat->st_size;
+    (void) get_os_version( hdr.os_version );
+
+    hdr.target_path = builder->target_path;
+    hdr.target_mtime = (unsigned int) pTargetStat->st_mtime;
+    hdr.target_size = (unsigned int) pTargetStat->st_size;
+
+    hdr.app_count = builder->app_count;
+    hdr.apps_offset = sizeof(hdr);
+    hdr.patch_count = builder->count;
+    hdr.patches_offset = hdr.apps_offset + (hdr.app_count * sizeof(unsigned int));
+    hdr.strings_offset = hdr.patches_offset +
+                         (hdr.patch_count * sizeof(struct patch_manifest_entry));
+    hdr.strings_size = builder->strings_size;
+
+    // write it alongside, then move it into place, so the injector
+    // never sees half a manifest
+    snprintf( temp_path, PATH_MAX, "%s.%d", path, getpid( ) );
+
+    fp = fopen( temp_path, "wb" );
+    if ( fp == NULL )
+    {
+        LogError( "Unable to create patch manifest '%s'", temp_path );
+        return ( 0 );
+    }
+
+    if ( fwrite( &hdr, sizeof(hdr), 1, fp ) != 1 )
+        ok = 0;
+    if ( ( ok ) && ( hdr.app_count > 0 ) &&
+         ( fwrite( builder->apps, sizeof(unsigned int), hdr.app_count, fp ) != hdr.app_count ) )
+        ok = 0;
+    if ( ( ok ) && ( hdr.patch_count > 0 ) &&
+         ( fwrite( builder->entries, sizeof(struct patch_manifest_entry), hdr.patch_count,
+                   fp ) != hdr.patch_count ) )
+        ok = 0;
+    if ( ( ok ) && ( fwrite( builder->strings, 1, hdr.strings_size, fp ) != hdr.strings_size ) )
+        ok = 0;
+
+    if ( fclose( fp ) != 0 )
+        ok = 0;
+
+    if ( ( ok ) && ( rename( temp_path, path ) != 0 ) )
+        ok = 0;
+
+    if ( !ok )
+    {
+        LogError( "Unable to write patch manifest '%s'", path );
+        (void) unlink( temp_path );
+    }
+
+    return ( ok );
+}
+
+int DPWritePatchManifest( const char * bundle_path, const char * target_path,
+                          const char * manifest_path )
+{
+    struct manifest_builder builder;
+    struct stat execStat, targetStat;
+    char exec_path[PATH_MAX];
+    char resource_path[PATH_MAX];
+    CFStringRef str = NULL;
+    CFURLRef url = NULL;
+    CFBundleRef bundle = NULL;
+    __get_patch_details_fn getDetailsFn = 0;
+    int result = 0;
+
+    if ( ( bundle_path == NULL ) || ( target_path == NULL ) )
+        return ( 0 );
+
+    if ( ( target_path[0] != '/' ) || ( stat( target_path, &targetStat ) != 0 ) )
+    {
+        LogError( "Target executable '%s' not found; it needs a full path", target_path );
+        return ( 0 );
+    }
+
+    bzero( &builder, sizeof(builder) );
+
+    str = CFStringCreateWithCString( NULL, bundle_path, kCFStringEncodingUTF8 );
+    if ( str != NULL )
+    {
+        url = CFURLCreateWithFileSystemPath( NULL, str, kCFURLPOSIXPathStyle, TRUE );
+        CFRelease( str );
+    }
+
+    if ( url != NULL )
+    {
+        bundle = CFBundleCreate( NULL, url );
+        CFRelease( url );
+    }
+
+    if ( bundle == NULL )
+    {
+        LogError( "Failed to create bundle '%s' !", bundle_path );
+        return ( 0 );
+    }
+
+    if ( manifest_path == NULL )
+    {
+        url = CFBundleCopyResourcesDirectoryURL( bundle );
+        if ( ( url != NULL ) &&
+             ( CFURLGetFileSystemRepresentation( url, TRUE, (UInt8 *) resource_path,
+                                                 PATH_MAX ) ) )
+        {
+            strlcat( resource_path, "/" kPatchManifestResourceName "."
+                     kPatchManifestResourceType, PATH_MAX );
+            manifest_path = resource_path;
+        }
+
+        if ( url != NULL )
+            CFRelease( url );
+    }
+
+    if ( manifest_path == NULL )
+    {
+        LogError( "Unable to find the resources folder of '%s'", bundle_path );
+    }
+    else if ( !bundle_allows_manifest( bundle ) )
+    {
+        LogError( "'%s' doesn't set %s in its Info.plist, so a manifest would never be used",
+                  bundle_path, kPatchManifestReplacesWillPatchKey );
+    }
+    else if ( !get_executable_info( bundle, exec_path, &execStat ) )
+    {
+        LogError( "Unable to find the executable of '%s'", bundle_path );
+    }
+    else if ( !CFBundleLoadExecutable( bundle ) )
+    {
+        LogError( "Failed to load bundle '%s' !", bundle_path );
+    }
+    else
+    {
+        getDetailsFn = (__get_patch_details_fn) CFBundleGetFunctionPointerForName( bundle,
+            CFSTR(kGetPatchDetailsFunctionName) );
+
+        if ( getDetailsFn != 0 )
+        {
+            builder.exec_path = exec_path;
+
+            // offset zero is the empty string
+            (void) builder_add_string( &builder, "" );
+            builder.target_path = builder_add_string( &builder, target_path );
+            builder_add_apps( &builder, bundle );
+
+            getDetailsFn( builder_add_patch, kInsertionArchPPC, &builder );
+
+            if ( builder.failed )
+                LogError( "Unable to build patch manifest for '%s'", bundle_path );
+            else if ( write_manifest( manifest_path, &builder, &execStat, &targetStat ) )
+            {
+                DEBUGLOG( "Wrote manifest of %u patches for '%s'", builder.count,
+                          bundle_path );
+                result = 1;
+            }
+        }
+        else
+        {
+            LogError( "Couldn't find bundle startup functions !" );
+        }
+
+        CFBundleUnloadExecutable( bundle );
+    }
+
+    free( builder.entries );
+    free( builder.apps );
+    free( builder.strings );
+    CFRelease( bundle );
+
+    return ( result );
+}
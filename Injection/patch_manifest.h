@@ -0,0 +1,205 @@
+/*
+ *  patch_manifest.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 22/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_PATCH_MANIFEST_H__
+#define __DP_PATCH_MANIFEST_H__
+
+#include <CoreFoundation/CFBundle.h>
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+
+/*!
+ @header Patch Manifests
+ @discussion A patch manifest records everything the Rosetta injector
+         would otherwise have to load a patch bundle's executable to
+         find out: the PowerPC address of each function it patches, the
+         offset of each patch function within its PowerPC executable,
+         and the applications it wants to patch. It's written once,
+         when the bundle is built, by
+         @link //apple_ref/c/func/DPWritePatchManifest DPWritePatchManifest @/link,
+         and mapped straight into memory by the injector.
+
+         Everything in the file is in the host's byte order, and all
+         offsets are from the start of the file, except for string
+         offsets, which are from the start of the string table. String
+         offset zero is always the empty string.
+
+         The target addresses are only good for the system and the
+         application they were looked up for, so a manifest records the
+         OS build it was made with, the path, modification date and size
+         of the target application's executable, and the modification
+         date and size of the bundle executable. If any of those don't
+         match, the manifest is ignored and the bundle is loaded as
+         before, which also means its
+         @link //apple_ref/c/macro/kWillPatchFunctionName kWillPatchFunctionName @/link
+         function gets called. A manifest is also ignored unless the
+         bundle sets
+         @link //apple_ref/c/macro/kPatchManifestReplacesWillPatchKey kPatchManifestReplacesWillPatchKey @/link
+         in its Info.plist.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+#define kPatchManifestMagic         0x4450504D  /* 'DPPM' */
+#define kPatchManifestVersion       2
+
+/*!
+ @struct patch_manifest_header
+ @abstract The start of a manifest file.
+ @field magic @link kPatchManifestMagic kPatchManifestMagic @/link.
+ @field version @link kPatchManifestVersion kPatchManifestVersion @/link.
+ @field exec_mtime The modification time of the bundle executable.
+ @field exec_size The size of the bundle executable.
+ @field os_version The value of the kern.osversion sysctl.
+ @field target_path The string offset of the full path of the target
+        application's executable.
+ @field target_mtime The modification time of the target executable.
+ @field target_size The size of the target executable.
+ @field app_count The number of application names in the filter list.
+ @field apps_offset The offset of the filter list, an array of string
+        offsets. An empty list means every application is patched.
+ @field patch_count The number of patches.
+ @field patches_offset The offset of the array of
+        @link patch_manifest_entry patch_manifest_entry @/link
+        structures.
+ @field strings_offset The offset of the string table.
+ @field strings_size The size of the string table, including the final
+        NUL character.
+ */
+struct patch_manifest_header
+{
+    unsigned int    magic;
+    unsigned int    version;
+    unsigned int    exec_mtime;
+    unsigned int    exec_size;
+    char            os_version[16];
+    unsigned int    target_path;
+    unsigned int    target_mtime;
+    unsigned int    target_size;
+    unsigned int    app_count;
+    unsigned int    apps_offset;
+    unsigned int    patch_count;
+    unsigned int    patches_offset;
+    unsigned int    strings_offset;
+    unsigned int    strings_size;
+};
+
+/*!
+ @struct patch_manifest_entry
+ @abstract One patch in a manifest.
+ @field target_addr The PowerPC address of the function to patch.
+ @field patch_fn_offset The offset of the patch function within the
+        bundle's PowerPC executable, as returned from
+        @link //apple_ref/c/func/DPFindFunctionForArchitecture DPFindFunctionForArchitecture @/link.
+ @field patch_name The string offset of the patch function's name, for
+        error messages.
+ */
+struct patch_manifest_entry
+{
+    unsigned int    target_addr;
+    unsigned int    patch_fn_offset;
+    unsigned int    patch_name;
+};
+
+/*!
+ @struct patch_manifest
+ @abstract A manifest which has been mapped into memory.
+ */
+struct patch_manifest
+{
+    void *                                  base;
+    size_t                                  size;
+    const struct patch_manifest_header *    header;
+    const unsigned int *                    apps;
+    const struct patch_manifest_entry *     entries;
+    const char *                            strings;
+};
+
+/*!
+ @function __open_patch_manifest
+ @abstract Map a bundle's manifest into memory.
+ @discussion The manifest is looked up as a resource named
+         @link //apple_ref/c/macro/kPatchManifestResourceName kPatchManifestResourceName @/link.
+         It's checked against the bundle executable and the running
+         system before it's returned, and only used at all if the
+         bundle allows it.
+ @param bundle The patch bundle.
+ @param manifest Filled in with the mapped manifest.
+ @result Nonzero if an up to date manifest was found; zero if there
+         isn't one, or it's stale or damaged.
+ */
+int __open_patch_manifest( CFBundleRef bundle, struct patch_manifest * manifest );
+
+/*!
+ @function __close_patch_manifest
+ @abstract Unmap a manifest.
+ @param manifest A manifest opened with
+        @link __open_patch_manifest __open_patch_manifest @/link.
+ */
+void __close_patch_manifest( struct patch_manifest * manifest );
+
+/*!
+ @function __patch_manifest_matches_target
+ @abstract Check that a manifest was made for a process's executable.
+ @discussion The path has to match, and the executable must not have
+         changed since the manifest was written.
+ @param manifest An open manifest.
+ @param exec_path The full path of the target process's executable.
+ @result Nonzero if the manifest's addresses are good for the process.
+ */
+int __patch_manifest_matches_target( const struct patch_manifest * manifest,
+                                     const char * exec_path );
+
+/*!
+ @function __patch_manifest_wants_app
+ @abstract Check an application against a manifest's filter list.
+ @param manifest An open manifest.
+ @param app_name The name of the target application.
+ @result Nonzero if the bundle patches this application.
+ */
+int __patch_manifest_wants_app( const struct patch_manifest * manifest,
+                                const char * app_name );
+
+/*!
+ @function __patch_manifest_string
+ @abstract Get a string from a manifest's string table.
+ @param manifest An open manifest.
+ @param offset The string offset.
+ @result The string, or an empty string if the offset is out of range.
+ */
+const char * __patch_manifest_string( const struct patch_manifest * manifest,
+                                      unsigned int offset );
+
+/*!
+ @function __find_patch_function_offset
+ @abstract Look up a patch function in a bundle's PowerPC executable.
+ @discussion A leading underscore is added to the name if it doesn't
+         have one already.
+ @param patch_fn_name The name of the patch function.
+ @param exec_path The path to the bundle executable.
+ @result The offset of the function, or zero if it wasn't found.
+ */
+unsigned int __find_patch_function_offset( const char * patch_fn_name,
+                                           const char * exec_path );
+
+__END_DECLS
+
+#endif  /* __DP_PATCH_MANIFEST_H__ */
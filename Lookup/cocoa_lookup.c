@@ -234,14 +234,14 @@ void * DPCocoaMethodSwizzle( const char *pClass, const char *pSelector,
             do
             {
                 result = methodObj->method_imp;
-                swapResult = DPCompareAndSwap( (unsigned int) result,
-                    (unsigned int) patch_addr,
-                    (unsigned int *) methodObj->method_imp );
+                swapResult = DPAtomicCompareAndSwapPtr( (void *) result, patch_addr,
+                    (void * volatile *) &methodObj->method_imp,
+                    kDPMemoryOrderSequential );
 
             } while ( swapResult == 0 );
 
             // synchronize instruction & data caches with memory
-            DPCodeSync( &methodObj->method_imp );
+            DPAtomicCodeSync( &methodObj->method_imp );
         }
     }
 
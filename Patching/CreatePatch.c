@@ -18,20 +18,85 @@
 
 #include <stdlib.h>
 #include "logging.h"
+#include "Patching.h"
+#include "patch_registry.h"
+#include "hook_frames.h"
 
 // this is the per-architecture function that implements the patching.
 // see ppc_patch.c or ia32_patch.c for details
-extern void * __create_patch( void * target, void * patch );
+extern void * __create_patch( void * target, void * patch, unsigned int options,
+                              int priority );
+extern int __remove_patch( void * target, void * patch );
+
+// the patch options each architecture knows how to build
+#if __i386__
+# define kSupportedPatchOptions     (kDPPatchInstrumented | kDPPatchNoRecursion | \
+                                     kDPPatchSafePoint | kDPPatchDirectBranch | \
+                                     kDPPatchHot | kDPPatchTraced)
+#else
+# define kSupportedPatchOptions     (kDPPatchSafePoint | kDPPatchHot)
+#endif
+
+int __check_patch_options( unsigned int options )
+{
+    if ( (options & ~kSupportedPatchOptions) != 0 )
+    {
+        LogError( "Unsupported patch options requested: %#x", 
+                  options & ~kSupportedPatchOptions );
+        return ( 0 );
+    }
+
+    // a direct branch can't go by way of the hook thunks
+    if ( ( options & kDPPatchDirectBranch ) &&
+         ( options & (kDPPatchInstrumented | kDPPatchNoRecursion | kDPPatchTraced) ) )
+    {
+        LogError( "Direct-branch patches can't be instrumented, guarded or traced" );
+        return ( 0 );
+    }
+
+    return ( 1 );
+}
 
 void * DPCreatePatch( void * target, void * patch )
+{
+    return ( DPCreatePatchWithOptions( target, patch, 0 ) );
+}
+
+void * DPCreatePatchWithOptions( void * target, void * patch, unsigned int options )
+{
+    return ( DPCreateChainedPatch( target, patch, kDPPatchDefaultPriority, options ) );
+}
+
+void * DPCreateChainedPatch( void * target, void * patch, int priority,
+                             unsigned int options )
 {
     void * result = NULL;
 
     DEBUGLOG( "CreatePatch() called..." );
 
-    if ( (target != NULL) && (patch != NULL) )
+    if ( !__check_patch_options( options ) )
     {
-        result = __create_patch( target, patch );
+        // error already logged
+    }
+    else if ( (target != NULL) && (patch != NULL) )
+    {
+        if ( options & kDPPatchSafePoint )
+        {
+            DPPatchRequest request;
+
+            request.fn_addr = target;
+            request.patch_addr = patch;
+            request.priority = priority;
+            request.options = options;
+            request.reentry = NULL;
+
+            (void) DPCreatePatchBatch( &request, 1, NULL );
+            result = request.reentry;
+        }
+        else
+        {
+            result = __create_patch( target, patch, options, priority );
+        }
     }
     else
     {
@@ -41,3 +106,61 @@ void * DPCreatePatch( void * target, void * patch )
 
     return ( result );
 }
+
+void * DPCreateHook( void * target, DPHookCallback pre, DPHookCallback post,
+                     void * user_info )
+{
+#if __i386__
+    struct patch_entry * entry = NULL;
+    struct hook_record * record = NULL;
+
+    if ( target == NULL )
+    {
+        LogError( "NULL target supplied to DPCreateHook()" );
+        return ( NULL );
+    }
+
+    // the island works out where to go for itself, so there's no patch
+    // function to pass in
+    if ( __create_patch( target, NULL, kDPPatchCallbacks, kDPPatchDefaultPriority ) == NULL )
+        return ( NULL );
+
+    entry = __patch_registry_lookup( target );
+    if ( ( entry == NULL ) || ( ( record = entry->record ) == NULL ) )
+    {
+        LogError( "Hook on %#x installed, but its callbacks can't be set",
+                  (unsigned) target );
+        return ( NULL );
+    }
+
+    // the island checks for each callback as it goes, so it doesn't
+    // matter that calls may already be coming through
+    record->user_info = user_info;
+    record->pre_callback = pre;
+    record->post_callback = post;
+
+    return ( entry->reentry );
+#else
+    LogError( "DPCreateHook() is only supported on Intel" );
+    return ( NULL );
+#endif
+}
+
+void DPRemovePatch( void * target )
+{
+    if ( __remove_patch( target, NULL ) == 0 )
+        LogError( "DPRemovePatch(): no patch installed on %#x", (unsigned) target );
+}
+
+void DPRemovePatchFunction( void * target, void * patch )
+{
+    if ( patch == NULL )
+    {
+        LogError( "NULL patch supplied to DPRemovePatchFunction()" );
+    }
+    else if ( __remove_patch( target, patch ) == 0 )
+    {
+        LogError( "DPRemovePatchFunction(): patch %#x not installed on %#x",
+                  (unsigned) patch, (unsigned) target );
+    }
+}
@@ -0,0 +1,446 @@
+/*
+ *  control_plane.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 25/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "control_plane.h"
+#include "hook_frames.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// The segment is a POSIX shared memory object named after the process
+// ID, so a control tool only needs a list of processes to find them
+// all. Nothing in the patched process blocks on it: outside changes
+// are picked up by a watcher thread which polls the slots, and applies
+// them through the same routines an application would call itself.
+//
+// The hooks don't read the slots themselves. Switching a plain patch
+// off means pointing its island back at the original code, which has
+// to be done under the patch mutex, and a plain island has no code in
+// it to look at a flag anyway. The watcher costs the hooks nothing,
+// and it's stopped when the segment is closed.
+//
+// Anything which maps the segment can write to it, so nothing the
+// patched process relies on is ever read back out of it: the number
+// of slots in use, and which of them are free, are kept here.
+
+// how often the watcher thread looks at the slots, in microseconds
+#define kControlPollInterval    250000
+
+// shared memory names are limited to 31 characters
+#define kControlNameSize        32
+
+static pthread_mutex_t      control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       control_cond = PTHREAD_COND_INITIALIZER;
+static DPControlSegment *   control_segment = NULL;
+static char                 control_segment_name[kControlNameSize];
+static pthread_t            control_thread;
+static int                  control_thread_running = 0;
+
+// slots handed out so far, and those given back by removed patches
+static volatile unsigned int control_slot_count = 0;
+static unsigned int         control_free_slots[kDPControlMaxSlots];
+static unsigned int         control_free_count = 0;
+
+static void name_for_pid( pid_t pid, char * name )
+{
+    snprintf( name, kControlNameSize, "/dynamicpatch.%d", (int) pid );
+}
+
+static void remove_control_segment( void )
+{
+    if ( control_segment != NULL )
+        (void) shm_unlink( control_segment_name );
+}
+
+#pragma mark -
+
+// called with control_mutex held
+static void attach_entry_locked( struct patch_entry * entry )
+{
+    DPControlSegment * segment = control_segment;
+    DPControlSlot * slot = NULL;
+    unsigned int count = control_slot_count;
+    Dl_info info;
+
+    if ( ( segment == NULL ) || ( entry->control != NULL ) )
+        return;
+
+    if ( control_free_count > 0 )
+    {
+        slot = &segment->slots[control_free_slots[--control_free_count]];
+
+        // clear the old patch's counters, bracketed as for any update
+        slot->sequence++;
+        slot->calls = 0;
+        slot->samples = 0;
+        slot->total_ticks = 0;
+        slot->sequence++;
+    }
+    else if ( count < kDPControlMaxSlots )
+    {
+        slot = &segment->slots[count];
+    }
+    else
+    {
+        LogError( "Patch control segment is full; patch on %#x has no slot",
+                  (unsigned) entry->target );
+        return;
+    }
+
+    slot->patch = entry->patch;
+
+    if ( ( dladdr( entry->target, &info ) != 0 ) && ( info.dli_sname != NULL ) &&
+         ( info.dli_saddr == entry->target ) )
+    {
+        strlcpy( slot->name, info.dli_sname, sizeof(slot->name) );
+    }
+    else
+    {
+        snprintf( slot->name, sizeof(slot->name), "%#x", (unsigned) entry->target );
+    }
+
+    slot->enabled = ( entry->disabled ? 0 : 1 );
+    slot->sample_rate = ( entry->record != NULL ) ? entry->record->sample_rate : 0;
+
+    // the slot is filled in; now let readers see it
+    DPAtomicStore32( (volatile unsigned int *) &slot->target, (unsigned int) entry->target,
+                     kDPMemoryOrderRelease );
+
+    entry->control = slot;
+
+    if ( slot == &segment->slots[count] )
+    {
+        DPAtomicStore32( &control_slot_count, count + 1, kDPMemoryOrderRelease );
+        segment->slot_count = count + 1;
+    }
+}
+
+static void attach_one_entry( struct patch_entry * entry, void * info )
+{
+    attach_entry_locked( entry );
+}
+
+void __control_attach_entry( struct patch_entry * entry )
+{
+    pthread_mutex_lock( &control_mutex );
+    attach_entry_locked( entry );
+    pthread_mutex_unlock( &control_mutex );
+}
+
+void __control_detach_entry( struct patch_entry * entry )
+{
+    DPControlSlot * slot = NULL;
+
+    pthread_mutex_lock( &control_mutex );
+
+    slot = entry->control;
+    entry->control = NULL;
+
+    if ( ( slot != NULL ) && ( control_segment != NULL ) )
+    {
+        slot->enabled = 0;
+        slot->target = NULL;
+
+        control_free_slots[control_free_count++] = slot - control_segment->slots;
+    }
+
+    pthread_mutex_unlock( &control_mutex );
+}
+
+static void forget_one_entry( struct patch_entry * entry, void * info )
+{
+    entry->control = NULL;
+}
+
+#pragma mark -
+
+static void sync_slot( DPControlSlot * slot )
+{
+    void * target = slot->target;
+    struct patch_entry * entry = NULL;
+    struct hook_record * record = NULL;
+    unsigned int enabled;
+
+    if ( target == NULL )
+        return;
+
+    // the slot could have been emptied, or even reused, since we read
+    // the target
+    entry = __patch_registry_lookup( target );
+    if ( ( entry == NULL ) || ( entry->control != slot ) )
+        return;
+
+    enabled = DPAtomicLoad32( &slot->enabled, kDPMemoryOrderRelaxed );
+    if ( entry->options & kDPPatchDirectBranch )
+    {
+        // these can't be switched off; put the flag back
+        if ( enabled == 0 )
+            slot->enabled = 1;
+    }
+    else if ( ( enabled != 0 ) == ( entry->disabled != 0 ) )
+    {
+        (void) DPSetPatchEnabled( target, enabled );
+    }
+
+    record = entry->record;
+    if ( record != NULL )
+    {
+        record->sample_rate = DPAtomicLoad32( &slot->sample_rate, kDPMemoryOrderRelaxed );
+
+#if __i386__
+        // stats only exist on Intel, where stores aren't reordered, so
+        // plain increments are enough to bracket the copy; the reads of
+        // the counters, though, could be split by an update
+        if ( ( record->options & kDPPatchInstrumented ) &&
+             ( slot->calls != DPAtomicLoad64( &record->calls ) ) )
+        {
+            slot->sequence++;
+            slot->calls = DPAtomicLoad64( &record->calls );
+            slot->samples = DPAtomicLoad64( &record->samples );
+            slot->total_ticks = DPAtomicLoad64( &record->total_ticks );
+            slot->sequence++;
+        }
+#endif
+    }
+}
+
+static void * control_watcher( void * arg )
+{
+    DPControlSegment * segment = (DPControlSegment *) arg;
+    struct timeval now;
+    struct timespec wake;
+    unsigned int i, count;
+    int running = 1;
+
+    while ( running )
+    {
+        gettimeofday( &now, NULL );
+        wake.tv_sec = now.tv_sec;
+        wake.tv_nsec = (now.tv_usec + kControlPollInterval) * 1000;
+        if ( wake.tv_nsec >= 1000000000 )
+        {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock( &control_mutex );
+        if ( control_thread_running )
+            (void) pthread_cond_timedwait( &control_cond, &control_mutex, &wake );
+        running = control_thread_running;
+        pthread_mutex_unlock( &control_mutex );
+
+        if ( !running )
+            break;
+
+        // not the count in the segment, which anyone could have changed
+        count = DPAtomicLoad32( &control_slot_count, kDPMemoryOrderAcquire );
+        if ( count > kDPControlMaxSlots )
+            count = kDPControlMaxSlots;
+
+        for ( i = 0; i < count; i++ )
+            sync_slot( &segment->slots[i] );
+    }
+
+    return ( NULL );
+}
+
+#pragma mark -
+
+int DPOpenControlSegment( void )
+{
+    DPControlSegment * segment = NULL;
+    static int registered_atexit = 0;
+    int fd;
+
+    pthread_mutex_lock( &control_mutex );
+
+    if ( control_segment != NULL )
+    {
+        pthread_mutex_unlock( &control_mutex );
+        return ( 1 );
+    }
+
+    name_for_pid( getpid( ), control_segment_name );
+
+    // anything already there was left behind by an earlier process
+    // with the same ID
+    (void) shm_unlink( control_segment_name );
+
+    fd = shm_open( control_segment_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR );
+    if ( fd == -1 )
+    {
+        LogError( "Unable to create patch control segment '%s': %s",
+                  control_segment_name, strerror( errno ) );
+    }
+    else
+    {
+        if ( ftruncate( fd, sizeof(DPControlSegment) ) == 0 )
+        {
+            segment = (DPControlSegment *) mmap( NULL, sizeof(DPControlSegment),
+                                                 PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED, fd, 0 );
+            if ( segment == (DPControlSegment *) MAP_FAILED )
+                segment = NULL;
+        }
+
+        if ( segment == NULL )
+        {
+            LogError( "Unable to map patch control segment '%s': %s",
+                      control_segment_name, strerror( errno ) );
+            (void) shm_unlink( control_segment_name );
+        }
+
+        close( fd );
+    }
+
+    if ( segment != NULL )
+    {
+        // fresh shared memory is zero-filled, so there are no slots yet
+        segment->version = kDPControlSegmentVersion;
+        segment->pid = getpid( );
+        segment->magic = kDPControlSegmentMagic;
+
+        control_segment = segment;
+        control_slot_count = 0;
+        control_free_count = 0;
+
+        if ( !registered_atexit )
+        {
+            atexit( remove_control_segment );
+            registered_atexit = 1;
+        }
+
+        // patches installed before now need slots too
+        (void) __patch_registry_enumerate( attach_one_entry, NULL );
+
+        control_thread_running = 1;
+        if ( pthread_create( &control_thread, NULL, control_watcher, segment ) != 0 )
+        {
+            LogError( "Unable to start patch control thread; outside changes won't be applied" );
+            control_thread_running = 0;
+        }
+
+        DEBUGLOG( "Published patch control segment '%s'", control_segment_name );
+    }
+
+    pthread_mutex_unlock( &control_mutex );
+
+    return ( segment != NULL );
+}
+
+void DPCloseControlSegment( void )
+{
+    DPControlSegment * segment = NULL;
+    int was_running = 0;
+
+    pthread_mutex_lock( &control_mutex );
+
+    segment = control_segment;
+    was_running = control_thread_running;
+    control_thread_running = 0;
+    pthread_cond_signal( &control_cond );
+
+    pthread_mutex_unlock( &control_mutex );
+
+    if ( segment == NULL )
+        return;
+
+    // the watcher may be part way through the slots; let it finish
+    if ( was_running )
+        (void) pthread_join( control_thread, NULL );
+
+    // DPSetPatchEnabled() writes through entry->control with only the
+    // patch lock held, so that has to be held as well before the slots
+    // go away; it's always taken before control_mutex
+    __patch_lock( );
+    pthread_mutex_lock( &control_mutex );
+
+    (void) __patch_registry_enumerate( forget_one_entry, NULL );
+
+    control_segment = NULL;
+    (void) shm_unlink( control_segment_name );
+    (void) munmap( segment, sizeof(DPControlSegment) );
+
+    pthread_mutex_unlock( &control_mutex );
+    __patch_unlock( );
+
+    DEBUGLOG( "Closed patch control segment '%s'", control_segment_name );
+}
+
+DPControlSegment * DPMapControlSegment( pid_t pid )
+{
+    DPControlSegment * segment = NULL;
+    char name[kControlNameSize];
+    struct stat info;
+    int fd;
+
+    name_for_pid( pid, name );
+
+    // most processes won't have one, so failing here isn't worth a log
+    fd = shm_open( name, O_RDWR, 0 );
+    if ( fd == -1 )
+        return ( NULL );
+
+    if ( ( kill( pid, 0 ) == -1 ) && ( errno == ESRCH ) )
+    {
+        DEBUGLOG( "Removing control segment '%s' of dead process", name );
+        (void) shm_unlink( name );
+    }
+    else if ( ( fstat( fd, &info ) == 0 ) &&
+              ( info.st_size >= (off_t) sizeof(DPControlSegment) ) )
+    {
+        segment = (DPControlSegment *) mmap( NULL, sizeof(DPControlSegment),
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, fd, 0 );
+        if ( segment == (DPControlSegment *) MAP_FAILED )
+        {
+            LogError( "Unable to map patch control segment '%s': %s",
+                      name, strerror( errno ) );
+            segment = NULL;
+        }
+        else if ( ( segment->magic != kDPControlSegmentMagic ) ||
+                  ( segment->version != kDPControlSegmentVersion ) )
+        {
+            LogError( "Patch control segment '%s' has an unknown format", name );
+            (void) munmap( segment, sizeof(DPControlSegment) );
+            segment = NULL;
+        }
+    }
+
+    close( fd );
+
+    return ( segment );
+}
+
+void DPUnmapControlSegment( DPControlSegment * segment )
+{
+    if ( segment != NULL )
+        (void) munmap( segment, sizeof(DPControlSegment) );
+}
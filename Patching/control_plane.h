@@ -0,0 +1,58 @@
+/*
+ *  control_plane.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 25/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_CONTROL_PLANE_H__
+#define __DP_CONTROL_PLANE_H__
+
+#include <sys/cdefs.h>
+
+#include "patch_registry.h"
+
+/*!
+ @header Control Plane
+ @discussion Internal side of the shared patch control segment. The
+         registry hands each new entry over to be given a slot, and
+         takes it back again when the patch is removed. Once the
+         segment is open, a watcher thread polls the slots, applying
+         any changes made from outside and copying out the statistics
+         of instrumented patches.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+/*!
+ @function __control_attach_entry
+ @abstract Give a registered patch a slot in the control segment.
+ @discussion Does nothing if the segment hasn't been opened, or if the
+         entry already has a slot.
+ @param entry The registered entry.
+ */
+void __control_attach_entry( struct patch_entry * entry );
+
+/*!
+ @function __control_detach_entry
+ @abstract Mark a removed patch's slot as empty.
+ @param entry The entry which has just been removed from the registry.
+ */
+void __control_detach_entry( struct patch_entry * entry );
+
+__END_DECLS
+
+#endif  /* __DP_CONTROL_PLANE_H__ */
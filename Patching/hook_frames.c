@@ -0,0 +1,359 @@
+/*
+ *  hook_frames.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 14/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#if __i386__
+
+#include "hook_frames.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <mach/mach.h>
+#include <mach/vm_map.h>
+#include <mach/machine/vm_param.h>
+
+// An instrumented island can't time a call without seeing it return,
+// so on the way in we swap the caller's return address for the exit
+// thunk, and remember the real one here. Each thread gets its own
+// stack of these frames, allocated straight from the VM system so
+// that we don't end up calling into malloc() -- which may well be one
+// of the functions being hooked.
+
+// The recursion guard bits for each thread live alongside its frames;
+// a guarded call sets its hook's bit on the way in, and its frame
+// clears it again on the way out.
+
+// Hooks made with DPCreateHook() keep the context they hand to their
+// callbacks in the frame too, so the post-callback sees the same one
+// the pre-callback did.
+
+// how deeply instrumented calls can nest on one thread before we stop
+// timing them (they still get counted, but aren't guarded)
+#define kHookFrameStackDepth    128
+
+#define guard_word( index )     ((index) >> 5)
+#define guard_bit( index )      (1U << ((index) & 31))
+
+struct hook_frame
+{
+    void *                  return_addr;
+    void **                 return_slot;
+    struct hook_record *    record;
+    int                     timed;
+    int                     watched;
+    int                     traced;
+    unsigned long long      entry_ticks;
+    DPHookContext           context;
+};
+
+struct hook_frame_stack
+{
+    unsigned int            depth;
+    void *                  last_return_addr;   // of the last frame popped
+    unsigned int            guard_bits[kMaxGuardedHooks / 32];
+    struct hook_frame       frames[kHookFrameStackDepth];
+};
+
+static pthread_key_t    frame_stack_key;
+static pthread_once_t   frame_stack_once = PTHREAD_ONCE_INIT;
+static int              frame_stack_key_valid = 0;
+
+static void free_frame_stack( void * stack )
+{
+    if ( stack != NULL )
+    {
+        (void) vm_deallocate( mach_task_self( ), (vm_address_t) stack,
+                              round_page( sizeof(struct hook_frame_stack) ) );
+    }
+}
+
+static void create_frame_stack_key( void )
+{
+    if ( pthread_key_create( &frame_stack_key, free_frame_stack ) == 0 )
+        frame_stack_key_valid = 1;
+    else
+        LogEmergency( "Unable to create hook frame key -- calls will not be timed" );
+}
+
+static struct hook_frame_stack * current_frame_stack( int create )
+{
+    struct hook_frame_stack * result = NULL;
+
+    pthread_once( &frame_stack_once, create_frame_stack_key );
+
+    if ( frame_stack_key_valid )
+    {
+        result = (struct hook_frame_stack *) pthread_getspecific( frame_stack_key );
+
+        if ( ( result == NULL ) && ( create ) )
+        {
+            vm_address_t addr = 0;
+            kern_return_t kr = vm_allocate( mach_task_self( ), &addr,
+                                            round_page( sizeof(struct hook_frame_stack) ),
+                                            TRUE );
+
+            // fresh pages are zero-filled, so depth is already zero
+            if ( kr == KERN_SUCCESS )
+            {
+                result = (struct hook_frame_stack *) addr;
+                pthread_setspecific( frame_stack_key, result );
+            }
+        }
+    }
+
+    return ( result );
+}
+
+#pragma mark -
+
+unsigned long long __hook_read_timestamp( void )
+{
+    unsigned long long result;
+
+    __asm__ __volatile__ ( "rdtsc" : "=A" (result) );
+
+    return ( result );
+}
+
+// a guarded frame is going away, whether it returned or was skipped
+// over by a longjmp()
+static void release_frame( struct hook_frame_stack * stack, struct hook_frame * frame )
+{
+    struct hook_record * record = frame->record;
+
+    stack->last_return_addr = frame->return_addr;
+
+    if ( record->options & kDPPatchNoRecursion )
+        stack->guard_bits[guard_word( record->guard_index )] &=
+            ~guard_bit( record->guard_index );
+}
+
+static void fill_context( DPHookContext * context, struct hook_record * record,
+                          void ** return_slot )
+{
+    context->target = record->target;
+    context->user_info = record->user_info;
+    context->arguments = return_slot + 1;
+    context->return_address = *return_slot;
+    context->return_value = 0;
+    context->return_value_high = 0;
+}
+
+void * __hook_enter( void * island, void ** return_slot )
+{
+    unsigned char * data = (unsigned char *) island;
+    void * target = *((void **)(data + island_branch_target_offset));
+    void * original = *((void **)(data + island_error_handler_offset));
+    struct hook_record * record = NULL;
+    struct hook_frame_stack * stack = NULL;
+    DPHookCallback pre = NULL;
+    DPHookContext context;
+    int guarded = 0;
+    int timed = 0;
+    int watched = 0;
+    int traced = 0;
+
+    // same test as the standard island: no patch, go to the fallback
+    if ( target == NULL )
+        return ( original );
+
+    record = *((struct hook_record **)(data + island_hook_record_offset));
+    guarded = ( (record->options & kDPPatchNoRecursion) != 0 );
+
+    stack = current_frame_stack( 1 );
+
+    // anything at or below our return address on the stack belongs to
+    // a call which was longjmp()'d out of; clear those away now, so a
+    // stale guard bit can't keep this thread out of the patch
+    if ( stack != NULL )
+    {
+        while ( ( stack->depth > 0 ) &&
+                ( stack->frames[stack->depth - 1].return_slot <= return_slot ) )
+        {
+            release_frame( stack, &stack->frames[--stack->depth] );
+        }
+    }
+
+    // already inside this patch on this thread? skip straight to the
+    // original, without touching the return address
+    if ( ( guarded ) && ( stack != NULL ) &&
+         ( stack->guard_bits[guard_word( record->guard_index )] &
+           guard_bit( record->guard_index ) ) )
+    {
+        return ( original );
+    }
+
+    if ( record->options & kDPPatchInstrumented )
+    {
+        unsigned int rate = record->sample_rate;
+
+        __hook_record_count( record );
+
+        // only time one call in every 'rate'; the low word of the
+        // counter is plenty to pick which
+        timed = ( ( rate <= 1 ) || ( ((unsigned int) record->calls % rate) == 0 ) );
+    }
+
+    if ( record->options & kDPPatchCallbacks )
+    {
+        pre = record->pre_callback;
+        watched = ( record->post_callback != NULL );
+    }
+
+    traced = ( ( record->options & kDPPatchTraced ) && __hook_trace_active );
+
+    // an untimed, unguarded, unwatched, untraced call has no need to
+    // see the return
+    if ( !timed && !guarded && !watched && !traced )
+    {
+        if ( pre != NULL )
+        {
+            fill_context( &context, record, return_slot );
+            pre( &context );
+        }
+
+        return ( target );
+    }
+
+    if ( ( stack != NULL ) && ( stack->depth < kHookFrameStackDepth ) )
+    {
+        struct hook_frame * frame = &stack->frames[stack->depth];
+
+        frame->return_addr = *return_slot;
+        frame->return_slot = return_slot;
+        frame->record = record;
+        frame->timed = timed;
+        frame->watched = watched;
+
+        if ( watched || pre )
+            fill_context( &frame->context, record, return_slot );
+
+        if ( guarded )
+            stack->guard_bits[guard_word( record->guard_index )] |=
+                guard_bit( record->guard_index );
+
+        *return_slot = (void *) &__island_exit_thunk;
+        stack->depth++;
+
+        // anything the callback calls gets frames above this one
+        if ( pre != NULL )
+            pre( &frame->context );
+
+        // take the timestamp last, so our own book-keeping isn't counted
+        frame->entry_ticks = __hook_read_timestamp( );
+
+        // if there's no room for the entry, don't record the exit
+        if ( traced )
+            frame->traced = __hook_trace_event( record, kHookTraceEnter, frame->entry_ticks );
+        else
+            frame->traced = 0;
+    }
+    else if ( pre != NULL )
+    {
+        // too deep to see the return, but we can still say we're here
+        fill_context( &context, record, return_slot );
+        pre( &context );
+    }
+
+    return ( target );
+}
+
+void * __hook_exit( void * stack_ptr )
+{
+    unsigned long long now = __hook_read_timestamp( );
+    struct hook_frame_stack * stack = current_frame_stack( 0 );
+    struct hook_frame * returning = NULL;
+    struct hook_frame frame;
+
+    if ( stack != NULL )
+    {
+        // The returning call's slot is now below the stack pointer.
+        // Normally it's the top frame, but if anything longjmp()'d out
+        // of a hooked call, there will be stale frames above it, which
+        // will also be below the stack pointer. The returning frame is
+        // the last (outermost) one we find in that state. Comparing
+        // addresses like this, rather than looking for an exact match,
+        // copes with callee-popped arguments (ret $n) as well.
+        while ( ( stack->depth > 0 ) &&
+                ( (void *) stack->frames[stack->depth - 1].return_slot < stack_ptr ) )
+        {
+            returning = &stack->frames[--stack->depth];
+            release_frame( stack, returning );
+        }
+    }
+
+    // This really shouldn't happen, but taking the whole process down
+    // would be worse than a best guess. The innermost frame is the
+    // likeliest if the stack pointer's just been moved somewhere we
+    // didn't expect; failing that, the frame most recently thrown away.
+    if ( ( returning == NULL ) && ( stack != NULL ) && ( stack->depth > 0 ) )
+    {
+        LogError( "Instrumented patch returned with no matching hook frame; "
+                  "using the innermost one" );
+        returning = &stack->frames[--stack->depth];
+        release_frame( stack, returning );
+    }
+    else if ( ( returning == NULL ) && ( stack != NULL ) &&
+              ( stack->last_return_addr != NULL ) )
+    {
+        LogError( "Instrumented patch returned with no hook frame; "
+                  "returning to %#x", (unsigned) stack->last_return_addr );
+        return ( stack->last_return_addr );
+    }
+    else if ( returning == NULL )
+    {
+        // no frame was ever made on this thread, so there's no address
+        // to go back to at all; losing the thread beats losing the process
+        LogEmergency( "Instrumented patch returned with no hook frames on this thread !" );
+        pthread_exit( NULL );
+    }
+
+    if ( returning->timed )
+        __hook_record_sample( returning->record, now - returning->entry_ticks );
+
+    if ( returning->traced )
+        (void) __hook_trace_event( returning->record, kHookTraceExit, now );
+
+    if ( returning->watched )
+    {
+        // the exit thunk pushed %eax, then %edx, just below the stack
+        // pointer it gave us; whatever's there when we return is what
+        // the caller gets
+        unsigned int * saved = (unsigned int *) stack_ptr - 2;
+        DPHookCallback post = returning->record->post_callback;
+
+        // the frame's slot is free now, and anything the callback
+        // calls will reuse it
+        frame = *returning;
+        returning = &frame;
+
+        frame.context.return_value = saved[1];
+        frame.context.return_value_high = saved[0];
+
+        if ( post != NULL )
+            post( &frame.context );
+
+        saved[1] = frame.context.return_value;
+        saved[0] = frame.context.return_value_high;
+    }
+
+    return ( returning->return_addr );
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ *  hook_frames.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 14/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_HOOK_FRAMES_H__
+#define __DP_HOOK_FRAMES_H__
+
+#include <sys/cdefs.h>
+
+#include "Patching.h"
+
+/*!
+ @header Hook Frames
+ @discussion Internal interface shared by the patch island builders and
+         the instrumentation code. An instrumented island doesn't
+         branch straight to its patch function; it goes through
+         @link __hook_enter __hook_enter @/link, which counts the
+         call, takes a timestamp, and swaps the caller's return address
+         for the exit thunk so that
+         @link __hook_exit __hook_exit @/link gets to see the call
+         complete. The real return addresses are kept on a small
+         per-thread stack of 'hook frames'.
+
+         The same islands are used for recursion-guarded patches: on
+         the way in, the hook's bit is set in a per-thread bitmap, and
+         on the way out it's cleared again. Any call which finds the
+         bit already set goes straight to the original code.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+/*!
+ @struct hook_record
+ @abstract Book-keeping for a single instrumented hook.
+ @discussion One of these is allocated for each instrumented patch,
+         and its address is stored in the island's data block and
+         kept in the patch's registry entry. The
+         counters are only ever updated atomically; readers take a
+         snapshot through
+         @link __hook_record_snapshot __hook_record_snapshot @/link.
+ @field target Address of the patched function.
+ @field patch Address of the patch function.
+ @field options The patch options the hook was created with.
+ @field guard_index The hook's bit in the per-thread recursion bitmap,
+        if it was created with
+        @link kDPPatchNoRecursion kDPPatchNoRecursion @/link.
+ @field calls Number of times the island has been entered.
+ @field samples Number of calls whose duration was recorded.
+ @field total_ticks Sum of all recorded durations.
+ @field min_ticks Shortest recorded duration.
+ @field max_ticks Longest recorded duration.
+ @field histogram Log-linear histogram of recorded durations.
+ @field sample_rate Time one call in this many; zero or one times
+        every call. Set from the patch's control slot.
+ @field pre_callback Called on the way in, for hooks made with
+        @link DPCreateHook DPCreateHook @/link.
+ @field post_callback Called on the way out, likewise.
+ @field user_info Handed to both callbacks.
+ @field trace_id Identifies the hook in trace events, if it was created
+        with @link kDPPatchTraced kDPPatchTraced @/link.
+ */
+struct hook_record
+{
+    void *              target;
+    void *              patch;
+    unsigned int        options;
+    unsigned int        guard_index;
+
+    volatile unsigned long long calls;
+    volatile unsigned long long samples;
+    volatile unsigned long long total_ticks;
+    volatile unsigned long long min_ticks;
+    volatile unsigned long long max_ticks;
+
+    volatile unsigned int histogram[kDPPatchHistogramBuckets];
+
+    volatile unsigned int sample_rate;
+
+    DPHookCallback      pre_callback;
+    DPHookCallback      post_callback;
+    void *              user_info;
+
+    unsigned int        trace_id;
+
+};
+
+// offsets of the words in an island's data block, which is kept apart
+// from its code; the hook_record is only set for instrumented islands,
+// and the code address is where calls enter the island
+#define island_branch_target_offset     0
+#define island_error_handler_offset     4
+#define island_hook_record_offset       8
+#define island_code_address_offset      12
+#define island_data_size                16
+
+// a private patch option, for hooks made by DPCreateHook(): the island
+// runs the record's callbacks around the call, and rather than a patch
+// function of its own it branches on down its handler chain
+#define kDPPatchCallbacks               0x80000000
+
+// the most recursion-guarded hooks a process can have
+#define kMaxGuardedHooks                1024
+
+// the most traced hooks a process can have
+#define kMaxTracedHooks                 1024
+
+// kinds of trace event
+#define kHookTraceEnter                 0
+#define kHookTraceExit                  1
+
+// nonzero while a trace is being recorded; see hook_trace.c
+extern volatile int __hook_trace_active;
+
+/*!
+ @function __hook_record_create
+ @abstract Allocate a record for a new instrumented or guarded hook.
+ @param target The address of the function being patched.
+ @param patch The address of the patch function.
+ @param options The patch options requested.
+ @result A new record, or NULL if no memory was available or there are
+         no recursion guard bits left.
+ */
+struct hook_record * __hook_record_create( void * target, void * patch,
+                                           unsigned int options );
+
+/*!
+ @function __hook_record_sample
+ @abstract Add one timed call to a hook's statistics.
+ @discussion Called from the exit path with the return value still
+         held by the thunk, so this must stick to integer arithmetic.
+ @param record The hook being timed.
+ @param ticks The duration of the call, in timestamp-counter ticks.
+ */
+void __hook_record_sample( struct hook_record * record, unsigned long long ticks );
+
+/*!
+ @function __hook_record_count
+ @abstract Atomically bump the call counter of a hook.
+ @param record The hook being called.
+ */
+void __hook_record_count( struct hook_record * record );
+
+/*!
+ @function __hook_record_snapshot
+ @abstract Copy a hook's counters into a public statistics structure.
+ @param record The hook to read.
+ @param stats The structure to fill in.
+ */
+void __hook_record_snapshot( struct hook_record * record, DPPatchStatistics * stats );
+
+/*!
+ @function __hook_trace_register
+ @abstract Give a new traced hook its ID.
+ @param record The hook's record; its trace_id is filled in.
+ @result Zero if there are no IDs left.
+ */
+int __hook_trace_register( struct hook_record * record );
+
+/*!
+ @function __hook_trace_event
+ @abstract Append an event to the current thread's trace ring.
+ @discussion Called from the hook thunks' C code, so this must not
+         allocate from the heap or take any locks. Never records
+         anything for the thread which drains the rings.
+ @param record The hook being entered or left.
+ @param kind kHookTraceEnter or kHookTraceExit.
+ @param ticks The timestamp of the event.
+ @result Nonzero if the event was recorded; zero if the ring was full
+         or the thread doesn't trace.
+ */
+int __hook_trace_event( struct hook_record * record, unsigned int kind,
+                        unsigned long long ticks );
+
+/*!
+ @function __hook_read_timestamp
+ @abstract Read the processor's timestamp counter.
+ @result The current timestamp, in processor-defined ticks.
+ */
+unsigned long long __hook_read_timestamp( void );
+
+/*!
+ @function __hook_enter
+ @abstract Called by the enter thunk on the way into an instrumented or
+         guarded hook.
+ @param island The address of the island's data block.
+ @param return_slot The address of the caller's return address on the stack.
+ @result The address to which the thunk should branch.
+ */
+void * __hook_enter( void * island, void ** return_slot );
+
+/*!
+ @function __hook_exit
+ @abstract Called by the exit thunk when an instrumented or guarded
+         hook returns.
+ @param stack_ptr The stack pointer as the hooked function left it.
+ @result The return address the hooked function was originally given.
+ */
+void * __hook_exit( void * stack_ptr );
+
+// the thunks themselves, in island_thunks.s
+void __island_enter_thunk( void );
+void __island_exit_thunk( void );
+
+__END_DECLS
+
+#endif  /* __DP_HOOK_FRAMES_H__ */
@@ -0,0 +1,277 @@
+/*
+ *  hook_stats.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 14/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "hook_frames.h"
+#include "patch_registry.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The histogram is log-linear, like HdrHistogram with three bits of
+// sub-bucket precision: values below eight get a bucket each, then
+// every power of two from 8 upwards is split into eight equal slices.
+#define kHistogramSubBits       3
+#define kHistogramSubBuckets    (1 << kHistogramSubBits)
+
+// next free bit in the per-thread recursion bitmaps
+static unsigned int     next_guard_index = 0;
+
+static unsigned int bucket_for_value( unsigned long long value )
+{
+    unsigned int exponent;
+
+    if ( value < kHistogramSubBuckets )
+        return ( (unsigned int) value );
+
+    exponent = 63 - __builtin_clzll( value );
+
+    return ( ((exponent - kHistogramSubBits + 1) << kHistogramSubBits) +
+             (unsigned int) ((value >> (exponent - kHistogramSubBits)) &
+                             (kHistogramSubBuckets - 1)) );
+}
+
+unsigned long long DPPatchHistogramBucketValue( unsigned int bucket )
+{
+    unsigned int exponent;
+
+    if ( bucket >= kDPPatchHistogramBuckets )
+        bucket = kDPPatchHistogramBuckets - 1;
+
+    if ( bucket < kHistogramSubBuckets )
+        return ( bucket );
+
+    exponent = (bucket >> kHistogramSubBits) + kHistogramSubBits - 1;
+
+    return ( (unsigned long long) (kHistogramSubBuckets + (bucket & (kHistogramSubBuckets - 1)))
+             << (exponent - kHistogramSubBits) );
+}
+
+#pragma mark -
+
+#if __i386__
+
+// the counters are only ever read as a snapshot, so nothing needs to
+// be ordered around them
+static void atomic_add_32( volatile unsigned int * addr, unsigned int amount )
+{
+    (void) DPAtomicFetchAdd32( addr, amount, kDPMemoryOrderRelaxed );
+}
+
+static void atomic_add_64( volatile unsigned long long * addr, unsigned long long amount )
+{
+    (void) DPAtomicFetchAdd64( addr, amount, kDPMemoryOrderRelaxed );
+}
+
+static void atomic_min_64( volatile unsigned long long * addr, unsigned long long value )
+{
+    unsigned long long oldVal;
+
+    do
+    {
+        oldVal = *addr;
+        if ( oldVal <= value )
+            break;
+
+    } while ( DPAtomicCompareAndSwap64( oldVal, value, addr, kDPMemoryOrderRelaxed ) == 0 );
+}
+
+static void atomic_max_64( volatile unsigned long long * addr, unsigned long long value )
+{
+    unsigned long long oldVal;
+
+    do
+    {
+        oldVal = *addr;
+        if ( oldVal >= value )
+            break;
+
+    } while ( DPAtomicCompareAndSwap64( oldVal, value, addr, kDPMemoryOrderRelaxed ) == 0 );
+}
+
+struct hook_record * __hook_record_create( void * target, void * patch,
+                                           unsigned int options )
+{
+    struct hook_record * record = NULL;
+    unsigned int guard_index = 0;
+
+    if ( options & kDPPatchNoRecursion )
+    {
+        // patches are created under a mutex, but there's no harm in
+        // being careful
+        do
+        {
+            guard_index = next_guard_index;
+            if ( guard_index >= kMaxGuardedHooks )
+            {
+                LogError( "Too many recursion-guarded patches; can't patch %#x",
+                          (unsigned) target );
+                return ( NULL );
+            }
+
+        } while ( DPAtomicCompareAndSwap32( guard_index, guard_index + 1,
+                                            &next_guard_index, kDPMemoryOrderRelaxed ) == 0 );
+    }
+
+    // never freed: an island can't be unmapped while a thread might
+    // still be inside it, and the island points at this
+    record = (struct hook_record *) calloc( 1, sizeof(struct hook_record) );
+    if ( record == NULL )
+    {
+        LogError( "Unable to allocate statistics for patch on %#x", (unsigned) target );
+        return ( NULL );
+    }
+
+    record->target = target;
+    record->patch = patch;
+    record->options = options;
+    record->guard_index = guard_index;
+    record->min_ticks = ~0ULL;
+
+    if ( ( options & kDPPatchTraced ) && !__hook_trace_register( record ) )
+    {
+        free( record );
+        return ( NULL );
+    }
+
+    return ( record );
+}
+
+void __hook_record_count( struct hook_record * record )
+{
+    atomic_add_64( &record->calls, 1 );
+}
+
+void __hook_record_sample( struct hook_record * record, unsigned long long ticks )
+{
+    atomic_add_64( &record->samples, 1 );
+    atomic_add_64( &record->total_ticks, ticks );
+    atomic_min_64( &record->min_ticks, ticks );
+    atomic_max_64( &record->max_ticks, ticks );
+    atomic_add_32( &record->histogram[bucket_for_value( ticks )], 1 );
+}
+
+#endif  /* __i386__ */
+
+#pragma mark -
+
+void __hook_record_snapshot( struct hook_record * record, DPPatchStatistics * stats )
+{
+    unsigned int i;
+
+    stats->target       = record->target;
+    stats->patch        = record->patch;
+
+#if __i386__
+    // a plain load of a 64-bit counter can be split by an update
+    stats->calls        = DPAtomicLoad64( &record->calls );
+    stats->samples      = DPAtomicLoad64( &record->samples );
+    stats->total_ticks  = DPAtomicLoad64( &record->total_ticks );
+    stats->min_ticks    = ( stats->samples == 0 ) ? 0 : DPAtomicLoad64( &record->min_ticks );
+    stats->max_ticks    = DPAtomicLoad64( &record->max_ticks );
+#else
+    // nothing updates the counters on PowerPC
+    stats->calls        = record->calls;
+    stats->samples      = record->samples;
+    stats->total_ticks  = record->total_ticks;
+    stats->min_ticks    = ( stats->samples == 0 ) ? 0 : record->min_ticks;
+    stats->max_ticks    = record->max_ticks;
+#endif
+
+    for ( i = 0; i < kDPPatchHistogramBuckets; i++ )
+        stats->histogram[i] = record->histogram[i];
+}
+
+struct statistics_context
+{
+    DPPatchStatisticsCallback   callback;
+    void *                      info;
+    unsigned int                count;
+};
+
+static void enumerate_one_record( struct patch_entry * entry, void * ctx )
+{
+    struct statistics_context * context = (struct statistics_context *) ctx;
+    DPPatchStatistics stats;
+
+    if ( ( entry->record == NULL ) ||
+         ( (entry->record->options & kDPPatchInstrumented) == 0 ) )
+        return;
+
+    __hook_record_snapshot( entry->record, &stats );
+    context->callback( &stats, context->info );
+    context->count++;
+}
+
+unsigned int DPEnumeratePatchStatistics( DPPatchStatisticsCallback callback, void * info )
+{
+    struct statistics_context context;
+
+    if ( callback == NULL )
+    {
+        LogError( "NULL callback supplied to DPEnumeratePatchStatistics()" );
+        return ( 0 );
+    }
+
+    context.callback = callback;
+    context.info = info;
+    context.count = 0;
+
+    (void) __patch_registry_enumerate( enumerate_one_record, &context );
+
+    return ( context.count );
+}
+
+unsigned long long DPPatchStatisticsPercentile( const DPPatchStatistics * stats,
+                                                double percentile )
+{
+    unsigned long long total = 0;
+    unsigned long long wanted = 0;
+    unsigned long long seen = 0;
+    unsigned int i;
+
+    if ( stats == NULL )
+        return ( 0 );
+
+    // the histogram is copied bucket by bucket, so sum it rather than
+    // trusting the sample count to match
+    for ( i = 0; i < kDPPatchHistogramBuckets; i++ )
+        total += stats->histogram[i];
+
+    if ( total == 0 )
+        return ( 0 );
+
+    if ( percentile < 0.0 )
+        percentile = 0.0;
+    else if ( percentile > 100.0 )
+        percentile = 100.0;
+
+    wanted = (unsigned long long) ( ( (double) total * percentile ) / 100.0 + 0.5 );
+    if ( wanted == 0 )
+        wanted = 1;
+
+    for ( i = 0; i < kDPPatchHistogramBuckets; i++ )
+    {
+        seen += stats->histogram[i];
+        if ( seen >= wanted )
+            break;
+    }
+
+    return ( DPPatchHistogramBucketValue( i ) );
+}
@@ -0,0 +1,434 @@
+/*
+ *  hook_trace.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 28/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "hook_frames.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/vm_map.h>
+#include <mach/machine/vm_param.h>
+
+#if __i386__
+
+// Each thread which calls a traced hook gets a ring of events, which
+// only it writes to and only the drain thread reads from. The writer
+// fills in an event and then moves the head on with a release store;
+// the reader loads the head with acquire order, copies events out and
+// then moves the tail on with a release store of its own. On Intel,
+// neither costs more than stopping the compiler reordering things.
+//
+// Rings come straight from the VM system, for the same reason the hook
+// frames do, and are never freed: the drain thread could be reading
+// one at any time. When a thread exits, its ring is left for the next
+// new thread to pick up once it's been emptied.
+//
+// The thread is recorded once per ring, not in every event.
+
+// events per ring; must be a power of two
+#define kTraceRingSize          4096
+
+// how often the drain thread empties the rings, in microseconds
+#define kTraceDrainInterval     100000
+
+// marks the drain thread, which mustn't trace itself
+#define kNoTraceRing            ((struct trace_ring *) 1)
+
+struct trace_event
+{
+    unsigned int            hook_id;
+    unsigned int            kind;
+    unsigned long long      ticks;
+};
+
+struct trace_ring
+{
+    struct trace_ring *     next;           // all rings, for the drain thread
+    volatile unsigned int   in_use;         // zero once its thread has gone
+    volatile unsigned int   thread_id;
+    volatile unsigned int   head;           // written by the owning thread
+    volatile unsigned int   tail;           // written by the drain thread
+    volatile unsigned int   dropped;
+    struct trace_event      events[kTraceRingSize];
+};
+
+struct traced_hook
+{
+    void *                  target;
+    const char *            name;
+    char                    address[12];
+};
+
+volatile int                __hook_trace_active = 0;
+
+static struct trace_ring * volatile ring_list = NULL;
+
+static pthread_key_t        ring_key;
+static pthread_once_t       ring_key_once = PTHREAD_ONCE_INIT;
+static int                  ring_key_valid = 0;
+
+static struct traced_hook   traced_hooks[kMaxTracedHooks];
+static unsigned int         next_trace_id = 0;
+
+// the trace in progress
+static pthread_mutex_t      trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t            drain_thread;
+static FILE *               trace_file = NULL;
+static unsigned int         trace_event_count = 0;
+static unsigned long long   trace_base_ticks = 0;
+static unsigned long long   trace_base_nanos = 0;
+static double               trace_nanos_per_tick = 0.0;
+
+static void release_ring( void * ring )
+{
+    if ( ( ring != NULL ) && ( ring != kNoTraceRing ) )
+        ((struct trace_ring *) ring)->in_use = 0;
+}
+
+static void create_ring_key( void )
+{
+    if ( pthread_key_create( &ring_key, release_ring ) == 0 )
+        ring_key_valid = 1;
+    else
+        LogEmergency( "Unable to create trace ring key -- calls will not be traced" );
+}
+
+// take over the ring of a thread which has exited
+static struct trace_ring * reuse_ring( unsigned int thread_id )
+{
+    struct trace_ring * ring;
+
+    for ( ring = ring_list; ring != NULL; ring = ring->next )
+    {
+        // only once the drain thread has read everything the last
+        // thread left in it
+        if ( ( ring->in_use == 0 ) && ( ring->head == ring->tail ) &&
+             DPAtomicCompareAndSwap32( 0, 1, &ring->in_use, kDPMemoryOrderAcquire ) )
+        {
+            ring->thread_id = thread_id;
+            return ( ring );
+        }
+    }
+
+    return ( NULL );
+}
+
+static struct trace_ring * current_ring( void )
+{
+    struct trace_ring * ring = NULL;
+    unsigned int thread_id;
+    vm_address_t addr = 0;
+
+    pthread_once( &ring_key_once, create_ring_key );
+    if ( !ring_key_valid )
+        return ( NULL );
+
+    ring = (struct trace_ring *) pthread_getspecific( ring_key );
+    if ( ring == kNoTraceRing )
+        return ( NULL );
+
+    if ( ring != NULL )
+        return ( ring );
+
+    thread_id = (unsigned int) pthread_mach_thread_np( pthread_self( ) );
+
+    ring = reuse_ring( thread_id );
+    if ( ring == NULL )
+    {
+        if ( vm_allocate( mach_task_self( ), &addr, round_page( sizeof(struct trace_ring) ),
+                          TRUE ) != KERN_SUCCESS )
+            return ( NULL );
+
+        // fresh pages are zero-filled, so the ring is already empty
+        ring = (struct trace_ring *) addr;
+        ring->in_use = 1;
+        ring->thread_id = thread_id;
+
+        do
+        {
+            ring->next = ring_list;
+
+        } while ( DPAtomicCompareAndSwapPtr( ring->next, ring, (void * volatile *) &ring_list,
+                                             kDPMemoryOrderRelease ) == 0 );
+    }
+
+    pthread_setspecific( ring_key, ring );
+
+    return ( ring );
+}
+
+#pragma mark -
+
+int __hook_trace_register( struct hook_record * record )
+{
+    struct traced_hook * hook = NULL;
+    unsigned int trace_id;
+    Dl_info info;
+
+    // patches are created under a mutex, but as with the guard bits,
+    // there's no harm in being careful
+    do
+    {
+        trace_id = next_trace_id;
+        if ( trace_id >= kMaxTracedHooks )
+        {
+            LogError( "Too many traced patches; can't patch %#x", (unsigned) record->target );
+            return ( 0 );
+        }
+
+    } while ( DPAtomicCompareAndSwap32( trace_id, trace_id + 1, &next_trace_id,
+                                        kDPMemoryOrderRelaxed ) == 0 );
+
+    hook = &traced_hooks[trace_id];
+    hook->target = record->target;
+    snprintf( hook->address, sizeof(hook->address), "%#x", (unsigned) record->target );
+
+    if ( ( dladdr( record->target, &info ) != 0 ) && ( info.dli_sname != NULL ) &&
+         ( info.dli_saddr == record->target ) )
+        hook->name = info.dli_sname;
+    else
+        hook->name = hook->address;
+
+    record->trace_id = trace_id;
+
+    return ( 1 );
+}
+
+int __hook_trace_event( struct hook_record * record, unsigned int kind,
+                        unsigned long long ticks )
+{
+    struct trace_ring * ring = current_ring( );
+    struct trace_event * event = NULL;
+    unsigned int head;
+
+    if ( ring == NULL )
+        return ( 0 );
+
+    head = ring->head;
+    if ( head - DPAtomicLoad32( &ring->tail, kDPMemoryOrderAcquire ) >= kTraceRingSize )
+    {
+        ring->dropped++;
+        return ( 0 );
+    }
+
+    event = &ring->events[head & (kTraceRingSize - 1)];
+    event->hook_id = record->trace_id;
+    event->kind = kind;
+    event->ticks = ticks;
+
+    // the event has to be there before the drain thread can see it
+    DPAtomicStore32( &ring->head, head + 1, kDPMemoryOrderRelease );
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+// match the timestamp counter against the system clock, over the
+// whole of the trace so far
+static void calibrate_ticks( void )
+{
+    static mach_timebase_info_data_t timebase;
+    unsigned long long ticks = __hook_read_timestamp( );
+    unsigned long long nanos;
+
+    if ( timebase.denom == 0 )
+        mach_timebase_info( &timebase );
+
+    nanos = mach_absolute_time( ) * timebase.numer / timebase.denom;
+
+    if ( trace_base_ticks == 0 )
+    {
+        trace_base_ticks = ticks;
+        trace_base_nanos = nanos;
+    }
+    else if ( ( ticks > trace_base_ticks ) && ( nanos > trace_base_nanos ) )
+    {
+        trace_nanos_per_tick = (double) (nanos - trace_base_nanos) /
+                               (double) (ticks - trace_base_ticks);
+    }
+}
+
+static void write_event( const struct trace_event * event, unsigned int thread_id )
+{
+    const char * name = "?";
+    double micros = 0.0;
+
+    if ( event->hook_id < kMaxTracedHooks )
+        name = traced_hooks[event->hook_id].name;
+
+    if ( event->ticks > trace_base_ticks )
+        micros = (double) (event->ticks - trace_base_ticks) * trace_nanos_per_tick / 1000.0;
+
+    fprintf( trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+             ( trace_event_count == 0 ) ? "" : ",", name,
+             ( event->kind == kHookTraceEnter ) ? 'B' : 'E', micros,
+             (int) getpid( ), thread_id );
+
+    trace_event_count++;
+}
+
+static void drain_rings( void )
+{
+    struct trace_ring * ring;
+
+    calibrate_ticks( );
+
+    for ( ring = ring_list; ring != NULL; ring = ring->next )
+    {
+        unsigned int tail = ring->tail;
+        unsigned int head, thread_id;
+
+        // read the events only after seeing the head which covers them
+        head = DPAtomicLoad32( &ring->head, kDPMemoryOrderAcquire );
+        thread_id = ring->thread_id;
+
+        for ( ; tail != head; tail++ )
+            write_event( &ring->events[tail & (kTraceRingSize - 1)], thread_id );
+
+        // and let the writer have the space back only once we're done
+        DPAtomicStore32( &ring->tail, tail, kDPMemoryOrderRelease );
+    }
+
+    fflush( trace_file );
+}
+
+static void * trace_drainer( void * arg )
+{
+    pthread_once( &ring_key_once, create_ring_key );
+    if ( ring_key_valid )
+        pthread_setspecific( ring_key, kNoTraceRing );
+
+    while ( __hook_trace_active )
+    {
+        usleep( kTraceDrainInterval );
+        drain_rings( );
+    }
+
+    // whatever came in during that last sleep
+    drain_rings( );
+
+    return ( NULL );
+}
+
+#pragma mark -
+
+int DPStartTrace( const char * path )
+{
+    struct trace_ring * ring;
+    int result = 0;
+
+    if ( path == NULL )
+        return ( 0 );
+
+    pthread_mutex_lock( &trace_mutex );
+
+    if ( trace_file != NULL )
+    {
+        LogError( "A trace is already running; can't start another in '%s'", path );
+    }
+    else if ( ( trace_file = fopen( path, "w" ) ) == NULL )
+    {
+        LogError( "Unable to open trace file '%s'", path );
+    }
+    else
+    {
+        // throw away anything left over from an earlier trace
+        for ( ring = ring_list; ring != NULL; ring = ring->next )
+        {
+            ring->tail = ring->head;
+            ring->dropped = 0;
+        }
+
+        trace_event_count = 0;
+        trace_base_ticks = 0;
+        trace_nanos_per_tick = 0.0;
+        calibrate_ticks( );
+
+        fprintf( trace_file, "{\"traceEvents\":[" );
+
+        __hook_trace_active = 1;
+
+        if ( pthread_create( &drain_thread, NULL, trace_drainer, NULL ) == 0 )
+        {
+            result = 1;
+        }
+        else
+        {
+            LogError( "Unable to start trace thread" );
+            __hook_trace_active = 0;
+            fclose( trace_file );
+            trace_file = NULL;
+        }
+    }
+
+    pthread_mutex_unlock( &trace_mutex );
+
+    return ( result );
+}
+
+unsigned int DPStopTrace( void )
+{
+    struct trace_ring * ring;
+    unsigned int dropped = 0;
+
+    pthread_mutex_lock( &trace_mutex );
+
+    if ( trace_file != NULL )
+    {
+        __hook_trace_active = 0;
+        pthread_join( drain_thread, NULL );
+
+        for ( ring = ring_list; ring != NULL; ring = ring->next )
+            dropped += ring->dropped;
+
+        fprintf( trace_file, "\n],\"displayTimeUnit\":\"ns\"}\n" );
+        fclose( trace_file );
+        trace_file = NULL;
+
+        if ( dropped != 0 )
+            LogError( "%u trace events were dropped", dropped );
+    }
+
+    pthread_mutex_unlock( &trace_mutex );
+
+    return ( dropped );
+}
+
+#else   /* !__i386__ */
+
+int DPStartTrace( const char * path )
+{
+    LogError( "Tracing is only supported on Intel" );
+    return ( 0 );
+}
+
+unsigned int DPStopTrace( void )
+{
+    return ( 0 );
+}
+
+#endif  /* __i386__ */
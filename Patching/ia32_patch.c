@@ -19,6 +19,9 @@
 #if __i386__
 
 #include "atomic.h"
+#include "hook_frames.h"
+#include "patch_registry.h"
+#include "island_arena.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,19 +45,9 @@
 // The Intel-based patching algorithm is essentially a port of the
 // PowerPC one. 
 
-// addresses of the allocated jump tables
-static vm_address_t     low_jump_table  = 0;
-static vm_address_t     high_jump_table = 0;
-
-// allocated size of the tables
-// originally I'd planned to have these resizable, but that never got
-// implemented
-static vm_size_t        low_table_size  = 0;
-static vm_size_t        high_table_size = 0;
-
-// offsets to the next available slot in the tables
-static vm_offset_t      low_table_offset    = 0;
-static vm_offset_t      high_table_offset   = 0;
+// All the islands live in arenas near the images they patch; see
+// island_arena.c. Since a jump on Intel can reach anywhere, the
+// nearest free space is used regardless of distance.
 
 // a mutex wraps all patching attempts
 static int              mutex_inited    = 0;
@@ -63,16 +56,6 @@ static pthread_mutex_t  patch_mutex;
 extern int __calc_insn_size( const unsigned char * in_fn_addr, void * jmp_target, 
                              unsigned char new_instr[32], size_t *pSize );
 
-static void free_patch_tables( void )
-{
-    if ( high_jump_table != 0L )
-        vm_deallocate( mach_task_self( ), high_jump_table, high_table_size );
-    if ( low_jump_table != 0L )
-        vm_deallocate( mach_task_self( ), low_jump_table, low_table_size );
-    if ( mutex_inited )
-        pthread_mutex_destroy( &patch_mutex );
-}
-
 static void initialize_patch_mutexes( void )
 {
     if ( mutex_inited == 0 )
@@ -91,12 +74,15 @@ static void initialize_patch_mutexes( void )
     }
 }
 
+// Every island's data words live apart from its code, in a small block
+// of their own (see hook_frames.h); only the code is executable. Data
+// is written each time a patch is retargeted, enabled or disabled, and
+// keeping those stores out of the code's cache lines means they don't
+// make the processor throw away any code it has already decoded.
+
 // this is a standalone chunk
 static unsigned char patch_template[] = {
-// L_TemplateStart:
-    0x00,0x00,0x00,0x00,            // .long branch_target
-    0x00,0x00,0x00,0x00,            // .long error_handler
-    0xBA,0x00,0x00,0x00,0x00,       // movl L_TemplateStart, %edx
+    0xBA,0x00,0x00,0x00,0x00,       // movl $island_data, %edx
     0x8B,0x02,                      // movl (%edx), %eax        -- loads branch_target
     0x85,0xC0,                      // test %eax, %eax
     0x0F,0x85,0x03,0x00,0x00,0x00,  // jne  L_BranchToTarget
@@ -105,204 +91,185 @@ static unsigned char patch_template[] = {
     0xFF,0xE0                       // jmp  *%eax
 };
 
-// the next two go together; they go on either side of the saved
-// instructions from the target. Note that the last byte of the starter
-// template is an 8-bit relative offset to the beginning of the end
-// template: its value should be overwritten with the size of the
-// copied code. This is also the place from which we read that length
-// when removing patches.
-static unsigned char reentry_template_start[] = {
-// L_TemplateStart:
-    0x00,0x00,0x00,0x00,            // .long branch_target
-    0x00,0x00,0x00,0x00,            // .long error_handler
-    0xBA,0x00,0x00,0x00,0x00,       // movl L_TemplateStart, %edx
-    0x8B,0x02,                      // movl (%edx), %eax        -- loads branch_target
-    0x85,0xC0,                      // test %eax, %eax
-    0x0F,0x85,0x08,0x00,0x00,0x00,  // jne  L_CallOriginal
-    0x8B,0x42,0x04,                 // movl 4(%edx), %eax       -- loads error_handler
-    0xEB,0x01                       // jmp  L_BranchToTarget -- **** overwrite last byte with real offset
-// L_CallOriginal:
+// this replaces patch_template when the caller asks for an instrumented
+// or recursion-guarded patch. Rather than testing branch_target itself
+// it hands the data block to the enter thunk (island_thunks.s), which
+// will make the same test as above after counting the call or checking
+// the guard.
+static unsigned char instrumented_template[] = {
+    0xBA,0x00,0x00,0x00,0x00,       // movl $island_data, %edx
+    0xB8,0x00,0x00,0x00,0x00,       // movl ___island_enter_thunk, %eax
+    0xFF,0xE0                       // jmp  *%eax
 };
 
-// ... saved instruction goes in the middle ...
+// this replaces patch_template for kDPPatchDirectBranch patches, which
+// are never retargeted: no load, no test, and no indirect jump, just a
+// straight jump to the patch function.
+static unsigned char direct_template[] = {
+    0xE9,0x00,0x00,0x00,0x00        // jmp  rel32 -- **** overwrite with offset to patch
+};
 
-static unsigned char reentry_template_end[]  = {
-// L_BranchToTarget:
-    0xFF,0xE0                       // jmp  *%eax
+// the re-entry island is just the instructions saved from the target,
+// followed by this. Nothing ever redirects it, so there's no branch
+// target to load and test: calling the original costs one direct jump
+// more than it would unpatched. It doesn't use any registers either,
+// so a thread can be moved into the middle of the saved instructions
+// -- see __relocate_pc()
+static unsigned char reentry_jump_template[] = {
+    0xE9,0x00,0x00,0x00,0x00        // jmp  rel32 -- **** overwrite with offset to original
 };
 
 // some useful offsets into those blocks
-#define branch_target_offset     0
-#define error_handler_offset     4
-#define start_addr_offset        9
-#define instr_size_offset       27
+#define data_addr_offset                1
+#define instrumented_thunk_addr_offset  6
+#define direct_branch_offset            1
+
+// hot patches get all their code from the hot arenas
+#define code_kind( options )    ( ((options) & kDPPatchHot) ? kIslandHotCode : kIslandCode )
+
+// Functions built with -fpatchable-function-entry, -mnop-mcount and the
+// like start with a run of no-ops put there for us to overwrite. These
+// are the forms compilers emit; the address forms always have a zero
+// displacement, so they can be matched byte for byte.
+static const struct nop_form
+{
+    unsigned char   length;
+    unsigned char   bytes[9];
+
+} nop_forms[] = {
+    { 1, { 0x90 } },                                                // nop
+    { 2, { 0x66,0x90 } },                                           // xchg %ax, %ax
+    { 2, { 0x89,0xF6 } },                                           // movl %esi, %esi
+    { 3, { 0x0F,0x1F,0x00 } },                                      // nopl (%eax)
+    { 3, { 0x8D,0x76,0x00 } },                                      // leal 0(%esi), %esi
+    { 4, { 0x0F,0x1F,0x40,0x00 } },                                 // nopl 0(%eax)
+    { 4, { 0x8D,0x74,0x26,0x00 } },                                 // leal 0(%esi,1), %esi
+    { 5, { 0x0F,0x1F,0x44,0x00,0x00 } },                            // nopl 0(%eax,%eax,1)
+    { 6, { 0x66,0x0F,0x1F,0x44,0x00,0x00 } },                       // nopw 0(%eax,%eax,1)
+    { 6, { 0x8D,0xB6,0x00,0x00,0x00,0x00 } },                       // leal 0L(%esi), %esi
+    { 7, { 0x0F,0x1F,0x80,0x00,0x00,0x00,0x00 } },                  // nopl 0L(%eax)
+    { 7, { 0x8D,0xB4,0x26,0x00,0x00,0x00,0x00 } },                  // leal 0L(%esi,1), %esi
+    { 8, { 0x0F,0x1F,0x84,0x00,0x00,0x00,0x00,0x00 } },             // nopl 0L(%eax,%eax,1)
+    { 9, { 0x66,0x0F,0x1F,0x84,0x00,0x00,0x00,0x00,0x00 } }         // nopw 0L(%eax,%eax,1)
+};
+
+#define kNopFormCount   (sizeof(nop_forms) / sizeof(nop_forms[0]))
 
 #pragma mark -
 
-// this builds a reentry table entry
+// this builds a reentry table entry. The code is written at 'local',
+// which is normally the same as this_entry_addr; when building islands
+// for another task, it's a local buffer, and this_entry_addr is where
+// the island will live in that task.
 static size_t build_low_entry( vm_address_t this_entry_addr,
+                               unsigned char * local,
                                vm_address_t reentry_addr,
                                unsigned char * saved_instructions,
                                unsigned int instr_size )
 {
-    size_t result = sizeof(reentry_template_start);
-    unsigned char * data_ptr = (unsigned char *) this_entry_addr;
-
-    // write the code directly into place
-    memcpy( data_ptr, reentry_template_start, result );
-
-    // we're going to try & make the compiler use lda & mov rather than
-    // call memcpy()
-
-    // store branch target -- second instruction of target fn
-    *((vm_address_t *)(data_ptr + branch_target_offset)) = reentry_addr;
-
-    // this block leaves the error-handler blank
-    // we could actually copy instr_size here, if we wanted
-
-    // put this entry's address into load instruction
-    *((vm_address_t *)(data_ptr + start_addr_offset)) = this_entry_addr;
-
-    // now copy in a one-byte variation of the saved instruction size
-    data_ptr[instr_size_offset] = (unsigned char) instr_size;
+    size_t result = instr_size;
+    unsigned char * data_ptr = local;
 
     // copy in the saved instructions
-    memcpy( data_ptr + result, saved_instructions, instr_size );
-    result += instr_size;
+    memcpy( data_ptr, saved_instructions, instr_size );
 
-    // copy in the end of the template
-    memcpy( data_ptr + result, reentry_template_end,
-            sizeof(reentry_template_end) );
-    result += sizeof(reentry_template_end);
+    // and the jump back to the rest of the original
+    memcpy( data_ptr + result, reentry_jump_template, sizeof(reentry_jump_template) );
+    *((vm_address_t *)(data_ptr + result + 1)) =
+        reentry_addr - (this_entry_addr + result + sizeof(reentry_jump_template));
+    result += sizeof(reentry_jump_template);
 
     return ( result );
 }
 
-// this builds the branch-to-patch island
-static size_t build_high_entry( vm_address_t this_entry_addr,
-                                vm_address_t low_entry_addr,
-                                vm_address_t patch_fn_addr )
+// this fills in an island's data block, at 'local' as above
+static void build_island_data( unsigned char * local,
+                               vm_address_t code_addr,
+                               vm_address_t branch_target,
+                               vm_address_t error_handler )
 {
-    unsigned char * data_ptr = (unsigned char *) this_entry_addr;
-
-    memcpy( data_ptr, patch_template, sizeof(patch_template) );
+    *((vm_address_t *)(local + island_branch_target_offset)) = branch_target;
+    *((vm_address_t *)(local + island_error_handler_offset)) = error_handler;
+    *((vm_address_t *)(local + island_hook_record_offset))   = 0;
+    *((vm_address_t *)(local + island_code_address_offset))  = code_addr;
+}
 
-    *((vm_address_t *)(data_ptr + branch_target_offset)) = patch_fn_addr;
-    *((vm_address_t *)(data_ptr + error_handler_offset)) = low_entry_addr;
-    *((vm_address_t *)(data_ptr + start_addr_offset))    = this_entry_addr;
+// this builds the branch-to-patch island
+static size_t build_high_entry( unsigned char * local, vm_address_t data_addr )
+{
+    memcpy( local, patch_template, sizeof(patch_template) );
+    *((vm_address_t *)(local + data_addr_offset)) = data_addr;
 
     return ( sizeof(patch_template) );
 }
 
-static void allocate_jump_tables( void )
+// this builds the direct-branch version of the branch-to-patch island
+static size_t build_direct_entry( vm_address_t this_entry_addr,
+                                  vm_address_t patch_fn_addr )
 {
-    // use vm_allocate to get a couple of pages in or around a couple certain addresses
-    vm_size_t page_size = 0;
-    kern_return_t kr = KERN_SUCCESS;
-    task_t me = 0;
-    vm_address_t page_addr = 0;
+    unsigned char * data_ptr = (unsigned char *) this_entry_addr;
 
-    kr = host_page_size( mach_host_self( ), &page_size );
+    memcpy( data_ptr, direct_template, sizeof(direct_template) );
 
-    if ( kr != KERN_SUCCESS )
-    {
-        // make an educated guess at 4096 bytes
-        page_size = 4096;
-    }
+    *((vm_address_t *)(data_ptr + direct_branch_offset)) =
+        patch_fn_addr - (this_entry_addr + sizeof(direct_template));
 
-    // cache this one
-    me = mach_task_self( );
-
-    // allocate one page for each jump table
-    // low memory one first...
-    kr = vm_allocate( me, &page_addr, page_size, TRUE );
+    return ( sizeof(direct_template) );
+}
 
-    if ( kr == KERN_SUCCESS )
-    {
-        low_jump_table = page_addr;
-        low_table_size = page_size;
-        low_table_offset = 0;
+// this builds the instrumented version of the branch-to-patch island;
+// the hook record goes in its data block
+static size_t build_instrumented_entry( vm_address_t this_entry_addr,
+                                        vm_address_t data_addr )
+{
+    unsigned char * data_ptr = (unsigned char *) this_entry_addr;
 
-        // on Intel, the 'high' memory jump table doesn't need to be in
-        // high memory, since we can give a full 32-bit address as a
-        // target operand for the jump instruction
+    memcpy( data_ptr, instrumented_template, sizeof(instrumented_template) );
 
-        // I'm not sure if this is supposed to be a hint or not, but we
-        // might as well increment the handed-in location by one page
-        page_addr += page_size;
+    *((vm_address_t *)(data_ptr + data_addr_offset)) = data_addr;
+    *((vm_address_t *)(data_ptr + instrumented_thunk_addr_offset)) =
+        (vm_address_t) &__island_enter_thunk;
 
-        kr = vm_allocate( me, &page_addr, page_size, TRUE );
-        if ( kr == KERN_SUCCESS )
-        {
-            int deallocate = 0;
+    return ( sizeof(instrumented_template) );
+}
 
-            high_jump_table = page_addr;
-            high_table_size = page_size;
-            high_table_offset = 0;
+// If the function starts with at least five bytes of no-ops, returns
+// the length of the whole no-op instructions covering the first five
+// bytes; otherwise zero. Those can be swapped for a jump without
+// moving any real code, and the function carries on from the end of
+// them.
+static size_t nop_sled_size( const unsigned char * fn )
+{
+    size_t size = 0;
+    unsigned int i;
 
-            // set protection on these pages
-            kr = vm_protect( me, high_jump_table, high_table_size,
-                             TRUE, VM_PROT_ALL );
-            if ( kr != KERN_SUCCESS )
-            {
-                deallocate = 1;
-            }
-            else
-            {
-                // set current to maximum
-                kr = vm_protect( me, high_jump_table, high_table_size,
-                                 FALSE, VM_PROT_ALL );
-
-                kr = vm_protect( me, low_jump_table, low_table_size,
-                                 TRUE, VM_PROT_ALL );
-                if ( kr != KERN_SUCCESS )
-                {
-                    deallocate = 1;
-                    LogEmergency( "Unable to set protection on low jump table ! %d (%s)",
-                                  kr, mach_error_string(kr) );
-                }
-                else
-                {
-                    // set current to maximum
-                    kr = vm_protect( me, low_jump_table, low_table_size,
-                                     FALSE, VM_PROT_ALL );
-                }
-            }
+    while ( size < 5 )
+    {
+        for ( i = 0; i < kNopFormCount; i++ )
+        {
+            if ( memcmp( fn + size, nop_forms[i].bytes, nop_forms[i].length ) == 0 )
+                break;
+        }
 
-            if ( deallocate )
-            {
-                // argh -- failed !
-                (void) vm_deallocate( me, low_jump_table, low_table_size );
-                (void) vm_deallocate( me, high_jump_table, high_table_size );
+        if ( i == kNopFormCount )
+            return ( 0 );
 
-                high_jump_table = low_jump_table = 0;
-                high_table_size = low_table_size = 0;
+        size += nop_forms[i].length;
+    }
 
-                LogEmergency( "Unable to set protection on high jump table ! %d (%s)",
-                              kr, mach_error_string(kr) );
-            }
-            else
-            {
-                // deallocate when we exit
-                atexit( free_patch_tables );
-            }
-        }
-        else
-        {
-            // failed to allocate second table, deallocate the first
-            (void) vm_deallocate( me, low_jump_table, low_table_size );
+    return ( size );
+}
 
-            low_jump_table = low_table_size = 0;
+// this builds the jump written over a no-op sled, padded out to the
+// end of the last no-op it covers
+static void build_sled_jump( vm_address_t fn_addr, vm_address_t jump_target,
+                             size_t sled_size, unsigned char new_instr[32] )
+{
+    int offset = (int) (jump_target - (fn_addr + 5));
 
-            LogEmergency( "Unable to allocate low jump table ! %d (%s)",
-                          kr, mach_error_string(kr) );
-        }
-    }
-    else
-    {
-        LogEmergency( "Unable to allocate high jump table ! %d (%s)",
-                      kr, mach_error_string(kr) );
-    }
+    new_instr[0] = 0xE9;
+    memcpy( &new_instr[1], &offset, 4 );
+    memset( &new_instr[5], 0x90, sled_size - 5 );
 }
 
 int __make_writable( void * addr )
@@ -371,10 +338,297 @@ int __make_writable( void * addr )
     return ( good_to_go );
 }
 
+// Patching happens in three steps, so that DPCreatePatchBatch() can
+// do the middle one with every other thread suspended:
+//
+//   __prepare_patch() builds the islands and everything else we'll
+//       need, but doesn't touch the target function.
+//   __commit_patch() writes the jump into the target. This mustn't
+//       allocate memory, log, or take any lock besides the ones we
+//       already hold, since a suspended thread might be holding it.
+//   __finish_patch() records the patch in the registry.
+//
+// All three are called with patch_mutex held.
+
+int __prepare_patch( void * in_fn_addr, void * in_patch_addr, unsigned int options,
+                     int priority, struct pending_patch * pending )
+{
+    // Okay, we need:
+    //
+    // The first instruction(s) from the function we're about to patch.
+    // The address of the re-entry island
+    // The address of the function to patch
+    // The address of the patch function
+    // The address of the patch island
+    //
+
+    unsigned char saved_instr[32];
+    vm_address_t fn_addr = ( vm_address_t ) in_fn_addr;
+    vm_address_t patch_addr = ( vm_address_t ) in_patch_addr;
+    vm_address_t low_entry = 0, high_entry = 0, high_data = 0, reentry = 0;
+    int instrumented = ( (options & (kDPPatchInstrumented | kDPPatchNoRecursion |
+                                     kDPPatchTraced | kDPPatchCallbacks)) != 0 );
+    int direct = ( (options & kDPPatchDirectBranch) != 0 );
+    int kind = code_kind( options );
+    struct hook_record * record = NULL;
+    void * next_island = NULL;
+    size_t saved_size, low_size = 0, high_size = 0, sled_size;
+
+    bzero( pending, sizeof(struct pending_patch) );
+
+    // not much point doing anything else if we can't get write access to patch the function...
+    if ( !__make_writable( in_fn_addr ) )
+        return ( 0 );
+
+    // a function which starts with a no-op sled needs no re-entry
+    // island: the jump just goes over the no-ops, and the original
+    // carries on from the end of them. If it's a direct-branch patch,
+    // it doesn't need a patch island either, since the jump can go
+    // straight to the patch function.
+    sled_size = nop_sled_size( (const unsigned char *) in_fn_addr );
+
+    if ( instrumented )
+        high_size = sizeof(instrumented_template);
+    else if ( ( direct ) && ( sled_size == 0 ) )
+        high_size = sizeof(direct_template);
+    else if ( !direct )
+        high_size = sizeof(patch_template);
+
+    // the patch island comes first, since the jump to it has to be
+    // generated before we know how much of the target it displaces
+    if ( high_size != 0 )
+    {
+        high_entry = __island_alloc_near( fn_addr, high_size, 0, kind );
+        high_data = __island_alloc_near( fn_addr, island_data_size, 0, kIslandData );
+        if ( ( high_entry == 0 ) || ( high_data == 0 ) )
+        {
+            LogError( "No room for a patch island; can't patch %#x", (unsigned) in_fn_addr );
+            return ( 0 );
+        }
+    }
+
+    if ( sled_size != 0 )
+    {
+        DEBUGLOG( "Patching %#x over a %lu-byte no-op sled", (unsigned) in_fn_addr,
+                  (unsigned long) sled_size );
+
+        saved_size = sled_size;
+        build_sled_jump( fn_addr, ( high_entry != 0 ) ? high_entry : patch_addr,
+                         sled_size, pending->patch_bytes );
+    }
+    else if ( __calc_insn_size( in_fn_addr, (void *) high_entry,
+                                pending->patch_bytes, &saved_size ) == 0 )
+    {
+        // calculate size of instructions to save off, and generate
+        // replacement instruction padded with no-ops
+        return ( 0 );
+    }
+
+    // from here on, any failure leaves the islands as unused garbage
+    if ( sled_size == 0 )
+    {
+        low_size = saved_size + sizeof(reentry_jump_template);
+        low_entry = __island_alloc_near( fn_addr, low_size, 0, kind );
+        if ( low_entry == 0 )
+        {
+            LogError( "No room for a re-entry island; can't patch %#x", (unsigned) in_fn_addr );
+            return ( 0 );
+        }
+    }
+
+    if ( instrumented )
+    {
+        // only create the record once we know the patch can go in
+        record = __hook_record_create( in_fn_addr, in_patch_addr, options );
+        if ( record == NULL )
+            return ( 0 );
+    }
+
+    // can't really do this atomically -- we could be reading
+    // twenty-odd bytes here... __commit_patch() checks they haven't
+    // changed before overwriting them
+    memcpy( saved_instr, in_fn_addr, saved_size );
+
+    if ( low_entry != 0 )
+    {
+        // generate reentry island
+        low_size = build_low_entry( low_entry, (unsigned char *) low_entry,
+                                    fn_addr + saved_size, saved_instr, saved_size );
+        reentry = low_entry;
+
+        // call msync() - flushes instruction cache
+        vm_msync( mach_task_self( ), low_entry,
+                  low_size, VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+    }
+    else
+    {
+        // the rest of the sled, then the function proper
+        reentry = fn_addr + saved_size;
+    }
+
+    if ( high_entry != 0 )
+    {
+        // generate patch island, and its data
+        build_island_data( (unsigned char *) high_data, high_entry, patch_addr, reentry );
+
+        if ( instrumented )
+        {
+            high_size = build_instrumented_entry( high_entry, high_data );
+            *((struct hook_record **)(high_data + island_hook_record_offset)) = record;
+        }
+        else if ( direct )
+        {
+            high_size = build_direct_entry( high_entry, patch_addr );
+        }
+        else
+        {
+            high_size = build_high_entry( (unsigned char *) high_entry, high_data );
+        }
+
+        vm_msync( mach_task_self( ), high_entry, 
+                  high_size, VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+    }
+
+    // the patch calls on through its own chain island, which leads to
+    // the re-entry code until another handler is added after it.
+    //
+    // A direct-branch patch never gets another handler, so it doesn't
+    // need one: it calls the re-entry code itself.
+    if ( !direct )
+    {
+        next_island = __create_chain_island( (void *) reentry, options );
+        if ( next_island == NULL )
+            return ( 0 );
+    }
+
+    // a callback hook has no patch function of its own; once the
+    // callbacks have seen the call, it carries on down the chain
+    if ( options & kDPPatchCallbacks )
+    {
+        in_patch_addr = __chain_island_code( next_island );
+        record->patch = in_patch_addr;
+        *((void **)(high_data + island_branch_target_offset)) = in_patch_addr;
+    }
+
+    pending->entry.target           = in_fn_addr;
+    pending->entry.patch            = in_patch_addr;
+    pending->entry.reentry          = (void *) reentry;
+    pending->entry.patch_island     = (void *) high_data;
+    pending->entry.reentry_island   = (void *) low_entry;
+    pending->entry.options          = options;
+    pending->entry.saved_size       = saved_size;
+    pending->entry.record           = record;
+    pending->entry.chain            = __patch_chain_create( in_patch_addr, priority,
+                                                            next_island );
+    memcpy( pending->entry.saved_bytes, saved_instr, saved_size );
+
+    if ( direct )
+        pending->result = pending->entry.reentry;
+    else
+        pending->result = __chain_island_code( next_island );
+
+    // if that failed, the islands are left as unused garbage
+    return ( pending->entry.chain != NULL );
+}
+
+int __commit_patch( struct pending_patch * pending )
+{
+    void * in_fn_addr = pending->entry.target;
+    size_t saved_size = pending->entry.saved_size;
+
+    // Ideally we want to use an atomic operation here.
+
+    // If the data is less than eight bytes in length, then
+    // we can use a 64-bit cmpxchg instruction.
+
+    // Unfortunately, anything more than that can't be done
+    // atomically -- at least, not easily -- so we have to
+    // rely on our mutexes, and hope nothing else (Unsanity,
+    // mach_override) gets in the way during our
+    // operation...
+
+    // Either way, if the instructions we saved have changed since
+    // then, the re-entry island is no good, so we give up.
+
+    if ( saved_size <= 8 )
+    {
+        // we will write eight bytes at once, so fill out
+        // the end of the new instructions as necessary
+        unsigned long long oldVal, newVal;
+        unsigned long long * addr = (unsigned long long *) in_fn_addr;
+
+        do
+        {
+            newVal = oldVal = *addr;
+            if ( memcmp( &oldVal, pending->entry.saved_bytes, saved_size ) != 0 )
+                return ( 0 );
+
+            // newVal now contains the jump padded with
+            // some bytes which aren't to be changed
+            memcpy( &newVal, pending->patch_bytes, saved_size );
+
+            // if this fails, it was the bytes beyond ours which
+            // changed, so just go round again
+
+        } while ( DPAtomicCompareAndSwap64( oldVal, newVal, addr,
+                                            kDPMemoryOrderSequential ) == 0 );
+    }
+    else
+    {
+        if ( memcmp( in_fn_addr, pending->entry.saved_bytes, saved_size ) != 0 )
+            return ( 0 );
+
+        // copy the padded ljmp instruction into the target function...
+        memcpy( in_fn_addr, pending->patch_bytes, saved_size );
+    }
+
+    DPAtomicCodeSync( in_fn_addr );
+
+    pending->committed = 1;
+
+    return ( 1 );
+}
+
+void * __finish_patch( struct pending_patch * pending )
+{
+    if ( !pending->committed )
+        return ( NULL );
+
+    // remember what we did, so it can be undone later
+    if ( __patch_registry_insert( &pending->entry ) == NULL )
+        LogError( "Patch on %#x installed, but won't be removable",
+                  (unsigned) pending->entry.target );
+
+    return ( pending->result );
+}
+
+void * __relocate_pc( const struct pending_patch * pending, void * pc )
+{
+    unsigned char * target = (unsigned char *) pending->entry.target;
+    unsigned char * addr = (unsigned char *) pc;
+
+    // a thread sitting right at the start will just take the jump; one
+    // part-way through the old instructions is moved to the same place
+    // in the copies, which then jump straight back to the original. If
+    // they were only no-ops, there are no copies; it skips past them.
+    if ( ( addr > target ) && ( addr < target + pending->entry.saved_size ) )
+    {
+        if ( pending->entry.reentry_island == NULL )
+            return ( pending->entry.reentry );
+
+        return ( (unsigned char *) pending->entry.reentry_island + (addr - target) );
+    }
+
+    return ( NULL );
+}
+
 // entry point from CreatePatch()
-void * __create_patch( void * in_fn_addr, void * in_patch_addr )
+void * __create_patch( void * in_fn_addr, void * in_patch_addr,
+                       unsigned int options, int priority )
 {
     void * result = NULL;
+    struct patch_entry * existing = NULL;
+    struct pending_patch pending;
 
     if ( !mutex_inited )
         initialize_patch_mutexes( );
@@ -382,183 +636,209 @@ void * __create_patch( void * in_fn_addr, void * in_patch_addr )
     // don't do ANYTHING unless we know we're not infringing on something else
     pthread_mutex_lock( &patch_mutex );
 
-    // not much point doing anything else if we can't get write access to patch the function...
-    if ( !__make_writable( in_fn_addr ) )
+    // if it's already patched, this just becomes another handler in
+    // its chain; the prologue stays exactly as it is
+    existing = __patch_registry_lookup( in_fn_addr );
+    if ( existing != NULL )
     {
-        // multiple return paths - EEUURRRRGHHH !!!
-        pthread_mutex_unlock( &patch_mutex );
-        return ( NULL );
+        if ( options & kDPPatchCallbacks )
+            LogError( "Can't hook %#x; it's already patched", (unsigned) in_fn_addr );
+        else if ( (options & ~existing->options) != 0 )
+            LogError( "Can't add options %#x to the existing patch on %#x",
+                      options & ~existing->options, (unsigned) in_fn_addr );
+        else
+            result = __patch_chain_add( existing, in_patch_addr, priority );
     }
-
-    // allocate memory for jump tables
-    if ( high_jump_table == 0 )	// either both will be allocated, or neither
+    else if ( __prepare_patch( in_fn_addr, in_patch_addr, options, priority, &pending ) )
     {
-        allocate_jump_tables( );
+        if ( __commit_patch( &pending ) )
+            result = __finish_patch( &pending );
+        else
+            LogError( "Function at %#x changed while it was being patched",
+                      (unsigned) in_fn_addr );
     }
 
-    if ( high_jump_table != 0 )
+    pthread_mutex_unlock( &patch_mutex );
+
+    return ( result );
+}
+
+// puts back the bytes saved from the start of a patched function
+static void restore_saved_instructions( void * fn_addr, const unsigned char * saved,
+                                        size_t saved_size )
+{
+    if ( saved_size <= 8 )
     {
-        // Okay, we need:
-        //
-        // The first instruction from the function we're about to patch.
-        // The address of the entry in the low memory jump table
-        // The address of the function to patch
-        // The address of the patch function
-        // The address of the entry in the high memory jump table
-        // The address of the bit of the high jump table entry which refers back to the target fn
-        //
-
-        unsigned char saved_instr[32];
-        unsigned char new_instr[32];
-        vm_address_t fn_addr = ( vm_address_t ) in_fn_addr;
-        vm_address_t patch_addr = ( vm_address_t ) in_patch_addr;
-        vm_address_t low_entry = low_jump_table + low_table_offset;
-        vm_address_t high_entry = high_jump_table + high_table_offset;
-        size_t saved_size, low_size, high_size;
+        // as when installing, swap the whole eight bytes in one go
+        unsigned long long oldVal, newVal;
+        unsigned long long * addr = (unsigned long long *) fn_addr;
 
-        // calculate size of instructions to save off, and generate
-        // replacement instruction padded with no-ops
-        if ( __calc_insn_size( in_fn_addr, (void *) (high_entry + 8),
-                               new_instr, &saved_size ) )
+        do
         {
-            // can't really do this atomically -- we could be reading
-            // twenty-odd bytes here...
-            memcpy( saved_instr, in_fn_addr, saved_size );
+            newVal = oldVal = *addr;
+            memcpy( &newVal, saved, saved_size );
 
-            // generate reentry island
-            low_size = build_low_entry( low_entry, fn_addr + saved_size,
-                                        saved_instr, saved_size );
+        } while ( DPAtomicCompareAndSwap64( oldVal, newVal, addr,
+                                            kDPMemoryOrderSequential ) == 0 );
+    }
+    else
+    {
+        memcpy( fn_addr, saved, saved_size );
+    }
+}
 
-            if ( low_size > 0 )
-            {
-                // generate patch island
-                high_size = build_high_entry( high_entry, low_entry, patch_addr );
-            }
+// entry point from DPRemovePatch() and DPRemovePatchFunction()
+int __remove_patch( void * fn_addr, void * patch_addr )
+{
+    struct patch_entry * entry = NULL;
+    int removed = 0;
 
-	    // ensure we have valid blocks, and that they'll both fit
-	    // into the tables
-            if ( ( (low_size > 0) && (high_size > 0) ) &&
-		 ( ( high_table_offset + high_size ) <= high_table_size ) &&
-		 ( ( low_table_offset + low_size ) <= low_table_size ) )
-            {
-                // Ideally we want to use an atomic operation here, and
-                // one which will allow us to re-save the initial
-                // instruction block should it have changed in the
-                // meantime
-
-                // If the data is less than eight bytes in length, then
-                // we can use a 64-bit cmpxchg instruction.
-
-                // Unfortunately, anything more than that can't be done
-                // atomically -- at least, not easily -- so we have to
-                // rely on our mutexes, and hope nothing else (Unsanity,
-                // mach_override) gets in the way during our
-                // operation...
-
-                if ( saved_size <= 8 )
-                {
-                    // we will write eight bytes at once, so fill out
-                    // the end of new_instr as necessary
-                    unsigned long long oldVal, newVal;
-                    unsigned long long * addr = (unsigned long long *) in_fn_addr;
-
-                    do
-                    {
-                        newVal = oldVal = *addr;
-                        memcpy( &newVal, new_instr, saved_size );
-
-                        // newVal now contains new_instr padded with
-                        // some bytes which aren't to be changed
-                        if ( DPCompareAndSwap64( oldVal, newVal, addr ) == 0 )
-                        {
-                            // it's changed beneath us
-
-                            // recalculate instructions
-                            // *pray* this call doesn't fail. It
-                            // shouldn't ever do that
-                            __calc_insn_size( in_fn_addr, (void *) (high_entry+8),
-                                              new_instr, &saved_size );
-
-                            // re-save instructions
-                            memcpy( saved_instr, in_fn_addr, saved_size );
-
-                            // re-generate reentry island
-                            low_size = build_low_entry( low_entry, fn_addr + saved_size,
-                                saved_instr, saved_size );
-                        }
-                        else
-                        {
-                            // all done
-                            break;
-                        }
-
-                    } while ( saved_size < 8 );
-                }
-
-                // a change might have made the saved instructions get
-                // larger than eight bytes, so we check again here.
-                if ( saved_size > 8 )
-                {
-                    // copy the padded ljmp instruction into the target function...
-                    memcpy( in_fn_addr, new_instr, saved_size );
-                }
-
-                // call msync() on each & update table offsets - flushes instruction cache
-                vm_msync( mach_task_self( ), low_entry,
-                          low_size, VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
-                vm_msync( mach_task_self( ), high_entry, 
-                          high_size, VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
-
-                low_table_offset += low_size;
-                high_table_offset += high_size;
-
-                DPCodeSync( in_fn_addr );
-
-                // set result - addr is address of first *instruction* in the new low addr table entry
-                result = (void *) (low_entry + 8);
-            }
-        }
+    if ( !mutex_inited )
+        initialize_patch_mutexes( );
+
+    pthread_mutex_lock( &patch_mutex );
+
+    entry = __patch_registry_lookup( fn_addr );
+    if ( entry == NULL )
+    {
+        // nothing to do
+    }
+    else if ( ( patch_addr != NULL ) && __patch_chain_remove( entry, patch_addr ) )
+    {
+        // taken out of the chain, others still installed
+        removed = 1;
+    }
+    else if ( ( patch_addr == NULL ) ||
+              ( ( entry->chain->count == 1 ) &&
+                ( entry->chain->handlers[0].patch == patch_addr ) ) )
+    {
+        // send anything already on its way through the patch island
+        // straight to the original code instead
+        if ( entry->patch_island != NULL )
+            *((vm_address_t *)((unsigned char *) entry->patch_island +
+                               island_branch_target_offset)) = 0;
+
+        restore_saved_instructions( fn_addr, entry->saved_bytes, entry->saved_size );
+        DPAtomicCodeSync( fn_addr );
+
+        (void) __patch_registry_remove( fn_addr );
+        removed = 1;
     }
 
     pthread_mutex_unlock( &patch_mutex );
 
-    return ( result );
+    return ( removed );
 }
 
-void DPRemovePatch( void * fn_addr )
+#pragma mark -
+
+// lets the handler chain code make its changes under our mutex
+void __patch_lock( void )
 {
+    if ( !mutex_inited )
+        initialize_patch_mutexes( );
+
     pthread_mutex_lock( &patch_mutex );
+}
 
-    // to get reentry_addr:
-    // 1: Look at first byte of function, if it's 0xE9 it's a jump
-    // 2: Read next four bytes: address of patch branch code
-    // 3: Deduct four bytes from that, read address of reentry code
-    // 4: Advance 19 bytes, read one-byte size of saved instr
-    // 5: Advance one byte, read saved instr
-    // 6: Copy into target function
+void __patch_unlock( void )
+{
+    pthread_mutex_unlock( &patch_mutex );
+}
 
-    // 1
-    if ( *((unsigned char *) fn_addr) == 0xE9 )
-    {
-        size_t size = 0;
-        void * addr = NULL;
-
-        // 2
-        addr = *((void **)(fn_addr + 1));
-        // 3
-        addr = *((void **)(addr - 4));
-        // 4
-        addr += 19;
-        size = (size_t) *((unsigned char *)addr);
-        // 5
-        addr++;
-        // 6
-        memcpy( fn_addr, addr, size );
-
-        DPCodeSync( fn_addr );
-    }
+// build an island for a handler chain -- called with patch_mutex held
+void * __create_chain_island( void * fallback, unsigned int options )
+{
+    // the fallback is normally the re-entry island, so this lands in
+    // the same arenas as the rest of the target's islands
+    vm_address_t island = __island_alloc_near( (vm_address_t) fallback,
+                                               sizeof(patch_template), 0,
+                                               code_kind( options ) );
+    vm_address_t data = __island_alloc_near( (vm_address_t) fallback,
+                                             island_data_size, 0, kIslandData );
+    size_t size = 0;
+
+    if ( ( island == 0 ) || ( data == 0 ) )
+        return ( NULL );
 
-    pthread_mutex_unlock( &patch_mutex );
+    build_island_data( (unsigned char *) data, island, 0, (vm_address_t) fallback );
+    size = build_high_entry( (unsigned char *) island, data );
+
+    vm_msync( mach_task_self( ), island, size,
+              VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+
+    // the chain code only ever deals with the data block
+    return ( (void *) data );
+}
+
+void * __chain_island_code( void * island )
+{
+    return ( *((void **)((unsigned char *) island + island_code_address_offset)) );
+}
+
+#pragma mark -
+
+// Islands for another task are a data block, a patch island and a
+// re-entry island, built side by side in a local buffer; see
+// remote_patch.c. They all go in one executable allocation there: no
+// other thread in that task will be retargeting the patch, so there's
+// nothing to gain from keeping the data apart.
+
+size_t __remote_island_space( void )
+{
+    return ( island_data_size + sizeof(patch_template) + kDPPatchMaxSavedBytes +
+             sizeof(reentry_jump_template) );
+}
+
+size_t __build_remote_patch( vm_address_t island_addr, unsigned char * local,
+                             vm_address_t fn_addr, const unsigned char * fn_bytes,
+                             vm_address_t patch_addr, struct pending_patch * pending )
+{
+    vm_address_t high_data = island_addr;
+    vm_address_t high_entry = high_data + island_data_size;
+    vm_address_t low_entry = high_entry + sizeof(patch_template);
+    unsigned char saved_instr[32];
+    size_t saved_size = 0, size = 0;
+    int offset;
+
+    bzero( pending, sizeof(struct pending_patch) );
+
+    // decode our copy of the remote function's first few bytes; the
+    // jump this generates is relative to the copy, so it's fixed up
+    // below
+    if ( __calc_insn_size( fn_bytes, (void *) high_entry,
+                           pending->patch_bytes, &saved_size ) == 0 )
+        return ( 0 );
+
+    offset = (int) (high_entry - (fn_addr + 5));
+    memcpy( &pending->patch_bytes[1], &offset, 4 );
+
+    memcpy( saved_instr, fn_bytes, saved_size );
+
+    build_island_data( local, high_entry, patch_addr, low_entry );
+    size  = island_data_size;
+    size += build_high_entry( local + size, high_data );
+    size += build_low_entry( low_entry, local + size, fn_addr + saved_size,
+                             saved_instr, saved_size );
+
+    pending->entry.target           = (void *) fn_addr;
+    pending->entry.patch            = (void *) patch_addr;
+    pending->entry.reentry          = (void *) low_entry;
+    pending->entry.patch_island     = (void *) high_data;
+    pending->entry.reentry_island   = (void *) low_entry;
+    pending->entry.saved_size       = saved_size;
+    memcpy( pending->entry.saved_bytes, saved_instr, saved_size );
+
+    pending->result = pending->entry.reentry;
+
+    return ( size );
+}
+
+kern_return_t __allocate_remote_islands( task_t task, vm_size_t size, vm_address_t * addr )
+{
+    // Intel islands are reached with a 32-bit jump, so anywhere will do
+    *addr = 0;
+    return ( vm_allocate( task, addr, size, TRUE ) );
 }
 
 #endif
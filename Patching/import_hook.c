@@ -0,0 +1,501 @@
+/*
+ *  import_hook.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 27/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "Patching.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <mach-o/dyld.h>
+
+// Calls from one image into another don't go straight to the callee;
+// they go through a symbol pointer in the caller's __DATA segment, or
+// on Intel, possibly through a five-byte jump in its __IMPORT,
+// __jump_table section. Both are found through the image's indirect
+// symbol table, so hooking an import just means finding the entries
+// for one symbol and pointing them somewhere else. No code is changed
+// except for jump table entries, and those are already private to the
+// process, since dyld rewrites them itself.
+
+// see ppc_patch.c or ia32_patch.c
+extern int __make_writable( void * addr );
+
+enum
+{
+    kImportSlotPointer      = 0,
+    kImportSlotJump         = 1
+};
+
+#define kJumpStubSize           5
+
+// one hooked symbol pointer or jump stub, kept so it can be put back
+struct import_slot
+{
+    unsigned char *     addr;
+    int                 kind;
+    void *              replacement;
+    unsigned char       saved[kJumpStubSize];   // the old pointer, or the old stub
+};
+
+// what we need from an image's __LINKEDIT segment
+struct image_tables
+{
+    const struct mach_header *  header;
+    intptr_t                    slide;
+    const struct nlist *        symbols;
+    const char *                strings;
+    const uint32_t *            indirect;
+    uint32_t                    nsyms;
+    uint32_t                    nindirect;
+};
+
+static pthread_mutex_t      import_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct import_slot * import_slots = NULL;
+static unsigned int         import_slot_count = 0;
+static unsigned int         import_slot_capacity = 0;
+
+static int remember_slot( unsigned char * addr, int kind, void * replacement,
+                          const void * saved, size_t saved_size )
+{
+    struct import_slot * slot = NULL;
+
+    if ( import_slot_count == import_slot_capacity )
+    {
+        unsigned int capacity = ( import_slot_capacity == 0 ) ? 32 : import_slot_capacity * 2;
+        struct import_slot * slots = (struct import_slot *) realloc( import_slots,
+                                                 capacity * sizeof(struct import_slot) );
+
+        if ( slots == NULL )
+            return ( 0 );
+
+        import_slots = slots;
+        import_slot_capacity = capacity;
+    }
+
+    slot = &import_slots[import_slot_count++];
+    slot->addr = addr;
+    slot->kind = kind;
+    slot->replacement = replacement;
+    memcpy( slot->saved, saved, saved_size );
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+static int load_image_tables( const struct mach_header * header, intptr_t slide,
+                              struct image_tables * tables )
+{
+    const struct load_command * cmd = (const struct load_command *) (header + 1);
+    const struct symtab_command * symtab = NULL;
+    const struct dysymtab_command * dysymtab = NULL;
+    uintptr_t linkedit = 0;
+    uint32_t i;
+
+    bzero( tables, sizeof(struct image_tables) );
+
+    for ( i = 0; i < header->ncmds; i++ )
+    {
+        if ( cmd->cmd == LC_SEGMENT )
+        {
+            const struct segment_command * seg = (const struct segment_command *) cmd;
+
+            // the file offsets in the symbol table commands are
+            // relative to wherever this got mapped
+            if ( strcmp( seg->segname, SEG_LINKEDIT ) == 0 )
+                linkedit = (seg->vmaddr + slide) - seg->fileoff;
+        }
+        else if ( cmd->cmd == LC_SYMTAB )
+        {
+            symtab = (const struct symtab_command *) cmd;
+        }
+        else if ( cmd->cmd == LC_DYSYMTAB )
+        {
+            dysymtab = (const struct dysymtab_command *) cmd;
+        }
+
+        cmd = (const struct load_command *) ((const char *) cmd + cmd->cmdsize);
+    }
+
+    if ( ( linkedit == 0 ) || ( symtab == NULL ) || ( dysymtab == NULL ) ||
+         ( dysymtab->nindirectsyms == 0 ) )
+        return ( 0 );
+
+    tables->header    = header;
+    tables->slide     = slide;
+    tables->symbols   = (const struct nlist *) (linkedit + symtab->symoff);
+    tables->strings   = (const char *) (linkedit + symtab->stroff);
+    tables->indirect  = (const uint32_t *) (linkedit + dysymtab->indirectsymoff);
+    tables->nsyms     = symtab->nsyms;
+    tables->nindirect = dysymtab->nindirectsyms;
+
+    return ( 1 );
+}
+
+// the symbol an indirect table entry refers to, or NULL for local ones
+static const char * indirect_symbol_name( const struct image_tables * tables,
+                                          uint32_t index )
+{
+    uint32_t sym;
+
+    if ( index >= tables->nindirect )
+        return ( NULL );
+
+    sym = tables->indirect[index];
+    if ( ( sym & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS) ) || ( sym >= tables->nsyms ) )
+        return ( NULL );
+
+    return ( tables->strings + tables->symbols[sym].n_un.n_strx );
+}
+
+// Where an unbound import will end up. Lazy pointers start out aimed
+// at the image's own binding stubs, and jump stubs start out as halt
+// instructions; neither is anything a replacement could call.
+static void * resolve_symbol( const char * symbol )
+{
+    void * addr = NULL;
+
+    // dlsym() wants the C name, without the leading underscore
+    if ( symbol[0] == '_' )
+        addr = dlsym( RTLD_DEFAULT, symbol + 1 );
+
+    if ( addr == NULL )
+        addr = dlsym( RTLD_DEFAULT, symbol );
+
+    if ( addr == NULL )
+        LogError( "Unable to resolve imported symbol '%s'", symbol );
+
+    return ( addr );
+}
+
+static int is_in_image( const struct mach_header * header, void * addr )
+{
+    Dl_info info;
+
+    return ( ( dladdr( addr, &info ) != 0 ) && ( info.dli_fbase == (void *) header ) );
+}
+
+static int hook_pointer( const struct image_tables * tables, const char * symbol,
+                         void ** slot, void * replacement, void ** original )
+{
+    void * old_value = NULL;
+    void * target = NULL;
+
+    do
+    {
+        old_value = *slot;
+        if ( old_value == replacement )
+            return ( 0 );
+
+        if ( is_in_image( tables->header, old_value ) )
+            target = resolve_symbol( symbol );
+        else
+            target = old_value;
+
+        if ( target == NULL )
+            return ( 0 );
+
+        // if dyld binds it between our read and the swap, go round again
+
+    } while ( DPAtomicCompareAndSwapPtr( old_value, replacement, slot,
+                                         kDPMemoryOrderSequential ) == 0 );
+
+    if ( !remember_slot( (unsigned char *) slot, kImportSlotPointer, replacement,
+                         &old_value, sizeof(void *) ) )
+        LogError( "Import hook on %#x installed, but won't be removable", (unsigned) slot );
+
+    if ( *original == NULL )
+        *original = target;
+
+    return ( 1 );
+}
+
+#if __i386__
+
+static int hook_jump_stub( const char * symbol, unsigned char * stub, void * replacement,
+                           void ** original )
+{
+    unsigned long long old_value, new_value;
+    unsigned long long * addr = (unsigned long long *) stub;
+    void * target = NULL;
+    int offset;
+
+    do
+    {
+        old_value = new_value = *addr;
+
+        if ( stub[0] == 0xE9 )
+        {
+            memcpy( &offset, stub + 1, 4 );
+            target = (void *) (stub + kJumpStubSize + offset);
+            if ( target == replacement )
+                return ( 0 );
+        }
+        else
+        {
+            target = resolve_symbol( symbol );
+            if ( target == NULL )
+                return ( 0 );
+        }
+
+        // the stub is only five bytes; the rest belongs to the next one
+        offset = (int) ((unsigned char *) replacement - (stub + kJumpStubSize));
+        ((unsigned char *) &new_value)[0] = 0xE9;
+        memcpy( ((unsigned char *) &new_value) + 1, &offset, 4 );
+
+    } while ( DPAtomicCompareAndSwap64( old_value, new_value, addr,
+                                        kDPMemoryOrderSequential ) == 0 );
+
+    DPAtomicCodeSync( stub );
+
+    if ( !remember_slot( stub, kImportSlotJump, replacement, &old_value, kJumpStubSize ) )
+        LogError( "Import hook on %#x installed, but won't be removable", (unsigned) stub );
+
+    if ( *original == NULL )
+        *original = target;
+
+    return ( 1 );
+}
+
+#endif
+
+// hook every reference to the symbol in one image
+static unsigned int hook_image( const struct mach_header * header, intptr_t slide,
+                                const char * symbol, void * replacement, void ** original )
+{
+    const struct load_command * cmd = (const struct load_command *) (header + 1);
+    struct image_tables tables;
+    unsigned int hooked = 0;
+    uint32_t i, j, k;
+
+    if ( !load_image_tables( header, slide, &tables ) )
+        return ( 0 );
+
+    for ( i = 0; i < header->ncmds; i++ )
+    {
+        if ( cmd->cmd == LC_SEGMENT )
+        {
+            const struct segment_command * seg = (const struct segment_command *) cmd;
+            const struct section * sect = (const struct section *) (seg + 1);
+
+            for ( j = 0; j < seg->nsects; j++, sect++ )
+            {
+                unsigned char * base = (unsigned char *) (sect->addr + slide);
+                uint32_t type = sect->flags & SECTION_TYPE;
+                uint32_t stride = 0;
+                int writable = 0;
+
+                if ( ( type == S_LAZY_SYMBOL_POINTERS ) ||
+                     ( type == S_NON_LAZY_SYMBOL_POINTERS ) )
+                {
+                    stride = sizeof(void *);
+                }
+#if __i386__
+                else if ( ( type == S_SYMBOL_STUBS ) &&
+                          ( sect->flags & S_ATTR_SELF_MODIFYING_CODE ) &&
+                          ( sect->reserved2 == kJumpStubSize ) )
+                {
+                    stride = kJumpStubSize;
+                }
+#endif
+
+                if ( stride == 0 )
+                    continue;
+
+                for ( k = 0; k < sect->size / stride; k++ )
+                {
+                    const char * name = indirect_symbol_name( &tables, sect->reserved1 + k );
+
+                    if ( ( name == NULL ) || ( strcmp( name, symbol ) != 0 ) )
+                        continue;
+
+                    // one protection change covers the whole section
+                    if ( !writable )
+                    {
+                        if ( !__make_writable( base ) )
+                            break;
+                        writable = 1;
+                    }
+
+#if __i386__
+                    if ( stride == kJumpStubSize )
+                    {
+                        hooked += hook_jump_stub( symbol, base + (k * stride),
+                                                  replacement, original );
+                        continue;
+                    }
+#endif
+
+                    hooked += hook_pointer( &tables, symbol, (void **) (base + (k * stride)),
+                                            replacement, original );
+                }
+            }
+        }
+
+        cmd = (const struct load_command *) ((const char *) cmd + cmd->cmdsize);
+    }
+
+    return ( hooked );
+}
+
+static int image_matches( const char * image_name, const char * module )
+{
+    const char * leaf = NULL;
+
+    if ( image_name == NULL )
+        return ( 0 );
+
+    if ( module[0] == '/' )
+        return ( strcmp( image_name, module ) == 0 );
+
+    leaf = strrchr( image_name, '/' );
+    leaf = ( leaf != NULL ) ? leaf + 1 : image_name;
+
+    return ( strcmp( leaf, module ) == 0 );
+}
+
+#pragma mark -
+
+unsigned int DPHookImport( const char * symbol, const char * module, void * replacement,
+                           void ** original )
+{
+    const struct mach_header * header = NULL;
+    void * unused = NULL;
+    unsigned int hooked = 0;
+    unsigned long i, count;
+    Dl_info info;
+
+    if ( ( symbol == NULL ) || ( replacement == NULL ) )
+        return ( 0 );
+
+    if ( original == NULL )
+        original = &unused;
+    *original = NULL;
+
+    // the replacement's own calls to the symbol had better still go
+    // to the real thing
+    if ( dladdr( replacement, &info ) == 0 )
+        info.dli_fbase = NULL;
+
+    pthread_mutex_lock( &import_mutex );
+
+    count = _dyld_image_count( );
+    for ( i = 0; i < count; i++ )
+    {
+        header = _dyld_get_image_header( i );
+        if ( header == NULL )
+            continue;
+
+        if ( module != NULL )
+        {
+            if ( !image_matches( _dyld_get_image_name( i ), module ) )
+                continue;
+        }
+        else if ( (void *) header == info.dli_fbase )
+        {
+            continue;
+        }
+
+        hooked += hook_image( header, _dyld_get_image_vmaddr_slide( i ), symbol,
+                              replacement, original );
+    }
+
+    pthread_mutex_unlock( &import_mutex );
+
+    if ( hooked == 0 )
+        DEBUGLOG( "No imports of '%s' found to hook", symbol );
+
+    return ( hooked );
+}
+
+unsigned int DPUnhookImport( void * replacement )
+{
+    unsigned int i = 0, restored = 0;
+
+    pthread_mutex_lock( &import_mutex );
+
+    while ( i < import_slot_count )
+    {
+        struct import_slot * slot = &import_slots[i];
+
+        if ( slot->replacement != replacement )
+        {
+            i++;
+            continue;
+        }
+
+        if ( slot->kind == kImportSlotPointer )
+        {
+            unsigned int old_value;
+
+            memcpy( &old_value, slot->saved, sizeof(old_value) );
+
+            // leave it alone if someone else has changed it since
+            if ( DPAtomicCompareAndSwap32( (unsigned int) replacement, old_value,
+                                           (volatile unsigned int *) slot->addr,
+                                           kDPMemoryOrderSequential ) )
+                restored++;
+        }
+#if __i386__
+        else
+        {
+            unsigned long long current, restored_value;
+            unsigned long long * addr = (unsigned long long *) slot->addr;
+            unsigned char ours[kJumpStubSize];
+            int offset = (int) ((unsigned char *) replacement - (slot->addr + kJumpStubSize));
+            int changed = 0;
+
+            ours[0] = 0xE9;
+            memcpy( &ours[1], &offset, 4 );
+
+            do
+            {
+                current = restored_value = *addr;
+
+                // as above, leave it alone if it's not our jump any more
+                changed = ( memcmp( &current, ours, kJumpStubSize ) != 0 );
+                if ( changed )
+                    break;
+
+                memcpy( &restored_value, slot->saved, kJumpStubSize );
+
+            } while ( DPAtomicCompareAndSwap64( current, restored_value, addr,
+                                                kDPMemoryOrderSequential ) == 0 );
+
+            if ( !changed )
+            {
+                DPAtomicCodeSync( slot->addr );
+                restored++;
+            }
+        }
+#endif
+
+        // order doesn't matter, so fill the hole from the end
+        import_slots[i] = import_slots[--import_slot_count];
+    }
+
+    pthread_mutex_unlock( &import_mutex );
+
+    return ( restored );
+}
@@ -0,0 +1,297 @@
+/*
+ *  island_arena.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 26/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "island_arena.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include <mach/mach.h>
+#include <mach/mach_host.h>
+#include <mach/mach_error.h>
+#include <mach/vm_map.h>
+#include <mach/vm_prot.h>
+#include <mach/vm_region.h>
+#include <mach/machine/vm_param.h>
+
+// how big a new arena is, unless an island needs more
+#define kIslandArenaPages       4
+
+// how many arenas there's room for at first; every patched image needs
+// at least two, so the table doubles whenever it fills up
+#define kInitialIslandArenas    32
+
+// how many times to look for a new gap if another thread takes the
+// one we found before we can allocate it
+#define kIslandArenaRetries     4
+
+// functions which aren't in any image (generated code, say) are
+// grouped into arenas by the block of this size they fall into
+#define kAnonymousModuleSpan    0x01000000
+
+struct island_arena
+{
+    int             kind;
+    vm_address_t    module;     // base of the image it serves
+    vm_address_t    base;
+    vm_size_t       size;
+    vm_size_t       used;
+};
+
+static struct island_arena *    arenas = NULL;
+static unsigned int             arena_count = 0;
+static unsigned int             arena_capacity = 0;
+static vm_size_t            arena_page_size = 0;
+
+static vm_address_t module_for_address( vm_address_t addr )
+{
+    Dl_info info;
+    unsigned int i;
+
+    // an address in one of our own islands belongs to the same image
+    // as the function that island was made for
+    for ( i = 0; i < arena_count; i++ )
+    {
+        if ( ( addr >= arenas[i].base ) && ( addr - arenas[i].base < arenas[i].size ) )
+            return ( arenas[i].module );
+    }
+
+    if ( ( dladdr( (void *) addr, &info ) != 0 ) && ( info.dli_fbase != NULL ) )
+        return ( (vm_address_t) info.dli_fbase );
+
+    return ( addr & ~(kAnonymousModuleSpan - 1) );
+}
+
+static int within_reach( vm_address_t addr, vm_size_t size, vm_address_t target,
+                         vm_size_t reach )
+{
+    if ( reach == 0 )
+        return ( 1 );
+
+    if ( addr >= target )
+        return ( ( addr - target < reach ) && ( size <= reach - (addr - target) ) );
+
+    return ( target - addr <= reach );
+}
+
+static vm_size_t distance( vm_address_t a, vm_address_t b )
+{
+    return ( ( a > b ) ? ( a - b ) : ( b - a ) );
+}
+
+// Walk the regions between target - reach and target + reach, looking
+// for the gap which can hold 'size' bytes closest to the target.
+// vm_region() only searches upwards, so we start from the bottom.
+static vm_address_t find_free_gap( vm_address_t target, vm_size_t size, vm_size_t reach )
+{
+    task_t me = mach_task_self( );
+    vm_address_t lo, hi, addr, best = 0;
+    vm_size_t best_distance = 0;
+
+    // leave page zero alone
+    if ( ( reach == 0 ) || ( target - arena_page_size < reach ) )
+        lo = arena_page_size;
+    else
+        lo = target - reach;
+
+    if ( ( reach == 0 ) || ( VM_MAX_ADDRESS - target < reach ) )
+        hi = VM_MAX_ADDRESS;
+    else
+        hi = target + reach;
+
+    addr = (lo + arena_page_size - 1) & ~(arena_page_size - 1);
+
+    while ( addr < hi )
+    {
+        vm_address_t region_addr = addr;
+        vm_size_t region_size = 0;
+        struct vm_region_basic_info region_info;
+        mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT;
+        memory_object_name_t region_object_name;
+        vm_address_t gap_end, candidate;
+        kern_return_t kr;
+
+        kr = vm_region( me, &region_addr, &region_size, VM_REGION_BASIC_INFO,
+                        (vm_region_info_t) &region_info, &info_count,
+                        &region_object_name );
+
+        if ( kr == KERN_INVALID_ADDRESS )
+            gap_end = hi;                       // nothing else above here
+        else if ( kr != KERN_SUCCESS )
+            break;
+        else
+            gap_end = ( region_addr < hi ) ? region_addr : hi;
+
+        if ( ( gap_end > addr ) && ( gap_end - addr >= size ) )
+        {
+            // the end of the gap nearest the target
+            if ( gap_end <= target )
+                candidate = (gap_end - size) & ~(arena_page_size - 1);
+            else
+                candidate = addr;
+
+            if ( within_reach( candidate, size, target, reach ) &&
+                 ( ( best == 0 ) || ( distance( candidate, target ) < best_distance ) ) )
+            {
+                best = candidate;
+                best_distance = distance( candidate, target );
+            }
+        }
+
+        if ( ( kr != KERN_SUCCESS ) || ( region_addr >= hi ) )
+            break;
+
+        addr = region_addr + region_size;
+        if ( addr < region_addr )
+            break;                              // wrapped at the top
+
+        // anything further up is only going to be further away
+        if ( ( best != 0 ) && ( addr > target ) && ( addr - target >= best_distance ) )
+            break;
+    }
+
+    return ( best );
+}
+
+static struct island_arena * create_arena( int kind, vm_address_t module,
+                                           vm_address_t target, vm_size_t size,
+                                           vm_size_t reach )
+{
+    task_t me = mach_task_self( );
+    struct island_arena * arena = NULL;
+    vm_address_t base = 0;
+    vm_size_t arena_size = kIslandArenaPages * arena_page_size;
+    vm_prot_t prot = ( kind == kIslandData ) ? (VM_PROT_READ | VM_PROT_WRITE) : VM_PROT_ALL;
+    kern_return_t kr = KERN_NO_SPACE;
+    int tries;
+
+    if ( arena_count == arena_capacity )
+    {
+        unsigned int capacity = ( arena_capacity == 0 ) ? kInitialIslandArenas
+                                                        : arena_capacity * 2;
+        struct island_arena * table = (struct island_arena *)
+            realloc( arenas, capacity * sizeof(struct island_arena) );
+
+        if ( table == NULL )
+        {
+            LogError( "Unable to allocate memory for %u patch island arenas; "
+                      "can't make another for %#x", capacity, (unsigned) target );
+            return ( NULL );
+        }
+
+        arenas = table;
+        arena_capacity = capacity;
+    }
+
+    if ( size > arena_size )
+        arena_size = (size + arena_page_size - 1) & ~(arena_page_size - 1);
+
+    // the gap is found with vm_region(), so something on another thread
+    // -- malloc(), say -- can take it before we do; look again if so
+    for ( tries = 0; ( tries < kIslandArenaRetries ) && ( kr == KERN_NO_SPACE ); tries++ )
+    {
+        base = find_free_gap( target, arena_size, reach );
+        if ( base == 0 )
+        {
+            DEBUGLOG( "No free space for patch islands near %#x", (unsigned) target );
+            return ( NULL );
+        }
+
+        // take exactly that address; anywhere else may be out of reach
+        kr = vm_allocate( me, &base, arena_size, FALSE );
+    }
+
+    if ( kr != KERN_SUCCESS )
+    {
+        LogError( "Unable to allocate patch islands at %#x ! %d (%s)",
+                  (unsigned) base, kr, mach_error_string(kr) );
+        return ( NULL );
+    }
+
+    // set maximum protection, then current
+    kr = vm_protect( me, base, arena_size, TRUE, prot );
+    if ( kr == KERN_SUCCESS )
+        kr = vm_protect( me, base, arena_size, FALSE, prot );
+
+    if ( kr != KERN_SUCCESS )
+    {
+        LogEmergency( "Unable to set protection on patch islands ! %d (%s)",
+                      kr, mach_error_string(kr) );
+        (void) vm_deallocate( me, base, arena_size );
+        return ( NULL );
+    }
+
+    arena = &arenas[arena_count++];
+    arena->kind = kind;
+    arena->module = module;
+    arena->base = base;
+    arena->size = arena_size;
+    arena->used = 0;
+
+    DEBUGLOG( "New patch island arena at %#x for image at %#x",
+              (unsigned) base, (unsigned) module );
+
+    return ( arena );
+}
+
+vm_address_t __island_alloc_near( vm_address_t target, vm_size_t size, vm_size_t reach,
+                                  int kind )
+{
+    struct island_arena * arena = NULL;
+    vm_address_t module, result = 0;
+    vm_size_t align = ( kind == kIslandHotCode ) ? kIslandCacheLineSize : 4;
+    unsigned int i;
+
+    if ( arena_page_size == 0 )
+    {
+        if ( host_page_size( mach_host_self( ), &arena_page_size ) != KERN_SUCCESS )
+            arena_page_size = 4096;
+    }
+
+    // hot islands from every image share arenas, to keep them together
+    module = ( kind == kIslandHotCode ) ? 0 : module_for_address( target );
+
+    for ( i = 0; ( i < arena_count ) && ( arena == NULL ); i++ )
+    {
+        if ( ( arenas[i].kind == kind ) && ( arenas[i].module == module ) )
+        {
+            result = arenas[i].base + ((arenas[i].used + align - 1) & ~(align - 1));
+
+            if ( ( result + size <= arenas[i].base + arenas[i].size ) &&
+                 within_reach( result, size, target, reach ) )
+            {
+                arena = &arenas[i];
+            }
+        }
+    }
+
+    if ( arena == NULL )
+    {
+        arena = create_arena( kind, module, target, size, reach );
+        if ( arena == NULL )
+            return ( 0 );
+
+        // new arenas are page-aligned, which is aligned enough
+        result = arena->base;
+    }
+
+    arena->used = (result - arena->base) + size;
+
+    return ( result );
+}
@@ -0,0 +1,95 @@
+/*
+ *  island_arena.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 26/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_ISLAND_ARENA_H__
+#define __DP_ISLAND_ARENA_H__
+
+#include <sys/cdefs.h>
+#include <mach/mach_types.h>
+
+/*!
+ @header Island Arenas
+ @discussion Internal allocator for patch islands. Rather than a single
+         fixed page of islands for the whole process, islands are
+         carved out of arenas: a few pages of executable memory at a
+         time, each placed in the nearest free gap in the address space
+         to the image containing the functions it serves. Every image
+         which gets patched has its own arenas.
+
+         Keeping islands close to their targets means a PowerPC patch
+         can usually branch to its island with an ordinary relative
+         branch, rather than needing the island in the few megabytes a
+         branch absolute can reach, and it keeps each image's islands
+         together in memory.
+
+         Code and data are kept apart. Data words, which are written
+         whenever a patch is retargeted, go in arenas of their own, so
+         a store to one never lands in a cache line holding code. The
+         code of islands for hot patches goes into arenas shared by all
+         hot patches, with each island starting a new cache line.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+/*!
+ @enum Island kinds
+ @constant kIslandCode Code for an ordinary patch; packed in with the
+        other islands for the same image.
+ @constant kIslandHotCode Code for a patch expected to be called very
+        often; aligned to a cache line, and packed in with other hot
+        islands from any image.
+ @constant kIslandData Data words read by island code. These arenas
+        aren't executable.
+ */
+enum
+{
+    kIslandCode         = 0,
+    kIslandHotCode      = 1,
+    kIslandData         = 2
+};
+
+/*!
+ @defined kIslandCacheLineSize
+ @abstract The alignment given to hot island code.
+ */
+#define kIslandCacheLineSize        64
+
+/*!
+ @function __island_alloc_near
+ @abstract Find room for an island close to a function.
+ @discussion Space is never freed; islands of removed patches may still
+         have threads running through them. Must be called with the
+         architecture's patch mutex held.
+ @param target The function the island is for, or an address within
+        another of that function's islands.
+ @param size The number of bytes needed.
+ @param reach How far the whole island may be from the target, in
+        either direction; zero if it can go anywhere, in which case the
+        nearest space is still preferred.
+ @param kind What the space will hold: one of the
+        @link //apple_ref/c/tag/Island_kinds island kinds @/link.
+ @result The address of the space, or zero if none could be found.
+ */
+vm_address_t __island_alloc_near( vm_address_t target, vm_size_t size, vm_size_t reach,
+                                  int kind );
+
+__END_DECLS
+
+#endif  /* __DP_ISLAND_ARENA_H__ */
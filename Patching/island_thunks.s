@@ -0,0 +1,71 @@
+/*
+ *  island_thunks.s
+ *  DynamicPatch
+ *
+ *  Created by jim on 14/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+// These two routines sit between an instrumented patch island and the
+// C code in hook_frames.c. The island itself is kept as small as the
+// standard one: it loads the address of its data block into %edx and jumps to the
+// enter thunk. The enter thunk asks __hook_enter() where to go (and
+// lets it replace the caller's return address with the exit thunk);
+// the exit thunk asks __hook_exit() where the hooked call was really
+// supposed to return to. Neither thunk touches the x87 stack, so
+// floating-point return values pass through untouched.
+//
+// There's no unwind information for the exit thunk: the real return
+// address is in the hook frame stack, not anywhere DWARF can describe.
+// An exception thrown past it can't be unwound, which is why the
+// options which install it are documented as unsafe for such code.
+
+#if defined(__i386__)
+
+    .text
+    .align 4
+
+#;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+#; entered via jmp from an island, %edx <- address of island data
+#; stack on entry: 0(%esp) = caller's return address
+    .globl ___island_enter_thunk
+___island_enter_thunk:
+    pushl       %ecx            #; preserve ecx
+    pushl       %edx            #; preserve island address
+    leal        8(%esp),%eax    #; eax <- address of caller's return address
+    subl        $12,%esp        #; keep the stack 16-byte aligned for the call
+    pushl       %eax            #; arg 2: return address slot
+    pushl       %edx            #; arg 1: island address
+    call        ___hook_enter   #; eax <- address to branch to
+    addl        $20,%esp        #; pop arguments & padding
+    popl        %edx            #; restore island address
+    popl        %ecx            #; restore ecx
+    jmp         *%eax           #; on to the patch (or the fallback)
+
+#;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+#; 'returned' to from a hooked call whose return address was swapped
+    .globl ___island_exit_thunk
+___island_exit_thunk:
+    pushl       %eax            #; preserve return value (low word)
+    pushl       %edx            #; preserve return value (high word)
+    leal        8(%esp),%ecx    #; ecx <- stack pointer as the callee left it
+    subl        $4,%esp         #; keep the stack 16-byte aligned for the call
+    pushl       %ecx            #; arg 1: stack pointer after return
+    call        ___hook_exit    #; eax <- real return address
+    addl        $8,%esp         #; pop argument & padding
+    movl        %eax,%ecx       #; ecx is free across a return
+    popl        %edx            #; restore return value (high word)
+    popl        %eax            #; restore return value (low word)
+    jmp         *%ecx           #; back to the original caller
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ *  patch_chain.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 18/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "patch_registry.h"
+#include "hook_frames.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A patched function only ever has its prologue rewritten once. Every
+// patch function installed on it gets a place in the target's handler
+// chain, and its own little branch island through which it calls the
+// 'original' function. That island's branch target is really the next
+// handler in the chain; for the last handler it's left at zero, which
+// sends it through its fallback address to the re-entry island.
+//
+//   target --> patch island --> handler[0]
+//                                  |
+//                               next island[0] --> handler[1]
+//                                                     |
+//                                                  next island[1] --> (zero)
+//                                                                       |
+//                                                                   re-entry
+//
+// All the code here does is keep the chain sorted and store the right
+// addresses into those islands. Each store is a single aligned word,
+// and the islands are rewired from the end of the chain towards the
+// start, so a new handler is fully wired before anything can branch to
+// it, and a removed one still leads somewhere sensible for any thread
+// already inside it.
+
+static unsigned int     handler_sequence = 0;
+
+static struct patch_chain * allocate_chain( unsigned int count )
+{
+    return ( (struct patch_chain *) calloc( 1, sizeof(struct patch_chain) +
+             ((count - 1) * sizeof(struct patch_handler)) ) );
+}
+
+static void publish_pointer( void * volatile * addr, void * value )
+{
+    void * oldVal;
+
+    do
+    {
+        oldVal = *addr;
+
+    } while ( DPAtomicCompareAndSwapPtr( oldVal, value, addr, kDPMemoryOrderRelease ) == 0 );
+}
+
+static void set_island_target( void * island, void * target )
+{
+    publish_pointer( (void * volatile *) ((unsigned char *) island +
+                                          island_branch_target_offset),
+                     target );
+}
+
+static void rewire_chain( struct patch_entry * entry, struct patch_chain * chain )
+{
+    int i;
+
+    for ( i = (int) chain->count - 1; i >= 0; i-- )
+    {
+        void * next = NULL;
+
+        if ( (unsigned int) (i + 1) < chain->count )
+            next = chain->handlers[i + 1].patch;
+
+        set_island_target( chain->handlers[i].next_island, next );
+    }
+
+    // a disabled patch stays disabled until someone turns it back on
+    if ( !entry->disabled )
+        set_island_target( entry->patch_island, chain->handlers[0].patch );
+
+    // publish the new chain last; readers only use it for introspection
+    publish_pointer( (void * volatile *) &entry->chain, chain );
+}
+
+// does handler a run before handler b?
+static int handler_precedes( const struct patch_handler * a, const struct patch_handler * b )
+{
+    if ( a->priority != b->priority )
+        return ( a->priority > b->priority );
+
+    return ( a->sequence > b->sequence );
+}
+
+#pragma mark -
+
+struct patch_chain * __patch_chain_create( void * patch, int priority, void * next_island )
+{
+    struct patch_chain * chain = allocate_chain( 1 );
+
+    if ( chain != NULL )
+    {
+        chain->count = 1;
+        chain->handlers[0].patch = patch;
+        chain->handlers[0].priority = priority;
+        chain->handlers[0].sequence = ++handler_sequence;
+        chain->handlers[0].next_island = next_island;
+    }
+
+    return ( chain );
+}
+
+void * __patch_chain_add( struct patch_entry * entry, void * patch, int priority )
+{
+    struct patch_chain * old_chain = entry->chain;
+    struct patch_chain * new_chain = NULL;
+    struct patch_handler handler;
+    unsigned int i, j;
+
+    if ( entry->options & kDPPatchDirectBranch )
+    {
+        LogError( "Can't add handlers to the direct-branch patch on %#x",
+                  (unsigned) entry->target );
+        return ( NULL );
+    }
+
+    for ( i = 0; i < old_chain->count; i++ )
+    {
+        if ( old_chain->handlers[i].patch == patch )
+        {
+            LogError( "Patch function %#x is already installed on %#x",
+                      (unsigned) patch, (unsigned) entry->target );
+            return ( NULL );
+        }
+    }
+
+    handler.patch = patch;
+    handler.priority = priority;
+    handler.sequence = ++handler_sequence;
+    handler.next_island = __create_chain_island( entry->reentry, entry->options );
+
+    if ( handler.next_island == NULL )
+    {
+        LogError( "No room for another handler on %#x", (unsigned) entry->target );
+        return ( NULL );
+    }
+
+    new_chain = allocate_chain( old_chain->count + 1 );
+    if ( new_chain == NULL )
+    {
+        // the island gets left as garbage, as with any other failure
+        LogError( "Unable to allocate handler chain for %#x", (unsigned) entry->target );
+        return ( NULL );
+    }
+
+    // merge the new handler into its place
+    for ( i = 0, j = 0; i < old_chain->count; i++ )
+    {
+        if ( ( j == i ) && handler_precedes( &handler, &old_chain->handlers[i] ) )
+            new_chain->handlers[j++] = handler;
+
+        new_chain->handlers[j++] = old_chain->handlers[i];
+    }
+    if ( j == i )
+        new_chain->handlers[j++] = handler;
+
+    new_chain->count = j;
+
+    rewire_chain( entry, new_chain );
+
+    // old chains are leaked, like registry tables, since we can't tell
+    // when a reader has finished with one
+
+    return ( __chain_island_code( handler.next_island ) );
+}
+
+int __patch_chain_remove( struct patch_entry * entry, void * patch )
+{
+    struct patch_chain * old_chain = entry->chain;
+    struct patch_chain * new_chain = NULL;
+    unsigned int i, j;
+    int found = 0;
+
+    if ( old_chain->count < 2 )
+        return ( 0 );
+
+    new_chain = allocate_chain( old_chain->count - 1 );
+    if ( new_chain == NULL )
+    {
+        LogError( "Unable to allocate handler chain for %#x", (unsigned) entry->target );
+        return ( 0 );
+    }
+
+    for ( i = 0, j = 0; i < old_chain->count; i++ )
+    {
+        if ( old_chain->handlers[i].patch == patch )
+            found = 1;
+        else if ( j < old_chain->count - 1 )
+            new_chain->handlers[j++] = old_chain->handlers[i];
+    }
+
+    if ( !found )
+    {
+        free( new_chain );
+        return ( 0 );
+    }
+
+    new_chain->count = j;
+
+    // the removed handler's own island is left pointing where it did,
+    // so a thread still inside it carries on down the chain as normal
+    rewire_chain( entry, new_chain );
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+void * DPReplacePatchFunction( void * fn_addr, void * old_patch, void * new_patch )
+{
+    struct patch_entry * entry = NULL;
+    struct patch_chain * old_chain = NULL;
+    struct patch_chain * new_chain = NULL;
+    void * result = NULL;
+    unsigned int i, index;
+
+    if ( ( fn_addr == NULL ) || ( old_patch == NULL ) || ( new_patch == NULL ) )
+    {
+        LogError( "NULL values supplied to DPReplacePatchFunction() !" );
+        return ( NULL );
+    }
+
+    __patch_lock( );
+
+    entry = __patch_registry_lookup( fn_addr );
+    if ( entry == NULL )
+    {
+        LogError( "DPReplacePatchFunction(): no patch installed on %#x",
+                  (unsigned) fn_addr );
+        __patch_unlock( );
+        return ( NULL );
+    }
+
+    if ( entry->options & kDPPatchDirectBranch )
+    {
+        LogError( "DPReplacePatchFunction(): the patch on %#x is a direct branch",
+                  (unsigned) fn_addr );
+        __patch_unlock( );
+        return ( NULL );
+    }
+
+    old_chain = entry->chain;
+    index = old_chain->count;
+
+    for ( i = 0; i < old_chain->count; i++ )
+    {
+        if ( old_chain->handlers[i].patch == new_patch )
+        {
+            LogError( "Patch function %#x is already installed on %#x",
+                      (unsigned) new_patch, (unsigned) fn_addr );
+            __patch_unlock( );
+            return ( NULL );
+        }
+
+        if ( old_chain->handlers[i].patch == old_patch )
+            index = i;
+    }
+
+    if ( index == old_chain->count )
+    {
+        LogError( "DPReplacePatchFunction(): patch %#x not installed on %#x",
+                  (unsigned) old_patch, (unsigned) fn_addr );
+    }
+    else if ( ( new_chain = allocate_chain( old_chain->count ) ) == NULL )
+    {
+        LogError( "Unable to allocate handler chain for %#x", (unsigned) fn_addr );
+    }
+    else
+    {
+        memcpy( new_chain, old_chain, sizeof(struct patch_chain) +
+                ((old_chain->count - 1) * sizeof(struct patch_handler)) );
+        new_chain->handlers[index].patch = new_patch;
+
+        // this is the only store that changes behaviour: whichever
+        // island led to the old handler now leads to the new one, and
+        // the new one calls on through the old one's island
+        if ( index > 0 )
+            set_island_target( old_chain->handlers[index - 1].next_island, new_patch );
+        else if ( !entry->disabled )
+            set_island_target( entry->patch_island, new_patch );
+
+        publish_pointer( (void * volatile *) &entry->chain, new_chain );
+
+        result = __chain_island_code( new_chain->handlers[index].next_island );
+    }
+
+    __patch_unlock( );
+
+    return ( result );
+}
+
+int DPSetPatchEnabled( void * fn_addr, int enabled )
+{
+    struct patch_entry * entry = NULL;
+    int result = 0;
+
+    __patch_lock( );
+
+    entry = __patch_registry_lookup( fn_addr );
+    if ( ( entry != NULL ) && ( entry->options & kDPPatchDirectBranch ) )
+    {
+        LogError( "DPSetPatchEnabled(): the patch on %#x is a direct branch",
+                  (unsigned) fn_addr );
+    }
+    else if ( entry != NULL )
+    {
+        entry->disabled = ( enabled ? 0 : 1 );
+        if ( entry->control != NULL )
+            entry->control->enabled = ( enabled ? 1 : 0 );
+
+        // with a zero branch target, the patch island goes straight to
+        // its error handler -- the original code
+        set_island_target( entry->patch_island,
+                           enabled ? entry->chain->handlers[0].patch : NULL );
+
+        result = 1;
+    }
+    else
+    {
+        LogError( "DPSetPatchEnabled(): no patch installed on %#x", (unsigned) fn_addr );
+    }
+
+    __patch_unlock( );
+
+    return ( result );
+}
@@ -0,0 +1,401 @@
+/*
+ *  patch_registry.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 17/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "patch_registry.h"
+#include "control_plane.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+// The registry is an open-addressed hash table with linear probing,
+// keyed on the target address. Readers never lock: they load the
+// current table pointer and probe until they hit an empty slot.
+// Writers are serialized by a mutex, and only ever change the table
+// by atomically storing a single slot (or the table pointer itself),
+// so a reader always sees either the old or the new value.
+//
+// Removed entries leave a tombstone behind so probe sequences aren't
+// broken. When the table gets too full it's rebuilt into a new one,
+// and the new table is published in one store. The old table is
+// leaked, since there's no way of knowing when every reader has
+// finished with it; tables are small, and this happens rarely.
+
+#define kInitialRegistryCapacity    64
+
+struct registry_table
+{
+    unsigned int                    capacity;   // always a power of two
+    unsigned int                    used;       // entries + tombstones
+    unsigned int                    live;       // entries only
+    struct patch_entry * volatile   slots[1];
+};
+
+static struct registry_table * volatile registry = NULL;
+
+static pthread_mutex_t  registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// marks a slot whose entry has been removed
+static struct patch_entry   tombstone_entry;
+#define kTombstone          (&tombstone_entry)
+
+static unsigned int hash_target( void * target, unsigned int capacity )
+{
+    // function addresses are at least four-byte aligned on PowerPC,
+    // and frequently sixteen-byte aligned on Intel, so throw away the
+    // low bits then scramble with Knuth's multiplicative constant
+    unsigned int value = ((unsigned int) target) >> 2;
+
+    return ( (value * 2654435761U) & (capacity - 1) );
+}
+
+static struct registry_table * allocate_table( unsigned int capacity )
+{
+    struct registry_table * table = NULL;
+
+    table = (struct registry_table *) calloc( 1, sizeof(struct registry_table) +
+        ((capacity - 1) * sizeof(struct patch_entry *)) );
+
+    if ( table != NULL )
+        table->capacity = capacity;
+
+    return ( table );
+}
+
+// publish a pointer; the release order makes sure whatever it points
+// at is visible first
+static void publish_pointer( void * volatile * addr, void * value )
+{
+    void * oldVal;
+
+    do
+    {
+        oldVal = *addr;
+
+    } while ( DPAtomicCompareAndSwapPtr( oldVal, value, addr, kDPMemoryOrderRelease ) == 0 );
+}
+
+// called with registry_mutex held. Returns the index of the target's
+// slot, or of the slot where it should be inserted.
+static unsigned int find_slot( struct registry_table * table, void * target, int * found )
+{
+    unsigned int index = hash_target( target, table->capacity );
+    unsigned int first_free = table->capacity;
+    unsigned int i;
+
+    *found = 0;
+
+    for ( i = 0; i < table->capacity; i++ )
+    {
+        struct patch_entry * entry = table->slots[index];
+
+        if ( entry == NULL )
+            break;
+
+        if ( entry == kTombstone )
+        {
+            if ( first_free == table->capacity )
+                first_free = index;
+        }
+        else if ( entry->target == target )
+        {
+            *found = 1;
+            return ( index );
+        }
+
+        index = (index + 1) & (table->capacity - 1);
+    }
+
+    if ( first_free != table->capacity )
+        return ( first_free );
+
+    return ( index );
+}
+
+// called with registry_mutex held
+static int grow_table_if_needed( void )
+{
+    struct registry_table * table = registry;
+    struct registry_table * new_table = NULL;
+    unsigned int capacity;
+    unsigned int i;
+
+    if ( table == NULL )
+    {
+        table = allocate_table( kInitialRegistryCapacity );
+        if ( table == NULL )
+            return ( 0 );
+
+        publish_pointer( (void * volatile *) &registry, table );
+        return ( 1 );
+    }
+
+    // keep the load factor at or below 3/4, counting tombstones
+    if ( ( (table->used + 1) * 4 ) <= ( table->capacity * 3 ) )
+        return ( 1 );
+
+    // if it's mostly tombstones, a rebuild at the same size will do
+    capacity = table->capacity;
+    if ( ( (table->live + 1) * 2 ) > capacity )
+        capacity *= 2;
+
+    new_table = allocate_table( capacity );
+    if ( new_table == NULL )
+        return ( 0 );
+
+    for ( i = 0; i < table->capacity; i++ )
+    {
+        struct patch_entry * entry = table->slots[i];
+
+        if ( ( entry != NULL ) && ( entry != kTombstone ) )
+        {
+            unsigned int index = hash_target( entry->target, capacity );
+
+            while ( new_table->slots[index] != NULL )
+                index = (index + 1) & (capacity - 1);
+
+            new_table->slots[index] = entry;
+            new_table->used++;
+            new_table->live++;
+        }
+    }
+
+    publish_pointer( (void * volatile *) &registry, new_table );
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+struct patch_entry * __patch_registry_insert( const struct patch_entry * proto )
+{
+    struct patch_entry * entry = NULL;
+    struct registry_table * table = NULL;
+    Dl_info image_info;
+    unsigned int index;
+    int found = 0;
+
+    entry = (struct patch_entry *) malloc( sizeof(struct patch_entry) );
+    if ( entry == NULL )
+    {
+        LogError( "Unable to allocate registry entry for patch on %#x",
+                  (unsigned) proto->target );
+        return ( NULL );
+    }
+
+    memcpy( entry, proto, sizeof(struct patch_entry) );
+    entry->owner = NULL;
+    entry->control = NULL;
+
+    if ( ( dladdr( proto->patch, &image_info ) != 0 ) &&
+         ( image_info.dli_fname != NULL ) )
+    {
+        entry->owner = strdup( image_info.dli_fname );
+    }
+
+    pthread_mutex_lock( &registry_mutex );
+
+    if ( grow_table_if_needed( ) )
+    {
+        table = registry;
+        index = find_slot( table, entry->target, &found );
+
+        if ( !found )
+        {
+            if ( table->slots[index] == NULL )
+                table->used++;
+            table->live++;
+
+            publish_pointer( (void * volatile *) &table->slots[index], entry );
+        }
+    }
+    else
+    {
+        LogError( "Unable to grow patch registry" );
+    }
+
+    if ( found || ( table == NULL ) )
+    {
+        if ( found )
+            LogError( "Patch registry already has an entry for %#x",
+                      (unsigned) entry->target );
+
+        free( entry->owner );
+        free( entry );
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+
+    if ( entry != NULL )
+        __control_attach_entry( entry );
+
+    return ( entry );
+}
+
+struct patch_entry * __patch_registry_lookup( void * target )
+{
+    struct registry_table * table = registry;
+    unsigned int index, i;
+
+    if ( table == NULL )
+        return ( NULL );
+
+    index = hash_target( target, table->capacity );
+
+    for ( i = 0; i < table->capacity; i++ )
+    {
+        struct patch_entry * entry = table->slots[index];
+
+        if ( entry == NULL )
+            break;
+
+        if ( ( entry != kTombstone ) && ( entry->target == target ) )
+            return ( entry );
+
+        index = (index + 1) & (table->capacity - 1);
+    }
+
+    return ( NULL );
+}
+
+struct patch_entry * __patch_registry_remove( void * target )
+{
+    struct patch_entry * entry = NULL;
+    struct registry_table * table = NULL;
+    unsigned int index;
+    int found = 0;
+
+    pthread_mutex_lock( &registry_mutex );
+
+    table = registry;
+    if ( table != NULL )
+    {
+        index = find_slot( table, target, &found );
+
+        if ( found )
+        {
+            entry = table->slots[index];
+
+            publish_pointer( (void * volatile *) &table->slots[index], kTombstone );
+            table->live--;
+        }
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+
+    if ( entry != NULL )
+        __control_detach_entry( entry );
+
+    return ( entry );
+}
+
+unsigned int __patch_registry_enumerate( patch_registry_callback callback, void * info )
+{
+    struct registry_table * table = registry;
+    unsigned int count = 0;
+    unsigned int i;
+
+    if ( table == NULL )
+        return ( 0 );
+
+    for ( i = 0; i < table->capacity; i++ )
+    {
+        struct patch_entry * entry = table->slots[i];
+
+        if ( ( entry != NULL ) && ( entry != kTombstone ) )
+        {
+            callback( entry, info );
+            count++;
+        }
+    }
+
+    return ( count );
+}
+
+#pragma mark -
+
+static void fill_patch_info( struct patch_entry * entry, DPPatchInfo * info )
+{
+    info->target            = entry->target;
+    info->patch             = entry->patch;
+    info->reentry           = entry->reentry;
+    info->patch_island      = entry->patch_island;
+    info->reentry_island    = entry->reentry_island;
+    info->options           = entry->options;
+    info->owner             = entry->owner;
+    info->handler_count     = entry->chain->count;
+    info->enabled           = ( entry->disabled == 0 );
+    info->saved_size        = entry->saved_size;
+
+    memcpy( info->saved_bytes, entry->saved_bytes, kDPPatchMaxSavedBytes );
+}
+
+int DPGetPatchInfo( void * fn_addr, DPPatchInfo * info )
+{
+    struct patch_entry * entry = NULL;
+
+    if ( ( fn_addr == NULL ) || ( info == NULL ) )
+    {
+        LogError( "NULL values supplied to DPGetPatchInfo() ! fn_addr = %#x, info = %#x",
+                  (unsigned) fn_addr, (unsigned) info );
+        return ( 0 );
+    }
+
+    entry = __patch_registry_lookup( fn_addr );
+    if ( entry == NULL )
+        return ( 0 );
+
+    fill_patch_info( entry, info );
+
+    return ( 1 );
+}
+
+struct enumerate_context
+{
+    DPPatchInfoCallback     callback;
+    void *                  info;
+};
+
+static void enumerate_one_patch( struct patch_entry * entry, void * ctx )
+{
+    struct enumerate_context * context = (struct enumerate_context *) ctx;
+    DPPatchInfo info;
+
+    fill_patch_info( entry, &info );
+    context->callback( &info, context->info );
+}
+
+unsigned int DPEnumeratePatches( DPPatchInfoCallback callback, void * info )
+{
+    struct enumerate_context context;
+
+    if ( callback == NULL )
+    {
+        LogError( "NULL callback supplied to DPEnumeratePatches()" );
+        return ( 0 );
+    }
+
+    context.callback = callback;
+    context.info = info;
+
+    return ( __patch_registry_enumerate( enumerate_one_patch, &context ) );
+}
@@ -0,0 +1,416 @@
+/*
+ *  patch_registry.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 17/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_PATCH_REGISTRY_H__
+#define __DP_PATCH_REGISTRY_H__
+
+#include <sys/cdefs.h>
+#include <mach/mach_types.h>
+
+#include "Patching.h"
+
+/*!
+ @header Patch Registry
+ @discussion Internal record of every patch installed in this process,
+         keyed by the address of the patched function. The patching
+         code for each architecture adds an entry once a patch is in
+         place, and looks it up again to remove it, so nothing needs to
+         decode the patched function's instructions to find its
+         islands.
+
+         Lookups don't take any locks, and can be made from any thread
+         at any time. Changes are serialized internally. Entries are
+         never freed, so a pointer returned from a lookup remains valid
+         for the lifetime of the process.
+ @copyright 2004-2006 Jim Dovey. Some Rights Reserved.
+ @author Jim Dovey
+ */
+
+__BEGIN_DECLS
+
+struct hook_record;
+
+/*!
+ @struct patch_handler
+ @abstract One patch function in a target's handler chain.
+ @field patch The patch function.
+ @field priority Its priority; higher priorities are called first.
+ @field sequence Installation order, used to break ties: of two
+        handlers with the same priority, the newer is called first.
+ @field next_island An island whose branch target is the next handler
+        in the chain, or zero for the original function. The patch
+        function calls on through this.
+ */
+struct patch_handler
+{
+    void *          patch;
+    int             priority;
+    unsigned int    sequence;
+    void *          next_island;
+};
+
+/*!
+ @struct patch_chain
+ @abstract An ordered list of handlers for one target.
+ @discussion Chains are never modified once published. Adding or
+         removing a handler builds a new chain, rewires the islands
+         to match, and swaps the entry's chain pointer; the old chain
+         is left alone for anyone still reading it.
+ @field count The number of handlers.
+ @field handlers The handlers, outermost first.
+ */
+struct patch_chain
+{
+    unsigned int            count;
+    struct patch_handler    handlers[1];
+};
+
+/*!
+ @struct patch_entry
+ @abstract Everything we know about one installed patch.
+ @field target The patched function.
+ @field patch The first patch function installed on the target.
+ @field reentry The first instruction of the re-entry island, which runs
+        the original implementation.
+ @field patch_island The start of the branch-to-patch island. On
+        Intel, this is the island's data block, which holds the branch
+        target; the code is elsewhere. NULL for a direct-branch patch
+        written over a no-op sled, which jumps straight to the patch.
+ @field reentry_island The start of the re-entry island, or NULL if the
+        patch was written over a no-op sled, in which case
+        @link reentry reentry @/link points into the target itself.
+ @field options The options the patch was created with.
+ @field saved_size The number of bytes copied out of the target.
+ @field saved_bytes The bytes overwritten in the target.
+ @field owner The path of the image containing the patch function, or
+        NULL if it couldn't be determined.
+ @field record The hook record, for instrumented or guarded patches.
+ @field chain The handlers installed on this target, in the order
+        they're called.
+ @field disabled Nonzero if the patch island has been switched off, so
+        that calls go straight to the original implementation.
+ @field control The patch's slot in the control segment, or NULL if the
+        segment hasn't been opened.
+ */
+struct patch_entry
+{
+    void *                  target;
+    void *                  patch;
+    void *                  reentry;
+    void *                  patch_island;
+    void *                  reentry_island;
+    unsigned int            options;
+    unsigned int            saved_size;
+    unsigned char           saved_bytes[kDPPatchMaxSavedBytes];
+    char *                  owner;
+    struct hook_record *    record;
+    struct patch_chain * volatile chain;
+    volatile unsigned int   disabled;
+    DPControlSlot *         control;
+};
+
+/*!
+ @struct pending_patch
+ @abstract A patch which has been prepared, but maybe not committed.
+ @field entry The registry entry which will describe the patch.
+ @field patch_bytes The instructions to write into the target.
+ @field result The address to hand back to the caller.
+ @field committed Nonzero once the target has been modified.
+ */
+struct pending_patch
+{
+    struct patch_entry      entry;
+    unsigned char           patch_bytes[kDPPatchMaxSavedBytes];
+    void *                  result;
+    int                     committed;
+};
+
+/*!
+ @function __patch_registry_insert
+ @abstract Record a newly-installed patch.
+ @discussion The entry is copied, and the owning image is looked up from
+         the patch function address. A target can only have one entry;
+         further patches on the same function are added to its
+         handler chain instead.
+ @param proto The details of the new patch.
+ @result The registered copy of the entry, or NULL if no memory was
+         available or the target already had an entry.
+ */
+struct patch_entry * __patch_registry_insert( const struct patch_entry * proto );
+
+/*!
+ @function __patch_registry_lookup
+ @abstract Find the patch on a function.
+ @param target The address of the patched function.
+ @result The entry for the patch, or NULL if the function isn't patched.
+ */
+struct patch_entry * __patch_registry_lookup( void * target );
+
+/*!
+ @function __patch_registry_remove
+ @abstract Forget the patch on a function.
+ @param target The address of the patched function.
+ @result The entry which was removed, or NULL if there wasn't one.
+ */
+struct patch_entry * __patch_registry_remove( void * target );
+
+/*!
+ @typedef patch_registry_callback
+ @abstract Called for each entry by
+         @link __patch_registry_enumerate __patch_registry_enumerate @/link.
+ */
+typedef void (*patch_registry_callback)( struct patch_entry * entry, void * info );
+
+/*!
+ @function __patch_registry_enumerate
+ @abstract Visit every patched function.
+ @param callback The function to call for each patch.
+ @param info Passed through to the callback.
+ @result The number of entries visited.
+ */
+unsigned int __patch_registry_enumerate( patch_registry_callback callback, void * info );
+
+#pragma mark -
+
+/*!
+ @function __patch_lock
+ @abstract Take the architecture's patch mutex.
+ @discussion Implemented alongside each architecture's patching code,
+         for the benefit of the handler chain routines which need to
+         make changes under the same lock.
+ */
+void __patch_lock( void );
+
+/*!
+ @function __patch_unlock
+ @abstract Release the architecture's patch mutex.
+ */
+void __patch_unlock( void );
+
+/*!
+ @function __prepare_patch
+ @abstract Build the islands for a new patch.
+ @discussion Implemented by each architecture. Everything needed to
+         install the patch is set up, but the target function isn't
+         touched. Must be called with the patch mutex held.
+ @param fn_addr The function to patch, which mustn't already be patched.
+ @param patch_addr The patch function.
+ @param options Patch options, already validated.
+ @param priority The patch function's priority in the handler chain.
+ @param pending Filled in with the details of the patch.
+ @result Nonzero on success.
+ */
+int __prepare_patch( void * fn_addr, void * patch_addr, unsigned int options,
+                     int priority, struct pending_patch * pending );
+
+/*!
+ @function __commit_patch
+ @abstract Write the branch into a prepared patch's target function.
+ @discussion Must be called with the patch mutex held. This may be
+         called while every other thread in the process is suspended,
+         so it doesn't allocate memory, log, or take any locks.
+ @param pending A patch set up by
+        @link __prepare_patch __prepare_patch @/link.
+ @result Nonzero on success; zero if the target's instructions changed
+         after they were copied.
+ */
+int __commit_patch( struct pending_patch * pending );
+
+/*!
+ @function __finish_patch
+ @abstract Record a committed patch in the registry.
+ @discussion Must be called with the patch mutex held, but not while
+         other threads are suspended.
+ @param pending A patch which has been through
+        @link __commit_patch __commit_patch @/link.
+ @result The address through which the patch function calls on, or
+         NULL if the patch was never committed.
+ */
+void * __finish_patch( struct pending_patch * pending );
+
+/*!
+ @function __relocate_pc
+ @abstract Find where a thread should resume after a patch is committed.
+ @discussion A thread stopped part-way through the instructions which
+         were overwritten needs to be moved to the same point in the
+         copies held in the re-entry island.
+ @param pending A committed patch.
+ @param pc A suspended thread's program counter, or a return address
+        found on its stack.
+ @result The new address, or NULL if it doesn't need to move.
+ */
+void * __relocate_pc( const struct pending_patch * pending, void * pc );
+
+/*!
+ @function __check_patch_options
+ @abstract Make sure this architecture can build the requested patch.
+ @param options The requested patch options.
+ @result Nonzero if they're all supported; if not, an error has been
+         logged.
+ */
+int __check_patch_options( unsigned int options );
+
+/*!
+ @function __get_thread_pc
+ @abstract Read a suspended thread's program counter.
+ @discussion Implemented in safe_point.c. The thread can belong to any
+         task running the same architecture as this one.
+ @param thread The thread, which should be suspended.
+ @result The program counter, or NULL if it couldn't be read.
+ */
+void * __get_thread_pc( thread_act_t thread );
+
+/*!
+ @function __set_thread_pc
+ @abstract Move a suspended thread to a new program counter.
+ @param thread The thread, which should be suspended.
+ @param pc The address at which it should resume.
+ @result Nonzero on success.
+ */
+int __set_thread_pc( thread_act_t thread, void * pc );
+
+/*!
+ @function __relocate_return_addresses
+ @abstract Move return addresses which point into overwritten
+         instructions.
+ @discussion Implemented in safe_point.c. Checks the words nearest a
+         suspended thread's stack pointer against every committed patch,
+         and rewrites any which
+         @link __relocate_pc __relocate_pc @/link would move. Like the
+         rest of the safe-point code, it doesn't allocate, lock or log.
+ @param task The task which owns the thread.
+ @param thread The thread, which should be suspended.
+ @param pending The patches; those not yet committed are skipped.
+ @param count The number of patches.
+ @param failed If not NULL, incremented for each address which was
+        found but couldn't be rewritten.
+ @result The number of return addresses moved.
+ */
+unsigned int __relocate_return_addresses( task_t task, thread_act_t thread,
+                                          const struct pending_patch * pending,
+                                          unsigned int count, unsigned int * failed );
+
+/*!
+ @function __remote_island_space
+ @abstract The most island space one patch in another task can need.
+ @discussion Implemented by each architecture.
+ */
+size_t __remote_island_space( void );
+
+/*!
+ @function __build_remote_patch
+ @abstract Build the islands for a patch in another task.
+ @discussion Implemented by each architecture. The islands are written
+         into a local buffer, but built to run at their address in the
+         target task. Nothing is added to this task's registry or
+         handler chains; the pending patch is only used to hold the
+         details until the target function is rewritten, and by
+         @link __relocate_pc __relocate_pc @/link. Must be called with
+         the patch mutex held.
+ @param island_addr Where the islands will live in the target task.
+ @param local Where to build them; at least
+        @link __remote_island_space __remote_island_space @/link bytes.
+ @param fn_addr The function to patch, in the target task.
+ @param fn_bytes A copy of the first
+        @link kDPPatchMaxSavedBytes kDPPatchMaxSavedBytes @/link bytes
+        of the function.
+ @param patch_addr The patch function, in the target task.
+ @param pending Filled in with the details of the patch.
+ @result The number of bytes of island built, or zero on failure.
+ */
+size_t __build_remote_patch( vm_address_t island_addr, unsigned char * local,
+                             vm_address_t fn_addr, const unsigned char * fn_bytes,
+                             vm_address_t patch_addr, struct pending_patch * pending );
+
+/*!
+ @function __allocate_remote_islands
+ @abstract Allocate memory for islands in another task.
+ @discussion Implemented by each architecture, since the islands need
+         to be somewhere a patched function can branch to.
+ @param task The target task.
+ @param size The number of bytes needed.
+ @param addr On return, the address of the memory in the target task.
+ @result A Mach error code.
+ */
+kern_return_t __allocate_remote_islands( task_t task, vm_size_t size, vm_address_t * addr );
+
+/*!
+ @function __create_chain_island
+ @abstract Build an empty branch island for a handler chain.
+ @discussion Implemented by each architecture. The island starts with
+         a zero branch target, so it sends everything to the fallback
+         address until a handler is wired into it. Must be called with
+         the architecture's patch mutex held.
+ @param fallback The address to branch to while the island has no
+        target; this is the code in the target's re-entry island.
+ @param options The options of the patch the chain belongs to; these
+        decide which arena the island goes in.
+ @result The address of the new island, or NULL if there's no room.
+         On Intel this is the island's data block, not its code.
+ */
+void * __create_chain_island( void * fallback, unsigned int options );
+
+/*!
+ @function __chain_island_code
+ @abstract Get the address of the first instruction in a chain island.
+ @param island An island returned from
+        @link __create_chain_island __create_chain_island @/link.
+ @result The address a patch function should call through.
+ */
+void * __chain_island_code( void * island );
+
+/*!
+ @function __patch_chain_create
+ @abstract Build the chain for a newly-patched target.
+ @param patch The first patch function.
+ @param priority Its priority.
+ @param next_island The island it calls on through.
+ @result A one-handler chain, or NULL if no memory was available.
+ */
+struct patch_chain * __patch_chain_create( void * patch, int priority, void * next_island );
+
+/*!
+ @function __patch_chain_add
+ @abstract Add a handler to an already-patched target.
+ @discussion The target's prologue is left as it is; a new island is
+         built for the handler to call on through, and the islands of
+         the handlers either side of it are retargeted. Must be called
+         with the architecture's patch mutex held.
+ @param entry The target's registry entry.
+ @param patch The new patch function.
+ @param priority Its priority.
+ @result The address through which the new handler should call on, or
+         NULL on failure.
+ */
+void * __patch_chain_add( struct patch_entry * entry, void * patch, int priority );
+
+/*!
+ @function __patch_chain_remove
+ @abstract Take a handler out of a target's chain.
+ @discussion Must be called with the architecture's patch mutex held.
+         The last handler can't be removed this way, since that means
+         restoring the target's original instructions.
+ @param entry The target's registry entry.
+ @param patch The patch function to remove.
+ @result Nonzero if the handler was found and removed.
+ */
+int __patch_chain_remove( struct patch_entry * entry, void * patch );
+
+__END_DECLS
+
+#endif  /* __DP_PATCH_REGISTRY_H__ */
@@ -44,6 +44,11 @@
  more likely that addresses above 0xFE000000 are free than below
  0x01FFFFFF.
 
+ Nowadays both blocks normally go side by side in an arena within
+ 32Mb of the patched function, which can then use an ordinary relative
+ branch to reach them (see island_arena.c); the high and low tables
+ are only used when there's no free space that close.
+
  The branching itself is done using registers 11 and 12, the same ones
  used in Objective-C message passing and C++ virtual function calls. I
  settled on this partly because it seemed the standard behaviour,
@@ -80,6 +85,8 @@
 #if __ppc__
 
 #include "atomic.h"
+#include "patch_registry.h"
+#include "island_arena.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -120,6 +127,10 @@ static vm_offset_t      high_table_offset   = 0;
 static int              mutex_inited    = 0;
 static pthread_mutex_t  patch_mutex;
 
+// a relative branch reaches 32Mb either way of the patched function;
+// leave a little slack so the whole island is in range
+#define kRelativeBranchReach    0x01FF0000
+
 // these constants are used to infer translated or native execution
 enum
 {
@@ -188,12 +199,16 @@ static void initialize_patch_mutexes( void )
 
 #pragma mark -
 
-// this builds an entry in the low-memory jump table
+// this builds an entry in the low-memory jump table. The code is
+// written at 'local', which is normally the same as this_entry_addr;
+// when building islands for another task, it's a local buffer, and
+// this_entry_addr is where the island will live in that task.
 static size_t build_low_entry( vm_address_t this_entry_addr,
+                               unsigned int * local,
                                vm_address_t reentry_addr,
                                unsigned int saved_instruction )
 {
-    unsigned int * data_ptr = (unsigned int *) this_entry_addr;
+    unsigned int * data_ptr = local;
 
     // we write directly to the table; if things go wrong, we simply
     // leave this there as unused garbage, to be overwritten by the
@@ -220,10 +235,11 @@ static size_t build_low_entry( vm_address_t this_entry_addr,
 
 // this builds the high jump table entry
 static size_t build_high_entry( vm_address_t this_entry_addr,
+                                unsigned int * local,
                                 vm_address_t low_entry_addr,
                                 vm_address_t patch_fn_addr )
 {
-    unsigned int * data_ptr = (unsigned int *) this_entry_addr;
+    unsigned int * data_ptr = local;
 
     memcpy( data_ptr, branch_template, sizeof(branch_template) );
 
@@ -555,10 +571,188 @@ int __make_writable( void * addr )
     return ( good_to_go );
 }
 
+// Patching happens in three steps, so that DPCreatePatchBatch() can
+// do the middle one with every other thread suspended:
+//
+//   __prepare_patch() builds the islands and everything else we'll
+//       need, but doesn't touch the target function.
+//   __commit_patch() writes the branch into the target. This mustn't
+//       allocate memory, log, or take any lock besides the ones we
+//       already hold, since a suspended thread might be holding it.
+//   __finish_patch() records the patch in the registry.
+//
+// All three are called with patch_mutex held. No patch options are
+// implemented for PowerPC; CreatePatch.c refuses any which are passed
+// in, so 'options' is always zero here.
+
+int __prepare_patch( void * in_fn_addr, void * in_patch_addr, unsigned int options,
+                     int priority, struct pending_patch * pending )
+{
+    // Okay, we need:
+    //
+    // The first instruction from the function we're about to patch.
+    // The address of the entry in the low memory jump table
+    // The address of the function to patch
+    // The address of the patch function
+    // The address of the entry in the high memory jump table
+    // The address of the bit of the high jump table entry which refers back to the target fn
+    //
+
+    unsigned int saved_instruction;
+    unsigned int branch_instruction = 0x48000000;   // branch instruction
+    vm_address_t fn_addr = ( vm_address_t ) in_fn_addr;
+    vm_address_t patch_addr = ( vm_address_t ) in_patch_addr;
+    vm_address_t low_entry, high_entry;
+    vm_offset_t high_size = 0, low_size = 0;
+    void * next_island = NULL;
+
+    bzero( pending, sizeof(struct pending_patch) );
+
+    // not much point doing anything else if we can't get write access to patch the function...
+    if ( !__make_writable( in_fn_addr ) )
+        return ( 0 );
+
+    // Ideally, both islands go side by side in an arena within range
+    // of a relative branch from the target. If there's no room near
+    // it, we fall back on the jump tables, whose high table is placed
+    // where a branch absolute can get to it.
+    high_entry = __island_alloc_near( fn_addr, 2 * sizeof(branch_template),
+                                      kRelativeBranchReach, kIslandCode );
+    if ( high_entry != 0 )
+    {
+        low_entry = high_entry + sizeof(branch_template);
+    }
+    else
+    {
+        // allocate memory for jump tables
+        if ( high_jump_table == 0 )	// either both will be allocated, or neither
+        {
+            allocate_jump_tables( );
+        }
+
+        if ( ( high_jump_table == 0 ) ||
+             ( ( high_table_offset + sizeof(branch_template) ) > high_table_size ) ||
+             ( ( low_table_offset + sizeof(branch_template) ) > low_table_size ) )
+        {
+            LogError( "Out of space in the patch tables; can't patch %#x",
+                      (unsigned) in_fn_addr );
+            return ( 0 );
+        }
+
+        low_entry = low_jump_table + low_table_offset;
+        high_entry = high_jump_table + high_table_offset;
+
+        low_table_offset += sizeof(branch_template);
+        high_table_offset += sizeof(branch_template);
+
+        // Absolute Address bit
+        branch_instruction |= 0x00000002;
+    }
+
+    saved_instruction = *((unsigned int *) in_fn_addr);
+
+    // generate jump table entry in low memory
+    low_size = build_low_entry( low_entry, (unsigned int *) low_entry, (fn_addr + 4),
+                                saved_instruction );
+
+    // generate high memory jump table entry
+    high_size = build_high_entry( high_entry, (unsigned int *) high_entry, low_entry + 8,
+                                  patch_addr );
+
+    // call msync() on each - flushes instruction cache
+    vm_msync( mach_task_self( ), low_entry, low_size,
+              VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+    vm_msync( mach_task_self( ), high_entry, high_size,
+              VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+
+    // get a branch instruction to patch the target function
+    // need to point to first instruction in high_table_entry (high_table_entry + 8, then)
+    if ( branch_instruction & 0x00000002 )
+        branch_instruction |= ((high_entry + 8) & 0x03FFFFFC);  // address, with high 6 & low 2 bits cleared
+    else
+        branch_instruction |= ((high_entry + 8 - fn_addr) & 0x03FFFFFC);  // offset, likewise
+    memcpy( pending->patch_bytes, &branch_instruction, sizeof(unsigned int) );
+
+    // the patch calls on through its own chain island, which leads to
+    // the first *instruction* in the new low addr table entry until
+    // another handler is added after it.
+    next_island = __create_chain_island( (void *) (low_entry + 8), options );
+    if ( next_island == NULL )
+        return ( 0 );
+
+    pending->entry.target           = in_fn_addr;
+    pending->entry.patch            = in_patch_addr;
+    pending->entry.reentry          = (void *) (low_entry + 8);
+    pending->entry.patch_island     = (void *) high_entry;
+    pending->entry.reentry_island   = (void *) low_entry;
+    pending->entry.options          = options;
+    pending->entry.saved_size       = sizeof(unsigned int);
+    pending->entry.chain            = __patch_chain_create( in_patch_addr, priority,
+                                                            next_island );
+    memcpy( pending->entry.saved_bytes, &saved_instruction, sizeof(unsigned int) );
+
+    pending->result = __chain_island_code( next_island );
+
+    // if that failed, the islands are left as unused garbage
+    return ( pending->entry.chain != NULL );
+}
+
+int __commit_patch( struct pending_patch * pending )
+{
+    unsigned int * target = (unsigned int *) pending->entry.target;
+    unsigned int * low_entry = (unsigned int *) pending->entry.reentry_island;
+    unsigned int saved_instruction = *((unsigned int *) pending->entry.saved_bytes);
+    unsigned int branch_instruction = *((unsigned int *) pending->patch_bytes);
+
+    // try to do this as atomically as possible
+    while ( DPAtomicCompareAndSwap32( saved_instruction, branch_instruction, target,
+                                      kDPMemoryOrderSequential ) == 0 )
+    {
+        // instruction has been changed underneath us...
+        saved_instruction = *target;
+
+        // write this to low_table_entry + 32 (offset of saved instruction in low table entry)
+        low_entry[8] = saved_instruction;
+        memcpy( pending->entry.saved_bytes, &saved_instruction, sizeof(unsigned int) );
+    }
+
+    // synchronizes instruction and data caches
+    // ppc code doesn't use the address, but might as well keep
+    // some sort of parity between architectures
+    DPAtomicCodeSync( target );
+
+    pending->committed = 1;
+
+    return ( 1 );
+}
+
+void * __finish_patch( struct pending_patch * pending )
+{
+    if ( !pending->committed )
+        return ( NULL );
+
+    // remember what we did, so it can be undone later
+    if ( __patch_registry_insert( &pending->entry ) == NULL )
+        LogError( "Patch on %#x installed, but won't be removable",
+                  (unsigned) pending->entry.target );
+
+    return ( pending->result );
+}
+
+void * __relocate_pc( const struct pending_patch * pending, void * pc )
+{
+    // only one instruction is replaced, so no thread can be part-way
+    // through it
+    return ( NULL );
+}
+
 // entry point from CreatePatch()
-void * __create_patch( void * in_fn_addr, void * in_patch_addr )
+void * __create_patch( void * in_fn_addr, void * in_patch_addr,
+                       unsigned int options, int priority )
 {
     void * result = NULL;
+    struct patch_entry * existing = NULL;
+    struct pending_patch pending;
 
     if ( !mutex_inited )
         initialize_patch_mutexes( );
@@ -566,135 +760,196 @@ void * __create_patch( void * in_fn_addr, void * in_patch_addr )
     // don't do ANYTHING unless we know we're not infringing on something else
     pthread_mutex_lock( &patch_mutex );
 
-    // not much point doing anything else if we can't get write access to patch the function...
-    if ( !__make_writable( in_fn_addr ) )
+    // if it's already patched, this just becomes another handler in
+    // its chain; the first instruction stays exactly as it is
+    existing = __patch_registry_lookup( in_fn_addr );
+    if ( existing != NULL )
     {
-        // multiple return paths - EEUURRRRGHHH !!!
-        pthread_mutex_unlock( &patch_mutex );
-        return ( NULL );
+        result = __patch_chain_add( existing, in_patch_addr, priority );
     }
-
-    // allocate memory for jump tables
-    if ( high_jump_table == 0 )	// either both will be allocated, or neither
+    else if ( __prepare_patch( in_fn_addr, in_patch_addr, options, priority, &pending ) &&
+              __commit_patch( &pending ) )
     {
-        allocate_jump_tables( );
+        result = __finish_patch( &pending );
     }
 
-    if ( ( high_jump_table != 0 ) &&
-         ( ( high_table_offset + sizeof(branch_template) ) <= high_table_size ) &&
-         ( ( low_table_offset + sizeof(branch_template) ) <= low_table_size ) )
+    pthread_mutex_unlock( &patch_mutex );
+
+    return ( result );
+}
+
+// entry point from DPRemovePatch() and DPRemovePatchFunction()
+int __remove_patch( void * fn_addr, void * patch_addr )
+{
+    struct patch_entry * entry = NULL;
+    int removed = 0;
+
+    if ( !mutex_inited )
+        initialize_patch_mutexes( );
+
+    pthread_mutex_lock( &patch_mutex );
+
+    // the registry holds the original first instruction, so there's no
+    // need to follow the branch to find it
+    entry = __patch_registry_lookup( fn_addr );
+    if ( entry == NULL )
     {
-        // Okay, we need:
-        //
-        // The first instruction from the function we're about to patch.
-        // The address of the entry in the low memory jump table
-        // The address of the function to patch
-        // The address of the patch function
-        // The address of the entry in the high memory jump table
-        // The address of the bit of the high jump table entry which refers back to the target fn
-        //
-
-        unsigned int saved_instruction;
-        vm_address_t fn_addr = ( vm_address_t ) in_fn_addr;
-        vm_address_t patch_addr = ( vm_address_t ) in_patch_addr;
-        vm_address_t low_entry = low_jump_table + low_table_offset;
-        vm_address_t high_entry = high_jump_table + high_table_offset;
-        vm_offset_t high_size = 0, low_size = 0;
-
-        saved_instruction = *((unsigned int *) in_fn_addr);
-
-        // generate jump table entry in low memory
-        low_size = build_low_entry( low_entry, (fn_addr + 4), saved_instruction );
-
-        if ( low_size > 0 )
-        {
-            // generate high memory jump table entry
-            high_size = build_high_entry( high_entry, low_entry, patch_addr );
-        }
+        // nothing to do
+    }
+    else if ( ( patch_addr != NULL ) && __patch_chain_remove( entry, patch_addr ) )
+    {
+        // taken out of the chain, others still installed
+        removed = 1;
+    }
+    else if ( ( patch_addr == NULL ) ||
+              ( ( entry->chain->count == 1 ) &&
+                ( entry->chain->handlers[0].patch == patch_addr ) ) )
+    {
+        unsigned int * pTo = (unsigned int *) fn_addr;
+        unsigned int restore = *((unsigned int *) entry->saved_bytes);
+        unsigned int instr;
 
-        if ( (low_size > 0) && (high_size > 0) )
-        {
-            // get a branch absolute instruction to patch the target function
-            // need to point to first instruction in high_table_entry (high_table_entry + 4, then)
-            unsigned int ba_instruction = 0x48000002;   // branch instruction, with Absolute Address bit set
-            ba_instruction |= ((high_entry + 8) & 0x03FFFFFC);   // address, with high 6 & low 2 bits cleared
-
-            // try to do this as atomically as possible
-            //*( ( unsigned long * ) in_fn_addr ) = ba_instruction;
-            while ( DPCompareAndSwap( saved_instruction, ba_instruction,
-                                      (unsigned int *) in_fn_addr ) == 0 )
-            {
-                // instruction has been changed underneath us...
-                saved_instruction = *((unsigned int *) in_fn_addr);
-                // write this to high_table_entry + 60 (offset of saved instruction in high table entry)
-                *((unsigned int *) (high_entry + (8*sizeof(unsigned int)))) = saved_instruction;
-            }
+        // send anything already on its way through the patch island
+        // straight to the original code instead
+        ((unsigned int *) entry->patch_island)[0] = 0;
 
-            // call msync() on each & update table offsets - flushes instruction cache
-            vm_msync( mach_task_self( ), low_entry, low_size,
-                      VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
-            vm_msync( mach_task_self( ), high_entry, high_size,
-                      VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+        // atomic swap
+        do
+        {
+            instr = *pTo;
 
-            low_table_offset += low_size;
-            high_table_offset += high_size;
+        } while ( DPAtomicCompareAndSwap32( instr, restore, pTo,
+                                            kDPMemoryOrderSequential ) == 0 );
 
-            // synchronizes instruction and data caches
-            // ppc code doesn't use the address, but might as well keep
-            // some sort of parity between architectures
-            DPCodeSync( in_fn_addr );
+        DPAtomicCodeSync( fn_addr );
 
-            // set result - addr is address of first *instruction* in the new low addr table entry
-            result = (void *) (low_entry + 8);
-        }
+        (void) __patch_registry_remove( fn_addr );
+        removed = 1;
     }
 
+    // all done
     pthread_mutex_unlock( &patch_mutex );
 
-    return ( result );
+    return ( removed );
 }
 
-void DPRemovePatch( void * fn_addr )
+#pragma mark -
+
+// lets the handler chain code make its changes under our mutex
+void __patch_lock( void )
 {
+    if ( !mutex_inited )
+        initialize_patch_mutexes( );
+
     pthread_mutex_lock( &patch_mutex );
+}
 
-    // okay, fn_addr is simple enough; the fiddly bit is locating the
-    // original first instruction which we need to reinstate. The first
-    // instruction of the original function should be a branch
-    // absolute, which contains the address of the code in the high
-    // memory block. On PowerPC, it's a simple matter of addition to
-    // locate the 'branch to original' block within here, and therefore
-    // pull out the original first instruction which we need to place.
-    unsigned int *pTo = (unsigned int *) fn_addr;
-    unsigned int *pFrom = NULL;
-    unsigned int instr = *pTo;
-    unsigned int restore = 0;
-
-    // check to see if it's a branch absolute to high memory:
-    // ba(addr) is 0x4800002 | (addr & 0x03FFFFFC)
-    // Therefore, we need (0x4800002 | 0x02000000), masked against
-    // top seven bits and bottom two bits
-    if ( (instr & 0xFE000003) == 0x4A000002)
-    {
-        // it's a branch absolute, pull out the address, and
-        // sign-extend it (it'll be all 0xFF above anyway)
-        // clear bottom three bits, set top six bits
-        pFrom = (unsigned int*) ( (instr & ~3) | 0xFC00000 );
+void __patch_unlock( void )
+{
+    pthread_mutex_unlock( &patch_mutex );
+}
 
-        // read address of low table from here
-        pFrom = (unsigned int *) pFrom[1];
+// build an island for a handler chain -- called with patch_mutex held
+void * __create_chain_island( void * fallback, unsigned int options )
+{
+    // chain islands are reached through the count register, so they
+    // can go anywhere; keep them with the target's other islands
+    vm_address_t island = __island_alloc_near( (vm_address_t) fallback,
+                                               sizeof(branch_template), 0,
+                                               kIslandCode );
+    size_t size = 0;
+
+    if ( island == 0 )
+        return ( NULL );
 
-        // instruction we're grabbing is at offset 8 (32 bytes)
-        restore = pFrom[8];
+    size = build_high_entry( island, (unsigned int *) island,
+                             (vm_address_t) fallback, 0 );
 
-        // atomic swap
-        DPCompareAndSwap( instr, restore, pTo );
+    vm_msync( mach_task_self( ), island, size,
+              VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
 
-        DPCodeSync( fn_addr );
-    }
+    return ( (void *) island );
+}
 
-    // all done
-    pthread_mutex_unlock( &patch_mutex );
+void * __chain_island_code( void * island )
+{
+    return ( (unsigned char *) island + 8 );
+}
+
+#pragma mark -
+
+// Islands for another task are a patch island followed by a re-entry
+// island, built side by side in a local buffer; see remote_patch.c
+
+size_t __remote_island_space( void )
+{
+    return ( 2 * sizeof(branch_template) );
+}
+
+size_t __build_remote_patch( vm_address_t island_addr, unsigned char * local,
+                             vm_address_t fn_addr, const unsigned char * fn_bytes,
+                             vm_address_t patch_addr, struct pending_patch * pending )
+{
+    vm_address_t high_entry = island_addr;
+    vm_address_t low_entry = island_addr + sizeof(branch_template);
+    unsigned int saved_instruction = *((const unsigned int *) fn_bytes);
+    unsigned int ba_instruction = 0x48000002;
+    size_t size = 0;
+
+    bzero( pending, sizeof(struct pending_patch) );
+
+    size  = build_high_entry( high_entry, (unsigned int *) local, low_entry + 8,
+                              patch_addr );
+    size += build_low_entry( low_entry, (unsigned int *) (local + size), fn_addr + 4,
+                             saved_instruction );
+
+    ba_instruction |= ((high_entry + 8) & 0x03FFFFFC);
+    memcpy( pending->patch_bytes, &ba_instruction, sizeof(unsigned int) );
+
+    pending->entry.target           = (void *) fn_addr;
+    pending->entry.patch            = (void *) patch_addr;
+    pending->entry.reentry          = (void *) (low_entry + 8);
+    pending->entry.patch_island     = (void *) high_entry;
+    pending->entry.reentry_island   = (void *) low_entry;
+    pending->entry.saved_size       = sizeof(unsigned int);
+    memcpy( pending->entry.saved_bytes, &saved_instruction, sizeof(unsigned int) );
+
+    pending->result = pending->entry.reentry;
+
+    return ( size );
+}
+
+kern_return_t __allocate_remote_islands( task_t task, vm_size_t size, vm_address_t * addr )
+{
+    // The patch islands are reached with a branch absolute, so they
+    // have to be in the top 32Mb, where a sign-extended 26-bit address
+    // can get to them. Work down from the top until there's a gap.
+    // We're never asked to patch a Rosetta task here, so the limits
+    // in allocate_jump_tables() don't apply.
+    vm_size_t page_size = 0;
+    vm_address_t page_addr;
+    kern_return_t kr;
+
+    if ( host_page_size( mach_host_self( ), &page_size ) != KERN_SUCCESS )
+        page_size = 4096;
+
+    size = (size + page_size - 1) & ~(page_size - 1);
+    page_addr = (0xFFFFF000 - size) & ~(page_size - 1);
+
+    do
+    {
+        kr = vm_allocate( task, &page_addr, size, FALSE );
+        if ( kr == KERN_SUCCESS )
+        {
+            *addr = page_addr;
+            break;
+        }
+
+        page_addr -= page_size;
+
+    } while ( page_addr >= 0xFE000000 );
+
+    return ( kr );
 }
 
 #endif
@@ -0,0 +1,379 @@
+/*
+ *  remote_patch.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 21/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "patch_registry.h"
+#include "timing.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/mach_error.h>
+#include <mach/vm_map.h>
+#include <mach/machine/vm_param.h>
+
+// This works along the same lines as the Rosetta patcher: the islands
+// are built here, in local memory, using the addresses they'll have in
+// the target task, and then copied across in one go. The difference is
+// that native islands branch straight to a patch function which is
+// already loaded in the target, so there's no stub or bind helper to
+// go with them, and we rewrite the target functions ourselves rather
+// than leaving it to injected code.
+//
+// All the islands for one call go into a single block of the target's
+// memory, so everything but the target functions themselves goes
+// across in a single vm_write().
+
+// from rosetta_patch.c -- there's nothing Rosetta-specific about it
+extern int __rosetta_make_writable( task_t taskPort, vm_address_t fn_addr );
+
+// reads the first few bytes of a function in the target task
+static int read_remote_prologue( task_t task, vm_address_t fn_addr,
+                                 unsigned char bytes[kDPPatchMaxSavedBytes] )
+{
+    vm_size_t size = kDPPatchMaxSavedBytes;
+    vm_size_t read_size = 0;
+    kern_return_t kr;
+
+    bzero( bytes, kDPPatchMaxSavedBytes );
+
+    kr = vm_read_overwrite( task, fn_addr, size, (vm_address_t) bytes, &read_size );
+
+    if ( kr != KERN_SUCCESS )
+    {
+        // a very short function at the end of the last page of a
+        // region; only read as far as the end of the page
+        size = round_page( fn_addr + 1 ) - fn_addr;
+        if ( size < kDPPatchMaxSavedBytes )
+            kr = vm_read_overwrite( task, fn_addr, size, (vm_address_t) bytes, &read_size );
+    }
+
+    return ( kr == KERN_SUCCESS );
+}
+
+// builds the islands for every request in a local buffer; returns how
+// many are ready to go
+static unsigned int build_islands( task_t task, DPRemotePatchRequest * requests,
+                                   unsigned int count, struct pending_patch * pending,
+                                   int * ready, vm_address_t remote_islands,
+                                   unsigned char * local_islands, vm_size_t * pUsed )
+{
+    unsigned char fn_bytes[kDPPatchMaxSavedBytes];
+    vm_size_t used = 0;
+    unsigned int result = 0;
+    unsigned int i, j;
+
+    for ( i = 0; i < count; i++ )
+    {
+        DPRemotePatchRequest * request = &requests[i];
+        vm_address_t fn_addr = (vm_address_t) request->fn_addr;
+        size_t size = 0;
+
+        request->reentry = NULL;
+
+        if ( ( request->fn_addr == NULL ) || ( request->patch_addr == NULL ) )
+        {
+            LogError( "NULL values supplied to DPCreateRemotePatches() ! fn_addr = %#x, "
+                      "patch_addr = %#x", (unsigned) request->fn_addr,
+                      (unsigned) request->patch_addr );
+            continue;
+        }
+
+        for ( j = 0; j < i; j++ )
+        {
+            if ( ( ready[j] ) && ( requests[j].fn_addr == request->fn_addr ) )
+                break;
+        }
+        if ( j < i )
+        {
+            LogError( "DPCreateRemotePatches(): %#x is patched twice in one batch",
+                      (unsigned) fn_addr );
+            continue;
+        }
+
+        if ( !__rosetta_make_writable( task, fn_addr ) )
+        {
+            LogError( "Unable to make %#x writable in task %#x",
+                      (unsigned) fn_addr, (unsigned) task );
+            continue;
+        }
+
+        if ( !read_remote_prologue( task, fn_addr, fn_bytes ) )
+        {
+            LogError( "Unable to read function at %#x in task %#x",
+                      (unsigned) fn_addr, (unsigned) task );
+            continue;
+        }
+
+        size = __build_remote_patch( remote_islands + used, local_islands + used,
+                                     fn_addr, fn_bytes, (vm_address_t) request->patch_addr,
+                                     &pending[i] );
+        if ( size == 0 )
+        {
+            LogError( "Unable to build patch islands for %#x in task %#x",
+                      (unsigned) fn_addr, (unsigned) task );
+            continue;
+        }
+
+        // keep the data words at the start of each island aligned
+        used += ( (size + 3) & ~3 );
+
+        ready[i] = 1;
+        result++;
+    }
+
+    *pUsed = used;
+
+    return ( result );
+}
+
+// copies the finished islands into the target, in one go
+static int copy_islands( task_t task, vm_address_t remote_islands,
+                         vm_size_t islands_size, unsigned char * local_islands,
+                         vm_size_t islands_used )
+{
+    kern_return_t kr;
+
+    kr = vm_write( task, remote_islands, (vm_offset_t) local_islands, islands_used );
+    if ( kr == KERN_SUCCESS )
+    {
+        kr = vm_protect( task, remote_islands, islands_size, FALSE,
+                         VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE );
+    }
+
+    if ( kr != KERN_SUCCESS )
+    {
+        LogError( "Unable to copy patch islands into task %#x: %d (%s)",
+                  (unsigned) task, kr, mach_error_string(kr) );
+        return ( 0 );
+    }
+
+    (void) vm_msync( task, remote_islands, islands_used,
+                     VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+
+    return ( 1 );
+}
+
+// rewrites the target functions, with the task suspended; returns the
+// number of patches which went in
+static unsigned int flip_patches( task_t task, DPRemotePatchRequest * requests,
+                                  unsigned int count, struct pending_patch * pending,
+                                  int * ready, DPPatchBatchReport * report )
+{
+    thread_act_array_t threads = NULL;
+    mach_msg_type_number_t thread_count = 0;
+    unsigned long long start = 0, end = 0;
+    unsigned int num_moved = 0, num_stack_failed = 0;
+    unsigned int result = 0;
+    unsigned int i, j;
+    kern_return_t kr;
+
+    start = mach_absolute_time( );
+
+    kr = task_suspend( task );
+    if ( kr != KERN_SUCCESS )
+    {
+        LogError( "Unable to suspend task %#x: %d (%s)",
+                  (unsigned) task, kr, mach_error_string(kr) );
+        return ( 0 );
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        DPRemotePatchRequest * request = &requests[i];
+        vm_address_t fn_addr = (vm_address_t) request->fn_addr;
+        vm_address_t reentry = (vm_address_t) pending[i].result;
+        unsigned char current[kDPPatchMaxSavedBytes];
+        vm_size_t read_size = 0;
+
+        if ( !ready[i] )
+            continue;
+
+        // it's been running since we read it, after all
+        kr = vm_read_overwrite( task, fn_addr, pending[i].entry.saved_size,
+                                (vm_address_t) current, &read_size );
+        if ( ( kr != KERN_SUCCESS ) ||
+             ( memcmp( current, pending[i].entry.saved_bytes,
+                       pending[i].entry.saved_size ) != 0 ) )
+        {
+            LogError( "Function at %#x in task %#x changed while it was being patched",
+                      (unsigned) fn_addr, (unsigned) task );
+            ready[i] = 0;
+            continue;
+        }
+
+        // the patch function mustn't see its original before it's set
+        if ( request->reentry_slot != NULL )
+        {
+            kr = vm_write( task, (vm_address_t) request->reentry_slot,
+                           (vm_offset_t) &reentry, sizeof(vm_address_t) );
+        }
+
+        if ( kr == KERN_SUCCESS )
+        {
+            kr = vm_write( task, fn_addr, (vm_offset_t) pending[i].patch_bytes,
+                           pending[i].entry.saved_size );
+        }
+
+        if ( kr != KERN_SUCCESS )
+        {
+            LogError( "Unable to patch %#x in task %#x: %d (%s)", (unsigned) fn_addr,
+                      (unsigned) task, kr, mach_error_string(kr) );
+            ready[i] = 0;
+            continue;
+        }
+
+        (void) vm_msync( task, fn_addr, pending[i].entry.saved_size,
+                         VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
+
+        pending[i].committed = 1;
+        request->reentry = (void *) reentry;
+        result++;
+    }
+
+    // anything part-way through an overwritten prologue moves into the
+    // copy in its re-entry island
+    if ( task_threads( task, &threads, &thread_count ) == KERN_SUCCESS )
+    {
+        for ( j = 0; j < thread_count; j++ )
+        {
+            void * pc = __get_thread_pc( threads[j] );
+
+            for ( i = 0; i < count; i++ )
+            {
+                void * new_pc = NULL;
+
+                if ( !ready[i] )
+                    continue;
+
+                new_pc = __relocate_pc( &pending[i], pc );
+                if ( new_pc != NULL )
+                {
+                    if ( __set_thread_pc( threads[j], new_pc ) )
+                        num_moved++;
+                    else
+                        LogEmergency( "Unable to move thread %#x out of patched code at %#x",
+                                      (unsigned) threads[j], (unsigned) pc );
+                    break;
+                }
+            }
+
+            num_moved += __relocate_return_addresses( task, threads[j], pending, count,
+                                                      &num_stack_failed );
+
+            (void) mach_port_deallocate( mach_task_self( ), threads[j] );
+        }
+
+        (void) vm_deallocate( mach_task_self( ), (vm_address_t) threads,
+                              thread_count * sizeof(thread_act_t) );
+    }
+
+    (void) task_resume( task );
+
+    end = mach_absolute_time( );
+
+    if ( num_stack_failed > 0 )
+    {
+        LogEmergency( "Unable to fix %u return address(es) into patched code in task %#x",
+                      num_stack_failed, (unsigned) task );
+    }
+
+    DEBUGLOG( "Remote patch: task %#x suspended for %llu usec, %u of %u patched, %u moved",
+              (unsigned) task, AbsoluteToMicroseconds( end - start ), result, count, num_moved );
+
+    if ( report != NULL )
+    {
+        report->pause_usec = AbsoluteToMicroseconds( end - start );
+        report->threads_suspended = thread_count;
+        report->threads_moved = num_moved;
+        report->patches_installed = result;
+    }
+
+    return ( result );
+}
+
+#pragma mark -
+
+unsigned int DPCreateRemotePatches( task_t task, DPRemotePatchRequest * requests,
+                                    unsigned int count, DPPatchBatchReport * report )
+{
+    struct pending_patch * pending = NULL;
+    int * ready = NULL;
+    unsigned char * local_islands = NULL;
+    vm_address_t remote_islands = 0;
+    vm_size_t islands_size = 0, islands_used = 0;
+    unsigned int result = 0;
+    kern_return_t kr;
+
+    if ( report != NULL )
+        bzero( report, sizeof(DPPatchBatchReport) );
+
+    if ( ( requests == NULL ) || ( count == 0 ) )
+    {
+        LogError( "No requests supplied to DPCreateRemotePatches()" );
+        return ( 0 );
+    }
+
+    islands_size = round_page( count * (__remote_island_space( ) + 4) );
+
+    pending = (struct pending_patch *) calloc( count, sizeof(struct pending_patch) );
+    ready = (int *) calloc( count, sizeof(int) );
+    local_islands = (unsigned char *) calloc( 1, islands_size );
+
+    if ( ( pending == NULL ) || ( ready == NULL ) || ( local_islands == NULL ) )
+    {
+        LogError( "Unable to allocate memory for %u remote patch requests", count );
+    }
+    else if ( ( kr = __allocate_remote_islands( task, islands_size,
+                                                &remote_islands ) ) != KERN_SUCCESS )
+    {
+        LogError( "Unable to allocate patch islands in task %#x: %d (%s)",
+                  (unsigned) task, kr, mach_error_string(kr) );
+    }
+    else
+    {
+        unsigned int num_built;
+
+        // the Intel instruction decoder recovers from errors through a
+        // single static jmp_buf, so it's only ever run with the patch
+        // lock held, same as for patches in this task
+        __patch_lock( );
+        num_built = build_islands( task, requests, count, pending, ready,
+                                   remote_islands, local_islands, &islands_used );
+        __patch_unlock( );
+
+        if ( ( num_built > 0 ) &&
+             ( copy_islands( task, remote_islands, islands_size, local_islands,
+                             islands_used ) ) )
+        {
+            result = flip_patches( task, requests, count, pending, ready, report );
+        }
+
+        // if nothing went in, nothing refers to the islands
+        if ( result == 0 )
+            (void) vm_deallocate( task, remote_islands, islands_size );
+    }
+
+    free( local_islands );
+    free( ready );
+    free( pending );
+
+    return ( result );
+}
@@ -44,6 +44,7 @@
 
 #include "lookup.h"
 #include "Injection.h"
+#include "atomic.h"
 
 // this file includes the helper code, defined as an array like the
 // templates below
@@ -66,14 +67,19 @@ static vm_size_t string_table_size = 0;
 // offsets to next free byte in tables
 static vm_size_t low_table_offset = 0;
 static vm_size_t high_table_offset = 0;
-static vm_size_t data_table_offset = 0;
 static vm_size_t string_table_offset = 0;
 
 // addresses of local working copies of the tables
-// NB: string table is actually allocated with the data table
+// The info and string tables grow as patches are added. The data table
+// which holds them in the target task is only laid out when it's
+// committed, once we know exactly how big it needs to be.
 static void * local_low_table = NULL;
 static void * local_high_table = NULL;
-static void * local_data_table = NULL;
+static void * local_info_table = NULL;
+static char * local_string_table = NULL;
+
+// allocated size of the local info table
+static vm_size_t info_table_size = 0;
 
 // default page size
 static vm_size_t page_size = 4096;
@@ -103,9 +109,12 @@ static pthread_mutex_t rosetta_mutex;
 #define FMWK_PATH   "/Library/Frameworks/DynamicPatch.framework/DynamicPatch"
 
 // Data Table Structure:
+// The header and stub code come first, followed immediately by the
+// info table and then the string table, all in one allocation.
 struct rosetta_data_table_header
 {
-    // length of data table (will be multiple of page-size)
+    // length of data table, including the info & string tables (will
+    // be multiple of page-size)
     vm_size_t data_table_size;
 
     // addresses of jump tables, so they can be deallocated
@@ -175,6 +184,35 @@ struct rosetta_info_table_entry
     // offset of the patch function within its file image
     unsigned patch_fn_offset;
 
+    // address of the branch_target word in this patch's island, which
+    // the binder overwrites with the patch function's address
+    void * branch_target_addr;
+
+    // binding options, from the patch bundle's Info.plist
+    unsigned flags;
+
+    // one of the binding states below; only changed atomically, and
+    // only after patch_fn_addr has been stored
+    volatile unsigned state;
+
+    // the patch function's address, once its bundle has been loaded
+    void * volatile patch_fn_addr;
+
+};
+
+// info table entry flags
+enum
+{
+    // bind every patch from this entry's bundle as soon as the bundle
+    // is loaded, rather than each one on its first call
+    kRosettaBindEager   = 0x00000001
+};
+
+// info table entry binding states
+enum
+{
+    kRosettaUnbound     = 0,    // bundle not loaded yet
+    kRosettaResolved    = 1     // patch_fn_addr is valid
 };
 
 static struct rosetta_info_table_entry *pInfoTable = NULL;
@@ -353,7 +391,7 @@ static unsigned __rosetta_locate_string( const char * str )
     // if the string table is empty, then the string isn't there yet
     if ( string_table_offset > 0 )
     {
-        const char * s = (const char *) (local_data_table + page_size);
+        const char * s = (const char *) local_string_table;
         const char * e = s + string_table_offset;
         const char * p = s;
 
@@ -385,14 +423,30 @@ static unsigned __rosetta_add_string( const char * str )
 
     if ( result == INVALID_STRING_OFFSET )
     {
-        // add the given string to the string table, if that's possible
+        // add the given string to the string table, growing it if
+        // necessary
         vm_size_t sz = (vm_size_t) strlen( str ) + 1;
 
+        if ( (string_table_size - string_table_offset) < sz )
+        {
+            vm_size_t new_size = ( string_table_size > 0 ) ? string_table_size : page_size;
+            char * new_table = NULL;
+
+            while ( (new_size - string_table_offset) < sz )
+                new_size *= 2;
+
+            new_table = (char *) realloc( local_string_table, new_size );
+            if ( new_table != NULL )
+            {
+                local_string_table = new_table;
+                string_table_size = new_size;
+            }
+        }
+
         if ( (string_table_size - string_table_offset) >= sz )
         {
             // there's enough room for the string in the table
-            memcpy( (local_data_table + page_size + string_table_offset),
-                    str, sz );
+            memcpy( (local_string_table + string_table_offset), str, sz );
             result = (unsigned) string_table_offset;
             string_table_offset += sz;
         }
@@ -406,17 +460,35 @@ static unsigned __rosetta_add_string( const char * str )
 // patch_bundle_path is the path to the path bundle, which will be
 // written into the string table
 // patch_fn_offset is the bundle-relative address of the patch function
+// target_addr is the address of the patch island's branch target
+// flags are the binding flags for this patch
 static unsigned __rosetta_create_info_entry( void * branch_addr,
                                              const char * patch_bundle_path,
-                                             unsigned patch_fn_offset )
+                                             unsigned patch_fn_offset,
+                                             vm_address_t target_addr,
+                                             unsigned flags )
 {
     unsigned result = INVALID_INFO_INDEX;
     vm_size_t sz = sizeof(struct rosetta_info_table_entry);
+    vm_size_t used = info_count * sz;
+
+    if ( (info_table_size - used) < sz )
+    {
+        // out of room; double it
+        vm_size_t new_size = ( info_table_size > 0 ) ? (info_table_size * 2) : page_size;
+        void * new_table = realloc( local_info_table, new_size );
+
+        if ( new_table != NULL )
+        {
+            local_info_table = new_table;
+            info_table_size = new_size;
+        }
+    }
 
-    if ( (data_table_size - data_table_offset) >= sz )
+    if ( (info_table_size - used) >= sz )
     {
         // enough room for one more
-        void * addr = local_data_table + data_table_offset;
+        void * addr = local_info_table + used;
 
         // see if we can store the string, first:
         unsigned pathOffset;
@@ -425,13 +497,16 @@ static unsigned __rosetta_create_info_entry( void * branch_addr,
         {
             // okay to add this bit
             // probablty should use offsetof, but I feel reasonably
-            // secure in assuming that a structure containing three
+            // secure in assuming that a structure containing seven
             // 32-bit words will use < 32-bit alignment
             OSWriteBigInt32( addr, 0, (unsigned) branch_addr );
             OSWriteBigInt32( addr, 4, pathOffset );
             OSWriteBigInt32( addr, 8, patch_fn_offset );
+            OSWriteBigInt32( addr, 12, (unsigned) target_addr );
+            OSWriteBigInt32( addr, 16, flags );
+            OSWriteBigInt32( addr, 20, kRosettaUnbound );
+            OSWriteBigInt32( addr, 24, 0 );
 
-            data_table_offset += sizeof(struct rosetta_info_table_entry);
             result = info_count++;
         }
     }
@@ -441,23 +516,40 @@ static unsigned __rosetta_create_info_entry( void * branch_addr,
 
 // these were long things to type so often, so they got macros
 #define HDR_OFFSET(m) offsetof(struct rosetta_data_table_header, m)
-#define PACK_HEADER_DWORD(m,v) OSWriteBigInt32(local_data_table, HDR_OFFSET(m), v)
-
-// this function will fill out the constant/static things in the data
-// header. The data comes from globals within this file.
-// This packs not only the things defined in the header structure
-// above, but also fills out the data block at the beginning of the
-// stub interface code.
-static void __rosetta_create_data_header( void )
+#define PACK_HEADER_DWORD(m,v) OSWriteBigInt32(local_table, HDR_OFFSET(m), v)
+
+// size of the header struct and the stub code which follows it
+#define DATA_HEADER_SIZE ((offsetof(struct rosetta_data_table_header, \
+                                    stub_helper_interface) + \
+                           sizeof(_stub_helper_code) + 3) & ~3)
+
+// the exact size of the data table, given what's been added to the
+// info & string tables so far
+static vm_size_t __rosetta_data_table_size( void )
+{
+    vm_size_t size = DATA_HEADER_SIZE;
+
+    size += info_count * sizeof(struct rosetta_info_table_entry);
+    size += string_table_offset;
+
+    return ( (size + page_size - 1) & ~(page_size - 1) );
+}
+
+// This lays out the whole data table in local_table, ready to be
+// copied to data_table in the target task: the header, the stub code,
+// the info table and the string table, one after another. Along with
+// the things defined in the header structure above, this also fills
+// out the data block at the beginning of the stub interface code.
+static void __rosetta_build_data_table( void * local_table )
 {
-    // size of the header struct
-    size_t header_block_size = offsetof(struct rosetta_data_table_header, stub_helper_interface);
     // size of the stub code
     size_t stub_code_size = sizeof(_stub_helper_code);
-    // size of entire block
-    size_t data_header_size = header_block_size + stub_code_size;
+    // offsets of the info table & string table
+    unsigned info_table_offset = DATA_HEADER_SIZE;
+    unsigned string_offset = info_table_offset +
+        (info_count * sizeof(struct rosetta_info_table_entry));
     // location of stub code block
-    void * stub_code_addr = local_data_table + HDR_OFFSET(stub_helper_interface);
+    void * stub_code_addr = local_table + HDR_OFFSET(stub_helper_interface);
     // location of stub block in remote process
     vm_address_t stub_addr = data_table + HDR_OFFSET(stub_helper_interface);
     // address of PPC implementation of NSAddImage
@@ -471,25 +563,32 @@ static void __rosetta_create_data_header( void )
     dlsym_ppc_ptr = DPFindFunctionForArchitecture( "_dlsym",
         "/usr/lib/libSystem.dylib", kInsertionArchPPC );
 
+    bzero( local_table, data_table_size );
+
+    string_table = data_table + string_offset;
+
     PACK_HEADER_DWORD( data_table_size, data_table_size );
     PACK_HEADER_DWORD( low_jump_table, low_jump_table );
     PACK_HEADER_DWORD( low_jump_table_size, low_table_size );
     PACK_HEADER_DWORD( high_jump_table, high_jump_table );
     PACK_HEADER_DWORD( high_jump_table_size, high_table_size );
-    PACK_HEADER_DWORD( info_table_offset, data_header_size );
-    // info_table_count will get filled in later
-    PACK_HEADER_DWORD( string_table_offset, page_size );
-    strncpy( local_data_table + HDR_OFFSET(bind_fn_sym),
+    PACK_HEADER_DWORD( info_table_offset, info_table_offset );
+    PACK_HEADER_DWORD( info_table_count, info_count );
+    PACK_HEADER_DWORD( string_table_offset, string_offset );
+    strncpy( local_table + HDR_OFFSET(bind_fn_sym),
              "__rosetta_bind_helper", 24 );
     // copy stub code at the end
     memcpy( stub_code_addr, _stub_helper_code, stub_code_size );
 
+    // the info & string tables are already in their final form
+    memcpy( local_table + info_table_offset, local_info_table,
+            info_count * sizeof(struct rosetta_info_table_entry) );
+    memcpy( local_table + string_offset, local_string_table, string_table_offset );
+
     // also need to fill in some things in the stub code
-    // first thing is address of framework path, which is first item in
-    // the string table -- so address of string table
-    (void) __rosetta_add_string( FMWK_PATH );
     // store addresses:
-    // addr of framework path
+    // addr of framework path, which is the first item in the string
+    // table -- so address of string table
     OSWriteBigInt32( stub_code_addr, fmwk_path_offset, string_table );
     // addr of stub binder symbol
     OSWriteBigInt32( stub_code_addr, bind_fn_sym_offset,
@@ -510,30 +609,28 @@ static void __rosetta_create_data_header( void )
 
     OSWriteBigInt16( stub_code_addr, table_offset_hi, hiword );
     OSWriteBigInt16( stub_code_addr, table_offset_lo, loword );
-
-    // setup offsets ready to use when writing info table
-    data_table_offset = data_header_size;
 }
 
-// this fills out the variables in the header block that contain daa
-// modified during hte injection setup process
-static void __rosetta_complete_data_header( void )
+// now we know where the stub code is going to be, point every patch
+// island at it
+static void __rosetta_set_stub_targets( void )
 {
-    // fill in the last field
-    PACK_HEADER_DWORD( info_table_count, info_count );
+    vm_address_t stub_addr = data_table + HDR_OFFSET(stub_helper_interface) +
+                             stub_code_offset;
+    vm_size_t offset;
+
+    for ( offset = 0; offset < high_table_offset; offset += high_entry_size )
+    {
+        OSWriteBigInt32( local_high_table, offset + branch_target_offset, stub_addr );
+    }
 }
 
 // this function will allocate space for the high and low memory jump
-// tables inside the target task. If both those succeed, then it will
-// allocate a two-page block to hold the data table and string table.
-// The data table goes into the first page, the string table into the
-// second. We pretty much assume that the data table won't grow to be
-// 4Kb in size, and that the string table is therefore safe from
-// corruption. If they're likely to grow some more, then this code
-// could be altered to allocate twice as much, etc. We need to have it
-// allocated within the target task NOW however, since any patches we
-// build will need to point themselves at the stub interface code
-// located within this block.
+// tables inside the target task. We need those allocated within the
+// target task NOW, since the caller needs the address of each patch
+// island to build the branch to it. The data table, which holds the
+// stub interface code the islands branch to, isn't allocated until
+// the data is committed; see __rosetta_allocate_data_table().
 static void __rosetta_allocate_tables( task_t taskPort )
 {
     // use vm_allocate to get a couple of pages in or around a couple certain addresses
@@ -660,34 +757,6 @@ static void __rosetta_allocate_tables( task_t taskPort )
                 high_jump_table = page_addr;
                 high_table_size = page_size;
                 high_table_offset = 0;
-
-                // now allocate two page anywhere for the data table +
-                // string table
-                kr = vm_allocate( taskPort, &page_addr, page_size * 2, TRUE );
-
-                if ( kr == KERN_SUCCESS )
-                {
-                    // actual data table uses first page...
-                    data_table = page_addr;
-                    data_table_size = page_size;
-
-                    // ...and is followed by string table
-                    string_table = page_addr + page_size;
-                    string_table_size = page_size;
-                }
-                else
-                {
-                    // deallocate jump tables
-                    (void) vm_deallocate( taskPort, high_jump_table,
-                                          high_table_size );
-                    (void) vm_deallocate( taskPort, low_jump_table,
-                                          low_table_size );
-
-                    high_jump_table = 0;
-                    high_table_size = 0;
-                    low_jump_table = 0;
-                    low_table_size = 0;
-                }
             }
             else
             {
@@ -769,17 +838,33 @@ static void __rosetta_clear_remote_tables( task_t taskPort )
         high_table_size = 0;
     }
     if ( ( data_table != 0 ) &&
-         ( (data_table_size > 0) ||
-           (string_table_size > 0) ) )
+         ( data_table_size > 0 ) )
     {
         (void) vm_deallocate( taskPort, data_table,
-                              data_table_size + string_table_size );
+                              data_table_size );
         data_table = 0;
         data_table_size = 0;
-        string_table_size = 0;
+        string_table = 0;
     }
 }
 
+// allocates the data table in the target task, now that we know
+// exactly how big it has to be
+static int __rosetta_allocate_data_table( task_t taskPort )
+{
+    vm_address_t page_addr = 0;
+    vm_size_t size = __rosetta_data_table_size( );
+    kern_return_t kr = vm_allocate( taskPort, &page_addr, size, TRUE );
+
+    if ( kr != KERN_SUCCESS )
+        return ( 0 );
+
+    data_table = page_addr;
+    data_table_size = size;
+
+    return ( 1 );
+}
+
 // this function looks up the address of the reentry island, ready to
 // pass back to the patch bundle so it can call the original functions
 // it has patched
@@ -928,6 +1013,95 @@ static unsigned __rosetta_get_vmaddr_slide( const char * path )
     return ( result );
 }
 
+// stores a branch target in a patch island; the release order makes
+// sure the patch is there before anyone can branch to it
+static void __rosetta_publish_target( void * volatile * addr, void * value )
+{
+    void * oldVal;
+
+    do
+    {
+        oldVal = *addr;
+
+    } while ( DPAtomicCompareAndSwapPtr( oldVal, value, addr, kDPMemoryOrderRelease ) == 0 );
+}
+
+// Works out the address of every patch which lives in the given
+// bundle, in one pass, and marks their entries as resolved; from then
+// on, none of them need the lock. This is called with rosetta_mutex
+// held, as soon as the bundle has been loaded. If the bundle asked for
+// eager binding, each patch's island is pointed at its patch function
+// straight away too, so the others never come through the binder at
+// all. The bundle can only be loaded from inside the target, so the
+// first call to any of its patches is the earliest we can do this.
+static void __rosetta_resolve_bundle( unsigned key, const char * path )
+{
+    unsigned vmaddr_slide = __rosetta_get_vmaddr_slide( path );
+    unsigned i;
+
+    for ( i = 0; i < info_count; i++ )
+    {
+        struct rosetta_info_table_entry * entry = &pInfoTable[i];
+
+        if ( entry->patch_bundle_path_offset != key )
+            continue;
+
+        entry->patch_fn_addr = (void *) (vmaddr_slide + entry->patch_fn_offset);
+
+        // publish the address before anyone can see the new state
+        (void) DPAtomicCompareAndSwap32( kRosettaUnbound, kRosettaResolved,
+                                         (volatile unsigned int *) &entry->state,
+                                         kDPMemoryOrderRelease );
+
+        if ( entry->flags & kRosettaBindEager )
+        {
+            __rosetta_publish_target( (void * volatile *) entry->branch_target_addr,
+                                      entry->patch_fn_addr );
+        }
+    }
+}
+
+// set up the globals from the data table, the first time through
+static void * pending_table_addr = NULL;
+static pthread_once_t rosetta_globals_once = PTHREAD_ONCE_INIT;
+
+static void __rosetta_init_globals( void )
+{
+    data_table = (vm_address_t) pending_table_addr;
+
+    // well, it *could* happen
+    if ( data_table != 0 )
+    {
+        // pull out the data into the globals
+        struct rosetta_data_table_header *pHdr =
+            (struct rosetta_data_table_header *) data_table;
+        pthread_mutexattr_t mattrs;
+
+        data_table_size = pHdr->data_table_size;
+        string_table_size = pHdr->data_table_size;  // meh
+
+        low_jump_table = pHdr->low_jump_table;
+        low_table_size = pHdr->low_jump_table_size;
+        high_jump_table = pHdr->high_jump_table;
+        high_table_size = pHdr->high_jump_table_size;
+
+        pInfoTable = (struct rosetta_info_table_entry *)
+                     (data_table + pHdr->info_table_offset);
+        info_count = pHdr->info_table_count;
+
+        string_table = data_table + pHdr->string_table_offset;
+
+        pthread_mutexattr_init( &mattrs );
+        pthread_mutexattr_settype( &mattrs, PTHREAD_MUTEX_RECURSIVE );
+        pthread_mutex_init( &rosetta_mutex, &mattrs );
+        pthread_mutexattr_destroy( &mattrs );
+
+        // also take this opportunity to get things deallocated on
+        // exit:
+        atexit( _rosetta_free_tables );
+    }
+}
+
 // This is the C part of the patch bundle runtime loader & linker
 // It takes an index into the patch info table, used to identify the
 // patch being called; the address of the location in which the patch
@@ -935,109 +1109,83 @@ static unsigned __rosetta_get_vmaddr_slide( const char * path )
 // data table.
 // It's an external symbol, since the stub code needs to load this
 // library and lookup the address of this function in order to call it.
+//
+// Only the first call into each bundle takes the mutex, to load it;
+// after that, every patch in the bundle is resolved, and just needs
+// its address publishing.
 void * __rosetta_bind_helper( unsigned index, void * addressPtr,
                               void * data_table_addr )
 {
     // cause access violation on error -- pagezero access
     void * result = NULL;
+    struct rosetta_info_table_entry * entry = NULL;
 
-    // could be the first time this has been called
-    if ( data_table == 0 )
-    {
-        data_table = (vm_address_t) data_table_addr;
-
-        // well, it *could* happen
-        if ( data_table != 0 )
-        {
-            // pull out the data into the globals
-            struct rosetta_data_table_header *pHdr =
-                (struct rosetta_data_table_header *) data_table;
-            pthread_mutexattr_t mattrs;
-
-            data_table_size = pHdr->data_table_size;
-            string_table_size = pHdr->data_table_size;  // meh
+    // could be the first time this has been called; every caller
+    // passes the same table address
+    pending_table_addr = data_table_addr;
+    pthread_once( &rosetta_globals_once, __rosetta_init_globals );
 
-            low_jump_table = pHdr->low_jump_table;
-            low_table_size = pHdr->low_jump_table_size;
-            high_jump_table = pHdr->high_jump_table;
-            high_table_size = pHdr->high_jump_table_size;
-
-            pInfoTable = (struct rosetta_info_table_entry *)
-                         (data_table + pHdr->info_table_offset);
-            info_count = pHdr->info_table_count;
-
-            string_table = data_table + pHdr->string_table_offset;
+    if ( data_table == 0 )
+        return ( NULL );
 
-            pthread_mutexattr_init( &mattrs );
-            pthread_mutexattr_settype( &mattrs, PTHREAD_MUTEX_RECURSIVE );
-            pthread_mutex_init( &rosetta_mutex, &mattrs );
-            pthread_mutexattr_destroy( &mattrs );
+    entry = &pInfoTable[index];
 
-            // also take this opportunity to get things deallocated on
-            // exit:
-            atexit( _rosetta_free_tables );
-        }
+    if ( DPAtomicLoad32( &entry->state, kDPMemoryOrderAcquire ) == kRosettaResolved )
+    {
+        // fast path: bundle's already loaded
+        result = entry->patch_fn_addr;
     }
-
-    if ( data_table != 0 )
+    else if ( pthread_mutex_lock( &rosetta_mutex ) == 0 )
     {
-        if ( pthread_mutex_lock( &rosetta_mutex ) == 0 )
+        unsigned key = entry->patch_bundle_path_offset;
+        const char * path = (const char *) string_table + key;
+        NSModule module = NULL;
+
+        // attempt to load bundle
+        // can't use NSAddImage, since that only works for dylib
+        // binaries, not bundles
+
+        // search for existing header -- another thread may have loaded
+        // it while we were waiting
+        module = __rosetta_lookup_module( key );
+        if ( module == NULL )
         {
-            unsigned key = pInfoTable[index].patch_bundle_path_offset;
-            const char * path = (const char *) string_table + key;
-            unsigned offset = pInfoTable[index].patch_fn_offset;
-            NSModule module = NULL;
-            unsigned vmaddr_slide = 0;
-
-            // attempt to load bundle
-            // can't use NSAddImage, since that only works for dylib
-            // binaries, not bundles
-
-            // search for existing header
-            module = __rosetta_lookup_module( key );
-            if ( module == NULL )
-            {
-                NSSymbol sym = 0;
-                patch_link_fn_t patchlink = NULL;
-
-                // okay, it wasn't loaded yet, so load it
-                module = __rosetta_load_bundle( path, key );
-
-                // now we look up the patch-link function and call it;
-                // this lets the newly loaded code in the bundle get
-                // access to the re-entry island pointers ordinarily
-                // returned from CreatePatch
-                // again, no return-on-error, this will exit on failure
-                sym = NSLookupSymbolInModule( module, kLinkPatchBundleSymbolName );
-                patchlink = NSAddressOfSymbol( sym );
-
-                // we pass it the address of a function here which will
-                // lookup the appropriate pointer from the patch into
-                // table
-                patchlink( __rosetta_lookup_patch, path );
-
-                // patch bundle is now up to date, it has re-entry
-                // addresses for all functions it's patched, that sort
-                // of thing
-            }
-
-            // lib_hdr should never be NULL here -- should exit on
-            // error
-
-            // get vmaddr slide of object image -- needs to look for
-            // name in dyld image table to find it
-            vmaddr_slide = __rosetta_get_vmaddr_slide( path );
+            NSSymbol sym = 0;
+            patch_link_fn_t patchlink = NULL;
+
+            // okay, it wasn't loaded yet, so load it
+            module = __rosetta_load_bundle( path, key );
+
+            // now we look up the patch-link function and call it;
+            // this lets the newly loaded code in the bundle get
+            // access to the re-entry island pointers ordinarily
+            // returned from CreatePatch
+            // again, no return-on-error, this will exit on failure
+            sym = NSLookupSymbolInModule( module, kLinkPatchBundleSymbolName );
+            patchlink = NSAddressOfSymbol( sym );
+
+            // we pass it the address of a function here which will
+            // lookup the appropriate pointer from the patch into
+            // table
+            patchlink( __rosetta_lookup_patch, path );
+
+            // patch bundle is now up to date, it has re-entry
+            // addresses for all functions it's patched, that sort
+            // of thing; work out where all its patches are
+            __rosetta_resolve_bundle( key, path );
+        }
 
-            // calculate patch function address using address slide and
-            // patch offset within image
-            result = (void *) (vmaddr_slide + offset);
+        // module should never be NULL here -- should exit on error
+        result = entry->patch_fn_addr;
 
-            // store this so that future calls go straight to the patch
-            // function, rather than coming here
-            *((void **)addressPtr) = result;
-        }
+        pthread_mutex_unlock( &rosetta_mutex );
     }
 
+    // store this so that future calls go straight to the patch
+    // function, rather than coming here
+    if ( result != NULL )
+        __rosetta_publish_target( (void * volatile *) addressPtr, result );
+
     return ( result );
 }
 
@@ -1055,10 +1203,16 @@ void _rosetta_clear_data( void )
         local_high_table = NULL;
     }
 
-    if ( local_data_table != NULL )
+    if ( local_info_table != NULL )
     {
-        free( local_data_table );
-        local_data_table = NULL;
+        free( local_info_table );
+        local_info_table = NULL;
+    }
+
+    if ( local_string_table != NULL )
+    {
+        free( local_string_table );
+        local_string_table = NULL;
     }
 
     low_jump_table = 0;
@@ -1070,6 +1224,7 @@ void _rosetta_clear_data( void )
     high_table_size = 0;
     data_table_size = 0;
     string_table_size = 0;
+    info_table_size = 0;
 
     low_table_offset = 0;
     high_table_offset = 0;
@@ -1081,13 +1236,20 @@ void _rosetta_clear_data( void )
 int _rosetta_commit_data( task_t taskPort )
 {
     int result = 0;
+    void * local_data_table = NULL;
 
     if ( ( low_jump_table != 0 ) &&
          ( high_jump_table != 0 ) &&
-         ( data_table != 0 ) )
+         ( __rosetta_allocate_data_table( taskPort ) ) )
     {
-        // finish off header block
-        __rosetta_complete_data_header( );
+        // lay out the data table, now we know where it's going
+        local_data_table = calloc( 1, data_table_size );
+    }
+
+    if ( local_data_table != NULL )
+    {
+        __rosetta_build_data_table( local_data_table );
+        __rosetta_set_stub_targets( );
 
         // copy local data blocks into remote process
         kern_return_t kr = vm_write( taskPort, low_jump_table,
@@ -1100,20 +1262,15 @@ int _rosetta_commit_data( task_t taskPort )
                            high_table_size );
             if ( kr == KERN_SUCCESS )
             {
+                // header, stub code, info & string tables all go in
+                // one write
                 kr = vm_write( taskPort, data_table,
                                (vm_address_t) local_data_table,
-                               data_table_size + string_table_size );
+                               data_table_size );
                 if ( kr == KERN_SUCCESS )
                 {
                     result = 1;
 
-                    // byte-swap the address before writing it out
-                    /*unsigned swapped = 0;
-                    OSWriteBigInt32( &swapped, 0, data_table );
-                    (void) vm_write( taskPort, _table_address_storage_addr,
-                                     (vm_address_t) &swapped,
-                                     sizeof(void *) );*/
-
                     (void) vm_msync( taskPort, low_jump_table,
                                      low_table_size,
                                      VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
@@ -1121,11 +1278,13 @@ int _rosetta_commit_data( task_t taskPort )
                                      high_table_size,
                                      VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
                     (void) vm_msync( taskPort, data_table,
-                                     data_table_size + string_table_size,
+                                     data_table_size,
                                      VM_SYNC_INVALIDATE | VM_SYNC_SYNCHRONOUS );
                 }
             }
         }
+
+        free( local_data_table );
     }
 
     if ( result == 0 )
@@ -1138,7 +1297,8 @@ int _rosetta_commit_data( task_t taskPort )
 }
 
 unsigned _rosetta_install_patch_stub( void * targetAddr, unsigned patchOffset,
-                                      const UInt8 * urlStr, task_t taskPort )
+                                      const UInt8 * urlStr, int eagerBind,
+                                      task_t taskPort )
 {
     unsigned result = 0;
 
@@ -1157,10 +1317,10 @@ unsigned _rosetta_install_patch_stub( void * targetAddr, unsigned patchOffset,
         // allocate local versions to work on, too
         local_low_table = malloc( low_table_size );
         local_high_table = malloc( high_table_size );
-        local_data_table = malloc( data_table_size + string_table_size );
 
-        // generate initial header data
-        __rosetta_create_data_header( );
+        // the framework path is always the first item in the string
+        // table; the stub code needs its address
+        (void) __rosetta_add_string( FMWK_PATH );
     }
 
     if ( (high_jump_table != 0) &&
@@ -1188,7 +1348,9 @@ unsigned _rosetta_install_patch_stub( void * targetAddr, unsigned patchOffset,
 
         size_t low_size = 0, high_size = 0;
 
-        vm_address_t stub_addr = data_table + HDR_OFFSET(stub_helper_interface) + stub_code_offset;
+        // the stub code's address isn't known until the data table is
+        // allocated, so that gets filled in by _rosetta_commit_data()
+        vm_address_t stub_addr = 0;
 
         // read first instruction of function to patch
         vm_read_overwrite( taskPort, (vm_address_t) fn_addr, 4,
@@ -1213,7 +1375,9 @@ unsigned _rosetta_install_patch_stub( void * targetAddr, unsigned patchOffset,
             // this increments the info_count global
             (void) __rosetta_create_info_entry( (void *) (low_table_entry + 8),
                                                 (const char *) urlStr,
-                                                patchOffset );
+                                                patchOffset,
+                                                high_table_entry + branch_target_offset,
+                                                eagerBind ? kRosettaBindEager : 0 );
 
             // update offsets, ready for the next patches
             low_table_offset += low_size;
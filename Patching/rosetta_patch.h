@@ -82,12 +82,17 @@ int _rosetta_commit_data( task_t taskPort );
          function itself.
  @param urlStr A URL (used to create a CFURLRef) indicating the
          location of the patch bundle.
+ @param eagerBind Nonzero to have every patch from this bundle bound
+         as soon as the bundle is loaded in the target, rather than
+         each one being bound the first time it's called. See
+         @link kRosettaEagerBindingKey kRosettaEagerBindingKey @/link.
  @param taskPort The Mach port of the target task.
  @result Returns the PowerPC branch absolute instruction, which the
          caller will need to install in the target function.
  */
 unsigned int _rosetta_install_patch_stub( void * targetAddr, unsigned patchOffset,
-                                          const UInt8 * urlStr, task_t taskPort );
+                                          const UInt8 * urlStr, int eagerBind,
+                                          task_t taskPort );
 
 __END_DECLS
 
@@ -0,0 +1,492 @@
+/*
+ *  safe_point.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 20/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "patch_registry.h"
+#include "timing.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_act.h>
+#include <mach/thread_status.h>
+
+// Installing a batch of patches happens in three passes. First, with
+// everything still running, the islands for every new patch are built
+// (and anything which only needs a handler added to an existing chain
+// gets done straight away). Then every other thread in the task is
+// suspended, the targets are rewritten, and any thread caught inside
+// the rewritten bytes is moved across into the matching re-entry
+// island. Finally the threads are resumed and the new patches are
+// entered into the registry.
+//
+// While the threads are stopped we can't do anything which might need
+// a lock one of them is holding: no malloc(), no logging, and nothing
+// which might call either. Anything we need is allocated beforehand,
+// and errors are noted and reported once everyone is running again.
+
+enum
+{
+    kRequestFailed = 0,
+    kRequestPrepared,       // islands built, target not yet touched
+    kRequestDeferred,       // same target as an earlier request in the batch
+    kRequestDone            // installed, reentry already filled in
+};
+
+// these work on any thread of our own architecture, so they're also
+// used by remote_patch.c
+void * __get_thread_pc( thread_act_t thread )
+{
+    kern_return_t kr;
+#if defined(__ppc__)
+    struct ppc_thread_state state;
+    mach_msg_type_number_t count = PPC_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, PPC_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+        return ( (void *) state.srr0 );
+#elif defined(__i386__)
+    i386_thread_state_t state;
+    mach_msg_type_number_t count = i386_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, i386_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+        return ( (void *) state.eip );
+#endif
+
+    return ( NULL );
+}
+
+int __set_thread_pc( thread_act_t thread, void * pc )
+{
+    kern_return_t kr = KERN_FAILURE;
+#if defined(__ppc__)
+    struct ppc_thread_state state;
+    mach_msg_type_number_t count = PPC_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, PPC_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+    {
+        state.srr0 = (unsigned int) pc;
+        kr = thread_set_state( thread, PPC_THREAD_STATE, (thread_state_t) &state, count );
+    }
+#elif defined(__i386__)
+    i386_thread_state_t state;
+    mach_msg_type_number_t count = i386_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, i386_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+    {
+        state.eip = (unsigned int) pc;
+        kr = thread_set_state( thread, i386_THREAD_STATE, (thread_state_t) &state, count );
+    }
+#endif
+
+    return ( kr == KERN_SUCCESS );
+}
+
+// A call among the overwritten instructions -- the call/pop pair which
+// fetches the PIC base, say -- leaves a return address part-way into
+// them, just as a program counter can be. Those are moved the same way.
+// Only the words nearest the stack pointer are checked: the thread has
+// to have stopped inside the callee, and anything called that early is
+// usually a leaf like ___i686.get_pc_thunk.bx.
+#define kReturnAddressScanWords     64
+
+static void * get_thread_sp( thread_act_t thread )
+{
+    kern_return_t kr;
+#if defined(__ppc__)
+    struct ppc_thread_state state;
+    mach_msg_type_number_t count = PPC_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, PPC_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+        return ( (void *) state.r1 );
+#elif defined(__i386__)
+    i386_thread_state_t state;
+    mach_msg_type_number_t count = i386_THREAD_STATE_COUNT;
+
+    kr = thread_get_state( thread, i386_THREAD_STATE, (thread_state_t) &state, &count );
+    if ( kr == KERN_SUCCESS )
+        return ( (void *) state.esp );
+#endif
+
+    return ( NULL );
+}
+
+unsigned int __relocate_return_addresses( task_t task, thread_act_t thread,
+                                          const struct pending_patch * pending,
+                                          unsigned int count, unsigned int * failed )
+{
+    vm_address_t words[kReturnAddressScanWords];
+    vm_address_t sp = (vm_address_t) get_thread_sp( thread );
+    vm_size_t got = 0;
+    unsigned int moved = 0;
+    unsigned int i, j;
+
+    if ( sp == 0 )
+        return ( 0 );
+
+    // a thread near the base of its stack has fewer words than that
+    // above it; read a page at a time, and stop at the first one which
+    // isn't there
+    while ( got < sizeof(words) )
+    {
+        vm_size_t chunk = vm_page_size - ( (sp + got) & (vm_page_size - 1) );
+        vm_size_t read_size = 0;
+
+        if ( chunk > sizeof(words) - got )
+            chunk = sizeof(words) - got;
+
+        if ( vm_read_overwrite( task, sp + got, chunk,
+                                (vm_address_t) words + got, &read_size ) != KERN_SUCCESS )
+            break;
+
+        got += read_size;
+    }
+
+    for ( i = 0; i < got / sizeof(vm_address_t); i++ )
+    {
+        for ( j = 0; j < count; j++ )
+        {
+            vm_address_t new_addr;
+
+            if ( !pending[j].committed )
+                continue;
+
+            new_addr = (vm_address_t) __relocate_pc( &pending[j], (void *) words[i] );
+            if ( new_addr == 0 )
+                continue;
+
+            if ( vm_write( task, sp + (i * sizeof(vm_address_t)), (vm_offset_t) &new_addr,
+                           sizeof(vm_address_t) ) == KERN_SUCCESS )
+                moved++;
+            else if ( failed != NULL )
+                (*failed)++;
+
+            break;
+        }
+    }
+
+    return ( moved );
+}
+
+#pragma mark -
+
+// undoes what __prepare_patch() allocated for a patch which will never
+// be committed. Its islands stay where they are, since arena space is
+// never freed, but nothing refers to them.
+static void discard_prepared_patch( struct pending_patch * pending )
+{
+    free( pending->entry.chain );
+    bzero( pending, sizeof(struct pending_patch) );
+}
+
+unsigned int DPCreatePatchBatch( DPPatchRequest * requests, unsigned int count,
+                                 DPPatchBatchReport * report )
+{
+    struct pending_patch * pending = NULL;
+    int * state = NULL;
+    thread_act_array_t threads = NULL;
+    mach_msg_type_number_t thread_count = 0;
+    thread_act_t self = MACH_PORT_NULL;
+    unsigned int * suspended = NULL;
+    unsigned long long start = 0, end = 0;
+    unsigned int num_prepared = 0;
+    unsigned int num_suspended = 0, num_moved = 0, num_moves_failed = 0;
+    unsigned int result = 0;
+    unsigned int i, j;
+    kern_return_t kr;
+
+    if ( report != NULL )
+        bzero( report, sizeof(DPPatchBatchReport) );
+
+    if ( ( requests == NULL ) || ( count == 0 ) )
+    {
+        LogError( "No requests supplied to DPCreatePatchBatch()" );
+        return ( 0 );
+    }
+
+    pending = (struct pending_patch *) calloc( count, sizeof(struct pending_patch) );
+    state = (int *) calloc( count, sizeof(int) );
+    if ( ( pending == NULL ) || ( state == NULL ) )
+    {
+        LogError( "Unable to allocate memory for %u patch requests", count );
+        free( pending );
+        free( state );
+        return ( 0 );
+    }
+
+    __patch_lock( );
+
+    // build all the islands while everything's still running
+    for ( i = 0; i < count; i++ )
+    {
+        DPPatchRequest * request = &requests[i];
+        struct patch_entry * existing = NULL;
+
+        request->reentry = NULL;
+        state[i] = kRequestFailed;
+
+        if ( ( request->fn_addr == NULL ) || ( request->patch_addr == NULL ) )
+        {
+            LogError( "NULL values supplied to DPCreatePatchBatch() ! fn_addr = %#x, "
+                      "patch_addr = %#x", (unsigned) request->fn_addr,
+                      (unsigned) request->patch_addr );
+            continue;
+        }
+
+        if ( !__check_patch_options( request->options ) )
+            continue;
+
+        // already patched: adding a handler doesn't touch the code, so
+        // there's no need to wait for the other threads to stop
+        existing = __patch_registry_lookup( request->fn_addr );
+        if ( existing != NULL )
+        {
+            request->reentry = __patch_chain_add( existing, request->patch_addr,
+                                                  request->priority );
+            if ( request->reentry != NULL )
+                state[i] = kRequestDone;
+            continue;
+        }
+
+        // patched earlier in this batch? then it becomes a handler once
+        // that one has been registered
+        for ( j = 0; j < i; j++ )
+        {
+            if ( ( state[j] == kRequestPrepared ) &&
+                 ( requests[j].fn_addr == request->fn_addr ) )
+                break;
+        }
+        if ( j < i )
+        {
+            state[i] = kRequestDeferred;
+            continue;
+        }
+
+        if ( __prepare_patch( request->fn_addr, request->patch_addr, request->options,
+                              request->priority, &pending[i] ) )
+        {
+            state[i] = kRequestPrepared;
+            num_prepared++;
+        }
+        else
+        {
+            LogError( "Unable to build patch islands for %#x",
+                      (unsigned) request->fn_addr );
+        }
+    }
+
+    if ( num_prepared > 0 )
+    {
+        // suspended[] needs allocating before anyone's stopped, too
+        kr = task_threads( mach_task_self( ), &threads, &thread_count );
+        if ( kr != KERN_SUCCESS )
+        {
+            LogError( "DPCreatePatchBatch(): task_threads() failed: %d", kr );
+            threads = NULL;
+            thread_count = 0;
+        }
+        else if ( ( suspended = (unsigned int *) calloc( thread_count + 1,
+                                                          sizeof(unsigned int) ) ) == NULL )
+        {
+            LogError( "Unable to allocate memory for %u threads", thread_count );
+        }
+
+        // writing the targets with everything still running is exactly
+        // what a safe-point patch is meant to avoid, so give up instead
+        if ( suspended == NULL )
+        {
+            LogError( "DPCreatePatchBatch(): unable to stop other threads; "
+                      "%u patch(es) not installed", num_prepared );
+
+            for ( i = 0; i < count; i++ )
+            {
+                if ( state[i] != kRequestPrepared )
+                    continue;
+
+                discard_prepared_patch( &pending[i] );
+                state[i] = kRequestFailed;
+            }
+        }
+
+        self = mach_thread_self( );
+
+        // === nothing below may allocate, lock, or log ===
+
+        start = mach_absolute_time( );
+
+        if ( suspended != NULL )
+        {
+            for ( i = 0; i < thread_count; i++ )
+            {
+                if ( threads[i] == self )
+                    continue;
+
+                // a thread which has gone away since task_threads() is
+                // no threat to anyone
+                if ( thread_suspend( threads[i] ) == KERN_SUCCESS )
+                {
+                    suspended[i] = 1;
+                    num_suspended++;
+                }
+            }
+        }
+
+        for ( i = 0; i < count; i++ )
+        {
+            if ( state[i] != kRequestPrepared )
+                continue;
+
+            // a failure here is picked up by __finish_patch() later
+            if ( !__commit_patch( &pending[i] ) )
+                continue;
+
+            for ( j = 0; j < thread_count; j++ )
+            {
+                void * pc = NULL;
+                void * new_pc = NULL;
+
+                if ( ( suspended == NULL ) || ( !suspended[j] ) )
+                    continue;
+
+                pc = __get_thread_pc( threads[j] );
+                new_pc = __relocate_pc( &pending[i], pc );
+
+                if ( new_pc != NULL )
+                {
+                    if ( __set_thread_pc( threads[j], new_pc ) )
+                        num_moved++;
+                    else
+                        num_moves_failed++;
+                }
+            }
+        }
+
+        // one pass over each thread's stack covers every patch
+        for ( j = 0; j < thread_count; j++ )
+        {
+            if ( ( suspended != NULL ) && ( suspended[j] ) )
+            {
+                num_moved += __relocate_return_addresses( mach_task_self( ), threads[j],
+                                                          pending, count,
+                                                          &num_moves_failed );
+            }
+        }
+
+        if ( suspended != NULL )
+        {
+            for ( i = 0; i < thread_count; i++ )
+            {
+                if ( suspended[i] )
+                    (void) thread_resume( threads[i] );
+            }
+        }
+
+        end = mach_absolute_time( );
+
+        // === everyone's running again ===
+
+        for ( i = 0; i < thread_count; i++ )
+            (void) mach_port_deallocate( mach_task_self( ), threads[i] );
+
+        if ( threads != NULL )
+        {
+            (void) vm_deallocate( mach_task_self( ), (vm_address_t) threads,
+                                  thread_count * sizeof(thread_act_t) );
+        }
+
+        if ( self != MACH_PORT_NULL )
+            (void) mach_port_deallocate( mach_task_self( ), self );
+
+        free( suspended );
+
+        if ( num_moves_failed > 0 )
+        {
+            LogEmergency( "DPCreatePatchBatch(): unable to move %u thread(s) out of "
+                          "patched code", num_moves_failed );
+        }
+
+        DEBUGLOG( "Patch batch: %u threads suspended for %llu usec, %u moved",
+                  num_suspended, AbsoluteToMicroseconds( end - start ), num_moved );
+    }
+
+    // register everything which went in
+    for ( i = 0; i < count; i++ )
+    {
+        if ( state[i] != kRequestPrepared )
+            continue;
+
+        requests[i].reentry = __finish_patch( &pending[i] );
+
+        if ( requests[i].reentry != NULL )
+        {
+            state[i] = kRequestDone;
+        }
+        else
+        {
+            state[i] = kRequestFailed;
+            LogError( "Function at %#x changed while it was being patched",
+                      (unsigned) requests[i].fn_addr );
+        }
+    }
+
+    // and now the earlier duplicates are registered, add the rest to
+    // their chains
+    for ( i = 0; i < count; i++ )
+    {
+        struct patch_entry * existing = NULL;
+
+        if ( state[i] != kRequestDeferred )
+            continue;
+
+        existing = __patch_registry_lookup( requests[i].fn_addr );
+        if ( existing != NULL )
+        {
+            requests[i].reentry = __patch_chain_add( existing, requests[i].patch_addr,
+                                                     requests[i].priority );
+        }
+
+        state[i] = ( requests[i].reentry != NULL ) ? kRequestDone : kRequestFailed;
+    }
+
+    __patch_unlock( );
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( state[i] == kRequestDone )
+            result++;
+    }
+
+    free( state );
+    free( pending );
+
+    if ( report != NULL )
+    {
+        report->pause_usec = AbsoluteToMicroseconds( end - start );
+        report->threads_suspended = num_suspended;
+        report->threads_moved = num_moved;
+        report->patches_installed = result;
+    }
+
+    return ( result );
+}
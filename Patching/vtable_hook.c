@@ -0,0 +1,330 @@
+/*
+ *  vtable_hook.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 27/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include "Patching.h"
+#include "Lookup.h"
+#include "atomic.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <mach-o/dyld.h>
+
+// A C++ class's virtual functions are called through its vtable, which
+// the GCC 3.x/4.x ABI exports as '_ZTV' followed by the mangled class
+// name. The symbol's address is the start of the table: the offset to
+// the top of the object and a pointer to the class's typeinfo, then
+// the function pointers. Objects point at the first function pointer,
+// so that's slot zero.
+
+// see ppc_patch.c or ia32_patch.c
+extern int __make_writable( void * addr );
+
+// words in front of the first function pointer
+#define kVTableHeaderWords      2
+
+// longest mangled vtable name we'll build
+#define kMaxVTableSymbol        256
+
+// far more slots than any real class has; a bigger one could wrap the
+// slot address round and land back inside the vtable
+#define kMaxVTableSlots         0x10000
+
+// one swapped slot, kept so it can be put back
+struct vtable_slot
+{
+    void **     addr;
+    void *      original;
+    void *      replacement;
+};
+
+static pthread_mutex_t      vtable_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vtable_slot * vtable_slots = NULL;
+static unsigned int         vtable_slot_count = 0;
+static unsigned int         vtable_slot_capacity = 0;
+
+static int remember_slot( void ** addr, void * original, void * replacement )
+{
+    if ( vtable_slot_count == vtable_slot_capacity )
+    {
+        unsigned int capacity = ( vtable_slot_capacity == 0 ) ? 32 : vtable_slot_capacity * 2;
+        struct vtable_slot * slots = (struct vtable_slot *) realloc( vtable_slots,
+                                                 capacity * sizeof(struct vtable_slot) );
+
+        if ( slots == NULL )
+            return ( 0 );
+
+        vtable_slots = slots;
+        vtable_slot_capacity = capacity;
+    }
+
+    vtable_slots[vtable_slot_count].addr = addr;
+    vtable_slots[vtable_slot_count].original = original;
+    vtable_slots[vtable_slot_count].replacement = replacement;
+    vtable_slot_count++;
+
+    return ( 1 );
+}
+
+#pragma mark -
+
+// Builds the vtable symbol for a class name, without the leading
+// underscore the compiler adds. 'Foo' becomes '_ZTV3Foo' and 'ns::Foo'
+// becomes '_ZTVN2ns3FooE'; anything which already looks mangled (it
+// starts with a digit, or an 'N' and a digit) is used as it is.
+static int vtable_symbol( const char * class_name, char * symbol, size_t size )
+{
+    const char * component = class_name;
+    const char * end = NULL;
+    size_t used = 0;
+    int nested = ( strstr( class_name, "::" ) != NULL );
+
+    if ( isdigit( class_name[0] ) ||
+         ( ( class_name[0] == 'N' ) && isdigit( class_name[1] ) ) )
+    {
+        return ( snprintf( symbol, size, "_ZTV%s", class_name ) < (int) size );
+    }
+
+    used = snprintf( symbol, size, nested ? "_ZTVN" : "_ZTV" );
+
+    while ( ( used < size ) && ( *component != '\0' ) )
+    {
+        end = strstr( component, "::" );
+        if ( end == NULL )
+            end = component + strlen( component );
+
+        used += snprintf( symbol + used, size - used, "%d%.*s", (int) (end - component),
+                          (int) (end - component), component );
+
+        component = ( *end == '\0' ) ? end : end + 2;
+    }
+
+    if ( ( nested ) && ( used < size ) )
+        used += snprintf( symbol + used, size - used, "E" );
+
+    return ( used < size );
+}
+
+static int image_matches( const char * image_name, const char * module )
+{
+    const char * leaf = NULL;
+
+    if ( image_name == NULL )
+        return ( 0 );
+
+    if ( module[0] == '/' )
+        return ( strcmp( image_name, module ) == 0 );
+
+    leaf = strrchr( image_name, '/' );
+    leaf = ( leaf != NULL ) ? leaf + 1 : image_name;
+
+    return ( strcmp( leaf, module ) == 0 );
+}
+
+// Looks a vtable up in the symbol table of a loaded image. That gives
+// the address the image was linked at, so the image's slide has to be
+// added; that means searching the file of each loaded image called
+// 'module', rather than letting the Lookup code pick one.
+static void ** find_unexported_vtable( const char * nlist_symbol, const char * module )
+{
+    const struct mach_header * header = NULL;
+    const char * image_name = NULL;
+    void * addr = NULL;
+    Dl_info info;
+    unsigned long i, count = _dyld_image_count( );
+
+    for ( i = 0; i < count; i++ )
+    {
+        header = _dyld_get_image_header( i );
+        image_name = _dyld_get_image_name( i );
+
+        if ( ( header == NULL ) || ( !image_matches( image_name, module ) ) )
+            continue;
+
+        addr = DPFindFunctionAddress( nlist_symbol, image_name );
+        if ( addr == NULL )
+            continue;
+
+        addr = (void *) ((unsigned long) addr + _dyld_get_image_vmaddr_slide( i ));
+
+        // make sure that really is inside the image before we write to it
+        if ( ( dladdr( addr, &info ) != 0 ) && ( info.dli_fbase == (void *) header ) )
+            return ( (void **) addr );
+
+        LogError( "Symbol %s doesn't lie in image '%s'", nlist_symbol, image_name );
+    }
+
+    return ( NULL );
+}
+
+static void ** find_vtable_slot( const char * class_name, const char * module,
+                                 unsigned int slot )
+{
+    char symbol[kMaxVTableSymbol];
+    void ** vtable = NULL;
+    void ** addr = NULL;
+    Dl_info info;
+
+    if ( !vtable_symbol( class_name, symbol, sizeof(symbol) ) )
+    {
+        LogError( "Class name '%s' is too long", class_name );
+        return ( NULL );
+    }
+
+    // exported vtables are quickest found through dyld, which also
+    // accounts for where the image was loaded
+    vtable = (void **) dlsym( RTLD_DEFAULT, symbol );
+
+    // the symbol table has the extra underscore
+    if ( ( vtable == NULL ) && ( module != NULL ) )
+    {
+        char nlist_symbol[kMaxVTableSymbol + 1];
+
+        snprintf( nlist_symbol, sizeof(nlist_symbol), "_%s", symbol );
+        vtable = find_unexported_vtable( nlist_symbol, module );
+    }
+
+    if ( vtable == NULL )
+    {
+        LogError( "Unable to find the vtable for class '%s' (%s)", class_name, symbol );
+        return ( NULL );
+    }
+
+    // Nothing records how long a vtable is, but the nearest symbol to
+    // a slot inside it is the vtable itself; a slot past the end finds
+    // whatever comes next instead. A vtable dladdr() can't see at all
+    // can't be checked, so it isn't touched.
+    addr = vtable + kVTableHeaderWords + slot;
+    if ( ( slot >= kMaxVTableSlots ) || ( dladdr( addr, &info ) == 0 ) ||
+         ( info.dli_saddr != (void *) vtable ) )
+    {
+        LogError( "Slot %u is outside the vtable for class '%s'", slot, class_name );
+        return ( NULL );
+    }
+
+    return ( addr );
+}
+
+// called with vtable_mutex held
+static void * hook_slot( const char * class_name, const char * module,
+                         unsigned int slot, void * replacement )
+{
+    void ** addr = find_vtable_slot( class_name, module, slot );
+    void * original = NULL;
+
+    if ( addr == NULL )
+        return ( NULL );
+
+    if ( !__make_writable( addr ) )
+        return ( NULL );
+
+    do
+    {
+        original = *addr;
+
+    } while ( DPAtomicCompareAndSwapPtr( original, replacement, addr,
+                                         kDPMemoryOrderSequential ) == 0 );
+
+    if ( !remember_slot( addr, original, replacement ) )
+        LogError( "Virtual method %u of '%s' hooked, but won't be restorable",
+                  slot, class_name );
+
+    DEBUGLOG( "Hooked virtual method %u of '%s' at %#x", slot, class_name,
+              (unsigned) addr );
+
+    return ( original );
+}
+
+#pragma mark -
+
+void * DPHookVirtualMethod( const char * class_name, const char * module,
+                            unsigned int slot, void * replacement )
+{
+    void * original = NULL;
+
+    if ( ( class_name == NULL ) || ( replacement == NULL ) )
+        return ( NULL );
+
+    pthread_mutex_lock( &vtable_mutex );
+    original = hook_slot( class_name, module, slot, replacement );
+    pthread_mutex_unlock( &vtable_mutex );
+
+    return ( original );
+}
+
+unsigned int DPHookVirtualMethods( DPVirtualMethodHook * hooks, unsigned int count )
+{
+    unsigned int i, hooked = 0;
+
+    if ( hooks == NULL )
+        return ( 0 );
+
+    pthread_mutex_lock( &vtable_mutex );
+
+    for ( i = 0; i < count; i++ )
+    {
+        hooks[i].original = NULL;
+
+        if ( ( hooks[i].class_name == NULL ) || ( hooks[i].replacement == NULL ) )
+            continue;
+
+        hooks[i].original = hook_slot( hooks[i].class_name, hooks[i].module,
+                                       hooks[i].slot, hooks[i].replacement );
+        if ( hooks[i].original != NULL )
+            hooked++;
+    }
+
+    pthread_mutex_unlock( &vtable_mutex );
+
+    return ( hooked );
+}
+
+unsigned int DPUnhookVirtualMethod( void * replacement )
+{
+    unsigned int i, restored = 0;
+
+    pthread_mutex_lock( &vtable_mutex );
+
+    // newest first, so a slot hooked twice with the same function ends
+    // up back where it started
+    i = vtable_slot_count;
+    while ( i-- > 0 )
+    {
+        struct vtable_slot * slot = &vtable_slots[i];
+
+        if ( slot->replacement != replacement )
+            continue;
+
+        // leave it alone if someone else has changed it since
+        if ( DPAtomicCompareAndSwapPtr( replacement, slot->original, slot->addr,
+                                        kDPMemoryOrderSequential ) )
+            restored++;
+
+        memmove( slot, slot + 1, (vtable_slot_count - i - 1) * sizeof(struct vtable_slot) );
+        vtable_slot_count--;
+    }
+
+    pthread_mutex_unlock( &vtable_mutex );
+
+    return ( restored );
+}
@@ -69,6 +69,118 @@
  */
 #define kLinkPatchBundleSymbolName      "_LinkPatches"
 
+/*!
+ @defined kRosettaEagerBindingKey
+ @abstract Info.plist key selecting eager binding for a Rosetta bundle.
+ @discussion Patches installed into a Rosetta process are normally
+         bound lazily: the first call to each patched function goes
+         through the stub binder, which loads the bundle if necessary
+         and looks up that one patch function. If a Rosetta patch
+         bundle's Info.plist sets this key to <code>true</code>, then
+         as soon as the bundle is loaded, every patch it installed is
+         bound in one pass, so only the very first call into any of
+         them pays for the binding.
+ */
+#define kRosettaEagerBindingKey         "DPRosettaEagerBinding"
+
+/*!
+ @defined kPatchTargetApplicationsKey
+ @abstract Info.plist key listing the applications a bundle patches.
+ @discussion An array of application names. When all installed
+         bundles are loaded into a native process, a bundle which
+         sets this key is skipped unless the process name matches one
+         of them, and its executable is never loaded. The names may
+         contain <code>fnmatch()</code> wildcards. For Rosetta
+         processes, the list is recorded in the bundle's patch
+         manifest, and checked when the manifest is used in place of
+         the bundle's
+         @link kWillPatchFunctionName kWillPatchFunctionName @/link
+         function. If the key is missing, the bundle patches every
+         application.
+ */
+#define kPatchTargetApplicationsKey     "DPTargetApplications"
+
+/*!
+ @defined kPatchTargetPathsKey
+ @abstract Info.plist key listing the executables a bundle patches.
+ @discussion An array of <code>fnmatch()</code> patterns, matched against
+         the full path of a native process's executable, such as
+         <code>/Applications/*.app/Contents/MacOS/*</code>. Like
+         @link kPatchTargetApplicationsKey kPatchTargetApplicationsKey @/link,
+         a bundle which sets this key is only loaded into processes
+         which match. If a bundle sets several of these keys, a process
+         has to match all of them.
+ */
+#define kPatchTargetPathsKey            "DPTargetExecutablePaths"
+
+/*!
+ @defined kPatchTargetProcessIDsKey
+ @abstract Info.plist key listing the process IDs a bundle patches.
+ @discussion An array of strings, each either a single process ID, a
+         range such as <code>"100-499"</code>, or <code>"*"</code>.
+         Works in the same way as
+         @link kPatchTargetPathsKey kPatchTargetPathsKey @/link.
+ */
+#define kPatchTargetProcessIDsKey       "DPTargetProcessIDs"
+
+/*!
+ @defined kPatchDependenciesKey
+ @abstract Info.plist key listing bundles which must start first.
+ @discussion An array of bundle identifiers. When all installed bundles
+         are loaded into a native process, this bundle's
+         @link kStartFunctionName kStartFunctionName @/link function
+         won't be called until the start functions of all the listed
+         bundles have returned. Bundles which aren't installed, or
+         which don't patch the current process, are ignored.
+ */
+#define kPatchDependenciesKey           "DPPatchDependencies"
+
+/*!
+ @defined kPatchThreadSafeStartKey
+ @abstract Info.plist key marking a bundle's start function thread-safe.
+ @discussion Patch bundles are loaded several at a time, but a start
+         function is called on the thread injected into the process,
+         while no other bundle is being loaded or started. If a
+         bundle's Info.plist sets this key to <code>true</code>, its
+         start function may instead be called on another thread, at
+         the same time as other bundles are loaded and other
+         thread-safe start functions run, once its dependencies have
+         started.
+ */
+#define kPatchThreadSafeStartKey        "DPPatchStartIsThreadSafe"
+
+/*!
+ @defined kPatchManifestReplacesWillPatchKey
+ @abstract Info.plist key allowing a Rosetta bundle's manifest to be used.
+ @discussion A bundle with a patch manifest isn't loaded into the
+         injector, so its
+         @link kWillPatchFunctionName kWillPatchFunctionName @/link
+         function can't be asked whether it wants to patch the target.
+         Its manifest is only used if the bundle sets this key to
+         <code>true</code>, saying that the manifest's target and the
+         names under
+         @link kPatchTargetApplicationsKey kPatchTargetApplicationsKey @/link
+         are all the choosing it needs. Otherwise the manifest is
+         ignored, and the bundle is loaded and asked as usual.
+ */
+#define kPatchManifestReplacesWillPatchKey  "DPPatchManifestReplacesWillPatch"
+
+/*!
+ @defined kPatchManifestResourceName
+ @abstract The name of a patch bundle's manifest resource.
+ @discussion The Rosetta injector looks in the patch bundle's resources
+         for a file with this name and the extension
+         @link kPatchManifestResourceType kPatchManifestResourceType @/link.
+         See @link DPWritePatchManifest DPWritePatchManifest @/link.
+ */
+#define kPatchManifestResourceName      "DPPatchManifest"
+
+/*!
+ @defined kPatchManifestResourceType
+ @abstract The file extension of a patch bundle's manifest resource.
+ */
+#define kPatchManifestResourceType      "dpmanifest"
+
 /*!
  @typedef __bundle_start_fn
  @abstract Function type for native patch bundle entry point.
@@ -189,4 +301,55 @@ typedef void (*patch_link_fn_t)( patch_lookup_fn_t fn, const char * exec_path );
  */
 DP_API void DPPatchRemoteTask( pid_t pid, const char * path_to_patch );
 
+/*!
+ @function DPWritePatchManifest
+ @abstract Precompute the Rosetta patch details for a patch bundle.
+ @discussion Normally, injecting into a Rosetta process means loading
+         every patch bundle into the injector, calling its
+         @link kWillPatchFunctionName kWillPatchFunctionName @/link and
+         @link kGetPatchDetailsFunctionName kGetPatchDetailsFunctionName @/link
+         functions, and looking up each of its patch functions in its
+         PowerPC executable. This function does all that once, and
+         writes the results to a manifest file, which the injector will
+         use instead of loading the bundle.
+
+         Nothing in the library's own build calls this. It's meant to
+         be run from a small tool by a Run Script build phase, as the
+         last step in building the patch bundle, with the built bundle
+         and the application it patches; the PatchManifest example is
+         such a tool:
+
+         <pre>"$BUILT_PRODUCTS_DIR/PatchManifest" "$BUILT_PRODUCTS_DIR/$WRAPPER_NAME" "$TARGET_EXECUTABLE"</pre>
+
+         where <code>TARGET_EXECUTABLE</code> is a build setting holding
+         the full path of the target application's executable.
+
+         Since it loads the bundle's PowerPC code, it has to be run on
+         a PowerPC Mac or under Rosetta.
+
+         A bundle with a manifest doesn't get asked whether it wants to
+         patch an application; instead, the application names listed
+         under @link kPatchTargetApplicationsKey kPatchTargetApplicationsKey @/link
+         in its Info.plist are checked. For that reason, the manifest is
+         only used if the bundle also sets
+         @link kPatchManifestReplacesWillPatchKey kPatchManifestReplacesWillPatchKey @/link,
+         and no manifest is written for a bundle which doesn't.
+
+         The manifest is specific to the system it was made on, to the
+         bundle executable it describes, and to the target executable
+         whose addresses it holds. If any of them changes, or the
+         process being injected wasn't started from the target
+         executable, the injector ignores the manifest and loads the
+         bundle as usual.
+ @param bundle_path The path to the patch bundle.
+ @param target_path The full path of the executable of the application
+         the bundle patches.
+ @param manifest_path Where to write the manifest. If NULL, it's
+         written into the bundle's Resources folder, using the name the
+         injector looks for.
+ @result Nonzero on success.
+ */
+DP_API int DPWritePatchManifest( const char * bundle_path, const char * target_path,
+                                 const char * manifest_path );
+
 #endif  /* __DP_INJECTION_H__*/
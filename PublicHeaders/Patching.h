@@ -21,6 +21,9 @@
 
 #include "DPAPI.h"
 
+#include <sys/types.h>          // for pid_t
+#include <mach/mach_types.h>    // for task_t
+
 /*!
  @header Patching
  @author Jim Dovey
@@ -132,14 +135,746 @@ DP_API void * DPCreatePatch( void * fn_addr, void * patch_addr );
  @seealso //apple_ref/c/func/DPCreatePatch
  @discussion This will remove a patch installed by the
          @link DPCreatePatch DPCreatePatch @/link instruction. It does
-         this by following the patch branch instruction to the re-entry
-         table, reading the saved instruction(s) from there, and
-         putting them back into the patched function.
+         this by looking up the patch in the library's registry of
+         installed patches, and putting the saved instruction(s) from
+         there back into the patched function.
+
+         If a function has been patched more than once, this removes
+         all of its patch functions. To take out just one of them, use
+         @link DPRemovePatchFunction DPRemovePatchFunction @/link.
  @param fn_addr The address of the original (patched) function, from
          which to remove the patch.
  */
 DP_API void DPRemovePatch( void * fn_addr );
 
+/*!
+ @defined kDPPatchDefaultPriority
+ @abstract The priority given to patches which don't ask for one.
+ */
+#define kDPPatchDefaultPriority         0
+
+/*!
+ @function DPCreateChainedPatch
+ @abstract Add a patch function to a function's chain of patches.
+ @seealso //apple_ref/c/func/DPCreatePatch
+ @seealso //apple_ref/c/func/DPRemovePatchFunction
+ @discussion Any number of patch functions can be installed on the
+         same target. Only the first one actually modifies the target
+         function; the rest are slotted into a chain of handlers, each
+         of which calls the next when it calls through the address
+         returned here. The last handler in the chain calls the
+         original implementation.
+
+         Handlers with a higher priority are called first. Handlers
+         with the same priority are called newest first, so
+         @link DPCreatePatch DPCreatePatch @/link, which uses
+         @link kDPPatchDefaultPriority kDPPatchDefaultPriority @/link,
+         behaves just as if each patch had been installed over the top
+         of the last.
+
+         Handlers can be added and removed, in any order, while other
+         threads are calling the target function.
+ @param fn_addr The address of the function to patch.
+ @param patch_addr The address of the patch function.
+ @param priority Where in the chain this handler should go.
+ @param options A combination of the
+         @link //apple_ref/c/tag/PatchOptions patch option @/link flags.
+         These only have any effect on the first patch installed on a
+         function; if a later patch asks for an option the existing one
+         wasn't created with, it will fail.
+ @result The address through which this handler should call on, or NULL
+         if the patch could not be installed.
+ */
+DP_API void * DPCreateChainedPatch( void * fn_addr, void * patch_addr,
+                                    int priority, unsigned int options );
+
+/*!
+ @function DPRemovePatchFunction
+ @abstract Take one patch function out of a function's chain of patches.
+ @seealso //apple_ref/c/func/DPCreateChainedPatch
+ @discussion The other handlers on the target carry on working as
+         before. If this was the only handler, the target function's
+         original instructions are put back, just as with
+         @link DPRemovePatch DPRemovePatch @/link.
+ @param fn_addr The address of the patched function.
+ @param patch_addr The address of the patch function to remove.
+ */
+DP_API void DPRemovePatchFunction( void * fn_addr, void * patch_addr );
+
+/*!
+ @function DPReplacePatchFunction
+ @abstract Swap one patch function for another on a live patch.
+ @discussion The patch islands read their branch targets from memory
+         each time they run, so a patch function can be replaced just
+         by storing a new address into the right island. Nothing in the
+         patched function is touched, and there's no need to flush any
+         instruction caches. Threads already inside the old patch
+         function carry on unaffected.
+
+         The new patch function takes over the old one's place in the
+         handler chain, and calls on through the same address.
+ @param fn_addr The address of the patched function.
+ @param old_patch The patch function to replace.
+ @param new_patch The patch function to replace it with.
+ @result The address through which the new patch function should call
+         on, or NULL if <code>old_patch</code> isn't installed on the
+         target.
+ */
+DP_API void * DPReplacePatchFunction( void * fn_addr, void * old_patch, void * new_patch );
+
+/*!
+ @function DPSetPatchEnabled
+ @abstract Switch a patch off or on again without removing it.
+ @discussion A disabled patch sends every call straight to the original
+         implementation, skipping all of its patch functions. As with
+         @link DPReplacePatchFunction DPReplacePatchFunction @/link,
+         this only takes a single store into the patch island, so it's
+         cheap enough to use for turning patches on and off while the
+         target function is in heavy use.
+ @param fn_addr The address of the patched function.
+ @param enabled Zero to disable the patch, nonzero to enable it.
+ @result Nonzero if the function was patched, zero otherwise.
+ */
+DP_API int DPSetPatchEnabled( void * fn_addr, int enabled );
+
+/*!
+ @enum Patch Options
+ @discussion These flags can be passed to
+         @link DPCreatePatchWithOptions DPCreatePatchWithOptions @/link
+         to select a different kind of patch island. Not all options
+         are available on all architectures; asking for one which isn't
+         will cause the patch to fail, rather than quietly install
+         something other than what was requested.
+ @constant kDPPatchInstrumented Count calls to the patch and time
+         each one using the processor's timestamp counter. The results
+         can be read using
+         @link DPEnumeratePatchStatistics DPEnumeratePatchStatistics @/link.
+         To see each call return, the caller's return address is
+         replaced with the address of a small thunk in the library,
+         which has no unwind information. A C++ exception thrown out of
+         the patched function, or out of anything it calls, will
+         therefore end in <code>std::terminate()</code>, and debuggers
+         and crash reports will show backtraces stopping at the thunk.
+         Don't use this option on functions which exceptions are
+         thrown through. (<code>longjmp()</code> is fine.) Intel only.
+ @constant kDPPatchNoRecursion Don't call the patch recursively. If
+         a thread calls the patched function again while it's already
+         inside the patch (for instance, because the patch calls some
+         other routine which uses the patched function), the nested call
+         goes straight to the original implementation. This saves patch
+         functions from having to guard against re-entry themselves.
+         The guard covers every function in the patch's handler chain.
+         Like @link kDPPatchInstrumented kDPPatchInstrumented @/link, it
+         has to see calls return, so it's unsafe for functions which
+         exceptions are thrown through. Intel only.
+ @constant kDPPatchSafePoint Suspend every other thread while the
+         function is patched, and move any which were stopped part-way
+         through the overwritten instructions into the copies held in
+         the re-entry island. This is the same as installing the patch
+         via a one-element
+         @link DPCreatePatchBatch DPCreatePatchBatch @/link.
+ @constant kDPPatchDirectBranch Send calls to the patch function with a
+         single relative jump, rather than loading its address from the
+         patch island and jumping through a register. This saves a load
+         and an indirect branch on every call, but the patch can never
+         be pointed anywhere else: it can't be disabled, have other
+         handlers added to it, or have its patch function replaced. It
+         can only be removed. If the function starts with a no-op sled,
+         the jump written over it goes straight to the patch function,
+         with no island at all. Can't be combined with
+         @link kDPPatchInstrumented kDPPatchInstrumented @/link or
+         @link kDPPatchNoRecursion kDPPatchNoRecursion @/link.
+         Intel only.
+ @constant kDPPatchHot A hint that the function is called very often.
+         The patch's islands are aligned to cache lines and packed in
+         with those of other hot patches, rather than with the islands
+         of other patches on the same image. Ignored on PowerPC.
+ @constant kDPPatchTraced Record a timestamped event each time the
+         function is entered and each time it returns, while a trace is
+         running; see @link DPStartTrace DPStartTrace @/link. Can be
+         combined with
+         @link kDPPatchInstrumented kDPPatchInstrumented @/link and
+         @link kDPPatchNoRecursion kDPPatchNoRecursion @/link, but not
+         with @link kDPPatchDirectBranch kDPPatchDirectBranch @/link.
+         While a trace is running, it's unsafe for functions which
+         exceptions are thrown through, for the same reason as
+         @link kDPPatchInstrumented kDPPatchInstrumented @/link.
+         Intel only.
+ */
+enum
+{
+    kDPPatchInstrumented        = 0x00000001,
+    kDPPatchNoRecursion         = 0x00000002,
+    kDPPatchSafePoint           = 0x00000004,
+    kDPPatchDirectBranch        = 0x00000008,
+    kDPPatchHot                 = 0x00000010,
+    kDPPatchTraced              = 0x00000020
+};
+
+/*!
+ @function DPCreatePatchWithOptions
+ @abstract Install a patch function, with some extra options.
+ @seealso //apple_ref/c/func/DPCreatePatch
+ @discussion This works exactly like
+         @link DPCreatePatch DPCreatePatch @/link, except that the
+         caller can ask for a different type of patch island using the
+         @link //apple_ref/c/tag/PatchOptions patch option @/link flags.
+         Calling this with an <code>options</code> value of zero is
+         the same as calling @link DPCreatePatch DPCreatePatch @/link.
+ @param fn_addr The address of the function to patch.
+ @param patch_addr The address of the patch function.
+ @param options A combination of the
+         @link //apple_ref/c/tag/PatchOptions patch option @/link flags.
+ @result The address through which to call the original function, or
+         NULL if the patch could not be installed.
+ */
+DP_API void * DPCreatePatchWithOptions( void * fn_addr, void * patch_addr,
+                                        unsigned int options );
+
+/*!
+ @typedef DPHookContext
+ @abstract What a hook callback gets to see of a call.
+ @field target The address of the hooked function.
+ @field user_info The value passed to
+        @link DPCreateHook DPCreateHook @/link.
+ @field arguments The caller's arguments, on its stack: arguments[0] is
+        the first 32-bit word of the first argument. Changes made here
+        by the pre-callback are seen by the hooked function.
+ @field return_address Where the call will return to.
+ @field return_value The low word of the return value (%eax). Only set
+        for the post-callback, which may change it.
+ @field return_value_high The high word of a 64-bit return value (%edx).
+        As above.
+ */
+typedef struct DPHookContext
+{
+    void *          target;
+    void *          user_info;
+    void **         arguments;
+    void *          return_address;
+    unsigned int    return_value;
+    unsigned int    return_value_high;
+
+} DPHookContext;
+
+/*!
+ @typedef DPHookCallback
+ @abstract Called on the way into or out of a hooked function.
+ @param context The call being made. The same context is handed to the
+        post-callback as was given to the pre-callback, so it can be
+        compared or timed across the call; but it's only valid until
+        the post-callback returns.
+ */
+typedef void (*DPHookCallback)( DPHookContext * context );
+
+/*!
+ @function DPCreateHook
+ @abstract Watch calls to a function without writing a patch function.
+ @discussion Rather than sending calls to a patch function with the
+         same prototype as the target, this calls a generic
+         pre-callback with a view of the call's arguments, then calls
+         the original, then calls a post-callback with its return
+         value. A single pair of callbacks can be used to watch any
+         number of functions.
+
+         The callbacks run on the thread making the call, with its
+         stack. Nothing is allocated from the heap along the way; the
+         context lives in the same per-thread frames used by
+         @link kDPPatchInstrumented instrumented @/link patches. The
+         post-callback is skipped if calls nest more deeply than those
+         frames allow. A hook with a post-callback has the same problem
+         as an instrumented patch with exceptions thrown through it.
+
+         Functions returning a floating-point value leave it on the x87
+         stack while the post-callback runs, so the post-callback for
+         such a function mustn't do any floating-point arithmetic of
+         its own.
+
+         The hook is removed with
+         @link DPRemovePatch DPRemovePatch @/link and can be switched
+         off with @link DPSetPatchEnabled DPSetPatchEnabled @/link, like
+         any other patch. Chained patches can be added to it, and run
+         between the two callbacks. Calls made while it's being
+         installed may not reach the callbacks. Intel only.
+ @param fn_addr The function to hook. It must not already be patched.
+ @param pre Called before the function runs; may be NULL.
+ @param post Called after it returns; may be NULL.
+ @param user_info Passed to both callbacks in the context.
+ @result The address through which to call the original function,
+         bypassing the callbacks; or NULL if the hook couldn't be
+         installed.
+ */
+DP_API void * DPCreateHook( void * fn_addr, DPHookCallback pre, DPHookCallback post,
+                            void * user_info );
+
+/*!
+ @defined kDPPatchHistogramBuckets
+ @abstract The number of buckets in a patch's timing histogram.
+ @discussion Call durations are recorded in a log-linear histogram:
+         every power of two is split into eight equal-width buckets,
+         so each bucket is accurate to within about 12%, and the whole
+         64-bit range of the timestamp counter is covered. Use
+         @link DPPatchHistogramBucketValue DPPatchHistogramBucketValue @/link
+         to find the lowest value held in a given bucket.
+ */
+#define kDPPatchHistogramBuckets        496
+
+/*!
+ @typedef DPPatchStatistics
+ @abstract A snapshot of the statistics gathered by an instrumented patch.
+ @field target The address of the patched function.
+ @field patch The address of the patch function.
+ @field calls The number of times the patch has been entered.
+ @field samples The number of calls which were timed. This can be lower
+        than <code>calls</code> if calls were nested too deeply to be
+        tracked, if a call hasn't returned yet, or if the patch's
+        sample rate has been set through its
+        @link DPControlSlot control slot @/link.
+ @field total_ticks The total time spent in timed calls.
+ @field min_ticks The shortest timed call.
+ @field max_ticks The longest timed call.
+ @field histogram The number of timed calls falling into each bucket.
+ */
+typedef struct DPPatchStatistics
+{
+    void *              target;
+    void *              patch;
+    unsigned long long  calls;
+    unsigned long long  samples;
+    unsigned long long  total_ticks;
+    unsigned long long  min_ticks;
+    unsigned long long  max_ticks;
+    unsigned int        histogram[kDPPatchHistogramBuckets];
+
+} DPPatchStatistics;
+
+/*!
+ @typedef DPPatchStatisticsCallback
+ @abstract Called once for each instrumented patch.
+ @param stats A snapshot of the patch's statistics. This is only valid
+        for the duration of the callback.
+ @param info The value passed to
+        @link DPEnumeratePatchStatistics DPEnumeratePatchStatistics @/link.
+ */
+typedef void (*DPPatchStatisticsCallback)( const DPPatchStatistics * stats, void * info );
+
+/*!
+ @function DPStartTrace
+ @abstract Start recording calls to traced patches.
+ @discussion Every patch created with
+         @link kDPPatchTraced kDPPatchTraced @/link records an event in
+         a per-thread ring buffer as each call starts and finishes. The
+         events carry the hook, the thread and a timestamp-counter
+         reading, and nothing else, so recording one costs a few
+         stores. A background thread empties the rings into the file
+         several times a second, in the Chrome trace event JSON format,
+         which can be opened in chrome://tracing or the Perfetto UI.
+
+         If a thread makes calls faster than the rings are emptied,
+         events are dropped; a call whose entry is dropped won't have
+         its exit recorded either. Only one trace can run at a time.
+         Intel only.
+ @param path The file to write the trace to. It's replaced if it exists.
+ @result Nonzero if the trace was started.
+ */
+DP_API int DPStartTrace( const char * path );
+
+/*!
+ @function DPStopTrace
+ @abstract Stop a trace started with
+         @link DPStartTrace DPStartTrace @/link.
+ @discussion Writes out any events still in the rings and closes the
+         file. Calls still in progress won't have their exits recorded.
+ @result The number of events dropped because a ring was full.
+ */
+DP_API unsigned int DPStopTrace( void );
+
+/*!
+ @function DPEnumeratePatchStatistics
+ @abstract Read the statistics for every instrumented patch.
+ @discussion This walks the patches currently installed with the
+         @link kDPPatchInstrumented kDPPatchInstrumented @/link option,
+         taking a snapshot of each one's counters and handing it to the
+         callback. It doesn't stop the patches from running, so the
+         figures within a single snapshot may be very slightly out of
+         step with one another on a busy hook.
+ @param callback The function to call for each patch.
+ @param info A value passed through to the callback untouched.
+ @result The number of patches enumerated.
+ */
+DP_API unsigned int DPEnumeratePatchStatistics( DPPatchStatisticsCallback callback,
+                                                void * info );
+
+/*!
+ @function DPPatchHistogramBucketValue
+ @abstract Get the lowest value recorded in a histogram bucket.
+ @param bucket A bucket index, less than
+        @link kDPPatchHistogramBuckets kDPPatchHistogramBuckets @/link.
+ @result The smallest duration, in ticks, which lands in that bucket.
+ */
+DP_API unsigned long long DPPatchHistogramBucketValue( unsigned int bucket );
+
+/*!
+ @function DPPatchStatisticsPercentile
+ @abstract Estimate a percentile of a patch's call durations.
+ @param stats A snapshot, as handed to a
+        @link DPPatchStatisticsCallback DPPatchStatisticsCallback @/link.
+ @param percentile The percentile to look up, from 0.0 to 100.0.
+ @result The lower bound of the histogram bucket containing the
+         requested percentile, in ticks.
+ */
+DP_API unsigned long long DPPatchStatisticsPercentile( const DPPatchStatistics * stats,
+                                                       double percentile );
+
+/*!
+ @defined kDPPatchMaxSavedBytes
+ @abstract The most instruction bytes a patch will ever overwrite.
+ */
+#define kDPPatchMaxSavedBytes           32
+
+/*!
+ @typedef DPPatchInfo
+ @abstract A description of an installed patch.
+ @field target The address of the patched function.
+ @field patch The address of the first patch function installed on it.
+ @field reentry The address of the original function's relocated
+        instructions. Calling this bypasses every handler.
+ @field patch_island The address of the island which branches to the
+        patch function. On Intel, this is the island's data block rather
+        than its code, and it's NULL for a direct-branch patch on a
+        function starting with a no-op sled.
+ @field reentry_island The address of the island which holds the
+        instructions copied out of the target function. NULL on Intel if
+        the function started with a no-op sled (as left by
+        -fpatchable-function-entry or -mnop-mcount): only no-ops were
+        overwritten, so nothing needed copying, and the re-entry address
+        is just past them in the function itself.
+ @field options The options used to create the patch.
+ @field owner The path of the binary containing the first patch
+        function; usually this will be a patch bundle's executable. This
+        may be NULL if it couldn't be determined.
+ @field handler_count The number of patch functions installed on the
+        target.
+ @field enabled Zero if the patch has been switched off with
+        @link DPSetPatchEnabled DPSetPatchEnabled @/link.
+ @field saved_size The number of bytes overwritten in the target.
+ @field saved_bytes The original contents of those bytes.
+ */
+typedef struct DPPatchInfo
+{
+    void *          target;
+    void *          patch;
+    void *          reentry;
+    void *          patch_island;
+    void *          reentry_island;
+    unsigned int    options;
+    const char *    owner;
+    unsigned int    handler_count;
+    int             enabled;
+    unsigned int    saved_size;
+    unsigned char   saved_bytes[kDPPatchMaxSavedBytes];
+
+} DPPatchInfo;
+
+/*!
+ @function DPGetPatchInfo
+ @abstract Find out whether, and how, a function has been patched.
+ @discussion This doesn't take any locks, and is safe to call from any
+         thread at any time, including from within a patch function.
+ @param fn_addr The address of the function in question.
+ @param info Filled in with the details of the patch on that function.
+ @result Nonzero if the function is patched, zero otherwise.
+ */
+DP_API int DPGetPatchInfo( void * fn_addr, DPPatchInfo * info );
+
+/*!
+ @typedef DPPatchInfoCallback
+ @abstract Called once for each installed patch.
+ @param patch A description of the patch. This is only valid for the
+        duration of the callback.
+ @param info The value passed to
+        @link DPEnumeratePatches DPEnumeratePatches @/link.
+ */
+typedef void (*DPPatchInfoCallback)( const DPPatchInfo * patch, void * info );
+
+/*!
+ @function DPEnumeratePatches
+ @abstract List all the patches installed in this process.
+ @discussion As with @link DPGetPatchInfo DPGetPatchInfo @/link,
+         this doesn't lock anything. Patches installed or removed while
+         the enumeration is running may or may not be seen.
+ @param callback The function to call for each patch.
+ @param info A value passed through to the callback untouched.
+ @result The number of patches enumerated.
+ */
+DP_API unsigned int DPEnumeratePatches( DPPatchInfoCallback callback, void * info );
+
+/*!
+ @defined kDPControlMaxSlots
+ @abstract The most patches a process's control segment can describe.
+ */
+#define kDPControlMaxSlots              1024
+
+/*!
+ @defined kDPControlNameLength
+ @abstract The size of the name field in a control slot.
+ */
+#define kDPControlNameLength            64
+
+#define kDPControlSegmentMagic          0x44504353  /* 'DPCS' */
+#define kDPControlSegmentVersion        1
+
+/*!
+ @typedef DPControlSlot
+ @abstract The shared view of a single patch.
+ @discussion Any process which has mapped the segment may write to
+         <code>enabled</code> and <code>sample_rate</code>; the patched
+         process notices within a quarter of a second or so. Everything
+         else is written by the patched process only.
+
+         The counters are copied from the patch's own statistics at the
+         same interval, and are only kept for patches created with
+         @link kDPPatchInstrumented kDPPatchInstrumented @/link. The
+         copy is bracketed by two increments of <code>sequence</code>:
+         a reader should take a copy of the counters while
+         <code>sequence</code> is even and unchanged.
+ @field target The address of the patched function, or NULL once the
+        patch has been removed.
+ @field patch The address of the first patch function.
+ @field name The name of the patched function, if it has one.
+ @field enabled Nonzero if the patch is switched on.
+ @field sample_rate For an instrumented patch, time one call in this
+        many. Zero and one both mean every call.
+ @field sequence Incremented before and after the counters are updated.
+ @field calls The number of times the patch has been entered.
+ @field samples The number of calls which were timed.
+ @field total_ticks The total time spent in timed calls.
+ */
+typedef struct DPControlSlot
+{
+    void *                          target;
+    void *                          patch;
+    char                            name[kDPControlNameLength];
+    volatile unsigned int           enabled;
+    volatile unsigned int           sample_rate;
+    volatile unsigned int           sequence;
+    volatile unsigned long long     calls;
+    volatile unsigned long long     samples;
+    volatile unsigned long long     total_ticks;
+
+} DPControlSlot;
+
+/*!
+ @typedef DPControlSegment
+ @abstract A process's patch control segment.
+ @discussion Each process with patches in it can publish a shared
+         memory segment describing them, with one slot per patched
+         function. Other processes can map it to read the patches'
+         statistics and switch them on or off, without any messages
+         passing between them and without the patched process doing
+         anything more than reading a flag now and then.
+ @field magic @link kDPControlSegmentMagic kDPControlSegmentMagic @/link.
+ @field version @link kDPControlSegmentVersion kDPControlSegmentVersion @/link.
+ @field pid The process which owns the segment.
+ @field slot_count The number of slots ever used. Slots of removed
+        patches have a NULL target until they're given to a new patch.
+        The patched process never reads this back, so a bad value
+        written here only affects the reader.
+ @field slots The slots.
+ */
+typedef struct DPControlSegment
+{
+    unsigned int                    magic;
+    unsigned int                    version;
+    pid_t                           pid;
+    volatile unsigned int           slot_count;
+    DPControlSlot                   slots[kDPControlMaxSlots];
+
+} DPControlSegment;
+
+/*!
+ @function DPOpenControlSegment
+ @abstract Publish this process's patch control segment.
+ @discussion This is called automatically when patch bundles are loaded
+         by the injection code; applications using the patching
+         routines directly can call it themselves. Every patch
+         installed before or after the call is given a slot. The
+         segment is removed when the process exits normally. Calling
+         this more than once does nothing.
+ @result Nonzero if the segment is available.
+ */
+DP_API int DPOpenControlSegment( void );
+
+/*!
+ @function DPCloseControlSegment
+ @abstract Withdraw this process's patch control segment.
+ @discussion Stops the thread which applies outside changes, and
+         removes the segment. Patches keep whatever state they were
+         last given. Does nothing if the segment isn't open.
+ */
+DP_API void DPCloseControlSegment( void );
+
+/*!
+ @function DPMapControlSegment
+ @abstract Map another process's patch control segment.
+ @discussion A segment left behind by a process which has since died is
+         removed, and NULL returned.
+ @param pid The process ID.
+ @result The segment, mapped read-write, or NULL if the process hasn't
+         published one, or it couldn't be mapped.
+ */
+DP_API DPControlSegment * DPMapControlSegment( pid_t pid );
+
+/*!
+ @function DPUnmapControlSegment
+ @abstract Release a segment mapped with
+         @link DPMapControlSegment DPMapControlSegment @/link.
+ @param segment The segment.
+ */
+DP_API void DPUnmapControlSegment( DPControlSegment * segment );
+
+/*!
+ @struct DPPatchRequest
+ @abstract One patch to install as part of a batch.
+ @field fn_addr The address of the function to patch.
+ @field patch_addr The address of the patch function.
+ @field priority The patch function's priority, as for
+        @link DPCreateChainedPatch DPCreateChainedPatch @/link.
+ @field options A combination of the
+        @link //apple_ref/c/tag/PatchOptions patch option @/link flags.
+ @field reentry On return, the address through which the patch function
+        calls on, or NULL if this patch couldn't be installed.
+ */
+typedef struct DPPatchRequest
+{
+    void *          fn_addr;
+    void *          patch_addr;
+    int             priority;
+    unsigned int    options;
+    void *          reentry;
+
+} DPPatchRequest;
+
+/*!
+ @struct DPPatchBatchReport
+ @abstract What happened while a batch of patches was installed.
+ @field pause_usec How long the other threads in the process were
+        suspended, in microseconds.
+ @field threads_suspended The number of threads which were suspended.
+ @field threads_moved The number of threads which had stopped inside
+        the instructions being overwritten, and were moved into a
+        re-entry island, plus the number of return addresses on their
+        stacks which pointed into those instructions and were moved
+        the same way.
+ @field patches_installed The number of requests which succeeded.
+ */
+typedef struct DPPatchBatchReport
+{
+    unsigned long long  pause_usec;
+    unsigned int        threads_suspended;
+    unsigned int        threads_moved;
+    unsigned int        patches_installed;
+
+} DPPatchBatchReport;
+
+/*!
+ @function DPCreatePatchBatch
+ @abstract Install several patches while the process is paused.
+ @seealso //apple_ref/c/func/DPCreateChainedPatch
+ @discussion Rewriting the start of a function which another thread
+         is executing can leave that thread running half an instruction,
+         or resuming at a point in the middle of the new jump. This
+         routine avoids that: every patch island is built first, then
+         all other threads in the task are suspended, every target
+         function is rewritten, and any thread whose program counter
+         lies within a rewritten range is moved to the same instruction
+         in the target's re-entry island, which runs the original code
+         and jumps back. Then the threads are resumed.
+
+         The threads are stopped only for as long as it takes to write
+         the new instructions, which is reported back through the
+         <code>report</code> parameter, so the cost of patching a
+         large number of functions is paid in one short pause, rather
+         than many.
+
+         Functions which are already patched just get a new handler
+         added to their chain, since that doesn't touch their code.
+         Each request succeeds or fails independently.
+
+         On PowerPC only a single instruction is ever replaced, so no
+         thread needs moving, but the targets are still rewritten in
+         one pause.
+ @param requests The patches to install. The <code>reentry</code>
+        field of each is filled in on return.
+ @param count The number of requests.
+ @param report Filled in with statistics about the batch. May be NULL.
+ @result The number of patches successfully installed.
+ */
+DP_API unsigned int DPCreatePatchBatch( DPPatchRequest * requests, unsigned int count,
+                                        DPPatchBatchReport * report );
+
+/*!
+ @struct DPRemotePatchRequest
+ @abstract One patch to install in another task.
+ @field fn_addr The address of the function to patch, in the target
+        task.
+ @field patch_addr The address of the patch function, in the target
+        task.
+ @field reentry_slot The address of a pointer variable in the target
+        task, into which the re-entry address will be written before
+        the patch goes live, or NULL. This is how the patch function
+        finds the original implementation without any code running in
+        the target to tell it.
+ @field reentry On return, the address through which the patch function
+        calls on, in the target task, or NULL if this patch couldn't be
+        installed.
+ */
+typedef struct DPRemotePatchRequest
+{
+    void *          fn_addr;
+    void *          patch_addr;
+    void *          reentry_slot;
+    void *          reentry;
+
+} DPRemotePatchRequest;
+
+/*!
+ @function DPCreateRemotePatches
+ @abstract Install patches in another task, without running any code
+         there.
+ @seealso //apple_ref/c/func/DPCreatePatchBatch
+ @discussion This does for another task what
+         @link DPCreatePatchBatch DPCreatePatchBatch @/link does for
+         this one. The memory for the patch islands is allocated in the
+         target task, but the islands are all built here, and copied
+         across with a single write. Then the target task is suspended
+         while each function's first instructions are replaced, any
+         threads caught inside them are moved into the re-entry islands,
+         and the re-entry slots are filled in.
+
+         Since no thread is started in the target, this is quick
+         enough to apply the same set of patches to many processes.
+         The patch functions must already be present in the target,
+         though; typically they're in a library it was launched with.
+
+         The target must be running the same architecture as the
+         caller; for Rosetta tasks, use the injection routines. Patches
+         installed this way are always plain patches: they can't be
+         chained, given options, or removed, and they aren't visible to
+         @link DPEnumeratePatches DPEnumeratePatches @/link in either
+         task.
+ @param task The target task. The caller needs to have got hold of
+        this already, with task_for_pid() or similar.
+ @param requests The patches to install. The <code>reentry</code>
+        field of each is filled in on return.
+ @param count The number of requests.
+ @param report Filled in with statistics about the pause. May be NULL.
+ @result The number of patches successfully installed.
+ */
+DP_API unsigned int DPCreateRemotePatches( task_t task, DPRemotePatchRequest * requests,
+                                           unsigned int count,
+                                           DPPatchBatchReport * report );
+
 /*!
  @function DPCocoaMethodSwizzle
  @abstract Patch a function implemented within an Objective-C object.
@@ -200,4 +935,122 @@ DP_API void DPRemovePatch( void * fn_addr );
 DP_API void * DPCocoaMethodSwizzle( const char * class_name, const char * selector_name, 
                                     void * patch_addr, int class_method );
 
+/*!
+ @function DPHookImport
+ @abstract Redirect calls made to a function from other images.
+ @discussion Rather than patching the function itself, this changes
+         the symbol pointers (and on Intel, the __jump_table stubs)
+         through which other images call it. No code in the function
+         is touched and no islands are built: each reference is
+         swapped with a single atomic store, and the protection of each
+         section is changed at most once. Calls from within the
+         function's own image, and calls through pointers obtained
+         before the hook went in, aren't affected.
+
+         When no module is given, every loaded image is hooked except
+         the one containing the replacement function, so that the
+         replacement's own calls to the symbol still reach the
+         original. Images loaded later aren't hooked.
+ @param symbol The symbol to hook, as it appears in the symbol table;
+        for a C function, that's its name with a leading underscore.
+ @param module The name of the image whose imports should be changed,
+        either as a full path or just the file name; or NULL for all
+        loaded images.
+ @param replacement The function to send calls to instead.
+ @param original On return, the address of the original function, which
+        the replacement can call to pass a call on. May be NULL.
+ @result The number of references changed; zero if none were found.
+ */
+DP_API unsigned int DPHookImport( const char * symbol, const char * module,
+                                  void * replacement, void ** original );
+
+/*!
+ @function DPUnhookImport
+ @abstract Put back the imports changed by
+         @link DPHookImport DPHookImport @/link.
+ @discussion Any reference which has been changed again since it was
+         hooked is left alone.
+ @param replacement The replacement function passed to DPHookImport.
+ @result The number of references restored.
+ */
+DP_API unsigned int DPUnhookImport( void * replacement );
+
+/*!
+ @typedef DPVirtualMethodHook
+ @abstract One virtual method to hook with
+         @link DPHookVirtualMethods DPHookVirtualMethods @/link.
+ @field class_name The name of the class, as for
+        @link DPHookVirtualMethod DPHookVirtualMethod @/link.
+ @field module The image defining the class, or NULL.
+ @field slot The method's index in the class's vtable.
+ @field replacement The function to install in the slot.
+ @field original Set to the function which was in the slot, or NULL if
+        it couldn't be hooked.
+ */
+typedef struct DPVirtualMethodHook
+{
+    const char *    class_name;
+    const char *    module;
+    unsigned int    slot;
+    void *          replacement;
+    void *          original;
+
+} DPVirtualMethodHook;
+
+/*!
+ @function DPHookVirtualMethod
+ @abstract Replace one virtual method of one C++ class.
+ @discussion This changes a single function pointer in the class's
+         vtable, with an atomic store. Only virtual calls on objects of
+         exactly that class are affected: non-virtual calls to the same
+         implementation, and calls on subclasses with vtables of their
+         own, aren't. Nothing is patched, so nothing needs relocating.
+
+         The vtable is found from its '_ZTV' symbol, as emitted by GCC
+         3.x and later; dyld is asked first, then the symbol table of
+         the given module, which finds vtables that aren't exported.
+
+         Slots are counted from zero in declaration order, starting
+         with the first virtual function of the base-most class. Note
+         that a virtual destructor takes two slots. The replacement
+         receives 'this' as its first argument, just like the method.
+ @param class_name The class name, such as "Foo" or "ns::Foo"; or its
+        mangled form, such as "N2ns3FooE", which is needed for template
+        classes.
+ @param module The loaded image which defines the class, either as a
+        full path or just the file name; or NULL to rely on dyld alone.
+ @param slot The index of the method in the vtable. A slot which
+        doesn't lie within the vtable's symbol is refused, as is any
+        slot in a vtable whose symbol dladdr() can't see.
+ @param replacement The function to install.
+ @result The function previously in the slot, for calling on to the
+         original; or NULL if the vtable couldn't be found or changed.
+ */
+DP_API void * DPHookVirtualMethod( const char * class_name, const char * module,
+                                   unsigned int slot, void * replacement );
+
+/*!
+ @function DPHookVirtualMethods
+ @abstract Replace a number of virtual methods, in any classes.
+ @discussion Works as @link DPHookVirtualMethod DPHookVirtualMethod @/link
+         for each hook in turn. Each slot is changed atomically, but the
+         batch as a whole isn't: a hook which fails doesn't undo the
+         ones before it.
+ @param hooks The methods to hook. Each one's original field is filled
+        in on return.
+ @param count The number of hooks.
+ @result The number of methods hooked.
+ */
+DP_API unsigned int DPHookVirtualMethods( DPVirtualMethodHook * hooks, unsigned int count );
+
+/*!
+ @function DPUnhookVirtualMethod
+ @abstract Put back the vtable slots changed to point at a function.
+ @discussion Any slot which has been changed again since it was hooked
+         is left alone.
+ @param replacement The replacement function.
+ @result The number of slots restored.
+ */
+DP_API unsigned int DPUnhookVirtualMethod( void * replacement );
+
 #endif  /* __DP_PATCHING_H__  */
@@ -16,8 +16,12 @@
  *
  */
 
+#include <fnmatch.h>
+
+#include "Patching.h"
 #include "logging.h"
 #include "load_bundle.h"
+#include "bundle_index.h"
 
 // we need to make sure that malloc doesn't thing it's single threaded
 // while we're doing stuff now
@@ -25,19 +29,34 @@ extern void set_malloc_singlethreaded( int );
 
 #pragma mark -
 
-// check against a list of apps we generally avoid patching
-static int _check_valid_apps( void )
+// apps we generally avoid patching; these are fnmatch() patterns, in
+// the same form as a bundle's DPTargetApplications list
+static const char * quarantined_apps[] =
+{
+    "SystemUIServer",
+    "System Events",
+    "Transport Monitor",
+    "UniversalAccessApp",
+    NULL
+};
+
+// check against the list of apps we generally avoid patching
+static int _check_valid_apps( const struct target_process * proc )
 {
     int result = 1;
-    const char *pName = ApplicationName( );
+    int i;
+
+    if ( proc->name == NULL )
+        return ( 1 );
 
-    if ( (strcmp( pName, "SystemUIServer" ) == 0) ||
-         (strcmp( pName, "System Events" ) == 0) ||
-         (strcmp( pName, "Transport Monitor" ) == 0) ||
-         (strcmp( pName, "UniversalAccessApp" ) == 0) )
+    for ( i = 0; quarantined_apps[i] != NULL; i++ )
     {
-        result = 0;
-        LogMessage( "Quarantined application, no injection allowed." );
+        if ( fnmatch( quarantined_apps[i], proc->name, 0 ) == 0 )
+        {
+            result = 0;
+            LogMessage( "Quarantined application, no injection allowed." );
+            break;
+        }
     }
 
     return ( result );
@@ -50,6 +69,8 @@ static int _check_valid_apps( void )
 
 void __start_all_patches( void )
 {
+    struct target_process proc;
+
     set_malloc_singlethreaded( 0 );
     InitLogs( "DynamicPatch" );
 
@@ -60,10 +81,15 @@ void __start_all_patches( void )
     // Unsanity-style 'patch every app'. So, avoid some apps.
     // Comment this out if you don't like it, but be careful when
     // attaching to certain system applications
-    if ( _check_valid_apps( ) )
+    __get_target_process( &proc );
+
+    if ( _check_valid_apps( &proc ) )
     {
-        // enumerate installed patches
-        load_patch_bundles( );
+        // enumerate installed patches; each bundle's target filter is
+        // checked before anything gets loaded, so if nothing wants
+        // this process, nothing more happens
+        if ( load_patch_bundles_for_process( &proc ) > 0 )
+            DPOpenControlSegment( );
     }
 }
 
@@ -78,4 +104,7 @@ void __start_one_patch( const char *pPathToPatch )
     // so you get the benefit of the doubt with regard to your target
     // application
     load_patch_bundle( pPathToPatch );
+
+    // publish whatever it patched, so it can be controlled from outside
+    DPOpenControlSegment( );
 }
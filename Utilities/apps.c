@@ -128,3 +128,34 @@ const char * NameForProcessID( pid_t target_pid )
 
     return ( result );
 }
+
+const char * PathForProcessID( pid_t target_pid )
+{
+    const char * result = NULL;
+    int name[ ] = { CTL_KERN, KERN_PROCARGS2, target_pid };
+    int argmax_name[ ] = { CTL_KERN, KERN_ARGMAX };
+    int argmax = 0;
+    size_t length = sizeof(argmax);
+    char * args = NULL;
+
+    if ( sysctl( argmax_name, 2, &argmax, &length, NULL, 0 ) != 0 )
+        return ( NULL );
+
+    args = (char *) malloc( argmax );
+    if ( args == NULL )
+        return ( NULL );
+
+    // the buffer starts with argc, then the path the process was
+    // started from
+    length = (size_t) argmax;
+    if ( ( sysctl( name, 3, args, &length, NULL, 0 ) == 0 ) &&
+         ( length > sizeof(int) ) && ( args[sizeof(int)] == '/' ) &&
+         ( memchr( args + sizeof(int), '\0', length - sizeof(int) ) != NULL ) )
+    {
+        result = strdup( args + sizeof(int) );
+    }
+
+    free( args );
+
+    return ( result );
+}
@@ -25,6 +25,10 @@ __BEGIN_DECLS
 
 const char * NameForProcessID( pid_t id );
 
+// the full path of a process's executable, allocated with strdup(),
+// or NULL if it couldn't be found
+const char * PathForProcessID( pid_t id );
+
 __END_DECLS
 
 #endif  /* __DP_APPS_H__ */
@@ -0,0 +1,31 @@
+/*
+ *  timing.c
+ *  DynamicPatch
+ *
+ *  Created by jim on 19/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#include <mach/mach_time.h>
+
+#include "timing.h"
+
+unsigned long long AbsoluteToMicroseconds( unsigned long long ticks )
+{
+    static mach_timebase_info_data_t timebase = { 0, 0 };
+
+    if ( timebase.denom == 0 )
+        (void) mach_timebase_info( &timebase );
+
+    return ( ((ticks * timebase.numer) / timebase.denom) / 1000ULL );
+}
@@ -0,0 +1,32 @@
+/*
+ *  timing.h
+ *  DynamicPatch
+ *
+ *  Created by jim on 19/4/2006.
+ *  Copyright (c) 2003-2006 Jim Dovey. Some Rights Reserved.
+ *
+ *  This work is licensed under a Creative Commons Attribution License.
+ *  You are free to use, modify, and redistribute this work, provided you
+ *  include the following disclaimer:
+ *
+ *    Portions Copyright (c) 2003-2006 Jim Dovey
+ *
+ *  For license details, see:
+ *    http://creativecommons.org/licences/by/2.5/
+ *
+ */
+
+#ifndef __DP_TIMING_H__
+#define __DP_TIMING_H__
+
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+// converts a difference between two mach_absolute_time() readings
+// into microseconds
+unsigned long long AbsoluteToMicroseconds( unsigned long long ticks );
+
+__END_DECLS
+
+#endif  /* __DP_TIMING_H__ */